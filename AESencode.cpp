@@ -1,387 +1,1052 @@
-/* AES Encryption Implementation (with 128-bit keys).
+/* AES Encryption Implementation (with 128, 192 and 256-bit keys).
 Specification source: https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.197.pdf
+Build: g++ -std=c++17 -O2 -pthread AESencode.cpp aes_core.cpp aes_bitsliced.cpp aes_x86.cpp aes_arm.cpp aes_modes.cpp aes_pool.cpp aes_buffers.cpp aes_kdf.cpp aes_io.cpp aes_server.cpp aes_selftest.cpp aes_tune.cpp
+Run with no arguments to be prompted for everything, or see -h for the
+non-interactive options (stdin to stdout by default). Add -DAES_STATS to the
+build for the per-stage timings and counters that -s prints.
 
-Todo:
--Implement cipher block chaining, which means identical 16-byte blocks in the same file don't translate
-    the same - avoiding patterns
-
--Encrypt to base 64, instead of hex
+The cipher itself is the library in aes.h (aes_io.h for the file format);
+this file is only the command line.
 
+Todo:
 -Decrypt as well as encrypt
-
--Add 192-bit and 256-bit keys
 */
 
+#include "aes.h"
+#include "aes_io.h"
+#include "aes_server.h"
+#include "aes_stats.h"
+#include "aes_tune.h"
 #include <iostream> //user dialog
 #include <iomanip>
 #include <fstream> //input + output data
 #include <string> //convert input to hex
 #include <array> //allow functions to return arrays 
+#include <iterator> //reading key files
+#include <vector>
+#include <filesystem> //batch mode
+#include <sstream>
+#include <random> //passphrase salts
+#include <limits>
+#include <csignal> //stopping the server
+#include <cstring> //comparing salts
+#include <cstdlib> //finding the tuning file
 
 using namespace std;
 
-typedef unsigned char u8;
-typedef unsigned int u32;
+//One encryption or decryption, from the prompts or the command line
+struct job
+{
+    bool encrypt = true;
+    int cipher_mode = mode_gcm; //decryption takes the mode from the file instead
+    armor_type armor = armor_binary;
+    string input = "-", output = "-"; //"-" is standard input or output
+    vector<u8> key; //16, 24 or 32 bytes
+    vector<u8> passphrase; //instead of key: stretched with PBKDF2 under a salt kept in the file
+    size_t passphrase_key_bytes = 32; //the key a passphrase is stretched into, when encrypting
+    u32 iterations = pbkdf2_default_iterations;
+    unsigned int threads = std::thread::hardware_concurrency(); //for CTR, CBC decryption and SEEKABLE
+    size_t chunk_size = 0; //bytes of data per task; 0 for each mode's default
+    bool range = false; //decrypt only range_length bytes from range_offset
+    u64 range_offset = 0, range_length = 0;
+    string batch; //a directory, or a file listing inputs, to do instead of input
+    string batch_output_dir; //where batch outputs go; empty to put each next to its input
+    string server; //an address to serve requests on (both ways), instead of doing one job
+    bool stats = false; //print the instrumentation counters to standard error afterwards
 
-/*In AES, bytes are not treated as integers but part of a 
-  "Galois field", a finite set of numbers with substitutes for addition
-  and multiplication such that the results remain within the set.
-  Specifically we use Rijndael's field, which contains 0-255 (2**8 - 1),
-  and where addition is replaced by xor. Multiplication uses the standard binary
-  multiplication method, but with xor instead of + and modulo 0x11b. */
-u8 rijndael_multiply(u8 a, u8 b)
+    ~job()
+    {
+        secure_zero(key.data(), key.size());
+        secure_zero(passphrase.data(), passphrase.size());
+    }
+};
+
+//Where a job's keys come from: the key it was given, or its passphrase stretched
+//under each file's salt. Everything encrypted in one run shares a salt, so however
+//many files a batch has the passphrase is only stretched once; files being
+//decrypted bring their own salts, and the cache stretches each of those once.
+class job_keys
 {
-    const int reducing_num = 0x11b;
-    short int result = 0;
-    for (int i = 0; i <= 7; i++) //binary multiply
+public:
+    explicit job_keys(const job& j) : j(j)
+    {
+        if (j.passphrase.empty())
+        {
+            fixed = make_shared<expanded_key>(j.key.data(), j.key.size());
+        }
+        else
+        {
+            random_device rng;
+            for (u8& b : salt)
+            {
+                b = (u8)rng();
+            }
+        }
+    }
+
+    size_t key_bytes() const
     {
-        if ((b & (1 << i)) == (1 << i))
+        return (fixed ? j.key.size() : j.passphrase_key_bytes);
+    }
+
+    //The key for a new file; the salt and iteration count go in its header
+    shared_ptr<const expanded_key> for_encryption(file_header& header)
+    {
+        if (fixed)
+        {
+            return fixed;
+        }
+        set_header_kdf(header, salt, j.iterations);
+        if (!own)
         {
-            result ^= (a << i);
+            own = cache.get(j.passphrase.data(), j.passphrase.size(), salt, sizeof(salt), j.iterations, j.passphrase_key_bytes);
         }
+        return own;
     }
 
-    for (int i = 15; i >= 8; i--) //modulus equivalent
+    //The key the file with this header needs, or nullptr with the reason in error
+    shared_ptr<const expanded_key> for_decryption(const file_header& header, string& error)
     {
-        if ((result & (1 << i)) == (1 << i))
+        if (header.kdf != kdf_none && fixed)
+        {
+            error = "it was encrypted with a passphrase (see -p)";
+            return nullptr;
+        }
+        if (header.kdf == kdf_none && !fixed)
+        {
+            error = "it was encrypted with a key, not a passphrase";
+            return nullptr;
+        }
+        if (fixed && header.key_bytes != j.key.size())
         {
-            result ^= (reducing_num << (i - 8));
+            error = "it needs a " + to_string(8 * header.key_bytes) + "-bit key";
+            return nullptr;
         }
+        if (fixed)
+        {
+            return fixed;
+        }
+        if (is_own(header))
+        {
+            return own;
+        }
+        return cache.get(j.passphrase.data(), j.passphrase.size(), header.salt, sizeof(header.salt), header.iterations,
+            header.key_bytes);
     }
-    return result;
-}
 
-//In a Galois field with 256 elements a**255 = 1 for a =/= 0,
-// so a**254 = a**-1.
-u8 rijndael_inverse(u8 x)
-{
-    u8 result = 1;
-    for (int i = 1; i <= 254; i++)
+    //Whether for_decryption answers at once, without stretching the passphrase
+    bool ready_for_decryption(const file_header& header) const
     {
-        result = rijndael_multiply(result, x);
+        return fixed || header.kdf == kdf_none || is_own(header) ||
+            cache.find(j.passphrase.data(), j.passphrase.size(), header.salt, sizeof(header.salt), header.iterations, header.key_bytes);
     }
-    return result;
-}
 
-//Shifts each bit of x to the left y times (and sends the front to the back)
-u8 lcs_8bit(u8 x, u8 y) //Used to calculate the S-box
-{
-    return ((x << y) % 0x100) + (x >> (8 - y));
-}
+private:
+    //Whether the header is for the key for_encryption gave out
+    bool is_own(const file_header& header) const
+    {
+        return own && header.iterations == j.iterations && header.key_bytes == j.passphrase_key_bytes &&
+            memcmp(header.salt, salt, sizeof(salt)) == 0;
+    }
+
+    const job& j;
+    shared_ptr<const expanded_key> fixed; //when there is no passphrase
+    u8 salt[kdf_salt_size];
+    //The key for this salt, held here once made: the cache is shared with the salts
+    //of files being decrypted, any number of which could push it out
+    shared_ptr<const expanded_key> own;
+    passphrase_cache cache;
+};
 
-//Same but with 4 bytes instead of 8 bits
-array<u8, 4> lcs_4byte(array<u8, 4> x, u8 y)
-{ //Used to generate the key schedule
-    for (int i = 1; i <= y; i++)
+//Don't leave unauthenticated or wrongly decrypted data behind. Plaintext
+//already sent to standard output can't be taken back, so the exit status
+//is what a pipeline has to check.
+int finish_job(const string& input, const string& output, bool ok, bool read_failed, bool written, ostream& messages, ostream& errors)
+{
+    bool keep = (ok && written && !read_failed);
+    if (!keep && output != "-")
+    {
+        remove(output.c_str());
+    }
+    if (read_failed || !written)
+    {
+        errors << (written ? "Cannot read " : "Cannot write ") << (written ? input : output) << endl;
+        return 1;
+    }
+    if (!ok)
     {
-        x = { x[1], x[2], x[3], x[0] };
+        errors << "Decryption failed: wrong key, or the file is corrupted" << endl;
+        return 1;
     }
-    return x;
+    messages << "Completed!" << endl;
+    return 0;
 }
 
-//The S-box is a nonlinear transformation used in all 10 rounds of the encryption,
-//and in generating the keys for each round.
-u8 sbox_value(u8 input)
+//Decrypts part of a seekable file, reading only the chunks the range covers
+int run_range_job(const job& j, ostream& messages, ostream& errors)
 {
-    u8 inv = rijndael_inverse(input);
-    u8 result = inv ^ lcs_8bit(inv, 1) ^ lcs_8bit(inv, 2) ^ lcs_8bit(inv, 3) ^ lcs_8bit(inv, 4) ^ 0x63;
-    return result;
+    random_access_file input_file;
+    file_sink output_file;
+    if (!input_file.open(j.input))
+    {
+        errors << "Cannot open " << j.input << (j.input == "-" ? ": a range needs a regular file" : "") << endl;
+        return 1;
+    }
+    file_header header;
+    const char* error = read_file_header(input_file, header);
+    if (!error && header.mode != mode_seekable)
+    {
+        error = "only SEEKABLE files can be decrypted in part";
+    }
+    if (error)
+    {
+        errors << "Cannot decrypt " << j.input << ": " << error << endl;
+        return 1;
+    }
+    job_keys keys(j);
+    string key_error;
+    shared_ptr<const expanded_key> key = keys.for_decryption(header, key_error);
+    if (!key)
+    {
+        errors << "Cannot decrypt " << j.input << ": " << key_error << endl;
+        return 1;
+    }
+
+    messages << endl << "Decrypting bytes " << j.range_offset << " to " << j.range_offset + j.range_length << "..." << endl;
+    if (!output_file.open(j.output))
+    {
+        errors << "Cannot create " << j.output << endl;
+        return 1;
+    }
+    output_stream out(output_file, armor_binary);
+    thread_pool pool(j.threads);
+    bool ok = decrypt_seekable_range(key->aes, input_file, header, j.range_offset, j.range_length, out, pool);
+    out.finish();
+    bool written = output_file.close();
+    return finish_job(j.input, j.output, ok, input_file.failed, written, messages, errors);
 }
 
-//store the s-box as an array rather than a function
-u8 sbox[256];
-u8 inverse_sbox[256];
-void make_sbox_array()
+//The chunk_shift for a SEEKABLE chunk size (a power of two, as parse_arguments
+//checked), or the default for 0
+int seekable_chunk_shift(size_t chunk_size)
 {
-    u8 s;
-    for (int i = 0; i <= 0xff; i++)
+    int chunk_shift = seekable_default_chunk_shift;
+    if (chunk_size != 0)
     {
-        s = sbox_value(i);
-        sbox[i] = s;
-        inverse_sbox[s] = i;
+        for (chunk_shift = 0; ((size_t)1 << chunk_shift) < chunk_size; chunk_shift++)
+        {
+        }
     }
+    return chunk_shift;
 }
 
-//The round constants are a series of bytes used in computing the keys
-//for each round.
-u8 round_constant(char i)
+//Encrypts or decrypts one file as j says, with keys from keys
+int process_file(const job& j, job_keys& keys, thread_pool& pool, const string& input, const string& output,
+    ostream& messages, ostream& errors)
 {
-    if (i == 1)
+    file_source input_file;
+    file_sink output_file;
+    if (!input_file.open(input))
     {
+        errors << "Cannot open " << input << endl;
         return 1;
     }
+
+    input_stream in(input_file);
+    file_header header;
+    int cipher_mode = j.cipher_mode;
+    shared_ptr<const expanded_key> key;
+    if (j.encrypt)
+    {
+        int chunk_shift = (cipher_mode == mode_seekable ? seekable_chunk_shift(j.chunk_size) : seekable_default_chunk_shift);
+        header = new_file_header(cipher_mode, keys.key_bytes(), chunk_shift);
+        key = keys.for_encryption(header);
+    }
     else
     {
-        u8 previous_rc = round_constant(i - 1);
-        if (previous_rc < 128)
+        const char* error = read_file_header(in, header);
+        if (error)
         {
-            return (2 * previous_rc);
+            errors << "Cannot decrypt " << input << ": " << error << endl;
+            return 1;
         }
-        else
+        cipher_mode = header.mode;
+        string key_error;
+        key = keys.for_decryption(header, key_error);
+        if (!key)
         {
-            return (((2 * previous_rc) - 256) ^ 0x1b);
+            errors << "Cannot decrypt " << input << ": " << key_error << endl;
+            return 1;
         }
     }
+    const aes_context& ctx = key->aes;
+
+    messages << endl << (j.encrypt ? "Encrypting" : "Decrypting") << " (" << cipher_mode_names[cipher_mode] << ")..." << endl;
+
+    if (!output_file.open(output))
+    {
+        errors << "Cannot create " << output << endl;
+        return 1;
+    }
+    if (input_file.size() >= 0)
+    {
+        output_file.reserve(expected_output_size(header, input_file.size(), j.encrypt, j.armor));
+    }
+    output_stream out(output_file, (j.encrypt ? j.armor : armor_binary));
+    if (j.encrypt)
+    {
+        out.write(header.bytes, header.size());
+    }
+
+    bool ok = true;
+    size_t chunk_size = (j.chunk_size != 0 ? j.chunk_size : current_tuning().chunk_size);
+    if (cipher_mode == mode_ecb || cipher_mode == mode_cbc)
+    {
+        ok = process_block_mode(ctx, in, out, header, j.encrypt, pool, chunk_size);
+    }
+    else if (cipher_mode == mode_gcm)
+    {
+        ok = process_gcm(ctx, in, out, header, j.encrypt);
+    }
+    else if (cipher_mode == mode_seekable)
+    {
+        ok = process_seekable(ctx, in, out, header, j.encrypt, pool);
+    }
+    else
+    {
+        process_ctr(ctx, in, out, header, pool, chunk_size);
+    }
+    out.finish();
+    ok = ok && !in.failed;
+    bool written = output_file.close();
+    return finish_job(input, output, ok, input_file.failed, written, messages, errors);
+}
+
+//The dialog's output name: _encrypted or _decrypted added before the first
+//extension of the file name
+string output_name(const string& input, bool encrypt)
+{
+    size_t name_pos = input.find_last_of("/\\");
+    size_t dot_pos = input.find('.', (name_pos == string::npos ? 0 : name_pos + 1));
+    if (dot_pos == string::npos)
+    {
+        dot_pos = input.size();
+    }
+    return input.substr(0, dot_pos) + (encrypt ? "_encrypted" : "_decrypted") + input.substr(dot_pos);
 }
 
-//This AES uses 10 rounds - each round uses a different 16-byte key which
-//is an evolution of the last's key. This function takes the original
-//key and returns it plus the 10 other keys.
-array<u8, 176> key_schedule;
-void make_key_schedule(array<u8, 16> key)
+//Whether a file name is one output_name makes, so a batch run again over the
+//same directory doesn't encrypt its own outputs
+bool is_output_name(const string& name, bool encrypt)
 {
-    array<u8, 4> o1; //1 byte ago
-    array<u8, 4> o4; //4 bytes ago
+    string stem = name.substr(0, name.find('.'));
+    string suffix = (encrypt ? "_encrypted" : "_decrypted");
+    return stem.size() >= suffix.size() && stem.compare(stem.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
-    for (char i = 0; i < 44; i++)
+//Every regular file under root, as paths relative to it. The directories at each
+//depth are listed in parallel, one task each. skip (the output directory, say) is
+//left out; so are symbolic links to directories, which could make loops.
+vector<filesystem::path> walk_directory(const filesystem::path& root, const filesystem::path& skip, thread_pool& pool)
+{
+    vector<filesystem::path> files;
+    vector<filesystem::path> level = { filesystem::path() };
+    while (!level.empty())
     {
-        if (i < 4)
+        vector<vector<filesystem::path>> found_files(level.size()), found_dirs(level.size());
+        pool.run(level.size(), [&](size_t i)
         {
-            memcpy(&key_schedule[i * 4], &key[i * 4], 4);
-        }
-        else
-        {
-            memcpy(&o1, &key_schedule[(i - 1) * 4], 4);
-            memcpy(&o4, &key_schedule[(i - 4) * 4], 4);
-            if ((i % 4) == 0)
+            error_code ec;
+            for (filesystem::directory_iterator d(root / level[i], ec), end; !ec && d != end; d.increment(ec))
             {
-                array<u8, 4> rot = lcs_4byte(o1, 1);
-                array<u8, 4> s = { sbox[rot[0]], sbox[rot[1]], sbox[rot[2]], sbox[rot[3]] };
-                array<u8, 4> rc_array = { round_constant(i / 4), 0x00, 0x00, 0x00 };
-                 for (int j = 0; j < 4; j++)
+                filesystem::path relative = level[i] / d->path().filename();
+                error_code entry_ec;
+                if (d->is_directory(entry_ec) && !d->is_symlink(entry_ec))
                 {
-                    key_schedule[4 * i + j] = o4[j] ^ s[j] ^ (rc_array[j]);
+                    if (skip.empty() || !filesystem::equivalent(d->path(), skip, entry_ec))
+                    {
+                        found_dirs[i].push_back(relative);
+                    }
                 }
-            }
-            else
-            {
-                for (int j = 0; j < 4; j++)
+                else if (d->is_regular_file(entry_ec))
                 {
-                    key_schedule[4 * i + j] = o1[j] ^ o4[j];
+                    found_files[i].push_back(relative);
                 }
             }
+        });
+        level.clear();
+        for (size_t i = 0; i < found_files.size(); i++)
+        {
+            files.insert(files.end(), found_files[i].begin(), found_files[i].end());
+            level.insert(level.end(), found_dirs[i].begin(), found_dirs[i].end());
         }
-
     }
+    sort(files.begin(), files.end());
+    return files;
 }
 
-array<u8, 16> encrypt_block(array<u8, 16> block)
+//Many files with one key context, several at a time on the pool. Each file is
+//done start to finish by one thread, which suits lots of small files (a big one
+//still streams, just without splitting its chunks across threads). Messages for
+//each file are gathered and written out whole, so lines from different files
+//aren't interleaved.
+int run_batch_job(const job& j, ostream& messages, ostream& errors)
 {
-    array<u8, 16> round_key;
-
-    //Round 0
-    memcpy(&round_key, &key_schedule, 16);
-    for (int i = 0; i < 16; i++)
+    error_code ec;
+    filesystem::path out_dir = j.batch_output_dir;
+    vector<pair<filesystem::path, filesystem::path>> files; //(input, output)
+    thread_pool pool(j.threads);
+    if (filesystem::is_directory(j.batch, ec))
     {
-        block[i] ^= round_key[i];
+        filesystem::path root = j.batch;
+        for (const filesystem::path& relative : walk_directory(root, out_dir, pool))
+        {
+            if (!out_dir.empty())
+            {
+                files.push_back({ root / relative, out_dir / relative });
+            }
+            else if (!is_output_name(relative.filename().string(), j.encrypt))
+            {
+                files.push_back({ root / relative, output_name((root / relative).string(), j.encrypt) });
+            }
+        }
+    }
+    else
+    {   //a list of files, one per line
+        ifstream list(j.batch);
+        if (!list)
+        {
+            errors << "Cannot open " << j.batch << endl;
+            return 1;
+        }
+        string line;
+        while (getline(list, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (line.empty())
+            {
+                continue;
+            }
+            filesystem::path input = line;
+            files.push_back({ input, out_dir.empty() ? filesystem::path(output_name(line, j.encrypt)) : out_dir / input.relative_path() });
+        }
     }
 
-    //Round 1..10
-    for (int round = 1; round <= 10; round++)
+    job_keys keys(j); //one set of keys for every file
+    atomic<size_t> failures{ 0 };
+    mutex output_lock;
+    pool.run(files.size(), [&](size_t i)
     {
-        //"SubBytes" - perform the S-box transformation
-        for (int i = 0; i < 16; i++)
+        const string input = files[i].first.string(), output = files[i].second.string();
+        ostringstream file_errors;
+        ostream quiet(nullptr);
+        thread_pool single(1);
+        int status = 1;
+        error_code dir_ec;
+        if (!out_dir.empty() && files[i].second.has_parent_path())
         {
-            block[i] = sbox[block[i]];
+            filesystem::create_directories(files[i].second.parent_path(), dir_ec);
         }
-
-        //The next two steps are done treating the block as a 4x4 matrix, filling columns first, then rows
-        //"ShiftRows" - does a left shift on row x (where x goes from 0 to 3) by x bytes.
-        for (int i = 0; i < 4; i++)
+        if (dir_ec)
         {
-            array<u8, 4> newrow = lcs_4byte({ block[i], block[i + 4], block[i + 8], block[i + 12] }, i);
-            block[i] = newrow[0];
-            block[i + 4] = newrow[1];
-            block[i + 8] = newrow[2];
-            block[i + 12] = newrow[3];
+            file_errors << "Cannot create " << files[i].second.parent_path().string() << endl;
         }
-        //"MixColumns" - a linear transformation on each column
-        if (round != 10)
+        else
         {
-            for (int i = 0; i < 4; i++)
-            {
-                array <u8, 4> mix;
-                mix[0] = rijndael_multiply(2, block[4 * i]) ^ rijndael_multiply(3, block[4 * i + 1]) ^ block[4 * i + 2] ^ block[4 * i + 3];
-                mix[1] = block[4 * i] ^ rijndael_multiply(2, block[4 * i + 1]) ^ rijndael_multiply(3, block[4 * i + 2]) ^ block[4 * i + 3];
-                mix[2] = block[4 * i] ^ block[4 * i + 1] ^ rijndael_multiply(2, block[4 * i + 2]) ^ rijndael_multiply(3, block[4 * i + 3]);
-                mix[3] = rijndael_multiply(3, block[4 * i]) ^ block[4 * i + 1] ^ block[4 * i + 2] ^ rijndael_multiply(2, block[4 * i + 3]);
-                memcpy(&block[4 * i], &mix, 4);
-            }
+            status = process_file(j, keys, single, input, output, quiet, file_errors);
         }
+        if (status != 0)
+        {
+            failures++;
+            lock_guard<mutex> guard(output_lock);
+            errors << file_errors.str();
+        }
+    });
+    messages << endl << "Completed " << files.size() - failures << " of " << files.size() << " files" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+#ifdef AES_SERVER
+aes_server* running_server = nullptr; //for the signal handler
 
-        //"AddRoundKey" - xor each byte with its corresponding round key byte
-        memcpy(&round_key, &key_schedule[round * 16], 16);
-        for (int i = 0; i < 16; i++)
+void stop_server(int)
+{
+    running_server->stop();
+}
+#endif
+
+//Serves requests on j.server until interrupted (SIGINT or SIGTERM), with the
+//key or passphrase expanded once for all of them
+int run_server_job(const job& j, ostream& errors)
+{
+#ifdef AES_SERVER
+    job_keys keys(j);
+    server_options options;
+    options.threads = j.threads;
+    options.chunk_shift = seekable_chunk_shift(j.chunk_size);
+    options.key_bytes = keys.key_bytes();
+    options.encryption_key = [&](file_header& header) { return keys.for_encryption(header); };
+    //Anyone can send a header, passphrase or not, so one asking for more PBKDF2
+    //iterations than this server's own files use is refused rather than run
+    auto too_costly = [&](const file_header& header) { return header.kdf != kdf_none && header.iterations > j.iterations; };
+    options.decryption_key = [&](const file_header& header, string& error) -> shared_ptr<const expanded_key>
+    {
+        if (too_costly(header))
         {
-            block[i] ^= round_key[i];
+            error = "it asks for more PBKDF2 iterations than -n allows";
+            return nullptr;
         }
+        return keys.for_decryption(header, error);
+    };
+    options.decryption_key_ready = [&](const file_header& header) { return too_costly(header) || keys.ready_for_decryption(header); };
+    //Every request encrypts with the same salt, so a passphrase can be stretched now
+    //instead of in the first request
+    file_header first = new_file_header(mode_seekable, keys.key_bytes(), options.chunk_shift);
+    keys.for_encryption(first);
+
+    aes_server server(options);
+    string error;
+    if (!server.listen(j.server, error))
+    {
+        errors << "Cannot listen on " << j.server << ": " << error << endl;
+        return 1;
     }
+    running_server = &server;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    bool ok = server.run(error);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    running_server = nullptr;
+    if (!ok)
+    {
+        errors << "Cannot serve on " << j.server << ": " << error << endl;
+        return 1;
+    }
+    return 0;
+#else
+    errors << "The server needs Linux" << endl;
+    return 1;
+#endif
+}
 
-    for (int i = 0; i < 16; i++)
+//progress goes to messages; errors go to errors
+int run_job(const job& j, ostream& messages, ostream& errors)
+{
+    if (!j.server.empty())
+    {
+        return run_server_job(j, errors);
+    }
+    if (j.range)
     {
-        cout << hex << int(block[i]) << " ";
+        return run_range_job(j, messages, errors);
     }
-    cout << endl;
+    if (!j.batch.empty())
+    {
+        return run_batch_job(j, messages, errors);
+    }
+    job_keys keys(j);
+    thread_pool pool(j.threads);
+    return process_file(j, keys, pool, j.input, j.output, messages, errors);
+}
+
+//A key given as 32, 48 or 64 hex digits (a 128, 192 or 256-bit key)
+bool parse_key(const string& text, vector<u8>& key)
+{
+    if (text.length() % 2 != 0 || !aes_key_size_valid(text.length() / 2))
+    {
+        return false;
+    }
+    key.resize(text.length() / 2);
+    return hex_decode(text.data(), key.size(), key.data());
+}
+
+//A key file holds the key as hex digits, or the 16, 24 or 32 key bytes
+//themselves. Hex is tried first; random bytes are almost never all hex digits.
+bool read_key_file(const string& path, vector<u8>& key)
+{
+    ifstream file(path, ios::binary);
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (file.bad())
+    {
+        return false;
+    }
+    string digits = text;
+    digits.erase(remove_if(digits.begin(), digits.end(), [](char c) { return isspace((u8)c); }), digits.end());
+    if (parse_key(digits, key))
+    {
+        return true;
+    }
+    if (aes_key_size_valid(text.size()))
+    {
+        key.assign(text.begin(), text.end());
+        return true;
+    }
+    return false;
+}
+
+//A passphrase file holds the passphrase on its first line; the line break, if any,
+//is not part of it
+bool read_passphrase_file(const string& path, vector<u8>& passphrase)
+{
+    ifstream file(path, ios::binary);
+    string line;
+    if (!file || (!getline(file, line) && !file.eof()))
+    {
+        return false;
+    }
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+    passphrase.assign(line.begin(), line.end());
+    secure_zero(&line[0], line.size());
+    return !passphrase.empty();
+}
 
-    return block;
+void print_usage(const char* program)
+{
+    cerr << "Usage: " << program << " (-e | -d) (-k KEY | -K KEYFILE | -p PASSFILE) [-m MODE] [-a ENCODING] [-i INPUT] [-o OUTPUT]\n"
+        "       [-t THREADS] [-c CHUNK] [-r OFFSET:LENGTH] [-s]\n"
+        "       " << program << " (-e | -d) (-k KEY | -K KEYFILE | -p PASSFILE) -B INPUTS [-O DIR] [options]\n"
+        "       " << program << " (-k KEY | -K KEYFILE | -p PASSFILE) -S ADDRESS [-t THREADS] [-c CHUNK] [-b BITS] [-n ITERATIONS]\n"
+        "  -e, -d      encrypt or decrypt\n"
+        "  -k KEY      the key as 32, 48 or 64 hex digits (AES-128, -192 or -256)\n"
+        "  -K KEYFILE  read the key from a file (16, 24 or 32 bytes, or hex digits)\n"
+        "  -p PASSFILE use the first line of a file as a passphrase instead of a key. It is\n"
+        "              stretched with PBKDF2-HMAC-SHA256 under a random salt kept in the file\n"
+        "  -b BITS     with -p, the key size to encrypt with: 128, 192 or 256 (default 256)\n"
+        "  -n ITERATIONS  with -p, the PBKDF2 iterations to encrypt with (default " << pbkdf2_default_iterations << ").\n"
+        "              With -S, also the most a file sent to be decrypted may ask for\n"
+        "  -m MODE     ECB, CBC, CTR, GCM or SEEKABLE (default GCM); decryption reads it\n"
+        "              from the input. SEEKABLE is GCM in chunks that can be decrypted alone\n"
+        "  -a ENCODING output encoding when encrypting: BIN, HEX or B64 (default BIN)\n"
+        "  -i INPUT    input file (default: standard input)\n"
+        "  -o OUTPUT   output file (default: standard output)\n"
+        "  -t THREADS  threads for CTR, CBC decryption and SEEKABLE, or with -B files done at\n"
+        "              once (default: one per CPU)\n"
+        "  -c CHUNK    bytes each thread takes at a time, a multiple of 16 of at least 4K,\n"
+        "              with K or M for KiB or MiB (default 1M, or what --autotune chose).\n"
+        "              For SEEKABLE, the chunk size of the file: a power of 2 up to 16M\n"
+        "              (default 64K)\n"
+        "  -r OFFSET:LENGTH  decrypt just these bytes of a SEEKABLE file (not standard input)\n"
+        "  -B INPUTS   every file under the directory INPUTS, or listed one per line in the\n"
+        "              file INPUTS, several at a time. Each output is named as the dialog\n"
+        "              names it (name_encrypted.ext, name_decrypted.ext) unless -O is given\n"
+        "  -O DIR      with -B, write the outputs under DIR instead, keeping their names and\n"
+        "              the directories they were in\n"
+        "  -S ADDRESS  serve requests instead, until interrupted: unix:PATH (or any path\n"
+        "              with a /) for a Unix socket, or HOST:PORT or PORT for TCP. Each\n"
+        "              request encrypts to a SEEKABLE file or decrypts one; see aes_server.h\n"
+        "              for the protocol. -t is the number of event loops, -c the chunk size\n"
+        "  -s          afterwards, print where the time went to standard error (if built\n"
+        "              with -DAES_STATS)\n"
+        "With no arguments, asks for everything interactively. " << program << " --self-test [ROUNDS]\n"
+        "checks every backend against the standard test vectors and the reference code.\n"
+        << program << " --autotune [--allow-ttable] [-t THREADS] [FILE] times the backends and\n"
+        "chunk sizes on this machine and saves the fastest for this CPU model in FILE\n"
+        "(default $XDG_CONFIG_HOME/aesencode/tuning, or ~/.config/aesencode/tuning), which\n"
+        "every later run reads. The T-tables aren't constant-time, so they are only tried\n"
+        "with --allow-ttable.\n"
+        "The exit status is nonzero if anything failed, including authentication:\n"
+        "decrypted data already written to standard output must then be discarded.\n";
+}
+
+//A size such as 65536, 64K or 4M (powers of 1024), already upper-cased; 0 if it isn't one
+size_t parse_chunk_size(const string& text)
+{
+    char* end;
+    unsigned long long n = strtoull(text.c_str(), &end, 10);
+    string suffix = end;
+    if (end == text.c_str() || !(suffix.empty() || suffix == "K" || suffix == "M") || n > (1 << 20))
+    {
+        return 0;
+    }
+    return (size_t)n << (suffix == "K" ? 10 : suffix == "M" ? 20 : 0);
 }
 
-array<u8, 16> decrypt_block(array<u8, 16> block)
+//Fills j from the command line; false (after saying why) if it doesn't make sense
+bool parse_arguments(int argc, char** argv, job& j)
 {
-    array<u8, 16> round_key;
-    memcpy(&round_key, &key_schedule[160], 16);
-    for (int round = 1; round <= 10; round++)
+    bool have_direction = false, have_key = false, have_passphrase = false, have_kdf_option = false, have_file = false;
+    for (int i = 1; i < argc; i++)
     {
-        //AddRoundKey is its own inverse, as xor with a number is its own inverse
-        memcpy(&round_key, &key_schedule[160 - (16 * (round - 1))], 16);
-        for (int i = 0; i < 16; i++)
+        string flag = argv[i];
+        if (flag == "-e" || flag == "-d")
         {
-            block[i] ^= round_key[i];
+            j.encrypt = (flag == "-e");
+            have_direction = true;
+            continue;
         }
+        if (flag == "-s")
+        {
+            j.stats = true;
+            continue;
+        }
+        if (flag.size() != 2 || flag[0] != '-' || strchr("kKpbnmaiotcrBOS", flag[1]) == nullptr)
+        {
+            cerr << "Unknown option " << flag << endl;
+            return false;
+        }
+        if (i + 1 == argc)
+        {
+            cerr << "Missing value for " << flag << endl;
+            return false;
+        }
+        string value = argv[++i];
+        string upper = value;
+        transform(upper.begin(), upper.end(), upper.begin(), [](char c) { return (char)toupper((u8)c); });
 
-        //MixColumns inverse - the original matrix's inverse in the Rijndael field
-        if (round != 1)
+        switch (flag[1])
         {
-            for (int i = 0; i < 4; i++)
+        case 'k':
+            if (!parse_key(value, j.key))
             {
-                array <u8, 4> mix;
-                mix[0] = rijndael_multiply(14, block[4 * i]) ^ rijndael_multiply(11, block[4 * i + 1])
-                    ^ rijndael_multiply(13, block[4 * i + 2]) ^ rijndael_multiply(9, block[4 * i + 3]);
-                mix[1] = rijndael_multiply(9, block[4 * i]) ^ rijndael_multiply(14, block[4 * i + 1])
-                    ^ rijndael_multiply(11, block[4 * i + 2]) ^ rijndael_multiply(13, block[4 * i + 3]);
-                mix[2] = rijndael_multiply(13, block[4 * i]) ^ rijndael_multiply(9, block[4 * i + 1])
-                    ^ rijndael_multiply(14, block[4 * i + 2]) ^ rijndael_multiply(11, block[4 * i + 3]);
-                mix[3] = rijndael_multiply(11, block[4 * i]) ^ rijndael_multiply(13, block[4 * i + 1])
-                    ^ rijndael_multiply(9, block[4 * i + 2]) ^ rijndael_multiply(14, block[4 * i + 3]);
-                memcpy(&block[4 * i], &mix, 4);
+                cerr << "The key must be 32, 48 or 64 hex digits" << endl;
+                return false;
             }
+            have_key = true;
+            break;
+        case 'K':
+            if (!read_key_file(value, j.key))
+            {
+                cerr << "Cannot read a key from " << value << endl;
+                return false;
+            }
+            have_key = true;
+            break;
+        case 'p':
+            if (!read_passphrase_file(value, j.passphrase))
+            {
+                cerr << "Cannot read a passphrase from " << value << endl;
+                return false;
+            }
+            have_passphrase = true;
+            break;
+        case 'b':
+            if (!(value == "128" || value == "192" || value == "256"))
+            {
+                cerr << "The key size must be 128, 192 or 256 bits" << endl;
+                return false;
+            }
+            j.passphrase_key_bytes = (size_t)atoi(value.c_str()) / 8;
+            have_kdf_option = true;
+            break;
+        case 'n':
+        {
+            char* end;
+            unsigned long long n = strtoull(value.c_str(), &end, 10);
+            if (end == value.c_str() || *end != 0 || n == 0 || n > kdf_max_iterations)
+            {
+                cerr << "The iteration count must be from 1 to " << kdf_max_iterations << endl;
+                return false;
+            }
+            j.iterations = (u32)n;
+            have_kdf_option = true;
+            break;
         }
-
-        //ShiftRows inverse
-        for (int i = 0; i < 4; i++)
+        case 'm':
         {
-            array<u8, 4> newrow = lcs_4byte({ block[i], block[i + 4], block[i + 8], block[i + 12] }, 4 - i);
-            block[i] = newrow[0];
-            block[i + 4] = newrow[1];
-            block[i + 8] = newrow[2];
-            block[i + 12] = newrow[3];
+            auto name = find_if(begin(cipher_mode_names), end(cipher_mode_names), [&](const char* n) { return upper == n; });
+            if (name == end(cipher_mode_names))
+            {
+                cerr << "Unknown mode " << value << endl;
+                return false;
+            }
+            j.cipher_mode = (int)(name - begin(cipher_mode_names));
+            break;
         }
-
-        //SubBytes inverse
-        for (int i = 0; i < 16; i++)
+        case 'a':
+            if (!(upper == "BIN" || upper == "HEX" || upper == "B64"))
+            {
+                cerr << "Unknown encoding " << value << endl;
+                return false;
+            }
+            j.armor = (upper == "BIN" ? armor_binary : upper == "HEX" ? armor_hex : armor_base64);
+            break;
+        case 'i':
+            j.input = value;
+            have_file = true;
+            break;
+        case 'o':
+            j.output = value;
+            have_file = true;
+            break;
+        case 'B':
+            j.batch = value;
+            break;
+        case 'O':
+            j.batch_output_dir = value;
+            break;
+        case 'S':
+            j.server = value;
+            break;
+        case 't':
+            j.threads = (unsigned int)atoi(value.c_str());
+            if (j.threads == 0)
+            {
+                cerr << "The thread count must be at least 1" << endl;
+                return false;
+            }
+            break;
+        case 'c':
+            j.chunk_size = parse_chunk_size(upper);
+            if (j.chunk_size < 4096 || j.chunk_size % 16 != 0)
+            {
+                cerr << "The chunk size must be a multiple of 16 bytes, and at least 4K" << endl;
+                return false;
+            }
+            break;
+        case 'r':
         {
-            block[i] = inverse_sbox[block[i]];
+            char* end;
+            j.range_offset = strtoull(value.c_str(), &end, 10);
+            bool valid = (end != value.c_str() && *end == ':' && isdigit((u8)end[1]));
+            j.range_length = (valid ? strtoull(end + 1, &end, 10) : 0);
+            if (!valid || *end != 0)
+            {
+                cerr << "A range is OFFSET:LENGTH, in bytes" << endl;
+                return false;
+            }
+            j.range = true;
+            break;
+        }
         }
     }
-
-    memcpy(&round_key, &key_schedule, 16);
-    for (int i = 0; i < 16; i++)
+    if (!j.server.empty() && (have_direction || have_file || j.range || !j.batch.empty()))
+    {
+        cerr << "-S serves both directions, and takes no -e, -d, -i, -o, -r or -B" << endl;
+        return false;
+    }
+    if (!j.server.empty())
+    {   //encrypts SEEKABLE files, with the chunk size checked below
+        have_direction = true;
+        j.cipher_mode = mode_seekable;
+    }
+    if (!have_direction || have_key == have_passphrase)
+    {
+        cerr << (!have_direction ? "Choose -e or -d" : have_key ? "Give a key or a passphrase, not both" : "No key given") << endl;
+        return false;
+    }
+    if (have_kdf_option && !have_passphrase)
+    {
+        cerr << "-b and -n are only for -p" << endl;
+        return false;
+    }
+    if (j.range && j.encrypt)
+    {
+        cerr << "Only decryption takes a range" << endl;
+        return false;
+    }
+    if (!j.batch.empty() && (have_file || j.range))
+    {
+        cerr << "-B takes the place of -i and -o, and can't be given a range" << endl;
+        return false;
+    }
+    if (j.batch.empty() && !j.batch_output_dir.empty())
+    {
+        cerr << "-O is only for -B" << endl;
+        return false;
+    }
+    size_t chunk = j.chunk_size;
+    if (j.encrypt && j.cipher_mode == mode_seekable && chunk != 0 && ((chunk & (chunk - 1)) != 0 || chunk > ((size_t)1 << seekable_max_chunk_shift)))
     {
-        block[i] ^= round_key[i];
+        cerr << "A SEEKABLE chunk size must be a power of 2, from 4K to 16M" << endl;
+        return false;
     }
-    return block;
+    return true;
 }
 
-array<u8, 16> user_key;
-int main(int argc, char **argv)
+//The original dialog: asks for everything, and names the output after the input
+job interactive_job()
 {
-    make_sbox_array();
-    
-    ifstream input_file;
-    ofstream output_file;
-    string input_filename, output_filename;
-
+    job j;
     string mode;
     do //Mode input loop
     {
         cout << "Encrypt or decrypt? (E/D): ";
         cin >> mode;
-    } while (!(mode == "E" || mode == "D"));
+    } while (cin && !(mode == "E" || mode == "D"));
+    j.encrypt = (mode == "E");
+
+    //Decryption gets the block cipher mode and encoding from the file itself
+    if (j.encrypt)
+    {
+        string mode_input;
+        do //Block cipher mode input loop
+        {
+            cout << endl << "Block cipher mode? (ECB/CBC/CTR/GCM/SEEKABLE): ";
+            cin >> mode_input;
+        } while (cin && find(begin(cipher_mode_names), end(cipher_mode_names), mode_input) == end(cipher_mode_names));
+        j.cipher_mode = (int)(find(begin(cipher_mode_names), end(cipher_mode_names), mode_input) - begin(cipher_mode_names));
 
+        string armor_input;
+        do //Output encoding input loop
+        {
+            cout << endl << "Output encoding? (BIN/HEX/B64): ";
+            cin >> armor_input;
+        } while (cin && !(armor_input == "BIN" || armor_input == "HEX" || armor_input == "B64"));
+        j.armor = (armor_input == "BIN" ? armor_binary : armor_input == "HEX" ? armor_hex : armor_base64);
+    }
+
+    file_source probe;
     do
     { //File input loop
         cout << endl << "Enter a file name: ";
-        cin >> input_filename;
-        input_file.open(input_filename);
-    } while (input_file.fail());
+        cin >> j.input;
+    } while (cin && !probe.open(j.input));
+
+    if (!cin)
+    {
+        return j;
+    }
+    j.output = output_name(j.input, j.encrypt);
 
-    int dot_pos = input_filename.find('.'); //append _aes to the name, for the encrypted output file
+    string key_type;
+    do //Key or passphrase input loop
+    {
+        cout << endl << "Key or passphrase? (K/P): ";
+        cin >> key_type;
+    } while (cin && !(key_type == "K" || key_type == "P"));
 
-    output_filename = input_filename.substr(0, dot_pos) + 
-       (mode == "E" ? "_encrypted" : "_decrypted") + input_filename.substr(dot_pos);
+    if (key_type == "P")
+    {
+        string passphrase;
+        cin.ignore(numeric_limits<streamsize>::max(), '\n'); //the rest of the last answer's line
+        do //Passphrase input loop: the whole line, spaces and all
+        {
+            cout << endl << "Enter a passphrase: ";
+            getline(cin, passphrase);
+        } while (cin && passphrase.empty());
+        j.passphrase.assign(passphrase.begin(), passphrase.end());
+        secure_zero(&passphrase[0], passphrase.size());
+        return j;
+    }
 
     string key_input;
     do //Key input loop
     {
         key_input = "";
-        cout << endl <<  "Enter a key - 32 hex characters: ";
+        cout << endl <<  "Enter a key - 32, 48 or 64 hex characters: ";
         cin >> key_input;
-    } while ((key_input.length() != 32) || (strspn(key_input.c_str(), "1234567890abcdefABCDEF") != 32));
+    } while (cin && !parse_key(key_input, j.key));
     //Prompt user until the input string has 32 characters, all of which are valid hex digits
+    return j;
+}
 
-    for (int i = 0; i < 16; i++)
-    { // Convert input to key, from two characters at a time to one byte at a time
-        user_key[i] = stoi(key_input.substr(2 * i, 2), nullptr, 16);
+//Where --autotune saves and every run looks; empty if there is no home directory
+string tuning_file_path()
+{
+    const char* config = getenv("XDG_CONFIG_HOME");
+    if (config && *config)
+    {
+        return string(config) + "/aesencode/tuning";
     }
+    const char* home = getenv("HOME");
+    if (home && *home)
+    {
+        return string(home) + "/.config/aesencode/tuning";
+    }
+    return "";
+}
 
-    cout << endl << (mode == "E" ? "Encrypting..." : "Decrypting...") << endl;
-
-    make_key_schedule(user_key); //Generate the round keys
+//Starts with what --autotune found for this CPU, if it has been run
+void load_saved_tuning(unsigned int threads)
+{
+    string path = tuning_file_path();
+    aes_tuning tuning;
+    if (!path.empty() && load_tuning(path, threads, tuning))
+    {
+        use_tuning(tuning);
+    }
+}
 
-    int chars_per_block = (mode == "E" ? 16 : 32);
-    char buffer[32];
-    array<u8, 16> current_block;
-    output_file.open(output_filename);
-    while (input_file)
+int run_autotune(int argc, char** argv)
+{
+    bool allow_ttable = false;
+    unsigned int threads = thread::hardware_concurrency();
+    string path = tuning_file_path();
+    for (int i = 2; i < argc; i++)
     {
-        //Read the input file, in blocks 16 characters at a time
-        input_file.read(buffer, chars_per_block);
-        if (!input_file)
-        {   //If the file ends before 16 characters, fill the rest of the block with zeros
-            //(this should only happen with encrypt mode).
-            int chars_left = input_file.gcount();
-            if (chars_left == 0)
-            {
-                break;
-            }
-            else
-            {
-                for (int i = input_file.gcount(); i < 16; i++)
-                {
-                    buffer[i] = 0x00;
-                }
-            }
+        if (strcmp(argv[i], "--allow-ttable") == 0)
+        {
+            allow_ttable = true;
         }
-        if (mode == "E") //encryption mode
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
         {
-            for (int i = 0; i < 16; i++)
-            {   //convert from signed to unsigned char
-                current_block[i] = (u8)buffer[i];
-            }
-
-            array<u8, 16> encrypt = encrypt_block(current_block);
-            for (int i = 0; i < 16; i++)
-            {   //write encrypted block to the output file as hex characters
-                output_file << setfill('0') << setw(2) << hex << int(encrypt[i]);
-            }
+            threads = (unsigned int)atoi(argv[++i]);
         }
-        else //decryption mode
+        else if (argv[i][0] != '-')
         {
-            for (int i = 0; i < 16; i++)
-            {
-                current_block[i] = (u8) stoi(string({ buffer[2 * i], buffer[2 * i + 1] }), nullptr, 16);
-            }
-            array<u8, 16> decrypt = decrypt_block(current_block);
-            for (int i = 0; i < 16; i++)
-            {   //write decrypted block to the output file
-                output_file << (char)decrypt[i];
-            }
+            path = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 2;
         }
     }
-    input_file.close();
-    output_file.close();
-
-    cout << "Completed!" << endl;
+    if (path.empty())
+    {
+        cerr << "No home directory to keep the tuning in; give a file" << endl;
+        return 1;
+    }
+    thread_pool pool(threads);
+    aes_tuning tuning = autotune(pool, allow_ttable, &cout);
+    if (!save_tuning(path, threads, tuning))
+    {
+        cerr << "Couldn't write " << path << endl;
+        return 1;
+    }
+    cout << "Saved in " << path << endl;
     return 0;
 }
-    
\ No newline at end of file
+
+int main(int argc, char **argv)
+{
+    make_codec_tables();
+
+    if (argc == 1)
+    {
+        job j = interactive_job();
+        if (cin.fail())
+        {
+            return 1;
+        }
+        load_saved_tuning(j.threads);
+        return run_job(j, cout, cout);
+    }
+
+    //Non-interactive: standard output may be the data, so nothing but errors is printed
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (strcmp(argv[1], "--self-test") == 0 && argc <= 3)
+    {
+        return aes_self_test(cout, argc == 3 ? (unsigned int)atoi(argv[2]) : 200) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "--autotune") == 0)
+    {
+        return run_autotune(argc, argv);
+    }
+    job j;
+    if (!parse_arguments(argc, argv, j))
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+    load_saved_tuning(j.threads);
+    ostream quiet(nullptr);
+    int status = run_job(j, quiet, cerr);
+    if (j.stats)
+    {
+        aes_stats_dump(cerr);
+    }
+    return status;
+}
+
@@ -0,0 +1,605 @@
+/* AES library (FIPS-197 with 128, 192 and 256-bit keys) and the CTR, CBC and GCM modes.
+An aes_context holds the round keys for one key and the backend that uses them,
+so any number of keys can be in use at once, from any number of threads.
+*/
+
+#ifndef AES_H
+#define AES_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+//A 16, 24 or 32-byte key has 10, 12 or 14 rounds
+const int aes_max_rounds = 14;
+inline bool aes_key_size_valid(size_t key_bytes)
+{
+    return key_bytes == 16 || key_bytes == 24 || key_bytes == 32;
+}
+
+inline int aes_rounds(size_t key_bytes)
+{
+    return (int)key_bytes / 4 + 6;
+}
+
+//Round keys in every form a backend might want: the expanded key, the keys for
+//the equivalent inverse cipher, and the bitsliced copy (each byte spread across
+//eight bit planes, two 64-bit halves per plane).
+struct aes_round_keys
+{
+    int rounds;
+    std::array<u8, 16 * (aes_max_rounds + 1)> enc;
+    std::array<u8, 16 * (aes_max_rounds + 1)> dec;
+    u64 bs[aes_max_rounds + 1][8][2];
+};
+
+//The block functions for one key size. Each is compiled separately for its
+//number of rounds, so the round loops have no run-time bound.
+struct aes_kernels
+{
+    std::array<u8, 16> (*encrypt_block)(const aes_round_keys& keys, std::array<u8, 16> block);
+    std::array<u8, 16> (*decrypt_block)(const aes_round_keys& keys, std::array<u8, 16> block);
+    void (*encrypt_blocks)(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks);
+    void (*decrypt_blocks)(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks);
+    //CTR over nblocks whole blocks: block i of in is xored with the encryption of
+    //the 128-bit big-endian counter (hi, lo) + i, which is then advanced past them.
+    //The counters are made and the data xored in registers, so no keystream is
+    //stored. nullptr if the backend has none; ctr_crypt then uses encrypt_blocks.
+    void (*ctr_blocks)(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks, u64& hi, u64& lo);
+};
+
+//A backend is one implementation of the key schedule and the block functions.
+//best_backend() is the fastest one the CPU supports (or the one use_tuning
+//chose); available_backends() lists every one that can run here, the best first.
+struct aes_backend
+{
+    const char* name;
+    void (*make_key_schedule)(const u8* key, size_t key_bytes, aes_round_keys& keys);
+    aes_kernels aes128, aes192, aes256;
+
+    const aes_kernels& kernels(int rounds) const
+    {
+        return rounds == 10 ? aes128 : rounds == 12 ? aes192 : aes256;
+    }
+};
+
+const aes_backend& best_backend();
+std::vector<const aes_backend*> available_backends();
+//available_backends() and the variants of them that only differ in how many
+//blocks they keep in flight, which the autotuner (aes_tune.h) chooses between
+std::vector<const aes_backend*> tuning_candidates();
+//The specification followed step by step. Far too slow to be chosen, but the
+//others can be checked against it.
+const aes_backend& reference_backend();
+
+//Overwrites key material in a way the compiler can't drop as a dead store
+void secure_zero(void* p, size_t len);
+
+class buffer_pool;
+
+//A buffer on loan from a buffer_pool, given back (and wiped) when the handle goes.
+//Only as much as mark_used has covered is wiped, so a large buffer used for a
+//small file costs little to give back; with no mark at all, all of it is.
+class pooled_buffer
+{
+public:
+    pooled_buffer() = default;
+    pooled_buffer(pooled_buffer&& other) noexcept;
+    pooled_buffer& operator=(pooled_buffer&& other) noexcept;
+    ~pooled_buffer()
+    {
+        release();
+    }
+
+    u8* data() const
+    {
+        return ptr;
+    }
+
+    size_t size() const
+    {
+        return len;
+    }
+
+    u8& operator[](size_t i) const
+    {
+        return ptr[i];
+    }
+
+    //Bytes [0, end) have held data
+    void mark_used(size_t end)
+    {
+        used = (used > end ? used : end);
+        marked = true;
+    }
+
+    void release();
+
+private:
+    friend class buffer_pool;
+    buffer_pool* pool = nullptr;
+    u8* ptr = nullptr;
+    size_t len = 0;
+    size_t used = 0;
+    bool marked = false;
+    bool locked = false;
+};
+
+//Large buffers for the bulk paths, reused instead of allocated for every call:
+//a stream gets the same memory back chunk after chunk and file after file. Each
+//is page-aligned (so also 64-byte aligned, for cache lines and AVX-512 loads),
+//and wiped before it is kept for the next get() of the same size. At most
+//max_cached bytes are kept; anything past that is freed. With huge_pages, buffers
+//of 2 MiB or more are mapped on their own and asked to be backed by huge pages
+//(transparent huge pages, on Linux), which cuts TLB misses sweeping through them.
+//Locked buffers are for key material and are also kept out of swap with mlock,
+//as far as RLIMIT_MEMLOCK allows. Safe to use from any number of threads.
+class buffer_pool
+{
+public:
+    explicit buffer_pool(size_t max_cached = 256 << 20, bool huge_pages = true);
+    //Every buffer must have been given back
+    ~buffer_pool();
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    pooled_buffer get(size_t len, bool locked = false);
+
+    //The same without a handle, for allocators. p must go back with the len and
+    //locked it was taken with; its first wipe_len bytes are wiped (all by default).
+    u8* take(size_t len, bool locked = false);
+    void give_back(u8* p, size_t len, bool locked = false, size_t wipe_len = ~(size_t)0);
+
+    //Frees every buffer being kept
+    void trim();
+    size_t cached_bytes() const;
+
+    //The pool the library's own buffers come from. Never destroyed, so buffers
+    //can still be given back during static destruction.
+    static buffer_pool& shared();
+
+private:
+    size_t capacity_for(size_t len) const;
+    bool mapped(size_t capacity) const;
+    u8* allocate(size_t capacity, bool locked) const;
+    void free_block(u8* p, size_t capacity, bool locked) const;
+
+    const size_t max_cached;
+    const bool huge_pages;
+    mutable std::mutex lock;
+    std::multimap<size_t, u8*> free_blocks[2]; //by capacity; [1] holds the locked ones
+    size_t cached = 0;
+};
+
+//A standard allocator over buffer_pool::shared()'s locked buffers, for objects
+//holding key material (see key_cache)
+template <class T>
+struct locked_allocator
+{
+    typedef T value_type;
+    locked_allocator() = default;
+    template <class U>
+    locked_allocator(const locked_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        return (T*)buffer_pool::shared().take(n * sizeof(T), true);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        buffer_pool::shared().give_back((u8*)p, n * sizeof(T), true);
+    }
+
+    template <class U>
+    bool operator==(const locked_allocator<U>&) const
+    {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(const locked_allocator<U>&) const
+    {
+        return false;
+    }
+};
+
+//One AES key, expanded once. The block functions are const and share nothing,
+//so a context can be used by several threads at the same time. The key must be
+//16, 24 or 32 bytes (see aes_key_size_valid); std::invalid_argument otherwise.
+class aes_context
+{
+public:
+    aes_context(const u8* key, size_t key_bytes, const aes_backend* backend = nullptr);
+    explicit aes_context(const std::array<u8, 16>& key, const aes_backend* backend = nullptr)
+        : aes_context(key.data(), key.size(), backend) {}
+    aes_context(const aes_context&) = default;
+    aes_context& operator=(const aes_context&) = default;
+    ~aes_context()
+    {
+        secure_zero(&keys, sizeof(keys));
+    }
+
+    std::array<u8, 16> encrypt_block(std::array<u8, 16> block) const
+    {
+        return fns->encrypt_block(keys, block);
+    }
+
+    std::array<u8, 16> decrypt_block(std::array<u8, 16> block) const
+    {
+        return fns->decrypt_block(keys, block);
+    }
+
+    //Bulk versions for the parallelisable modes: nblocks consecutive 16-byte blocks
+    void encrypt_blocks(const u8* in, u8* out, size_t nblocks) const
+    {
+        fns->encrypt_blocks(keys, in, out, nblocks);
+    }
+
+    void decrypt_blocks(const u8* in, u8* out, size_t nblocks) const
+    {
+        fns->decrypt_blocks(keys, in, out, nblocks);
+    }
+
+    //The backend's CTR kernel (see aes_kernels::ctr_blocks); false, with nothing
+    //done, if it has none
+    bool ctr_blocks(const u8* in, u8* out, size_t nblocks, u64& hi, u64& lo) const
+    {
+        if (!fns->ctr_blocks)
+        {
+            return false;
+        }
+        fns->ctr_blocks(keys, in, out, nblocks, hi, lo);
+        return true;
+    }
+
+    size_t key_size() const
+    {
+        return (size_t)(keys.rounds - 6) * 4;
+    }
+
+    const aes_backend& backend() const
+    {
+        return *impl;
+    }
+
+    const aes_round_keys& round_keys() const
+    {
+        return keys;
+    }
+
+private:
+    const aes_backend* impl;
+    const aes_kernels* fns; //impl's functions for this key size
+    aes_round_keys keys;
+};
+
+//A fixed set of worker threads. run() hands out task indices 0..ntasks-1 to the
+//workers and the calling thread, and returns once every task has finished.
+//
+//Each thread starts a batch with its own contiguous share of the indices and
+//works through it from the front. One that runs out takes the back half of
+//another's share, trying the threads on its own NUMA node before the rest. The
+//shares are laid out the same way every batch, so a thread tends to get the same
+//chunks of a buffer each time (see first_touch). Where the CPU layout is known
+//(Linux), the workers are pinned to CPUs taken from each node in turn, so a pool
+//smaller than the machine is still spread across all of its memory controllers.
+class thread_pool
+{
+public:
+    //The workers are only started by the first batch with more than one task,
+    //so short runs never pay for creating threads. The calling thread is never
+    //pinned, and neither is anything when there are more threads than CPUs.
+    thread_pool(unsigned int nthreads = std::thread::hardware_concurrency(), bool pin_threads = true);
+    ~thread_pool();
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    size_t size() const
+    {
+        return nthreads;
+    }
+
+    void run(size_t ntasks, const std::function<void(size_t)>& task);
+
+private:
+    //One thread's share of the current batch, packed as (next << 32) | end so
+    //that taking from either end is a single compare-and-swap. A cache line each,
+    //as the owner updates it for every task.
+    struct alignas(64) share
+    {
+        std::atomic<u64> range{ 0 };
+        int node = 0;
+        int cpu = -1; //to pin the worker to, or -1
+    };
+
+    bool take_own(size_t self, size_t& index);
+    bool steal(size_t self);
+    void run_tasks(size_t self, const std::function<void(size_t)>& task);
+    void worker_loop(size_t self, u64 seen);
+
+    unsigned int nthreads;
+    std::unique_ptr<share[]> shares;
+    std::vector<std::vector<size_t>> victims; //for each thread, the others to steal from, nearest first
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable start_signal, done_signal;
+    const std::function<void(size_t)>* current_task = nullptr;
+    size_t workers_done = 0;
+    u64 generation = 0;
+    bool stopping = false;
+};
+
+//Writes to every page of a new buffer from the pool thread that will work on it,
+//one chunk_size piece per task, as the parallel modes split it. A page is placed
+//on the NUMA node of the thread that first touches it, so this keeps each chunk
+//in memory local to its thread, rather than wherever the allocating thread ran.
+void first_touch(thread_pool& pool, u8* data, size_t len, size_t chunk_size);
+
+//Counter (CTR) mode. block_offset is the index of the block at in[0], so a chunk
+//from the middle of a stream can be processed on its own.
+void ctr_crypt(const aes_context& ctx, const u8* in, u8* out, size_t len, const std::array<u8, 16>& iv, u64 block_offset);
+
+//Splits the data into chunk_size pieces (a whole number of blocks) and runs them
+//on the thread pool
+const size_t ctr_chunk_size = 1 << 20;
+void ctr_crypt_parallel(thread_pool& pool, const aes_context& ctx, const u8* in, u8* out, size_t len, const std::array<u8, 16>& iv,
+    u64 block_offset, size_t chunk_size = ctr_chunk_size);
+
+//Many short messages at once, each with its own context and initial counter block.
+//Blocks from different messages are encrypted together through the bulk kernels,
+//so messages of a few blocks still keep them busy. The jobs for each context are
+//gathered together, whatever their order; any number of jobs may share one.
+struct ctr_job
+{
+    const aes_context* ctx;
+    std::array<u8, 16> iv;
+    const u8* in;
+    u8* out;
+    size_t len;
+};
+void ctr_crypt_batch(const ctr_job* jobs, size_t njobs);
+
+//Cipher block chaining (CBC) over whole blocks; cbc_encrypt leaves the last
+//ciphertext block in iv so a stream can be encrypted in pieces. prev is the
+//block before in[0] (the IV for the first piece). cbc_decrypt_parallel splits
+//the data into chunk_size pieces like ctr_crypt_parallel.
+void cbc_encrypt(const aes_context& ctx, const u8* in, u8* out, size_t nblocks, std::array<u8, 16>& iv);
+void cbc_decrypt(const aes_context& ctx, const u8* in, u8* out, size_t nblocks, const u8* prev);
+void cbc_decrypt_parallel(thread_pool& pool, const aes_context& ctx, const u8* in, u8* out, size_t nblocks, const std::array<u8, 16>& iv,
+    size_t chunk_size = ctr_chunk_size);
+
+//Length of the last block once its PKCS#7 padding is removed, or -1 if the padding is invalid
+int pkcs7_unpadded_length(const u8* last_block);
+
+//GCM (Galois/Counter Mode, NIST SP 800-38D). A gcm_key is everything about one
+//AES key that GHASH needs; it refers to the context, which must outlive it.
+const int ghash_aggregate = 8;
+const int ghash_powers = 16; //the VAES-512 loop aggregates 16 blocks
+struct gcm_state;
+struct gcm_key
+{
+    const aes_context* aes;
+    u8 h[16]; //H = E(0)
+    //H^1..H^16 for the carry-less multiply versions (8 or 16 blocks are multiplied
+    //by descending powers and summed before a single reduction), and Shoup's 4-bit
+    //tables for the portable version
+    u64 h_powers[ghash_powers][2]; //(hi, lo) of H^(i+1)
+    u64 table_hi[16], table_lo[16];
+    //x = (x ^ block) * H for each block, and the bulk encrypt-and-hash loop
+    void (*ghash)(const gcm_key& key, u8* x, const u8* data, size_t nblocks);
+    void (*blocks)(gcm_state& st, const u8* in, u8* out, size_t nblocks, bool encrypt);
+
+    ~gcm_key()
+    {
+        secure_zero(this, sizeof(*this));
+    }
+};
+
+gcm_key make_gcm_key(const aes_context& aes);
+
+//State of one GCM message. Every gcm_update call except the last must be a
+//whole number of blocks.
+struct gcm_state
+{
+    const gcm_key* key;
+    u8 j0[16];   //initial counter block; its encryption masks the tag
+    u8 x[16];    //GHASH accumulator
+    u32 counter; //low 32 bits of the next counter block (GCM increments only these)
+    u64 aad_len;
+    u64 data_len;
+};
+
+void gcm_start(gcm_state& st, const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len);
+void gcm_update(gcm_state& st, const u8* in, u8* out, size_t len, bool encrypt);
+void gcm_finish(gcm_state& st, u8* tag);
+
+//Compares two 16-byte tags in constant time
+bool tags_equal(const u8* a, const u8* b);
+
+//One-shot versions; gcm_decrypt returns false (and the output must be discarded)
+//if the tag doesn't match
+void gcm_encrypt(const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len, const u8* in, u8* out, size_t len, u8* tag);
+bool gcm_decrypt(const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len, const u8* in, u8* out, size_t len, const u8* tag);
+
+//Batched GCM, as for ctr_crypt_batch. Messages with 12-byte IVs that fit in one
+//batch (up to 1008 bytes) share the bulk kernels; the rest go through
+//gcm_encrypt/gcm_decrypt one by one.
+struct gcm_job
+{
+    const gcm_key* key;
+    const u8* iv;
+    size_t iv_len;
+    const u8* aad;
+    size_t aad_len;
+    const u8* in;
+    u8* out;
+    size_t len;
+    u8* tag;  //written by gcm_encrypt_batch, checked by gcm_decrypt_batch
+    bool ok;  //set by gcm_decrypt_batch: false if the tag didn't match (discard out)
+};
+void gcm_encrypt_batch(gcm_job* jobs, size_t njobs);
+//True if every tag matched
+bool gcm_decrypt_batch(gcm_job* jobs, size_t njobs);
+
+//XTS (IEEE 1619, NIST SP 800-38E): length-preserving encryption of fixed-size
+//sectors (disk blocks, database pages), each encrypted under its own number. The
+//key is two AES keys of the same size one after the other, 32 or 64 bytes in all
+//(AES-128 or AES-256): the first for the data and the second for the tweaks. The
+//two halves must differ; std::invalid_argument otherwise.
+struct xts_key
+{
+    xts_key(const u8* key, size_t key_bytes, const aes_backend* backend = nullptr);
+
+    aes_context data;
+    aes_context tweak;
+};
+
+//One sector of len bytes, at least 16. A length that isn't a whole number of
+//blocks uses ciphertext stealing for the last one. in and out may be the same.
+void xts_encrypt(const xts_key& key, u64 sector, const u8* in, u8* out, size_t len);
+void xts_decrypt(const xts_key& key, u64 sector, const u8* in, u8* out, size_t len);
+
+//nsectors consecutive sectors of sector_size bytes, numbered from first_sector,
+//in ctr_chunk_size (or at least one sector) pieces on the thread pool
+void xts_encrypt_sectors(thread_pool& pool, const xts_key& key, u64 first_sector, size_t sector_size, const u8* in, u8* out,
+    size_t nsectors);
+void xts_decrypt_sectors(thread_pool& pool, const xts_key& key, u64 first_sector, size_t sector_size, const u8* in, u8* out,
+    size_t nsectors);
+
+//Checks every backend the CPU can run (the autotuner's variants too) and the
+//reference implementation with the FIPS-197, SP 800-38A, GCM specification and
+//XTS vectors and ECB Monte Carlo chains, then compares each with the reference
+//on rounds random cases drawn from seed; and SHA-256, HMAC and PBKDF2 with
+//theirs. Writes a line per group or failure to out; true if everything passed.
+bool aes_self_test(std::ostream& out, unsigned int rounds = 200, u64 seed = 1);
+
+//Everything derived from one key: the round keys (both directions) and the GHASH
+//key. gcm refers to aes, so it can't be copied or moved.
+struct expanded_key
+{
+    expanded_key(const u8* key, size_t key_bytes, const aes_backend* backend = nullptr)
+        : aes(key, key_bytes, backend), gcm(make_gcm_key(aes)) {}
+    expanded_key(const expanded_key&) = delete;
+    expanded_key& operator=(const expanded_key&) = delete;
+
+    aes_context aes;
+    gcm_key gcm;
+};
+
+//Recently used keys, already expanded, for callers that see the same few keys
+//over and over (a server handling many short messages per tenant key). Holds at
+//most capacity keys, dropping the least recently used; get() can be called from
+//any number of threads. Keys are found by a hash seeded per cache, then compared
+//in full. Both the copies of the keys and the expanded keys are kept in locked
+//pages (see buffer_pool). Everything a dropped entry held is wiped once it is no
+//longer in use: the copy of the key at once, the expanded key when its last user
+//lets go.
+class key_cache
+{
+public:
+    explicit key_cache(size_t capacity = 64);
+    ~key_cache();
+    key_cache(const key_cache&) = delete;
+    key_cache& operator=(const key_cache&) = delete;
+
+    //The expanded key, from the cache or made (and cached) now. Throws
+    //std::invalid_argument if the key isn't 16, 24 or 32 bytes.
+    std::shared_ptr<const expanded_key> get(const u8* key, size_t key_bytes);
+    void clear();
+    size_t size() const;
+
+private:
+    struct entry
+    {
+        u64 hash;
+        size_t key_bytes;
+        u8 key[32];
+        std::shared_ptr<const expanded_key> value;
+    };
+    typedef std::list<entry, locked_allocator<entry>> entry_list;
+    typedef entry_list::iterator entry_iterator;
+
+    u64 hash_key(const u8* key, size_t key_bytes) const;
+    entry_iterator find(u64 hash, const u8* key, size_t key_bytes);
+    void evict(entry_iterator e);
+
+    size_t capacity;
+    u64 seed;
+    mutable std::mutex lock;
+    entry_list entries; //most recently used first
+    std::unordered_multimap<u64, entry_iterator> index;
+};
+
+//SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104) and PBKDF2-HMAC-SHA256 (RFC 8018),
+//for turning a passphrase into a key. The compression function uses the SHA
+//extensions (x86 SHA-NI, or ARMv8 SHA2) when the CPU has them.
+void sha256(const u8* data, size_t len, u8 digest[32]);
+void hmac_sha256(const u8* key, size_t key_len, const u8* data, size_t len, u8 mac[32]);
+
+//Fills out_len bytes; iterations must be at least 1 (std::invalid_argument
+//otherwise). The default is OWASP's 2023 recommendation for PBKDF2-HMAC-SHA256.
+const u32 pbkdf2_default_iterations = 600000;
+void pbkdf2_hmac_sha256(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len, u32 iterations,
+    u8* out, size_t out_len);
+
+//Keys derived from passphrases with PBKDF2-HMAC-SHA256 and expanded, so one used
+//for many files (one salt for a batch, say) is only stretched once. Like
+//key_cache, it drops the least recently used beyond capacity, keeps everything in
+//locked pages and wipes what it drops. get() can be called from any number of
+//threads; when several ask for the same key at once, one derives it while the
+//rest wait for it, rather than each running the KDF. A cache holds only a few
+//entries, so they are looked through in turn, the passphrases compared in
+//constant time.
+class passphrase_cache
+{
+public:
+    explicit passphrase_cache(size_t capacity = 16);
+    ~passphrase_cache();
+    passphrase_cache(const passphrase_cache&) = delete;
+    passphrase_cache& operator=(const passphrase_cache&) = delete;
+
+    //Throws std::invalid_argument if key_bytes isn't 16, 24 or 32
+    std::shared_ptr<const expanded_key> get(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+        u32 iterations, size_t key_bytes);
+    //The key if it has already been derived, or nullptr; never derives one (and
+    //doesn't count as a use), so it is always quick
+    std::shared_ptr<const expanded_key> find(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+        u32 iterations, size_t key_bytes) const;
+    void clear();
+    size_t size() const;
+
+private:
+    struct entry
+    {
+        std::vector<u8, locked_allocator<u8>> passphrase;
+        std::vector<u8> salt;
+        u32 iterations = 0;
+        size_t key_bytes = 0;
+        std::shared_future<std::shared_ptr<const expanded_key>> value;
+    };
+
+    static bool matches(const entry& e, const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+        u32 iterations, size_t key_bytes);
+
+    size_t capacity;
+    mutable std::mutex lock;
+    std::list<entry, locked_allocator<entry>> entries; //most recently used first
+};
+
+#endif
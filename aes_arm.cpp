@@ -0,0 +1,319 @@
+/* 64-bit ARM kernels: ARMv8 Crypto Extensions block functions, PMULL GHASH and
+SHA-256.
+*/
+
+#include "aes_internal.h"
+
+using namespace std;
+
+#ifdef AES_ARM64
+bool cpu_has_armv8_aes()
+{
+#if defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__APPLE__)
+    return true; //every Apple arm64 core has the crypto extensions
+#else
+    return false;
+#endif
+}
+
+//64-bit carry-less multiply (PMULL), used for GHASH
+bool cpu_has_armv8_pmull()
+{
+#if defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#elif defined(__APPLE__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_armv8_sha2()
+{
+#if defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__APPLE__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+//AESE does AddRoundKey, SubBytes and ShiftRows (key first), AESMC does MixColumns,
+//so the round keys are applied one step earlier than in the x86 version and the
+//last one is a plain xor. The key schedule is the same as everywhere else.
+template <int Nr>
+TARGET_ARMV8_CRYPTO array<u8, 16> encrypt_block_armv8(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const u8* rk = &keys.enc[0];
+    uint8x16_t b = vld1q_u8(&block[0]);
+    AES_UNROLL
+    for (int round = 0; round < Nr - 1; round++)
+    {
+        b = vaesmcq_u8(vaeseq_u8(b, vld1q_u8(rk + 16 * round)));
+    }
+    b = vaeseq_u8(b, vld1q_u8(rk + 16 * (Nr - 1)));
+    b = veorq_u8(b, vld1q_u8(rk + 16 * Nr));
+    vst1q_u8(&block[0], b);
+    return block;
+}
+
+//AESD is AddRoundKey, InvShiftRows, InvSubBytes and AESIMC is InvMixColumns,
+//which lines up with keys.dec (equivalent inverse cipher).
+template <int Nr>
+TARGET_ARMV8_CRYPTO array<u8, 16> decrypt_block_armv8(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const u8* rk = &keys.dec[0];
+    uint8x16_t b = vld1q_u8(&block[0]);
+    AES_UNROLL
+    for (int round = 0; round < Nr - 1; round++)
+    {
+        b = vaesimcq_u8(vaesdq_u8(b, vld1q_u8(rk + 16 * round)));
+    }
+    b = vaesdq_u8(b, vld1q_u8(rk + 16 * (Nr - 1)));
+    b = veorq_u8(b, vld1q_u8(rk + 16 * Nr));
+    vst1q_u8(&block[0], b);
+    return block;
+}
+
+//Blocks in flight (W): 8 by default, and the autotuner also tries 4
+const int armv8_interleave = 8;
+template <int Nr, int W = armv8_interleave>
+TARGET_ARMV8_CRYPTO void encrypt_blocks_armv8(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    uint8x16_t rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = vld1q_u8(&keys.enc[16 * round]);
+    }
+
+    for (; nblocks >= W; nblocks -= W)
+    {
+        uint8x16_t b[W];
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = vld1q_u8(in + 16 * i);
+        }
+        AES_UNROLL
+        for (int round = 0; round < Nr - 1; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < W; i++)
+            {
+                b[i] = vaesmcq_u8(vaeseq_u8(b[i], rk[round]));
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            vst1q_u8(out + 16 * i, veorq_u8(vaeseq_u8(b[i], rk[Nr - 1]), rk[Nr]));
+        }
+        in += 16 * W;
+        out += 16 * W;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        uint8x16_t b = vld1q_u8(in);
+        AES_UNROLL
+        for (int round = 0; round < Nr - 1; round++)
+        {
+            b = vaesmcq_u8(vaeseq_u8(b, rk[round]));
+        }
+        vst1q_u8(out, veorq_u8(vaeseq_u8(b, rk[Nr - 1]), rk[Nr]));
+    }
+}
+
+template <int Nr, int W = armv8_interleave>
+TARGET_ARMV8_CRYPTO void decrypt_blocks_armv8(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    uint8x16_t rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = vld1q_u8(&keys.dec[16 * round]);
+    }
+
+    for (; nblocks >= W; nblocks -= W)
+    {
+        uint8x16_t b[W];
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = vld1q_u8(in + 16 * i);
+        }
+        AES_UNROLL
+        for (int round = 0; round < Nr - 1; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < W; i++)
+            {
+                b[i] = vaesimcq_u8(vaesdq_u8(b[i], rk[round]));
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            vst1q_u8(out + 16 * i, veorq_u8(vaesdq_u8(b[i], rk[Nr - 1]), rk[Nr]));
+        }
+        in += 16 * W;
+        out += 16 * W;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        uint8x16_t b = vld1q_u8(in);
+        AES_UNROLL
+        for (int round = 0; round < Nr - 1; round++)
+        {
+            b = vaesimcq_u8(vaesdq_u8(b, rk[round]));
+        }
+        vst1q_u8(out, veorq_u8(vaesdq_u8(b, rk[Nr - 1]), rk[Nr]));
+    }
+}
+//SubWord of one key word by AESE with a zero round key, so that no table is
+//indexed by the key. With the word in all four columns, ShiftRows only moves
+//bytes between equal columns, so each lane comes out as SubWord of it.
+TARGET_ARMV8_CRYPTO u32 armv8_sub_word(u32 w)
+{
+    uint8x16_t b = vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0));
+    return vgetq_lane_u32(vreinterpretq_u32_u8(b), 0);
+}
+
+//FIPS-197 section 5.2 a word at a time, as there is no AESKEYGENASSIST here, and
+//keys.dec for the equivalent inverse cipher with AESIMC doing InvMixColumns on
+//all but the first and last. Same layout as the software version.
+TARGET_ARMV8_CRYPTO void make_key_schedule_armv8(const u8* key, size_t key_bytes, aes_round_keys& keys)
+{
+    const int nk = (int)key_bytes / 4;
+    keys.rounds = nk + 6;
+    u32 rcon = 1;
+    for (int i = 0; i < 4 * (keys.rounds + 1); i++)
+    {
+        u32 w;
+        if (i < nk)
+        {
+            w = load_word(key + 4 * i);
+        }
+        else
+        {
+            w = load_word(&keys.enc[4 * (i - 1)]);
+            if (i % nk == 0)
+            {   //RotWord moves byte 0 (the lowest) to the top
+                w = armv8_sub_word((w >> 8) | (w << 24)) ^ rcon;
+                rcon = (rcon << 1) ^ ((rcon >> 7) * 0x11b);
+            }
+            else if (nk > 6 && i % nk == 4)
+            {
+                w = armv8_sub_word(w);
+            }
+            w ^= load_word(&keys.enc[4 * (i - nk)]);
+        }
+        store_word(&keys.enc[4 * i], w);
+    }
+    for (int round = 0; round <= keys.rounds; round++)
+    {
+        uint8x16_t dk = vld1q_u8(&keys.enc[16 * (keys.rounds - round)]);
+        if (round != 0 && round != keys.rounds)
+        {
+            dk = vaesimcq_u8(dk);
+        }
+        vst1q_u8(&keys.dec[16 * round], dk);
+    }
+}
+
+template <int Nr>
+constexpr aes_kernels armv8_kernels()
+{
+    return { encrypt_block_armv8<Nr>, decrypt_block_armv8<Nr>, encrypt_blocks_armv8<Nr>, decrypt_blocks_armv8<Nr>, nullptr };
+}
+
+template <int Nr, int W>
+constexpr aes_kernels armv8_width_kernels()
+{
+    return { encrypt_block_armv8<Nr>, decrypt_block_armv8<Nr>, encrypt_blocks_armv8<Nr, W>, decrypt_blocks_armv8<Nr, W>, nullptr };
+}
+
+extern const aes_backend armv8_backend = { "ARMv8", make_key_schedule_armv8,
+    armv8_kernels<10>(), armv8_kernels<12>(), armv8_kernels<14>() };
+extern const aes_backend armv8_4_backend = { "ARMv8 x4", make_key_schedule_armv8,
+    armv8_width_kernels<10, 4>(), armv8_width_kernels<12, 4>(), armv8_width_kernels<14, 4>() };
+#endif
+
+
+#ifdef AES_ARM64
+//PMULL does the 64x64 carry-less multiplies; the reduction is gf128_reduce
+TARGET_ARMV8_CRYPTO void clmul_accumulate_pmull(u64 a_hi, u64 a_lo, u64 b_hi, u64 b_lo, u64 acc[4])
+{
+    poly128_t ll = vmull_p64(a_lo, b_lo);
+    poly128_t hh = vmull_p64(a_hi, b_hi);
+    uint64x2_t mid = veorq_u64(vreinterpretq_u64_p128(vmull_p64(a_lo, b_hi)), vreinterpretq_u64_p128(vmull_p64(a_hi, b_lo)));
+    uint64x2_t l = vreinterpretq_u64_p128(ll), h = vreinterpretq_u64_p128(hh);
+    acc[0] ^= vgetq_lane_u64(l, 0);
+    acc[1] ^= vgetq_lane_u64(l, 1) ^ vgetq_lane_u64(mid, 0);
+    acc[2] ^= vgetq_lane_u64(h, 0) ^ vgetq_lane_u64(mid, 1);
+    acc[3] ^= vgetq_lane_u64(h, 1);
+}
+
+TARGET_ARMV8_CRYPTO void ghash_blocks_pmull(const gcm_key& key, u8* x, const u8* data, size_t nblocks)
+{
+    u64 x_hi = load_be64(x), x_lo = load_be64(x + 8);
+    while (nblocks > 0)
+    {
+        size_t n = min((size_t)ghash_aggregate, nblocks);
+        u64 acc[4] = { 0, 0, 0, 0 };
+        for (size_t i = 0; i < n; i++)
+        {
+            u64 c_hi = load_be64(data + 16 * i), c_lo = load_be64(data + 16 * i + 8);
+            if (i == 0)
+            {
+                c_hi ^= x_hi;
+                c_lo ^= x_lo;
+            }
+            const u64* h = key.h_powers[n - 1 - i];
+            clmul_accumulate_pmull(c_hi, c_lo, h[0], h[1], acc);
+        }
+        gf128_reduce(acc, x_hi, x_lo);
+        data += 16 * n;
+        nblocks -= n;
+    }
+    store_be64(x, x_hi);
+    store_be64(x + 8, x_lo);
+}
+
+//SHA-256 with the ARMv8 SHA2 instructions: SHA256H and SHA256H2 do four rounds
+//on the two halves of the state, SHA256SU0 and SHA256SU1 the message schedule
+TARGET_ARMV8_SHA2 void sha256_blocks_armv8(u32 state[8], const u8* data, size_t nblocks)
+{
+    uint32x4_t abcd = vld1q_u32(&state[0]), efgh = vld1q_u32(&state[4]);
+    for (; nblocks > 0; nblocks--, data += 64)
+    {
+        uint32x4_t abcd_start = abcd, efgh_start = efgh;
+        uint32x4_t w[4];
+        AES_UNROLL
+        for (int g = 0; g < 16; g++)
+        {
+            if (g < 4)
+            {
+                w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+            }
+            else
+            {
+                w[g % 4] = vsha256su1q_u32(vsha256su0q_u32(w[g % 4], w[(g + 1) % 4]), w[(g + 2) % 4], w[(g + 3) % 4]);
+            }
+            uint32x4_t wk = vaddq_u32(w[g % 4], vld1q_u32(&sha256_k[4 * g]));
+            uint32x4_t abcd_before = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_before, wk);
+        }
+        abcd = vaddq_u32(abcd, abcd_start);
+        efgh = vaddq_u32(efgh, efgh_start);
+    }
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+#endif
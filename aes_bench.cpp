@@ -0,0 +1,401 @@
+/* Throughput benchmark for the AES library: every backend (each interleave width
+of the hardware ones), mode and message size.
+Build: g++ -std=c++17 -O2 -pthread aes_bench.cpp aes_core.cpp aes_bitsliced.cpp aes_x86.cpp aes_arm.cpp aes_modes.cpp aes_pool.cpp aes_buffers.cpp aes_kdf.cpp
+Run with -h for the options. Results go to standard output as CSV, one line per
+measurement, so runs on the same machine can be compared across releases:
+
+    backend,key_bits,mode,op,bytes,threads,ns_per_op,gb_per_s,cycles_per_byte
+
+gb_per_s is 10^9 bytes a second. cycles_per_byte uses the time-stamp counter on
+x86 (which ticks at the nominal frequency, whatever the core is really doing);
+elsewhere it is only filled in when --ghz gives the clock rate.
+*/
+
+#include "aes.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define BENCH_TSC
+#endif
+
+using namespace std;
+using bench_clock = chrono::steady_clock;
+
+struct options
+{
+    vector<string> backends; //empty is every one, including the reference
+    vector<string> modes = { "ECB", "CBC", "CTR", "GCM", "XTS" };
+    vector<size_t> sizes;
+    vector<unsigned int> threads = { 1 };
+    vector<size_t> key_sizes = { 16 };
+    double seconds = 0.2; //minimum time per measurement
+    double ghz = 0;
+};
+
+//Until the calls take at least min_seconds; the time per call
+double time_per_call(const function<void()>& call, double min_seconds)
+{
+    call(); //warms the caches, and starts any pool threads
+    for (size_t calls = 1;; calls *= 2)
+    {
+        auto start = bench_clock::now();
+        for (size_t i = 0; i < calls; i++)
+        {
+            call();
+        }
+        double elapsed = chrono::duration<double>(bench_clock::now() - start).count();
+        if (elapsed >= min_seconds || calls >= ((size_t)1 << 40))
+        {
+            return elapsed / calls;
+        }
+        //Jump straight to about the right count once there is something to go on
+        if (elapsed > min_seconds / 64)
+        {
+            calls = max(calls, (size_t)(calls * min_seconds / elapsed / 2));
+        }
+    }
+}
+
+//Time-stamp counter ticks per second, measured against the steady clock
+double tsc_hz()
+{
+#ifdef BENCH_TSC
+    auto start = bench_clock::now();
+    u64 ticks = __rdtsc();
+    while (bench_clock::now() - start < chrono::milliseconds(100))
+    {
+    }
+    ticks = __rdtsc() - ticks;
+    return ticks / chrono::duration<double>(bench_clock::now() - start).count();
+#else
+    return 0;
+#endif
+}
+
+const size_t xts_sector_size = 4096;
+
+//One operation on a message of n bytes, in its own buffers
+struct workload
+{
+    const aes_context& ctx;
+    const gcm_key& gcm;
+    const xts_key* xts; //null for key sizes XTS doesn't have
+    thread_pool& pool;
+    vector<u8> in, out;
+    array<u8, 16> iv = {};
+    u8 tag[16] = {};
+
+    workload(const aes_context& ctx, const gcm_key& gcm, const xts_key* xts, thread_pool& pool, size_t n)
+        : ctx(ctx), gcm(gcm), xts(xts), pool(pool), in(n, 0x5a), out(n) {}
+
+    size_t blocks() const
+    {
+        return in.size() / 16;
+    }
+
+    //Whole blocks across the pool, for ECB
+    void ecb(bool encrypt)
+    {
+        const size_t chunk = ctr_chunk_size / 16;
+        size_t nchunks = (blocks() + chunk - 1) / chunk;
+        pool.run(nchunks, [&](size_t c)
+        {
+            size_t start = c * chunk, n = min(chunk, blocks() - start);
+            if (encrypt)
+            {
+                ctx.encrypt_blocks(&in[16 * start], &out[16 * start], n);
+            }
+            else
+            {
+                ctx.decrypt_blocks(&in[16 * start], &out[16 * start], n);
+            }
+        });
+    }
+
+    //The call to time, or nothing if the mode can't use that many threads (or this key size)
+    function<void()> operation(const string& mode, bool encrypt, unsigned int threads)
+    {
+        bool serial = (mode == "GCM" || (mode == "CBC" && encrypt));
+        if ((serial && threads > 1) || (mode == "XTS" && !xts))
+        {
+            return nullptr;
+        }
+        if (mode == "XTS")
+        {   //disk-sized sectors, or one sector for smaller messages
+            size_t sector = min(in.size(), xts_sector_size);
+            if (encrypt)
+            {
+                return [this, sector] { xts_encrypt_sectors(pool, *xts, 0, sector, in.data(), out.data(), in.size() / sector); };
+            }
+            return [this, sector] { xts_decrypt_sectors(pool, *xts, 0, sector, in.data(), out.data(), in.size() / sector); };
+        }
+        if (mode == "ECB")
+        {
+            return [this, encrypt] { ecb(encrypt); };
+        }
+        if (mode == "CBC")
+        {
+            if (encrypt)
+            {
+                return [this] { array<u8, 16> chain = iv; cbc_encrypt(ctx, in.data(), out.data(), blocks(), chain); };
+            }
+            return [this] { cbc_decrypt_parallel(pool, ctx, in.data(), out.data(), blocks(), iv); };
+        }
+        if (mode == "CTR")
+        {
+            return [this] { ctr_crypt_parallel(pool, ctx, in.data(), out.data(), in.size(), iv, 0); };
+        }
+        if (encrypt)
+        {
+            return [this] { gcm_encrypt(gcm, iv.data(), 12, nullptr, 0, in.data(), out.data(), in.size(), tag); };
+        }
+        //The tag won't match; the time is the same either way
+        return [this] { gcm_decrypt(gcm, iv.data(), 12, nullptr, 0, in.data(), out.data(), in.size(), tag); };
+    }
+};
+
+vector<string> split(const string& text)
+{
+    vector<string> parts;
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t comma = text.find(',', start);
+        if (comma == string::npos)
+        {
+            comma = text.size();
+        }
+        if (comma > start)
+        {
+            parts.push_back(text.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return parts;
+}
+
+//A size such as 4096, 64K, 16M or 1G (powers of 1024); 0 if it isn't one
+size_t parse_size(const string& text)
+{
+    char* end;
+    unsigned long long n = strtoull(text.c_str(), &end, 10);
+    string suffix = end;
+    if (end == text.c_str() || suffix.size() > 1)
+    {
+        return 0;
+    }
+    int shift = suffix.empty() ? 0 : suffix == "K" || suffix == "k" ? 10 : suffix == "M" || suffix == "m" ? 20 : suffix == "G" || suffix == "g" ? 30 : -1;
+    return (shift < 0) ? 0 : (size_t)(n << shift);
+}
+
+void print_usage(const char* program)
+{
+    cerr << "Usage: " << program << " [-b BACKENDS] [-m MODES] [-s SIZES] [-t THREADS] [-k KEYBITS] [-T SECONDS] [--ghz GHZ]\n"
+        "  -b BACKENDS  comma-separated backend names (default: all, including the reference)\n"
+        "  -m MODES     from ECB,CBC,CTR,GCM,XTS (default: all); XTS uses 4K sectors and\n"
+        "               isn't run with 192-bit keys\n"
+        "  -s SIZES     message sizes in bytes, with K, M or G (default: 16 to 1G, powers of 4)\n"
+        "  -t THREADS   thread counts (default: 1); serial modes are only run with 1\n"
+        "  -k KEYBITS   from 128,192,256 (default: 128)\n"
+        "  -T SECONDS   minimum time per measurement (default: 0.2)\n"
+        "  --ghz GHZ    clock rate for cycles_per_byte where there is no time-stamp counter\n"
+        "A measurement whose single operation would take more than 10 times -T (judged\n"
+        "from the size before) is skipped, so the slow backends don't run for hours.\n";
+}
+
+bool parse_arguments(int argc, char** argv, options& opt)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string flag = argv[i];
+        if (i + 1 == argc)
+        {
+            cerr << "Missing value for " << flag << endl;
+            return false;
+        }
+        string value = argv[++i];
+        if (flag == "-b")
+        {
+            opt.backends = split(value);
+        }
+        else if (flag == "-m")
+        {
+            opt.modes = split(value);
+            for (string& m : opt.modes)
+            {
+                transform(m.begin(), m.end(), m.begin(), [](char c) { return (char)toupper((u8)c); });
+                if (m != "ECB" && m != "CBC" && m != "CTR" && m != "GCM" && m != "XTS")
+                {
+                    cerr << "Unknown mode " << m << endl;
+                    return false;
+                }
+            }
+        }
+        else if (flag == "-s")
+        {
+            opt.sizes.clear();
+            for (const string& s : split(value))
+            {
+                size_t n = parse_size(s);
+                if (n < 16 || n % 16 != 0)
+                {
+                    cerr << "Sizes must be whole blocks (multiples of 16 bytes): " << s << endl;
+                    return false;
+                }
+                opt.sizes.push_back(n);
+            }
+        }
+        else if (flag == "-t")
+        {
+            opt.threads.clear();
+            for (const string& t : split(value))
+            {
+                opt.threads.push_back(max(atoi(t.c_str()), 1));
+            }
+        }
+        else if (flag == "-k")
+        {
+            opt.key_sizes.clear();
+            for (const string& k : split(value))
+            {
+                size_t bytes = (size_t)atoi(k.c_str()) / 8;
+                if (!aes_key_size_valid(bytes))
+                {
+                    cerr << "Key sizes are 128, 192 or 256 bits" << endl;
+                    return false;
+                }
+                opt.key_sizes.push_back(bytes);
+            }
+        }
+        else if (flag == "-T")
+        {
+            opt.seconds = atof(value.c_str());
+        }
+        else if (flag == "--ghz")
+        {
+            opt.ghz = atof(value.c_str());
+        }
+        else
+        {
+            cerr << "Unknown option " << flag << endl;
+            return false;
+        }
+    }
+    if (opt.sizes.empty())
+    {
+        for (size_t n = 16; n <= ((size_t)1 << 30); n *= 4)
+        {
+            opt.sizes.push_back(n);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+    options opt;
+    if (!parse_arguments(argc, argv, opt))
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    vector<const aes_backend*> backends = tuning_candidates();
+    backends.push_back(&reference_backend());
+    if (!opt.backends.empty())
+    {
+        vector<const aes_backend*> chosen;
+        for (const string& name : opt.backends)
+        {
+            auto b = find_if(backends.begin(), backends.end(), [&](const aes_backend* b) { return name == b->name; });
+            if (b == backends.end())
+            {
+                cerr << "No backend " << name << " here; this CPU has:";
+                for (const aes_backend* a : backends)
+                {
+                    cerr << " \"" << a->name << "\"";
+                }
+                cerr << endl;
+                return 2;
+            }
+            chosen.push_back(*b);
+        }
+        backends = chosen;
+    }
+
+    double hz = opt.ghz > 0 ? opt.ghz * 1e9 : tsc_hz();
+    printf("backend,key_bits,mode,op,bytes,threads,ns_per_op,gb_per_s,cycles_per_byte\n");
+    fflush(stdout);
+
+    u8 key[64]; //two keys for XTS
+    for (int i = 0; i < 64; i++)
+    {
+        key[i] = (u8)(i * 17 + 1);
+    }
+    for (unsigned int nthreads : opt.threads)
+    {
+        thread_pool pool(nthreads);
+        for (const aes_backend* backend : backends)
+        {
+            for (size_t key_bytes : opt.key_sizes)
+            {
+                expanded_key k(key, key_bytes, backend);
+                unique_ptr<xts_key> xts(key_bytes == 24 ? nullptr : new xts_key(key, 2 * key_bytes, backend));
+                for (const string& mode : opt.modes)
+                {
+                    for (bool encrypt : { true, false })
+                    {
+                        //CTR is the same both ways
+                        if (mode == "CTR" && !encrypt)
+                        {
+                            continue;
+                        }
+                        double bytes_per_second = 0;
+                        for (size_t size : opt.sizes)
+                        {
+                            if (bytes_per_second > 0 && size / bytes_per_second > 10 * opt.seconds)
+                            {
+                                cerr << "Skipping " << backend->name << " " << mode << " at " << size << " bytes and up: too slow" << endl;
+                                break;
+                            }
+                            workload w(k.aes, k.gcm, xts.get(), pool, size);
+                            function<void()> op = w.operation(mode, encrypt, nthreads);
+                            if (!op)
+                            {
+                                break;
+                            }
+                            double seconds = time_per_call(op, opt.seconds);
+                            bytes_per_second = size / seconds;
+                            printf("%s,%d,%s,%s,%zu,%u,%.1f,%.3f,", backend->name, (int)key_bytes * 8, mode.c_str(),
+                                encrypt ? "encrypt" : "decrypt", size, nthreads, seconds * 1e9, bytes_per_second / 1e9);
+                            if (hz > 0)
+                            {
+                                printf("%.3f", seconds * hz / size);
+                            }
+                            printf("\n");
+                            fflush(stdout);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
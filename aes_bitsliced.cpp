@@ -0,0 +1,585 @@
+/* Bitsliced AES: constant-time, for CPUs without AES instructions. The key
+schedule is too: its S-box lookups go through the same circuit.
+*/
+
+#include "aes_internal.h"
+#include <cstring>
+
+using namespace std;
+
+//Bitsliced engine. Instead of looking bytes up in sbox[] (whose cache footprint
+//depends on the data), 8 blocks are transposed into 8 bit planes and the S-box
+//is evaluated as a boolean circuit, so timing does not depend on key or data.
+//
+//Plane b holds bit b of every byte of the 8 blocks: bit (8 * j + k) of a plane is
+//bit b of byte j of block k. Each byte of a plane is therefore one byte position
+//of the state, and ShiftRows/MixColumns become byte moves within the planes.
+//A plane is 128 bits stored as two u64; bs_state<G> holds G groups of 8 blocks.
+//With AVX2, 32 blocks (G = 4) are done at once and the compiler vectorises the planes.
+template <int G>
+struct bs_state
+{
+    u64 q[8][2 * G];
+};
+
+//Read/write 8 bytes as a little-endian u64
+u64 load_u64(const u8* p)
+{
+    return (u64)load_word(p) | ((u64)load_word(p + 4) << 32);
+}
+
+void store_u64(u8* p, u64 x)
+{
+    store_word(p, (u32)x);
+    store_word(p + 4, (u32)(x >> 32));
+}
+
+//Exchanges the bits of a selected by mask << n with the bits of b selected by mask
+void swap_move(u64& a, u64& b, u64 mask, int n)
+{
+    u64 t = ((a >> n) ^ b) & mask;
+    b ^= t;
+    a ^= t << n;
+}
+
+//Loading half a block per word, word k holds bit b of byte j at bit 8 * j + b. Swapping
+//the block index k with the low 3 bits of the bit index (three rounds of swap_move)
+//turns word b into plane b. The transposition is its own inverse, so it also unpacks.
+void bs_transpose(u64* w)
+{
+    for (int k = 0; k < 8; k += 2)
+    {
+        swap_move(w[k], w[k + 1], 0x5555555555555555ULL, 1);
+    }
+    for (int k = 0; k < 8; k += 4)
+    {
+        swap_move(w[k], w[k + 2], 0x3333333333333333ULL, 2);
+        swap_move(w[k + 1], w[k + 3], 0x3333333333333333ULL, 2);
+    }
+    for (int k = 0; k < 4; k++)
+    {
+        swap_move(w[k], w[k + 4], 0x0f0f0f0f0f0f0f0fULL, 4);
+    }
+}
+
+template <int G>
+void bs_pack(bs_state<G>& s, const u8* in)
+{
+    for (int g = 0; g < G; g++)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            u64 w[8];
+            for (int k = 0; k < 8; k++)
+            {
+                w[k] = load_u64(in + 128 * g + 16 * k + 8 * half);
+            }
+            bs_transpose(w);
+            for (int b = 0; b < 8; b++)
+            {
+                s.q[b][2 * g + half] = w[b];
+            }
+        }
+    }
+}
+
+template <int G>
+void bs_unpack(const bs_state<G>& s, u8* out)
+{
+    for (int g = 0; g < G; g++)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            u64 w[8];
+            for (int b = 0; b < 8; b++)
+            {
+                w[b] = s.q[b][2 * g + half];
+            }
+            bs_transpose(w);
+            for (int k = 0; k < 8; k++)
+            {
+                store_u64(out + 128 * g + 16 * k + 8 * half, w[k]);
+            }
+        }
+    }
+}
+
+//The round keys in plane form: byte j of plane b is 0xff if bit b of key byte j
+//is set. The bit becomes a mask (0 - bit) rather than a branch.
+void make_bs_key_schedule(aes_round_keys& keys)
+{
+    for (int round = 0; round <= keys.rounds; round++)
+    {
+        for (int b = 0; b < 8; b++)
+        {
+            u64 half[2] = { 0, 0 };
+            for (int j = 0; j < 16; j++)
+            {
+                u64 bit = (keys.enc[16 * round + j] >> b) & 1;
+                half[j / 8] |= ((u64)0 - bit) & (0xffULL << (8 * (j % 8)));
+            }
+            keys.bs[round][b][0] = half[0];
+            keys.bs[round][b][1] = half[1];
+        }
+    }
+}
+
+template <int G>
+void bs_add_round_key(bs_state<G>& s, const aes_round_keys& keys, int round)
+{
+    for (int b = 0; b < 8; b++)
+    {
+        for (int i = 0; i < 2 * G; i++)
+        {
+            s.q[b][i] ^= keys.bs[round][b][i % 2];
+        }
+    }
+}
+
+//Boyar-Peralta S-box circuit (113 gates), applied to every bit position at once.
+//x0 is the most significant bit of the input byte, i.e. plane 7.
+template <int G>
+void bs_sub_bytes(bs_state<G>& s)
+{
+    for (int i = 0; i < 2 * G; i++)
+    {
+        u64 x0 = s.q[7][i], x1 = s.q[6][i], x2 = s.q[5][i], x3 = s.q[4][i];
+        u64 x4 = s.q[3][i], x5 = s.q[2][i], x6 = s.q[1][i], x7 = s.q[0][i];
+
+        //Top linear transformation
+        u64 y14 = x3 ^ x5;
+        u64 y13 = x0 ^ x6;
+        u64 y9 = x0 ^ x3;
+        u64 y8 = x0 ^ x5;
+        u64 t0 = x1 ^ x2;
+        u64 y1 = t0 ^ x7;
+        u64 y4 = y1 ^ x3;
+        u64 y12 = y13 ^ y14;
+        u64 y2 = y1 ^ x0;
+        u64 y5 = y1 ^ x6;
+        u64 y3 = y5 ^ y8;
+        u64 t1 = x4 ^ y12;
+        u64 y15 = t1 ^ x5;
+        u64 y20 = t1 ^ x1;
+        u64 y6 = y15 ^ x7;
+        u64 y10 = y15 ^ t0;
+        u64 y11 = y20 ^ y9;
+        u64 y7 = x7 ^ y11;
+        u64 y17 = y10 ^ y11;
+        u64 y19 = y10 ^ y8;
+        u64 y16 = t0 ^ y11;
+        u64 y21 = y13 ^ y16;
+        u64 y18 = x0 ^ y16;
+
+        //Non-linear section (the GF(2^8) inversion)
+        u64 t2 = y12 & y15;
+        u64 t3 = y3 & y6;
+        u64 t4 = t3 ^ t2;
+        u64 t5 = y4 & x7;
+        u64 t6 = t5 ^ t2;
+        u64 t7 = y13 & y16;
+        u64 t8 = y5 & y1;
+        u64 t9 = t8 ^ t7;
+        u64 t10 = y2 & y7;
+        u64 t11 = t10 ^ t7;
+        u64 t12 = y9 & y11;
+        u64 t13 = y14 & y17;
+        u64 t14 = t13 ^ t12;
+        u64 t15 = y8 & y10;
+        u64 t16 = t15 ^ t12;
+        u64 t17 = t4 ^ t14;
+        u64 t18 = t6 ^ t16;
+        u64 t19 = t9 ^ t14;
+        u64 t20 = t11 ^ t16;
+        u64 t21 = t17 ^ y20;
+        u64 t22 = t18 ^ y19;
+        u64 t23 = t19 ^ y21;
+        u64 t24 = t20 ^ y18;
+
+        u64 t25 = t21 ^ t22;
+        u64 t26 = t21 & t23;
+        u64 t27 = t24 ^ t26;
+        u64 t28 = t25 & t27;
+        u64 t29 = t28 ^ t22;
+        u64 t30 = t23 ^ t24;
+        u64 t31 = t22 ^ t26;
+        u64 t32 = t31 & t30;
+        u64 t33 = t32 ^ t24;
+        u64 t34 = t23 ^ t33;
+        u64 t35 = t27 ^ t33;
+        u64 t36 = t24 & t35;
+        u64 t37 = t36 ^ t34;
+        u64 t38 = t27 ^ t36;
+        u64 t39 = t29 & t38;
+        u64 t40 = t25 ^ t39;
+
+        u64 t41 = t40 ^ t37;
+        u64 t42 = t29 ^ t33;
+        u64 t43 = t29 ^ t40;
+        u64 t44 = t33 ^ t37;
+        u64 t45 = t42 ^ t41;
+        u64 z0 = t44 & y15;
+        u64 z1 = t37 & y6;
+        u64 z2 = t33 & x7;
+        u64 z3 = t43 & y16;
+        u64 z4 = t40 & y1;
+        u64 z5 = t29 & y7;
+        u64 z6 = t42 & y11;
+        u64 z7 = t45 & y17;
+        u64 z8 = t41 & y10;
+        u64 z9 = t44 & y12;
+        u64 z10 = t37 & y3;
+        u64 z11 = t33 & y4;
+        u64 z12 = t43 & y13;
+        u64 z13 = t40 & y5;
+        u64 z14 = t29 & y2;
+        u64 z15 = t42 & y9;
+        u64 z16 = t45 & y14;
+        u64 z17 = t41 & y8;
+
+        //Bottom linear transformation (includes the affine step)
+        u64 t46 = z15 ^ z16;
+        u64 t47 = z10 ^ z11;
+        u64 t48 = z5 ^ z13;
+        u64 t49 = z9 ^ z10;
+        u64 t50 = z2 ^ z12;
+        u64 t51 = z2 ^ z5;
+        u64 t52 = z7 ^ z8;
+        u64 t53 = z0 ^ z3;
+        u64 t54 = z6 ^ z7;
+        u64 t55 = z16 ^ z17;
+        u64 t56 = z12 ^ t48;
+        u64 t57 = t50 ^ t53;
+        u64 t58 = z4 ^ t46;
+        u64 t59 = z3 ^ t54;
+        u64 t60 = t46 ^ t57;
+        u64 t61 = z14 ^ t57;
+        u64 t62 = t52 ^ t58;
+        u64 t63 = t49 ^ t58;
+        u64 t64 = z4 ^ t59;
+        u64 t65 = t61 ^ t62;
+        u64 t66 = z1 ^ t63;
+        u64 s0 = t59 ^ t63;
+        u64 s6 = t56 ^ ~t62;
+        u64 s7 = t48 ^ ~t60;
+        u64 t67 = t64 ^ t65;
+        u64 s3 = t53 ^ t66;
+        u64 s4 = t51 ^ t66;
+        u64 s5 = t47 ^ t65;
+        u64 s1 = t64 ^ ~s3;
+        u64 s2 = t55 ^ ~t67;
+
+        s.q[7][i] = s0;
+        s.q[6][i] = s1;
+        s.q[5][i] = s2;
+        s.q[4][i] = s3;
+        s.q[3][i] = s4;
+        s.q[2][i] = s5;
+        s.q[1][i] = s6;
+        s.q[0][i] = s7;
+    }
+}
+
+//Linear part of the inverse S-box's affine map, plus its constant 0x05
+template <int G>
+void bs_inverse_affine(bs_state<G>& s)
+{
+    for (int i = 0; i < 2 * G; i++)
+    {
+        u64 y[8];
+        for (int b = 0; b < 8; b++)
+        {
+            y[b] = s.q[b][i];
+        }
+        for (int b = 0; b < 8; b++)
+        {
+            s.q[b][i] = y[(b + 2) % 8] ^ y[(b + 5) % 8] ^ y[(b + 7) % 8];
+        }
+        s.q[0][i] = ~s.q[0][i];
+        s.q[2][i] = ~s.q[2][i];
+    }
+}
+
+//sbox(x) = A(x^-1), so x^-1 = A^-1(sbox(x)) and inverse_sbox(y) = A^-1(sbox(A^-1(y)))
+template <int G>
+void bs_inverse_sub_bytes(bs_state<G>& s)
+{
+    bs_inverse_affine(s);
+    bs_sub_bytes(s);
+    bs_inverse_affine(s);
+}
+
+//Row r is byte r of each 32-bit column and moves r columns left (right to invert).
+//On the 128-bit plane (lo, hi), moving by one column is a 32-bit rotate, by two
+//swaps lo and hi, and by three is the one-column rotate with its halves swapped.
+template <int G>
+void bs_shift_rows(bs_state<G>& s, bool inverse)
+{
+    const u64 m0 = 0x000000ff000000ffULL, m1 = 0x0000ff000000ff00ULL;
+    const u64 m2 = 0x00ff000000ff0000ULL, m3 = 0xff000000ff000000ULL;
+    for (int b = 0; b < 8; b++)
+    {
+        for (int g = 0; g < G; g++)
+        {
+            u64 lo = s.q[b][2 * g], hi = s.q[b][2 * g + 1];
+            u64 r_lo = (lo >> 32) | (hi << 32);
+            u64 r_hi = (hi >> 32) | (lo << 32);
+            if (!inverse)
+            {
+                s.q[b][2 * g] = (lo & m0) | (r_lo & m1) | (hi & m2) | (r_hi & m3);
+                s.q[b][2 * g + 1] = (hi & m0) | (r_hi & m1) | (lo & m2) | (r_lo & m3);
+            }
+            else
+            {
+                s.q[b][2 * g] = (lo & m0) | (r_hi & m1) | (hi & m2) | (r_lo & m3);
+                s.q[b][2 * g + 1] = (hi & m0) | (r_lo & m1) | (lo & m2) | (r_hi & m3);
+            }
+        }
+    }
+}
+
+//Byte i of each column takes byte i + 1 (resp. i + 2) of the same column
+u64 bs_column_rotate1(u64 x)
+{
+    return ((x >> 8) & 0x00ffffff00ffffffULL) | ((x << 24) & 0xff000000ff000000ULL);
+}
+
+u64 bs_column_rotate2(u64 x)
+{
+    return ((x >> 16) & 0x0000ffff0000ffffULL) | ((x << 16) & 0xffff0000ffff0000ULL);
+}
+
+//MixColumns: out_i = 2 * d_i ^ a_i+1 ^ rot2(d)_i, with d_i = a_i ^ a_i+1. Multiplying by 2
+//moves each plane up one bit, with plane 7 folded back into planes 0, 1, 3 and 4 (0x11b).
+template <int G>
+void bs_mix_columns(bs_state<G>& s)
+{
+    for (int i = 0; i < 2 * G; i++)
+    {
+        u64 r0 = bs_column_rotate1(s.q[0][i]), r1 = bs_column_rotate1(s.q[1][i]);
+        u64 r2 = bs_column_rotate1(s.q[2][i]), r3 = bs_column_rotate1(s.q[3][i]);
+        u64 r4 = bs_column_rotate1(s.q[4][i]), r5 = bs_column_rotate1(s.q[5][i]);
+        u64 r6 = bs_column_rotate1(s.q[6][i]), r7 = bs_column_rotate1(s.q[7][i]);
+        u64 d0 = s.q[0][i] ^ r0, d1 = s.q[1][i] ^ r1, d2 = s.q[2][i] ^ r2, d3 = s.q[3][i] ^ r3;
+        u64 d4 = s.q[4][i] ^ r4, d5 = s.q[5][i] ^ r5, d6 = s.q[6][i] ^ r6, d7 = s.q[7][i] ^ r7;
+
+        s.q[0][i] = d7 ^ r0 ^ bs_column_rotate2(d0);
+        s.q[1][i] = d0 ^ d7 ^ r1 ^ bs_column_rotate2(d1);
+        s.q[2][i] = d1 ^ r2 ^ bs_column_rotate2(d2);
+        s.q[3][i] = d2 ^ d7 ^ r3 ^ bs_column_rotate2(d3);
+        s.q[4][i] = d3 ^ d7 ^ r4 ^ bs_column_rotate2(d4);
+        s.q[5][i] = d4 ^ r5 ^ bs_column_rotate2(d5);
+        s.q[6][i] = d5 ^ r6 ^ bs_column_rotate2(d6);
+        s.q[7][i] = d6 ^ r7 ^ bs_column_rotate2(d7);
+    }
+}
+
+//InvMixColumns factors as MixColumns after u_i = a_i ^ 4 * d_i, with d_i = a_i ^ a_i+2
+template <int G>
+void bs_inverse_mix_columns(bs_state<G>& s)
+{
+    for (int i = 0; i < 2 * G; i++)
+    {
+        u64 d0 = s.q[0][i] ^ bs_column_rotate2(s.q[0][i]), d1 = s.q[1][i] ^ bs_column_rotate2(s.q[1][i]);
+        u64 d2 = s.q[2][i] ^ bs_column_rotate2(s.q[2][i]), d3 = s.q[3][i] ^ bs_column_rotate2(s.q[3][i]);
+        u64 d4 = s.q[4][i] ^ bs_column_rotate2(s.q[4][i]), d5 = s.q[5][i] ^ bs_column_rotate2(s.q[5][i]);
+        u64 d6 = s.q[6][i] ^ bs_column_rotate2(s.q[6][i]), d7 = s.q[7][i] ^ bs_column_rotate2(s.q[7][i]);
+
+        s.q[0][i] ^= d6;
+        s.q[1][i] ^= d6 ^ d7;
+        s.q[2][i] ^= d0 ^ d7;
+        s.q[3][i] ^= d1 ^ d6;
+        s.q[4][i] ^= d2 ^ d6 ^ d7;
+        s.q[5][i] ^= d3 ^ d7;
+        s.q[6][i] ^= d4;
+        s.q[7][i] ^= d5;
+    }
+    bs_mix_columns(s);
+}
+
+template <int G, int Nr>
+void bs_encrypt(const aes_round_keys& keys, const u8* in, u8* out)
+{
+    bs_state<G> s;
+    bs_pack(s, in);
+    bs_add_round_key(s, keys, 0);
+    for (int round = 1; round <= Nr; round++)
+    {
+        bs_sub_bytes(s);
+        bs_shift_rows(s, false);
+        if (round != Nr)
+        {
+            bs_mix_columns(s);
+        }
+        bs_add_round_key(s, keys, round);
+    }
+    bs_unpack(s, out);
+}
+
+//Straight inverse cipher (not the equivalent one), so it shares keys.bs
+template <int G, int Nr>
+void bs_decrypt(const aes_round_keys& keys, const u8* in, u8* out)
+{
+    bs_state<G> s;
+    bs_pack(s, in);
+    bs_add_round_key(s, keys, Nr);
+    for (int round = Nr - 1; round >= 0; round--)
+    {
+        bs_shift_rows(s, true);
+        bs_inverse_sub_bytes(s);
+        bs_add_round_key(s, keys, round);
+        if (round != 0)
+        {
+            bs_inverse_mix_columns(s);
+        }
+    }
+    bs_unpack(s, out);
+}
+
+//SubWord through the S-box circuit: a word in the first column of one block,
+//the rest of the group zero
+u32 bs_sub_word(u32 w)
+{
+    u8 group[128] = {};
+    store_word(group, w);
+    bs_state<1> s;
+    bs_pack(s, group);
+    bs_sub_bytes(s);
+    bs_unpack(s, group);
+    w = load_word(group);
+    secure_zero(group, sizeof(group));
+    secure_zero(&s, sizeof(s));
+    return w;
+}
+
+//The FIPS-197 key expansion, like make_key_schedule_software's but with SubWord
+//done by the circuit instead of sbox[], so that no memory access depends on the
+//key here either. Only the branches on the word index remain, which is public.
+//The bitsliced decryption uses the straight inverse cipher, so keys.dec isn't needed.
+void make_key_schedule_bitsliced(const u8* key, size_t key_bytes, aes_round_keys& keys)
+{
+    const int nk = (int)key_bytes / 4;
+    keys.rounds = nk + 6;
+    u32 rcon = 1;
+    for (int i = 0; i < 4 * (keys.rounds + 1); i++)
+    {
+        u32 w;
+        if (i < nk)
+        {
+            w = load_word(key + 4 * i);
+        }
+        else
+        {
+            w = load_word(&keys.enc[4 * (i - 1)]);
+            if (i % nk == 0)
+            {   //RotWord moves byte 0 (the lowest) to the top
+                w = bs_sub_word((w >> 8) | (w << 24)) ^ rcon;
+                rcon = (rcon << 1) ^ ((rcon >> 7) * 0x11b);
+            }
+            else if (nk > 6 && i % nk == 4)
+            {
+                w = bs_sub_word(w);
+            }
+            w ^= load_word(&keys.enc[4 * (i - nk)]);
+        }
+        store_word(&keys.enc[4 * i], w);
+    }
+    keys.dec.fill(0);
+    make_bs_key_schedule(keys);
+}
+
+#ifdef AES_X86
+template <int Nr>
+TARGET_AVX2 void encrypt_32_blocks_avx2(const aes_round_keys& keys, const u8* in, u8* out, size_t ngroups)
+{
+    for (; ngroups > 0; ngroups--, in += 512, out += 512)
+    {
+        bs_encrypt<4, Nr>(keys, in, out);
+    }
+}
+
+template <int Nr>
+TARGET_AVX2 void decrypt_32_blocks_avx2(const aes_round_keys& keys, const u8* in, u8* out, size_t ngroups)
+{
+    for (; ngroups > 0; ngroups--, in += 512, out += 512)
+    {
+        bs_decrypt<4, Nr>(keys, in, out);
+    }
+}
+#endif
+bool bitsliced_avx2 = false; //set by aes_init
+
+//Whole groups of 8 go straight through; a short tail is padded out to a group
+template <int Nr>
+void encrypt_blocks_bitsliced(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+#ifdef AES_X86
+    if (bitsliced_avx2 && nblocks >= 32)
+    {
+        encrypt_32_blocks_avx2<Nr>(keys, in, out, nblocks / 32);
+        in += 16 * (nblocks & ~31);
+        out += 16 * (nblocks & ~31);
+        nblocks %= 32;
+    }
+#endif
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128)
+    {
+        bs_encrypt<1, Nr>(keys, in, out);
+    }
+    if (nblocks > 0)
+    {
+        u8 tail[128] = {};
+        memcpy(tail, in, 16 * nblocks);
+        bs_encrypt<1, Nr>(keys, tail, tail);
+        memcpy(out, tail, 16 * nblocks);
+    }
+}
+
+template <int Nr>
+void decrypt_blocks_bitsliced(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+#ifdef AES_X86
+    if (bitsliced_avx2 && nblocks >= 32)
+    {
+        decrypt_32_blocks_avx2<Nr>(keys, in, out, nblocks / 32);
+        in += 16 * (nblocks & ~31);
+        out += 16 * (nblocks & ~31);
+        nblocks %= 32;
+    }
+#endif
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128)
+    {
+        bs_decrypt<1, Nr>(keys, in, out);
+    }
+    if (nblocks > 0)
+    {
+        u8 tail[128] = {};
+        memcpy(tail, in, 16 * nblocks);
+        bs_decrypt<1, Nr>(keys, tail, tail);
+        memcpy(out, tail, 16 * nblocks);
+    }
+}
+
+template <int Nr>
+array<u8, 16> encrypt_block_bitsliced(const aes_round_keys& keys, array<u8, 16> block)
+{
+    encrypt_blocks_bitsliced<Nr>(keys, &block[0], &block[0], 1);
+    return block;
+}
+
+template <int Nr>
+array<u8, 16> decrypt_block_bitsliced(const aes_round_keys& keys, array<u8, 16> block)
+{
+    decrypt_blocks_bitsliced<Nr>(keys, &block[0], &block[0], 1);
+    return block;
+}
+
+
+template <int Nr>
+constexpr aes_kernels bitsliced_kernels()
+{
+    return { encrypt_block_bitsliced<Nr>, decrypt_block_bitsliced<Nr>, encrypt_blocks_bitsliced<Nr>, decrypt_blocks_bitsliced<Nr>, nullptr };
+}
+
+extern const aes_backend bitsliced_backend = { "bitsliced", make_key_schedule_bitsliced,
+    bitsliced_kernels<10>(), bitsliced_kernels<12>(), bitsliced_kernels<14>() };
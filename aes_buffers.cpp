@@ -0,0 +1,217 @@
+/* The buffer pool: page-aligned buffers reused across calls and wiped on return,
+huge pages for the big ones, and locked pages for key material.
+*/
+
+#include "aes.h"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define AES_POSIX_MEMORY
+#endif
+
+using namespace std;
+
+const size_t page_size = 4096; //the smallest page size; larger pages hold whole buffers anyway
+const size_t huge_page_size = 2 << 20;
+
+pooled_buffer::pooled_buffer(pooled_buffer&& other) noexcept
+{
+    *this = move(other);
+}
+
+pooled_buffer& pooled_buffer::operator=(pooled_buffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        pool = other.pool;
+        ptr = other.ptr;
+        len = other.len;
+        used = other.used;
+        marked = other.marked;
+        locked = other.locked;
+        other.pool = nullptr;
+        other.ptr = nullptr;
+        other.len = 0;
+    }
+    return *this;
+}
+
+void pooled_buffer::release()
+{
+    if (pool)
+    {
+        pool->give_back(ptr, len, locked, marked ? used : ~(size_t)0);
+    }
+    pool = nullptr;
+    ptr = nullptr;
+    len = used = 0;
+    marked = false;
+}
+
+buffer_pool::buffer_pool(size_t max_cached, bool huge_pages) : max_cached(max_cached), huge_pages(huge_pages) {}
+
+buffer_pool::~buffer_pool()
+{
+    trim();
+}
+
+buffer_pool& buffer_pool::shared()
+{
+    static buffer_pool* pool = new buffer_pool;
+    return *pool;
+}
+
+//Whole pages, so locking one buffer never locks part of another, or whole huge
+//pages for buffers big enough to have their own
+size_t buffer_pool::capacity_for(size_t len) const
+{
+    size_t unit = (huge_pages && len >= huge_page_size ? huge_page_size : page_size);
+    return (max(len, (size_t)1) + unit - 1) / unit * unit;
+}
+
+bool buffer_pool::mapped(size_t capacity) const
+{
+#ifdef AES_POSIX_MEMORY
+    return huge_pages && capacity >= huge_page_size;
+#else
+    (void)capacity;
+    return false;
+#endif
+}
+
+u8* buffer_pool::allocate(size_t capacity, bool locked) const
+{
+    u8* p;
+    if (mapped(capacity))
+    {
+#ifdef AES_POSIX_MEMORY
+        //Map a huge page more than needed, and unmap the ends so what's left
+        //starts on a huge page boundary
+        size_t span = capacity + huge_page_size;
+        void* m = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED)
+        {
+            throw bad_alloc();
+        }
+        u8* start = (u8*)m;
+        p = (u8*)(((uintptr_t)start + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1));
+        if (p > start)
+        {
+            munmap(start, p - start);
+        }
+        if (start + span > p + capacity)
+        {
+            munmap(p + capacity, start + span - (p + capacity));
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(p, capacity, MADV_HUGEPAGE); //only a hint; fine if it fails
+#endif
+#endif
+    }
+    else
+    {
+        p = (u8*)operator new(capacity, align_val_t(page_size));
+    }
+#ifdef AES_POSIX_MEMORY
+    if (locked)
+    {   //best effort, like the hints above: the memory is still wiped either way
+        mlock(p, capacity);
+#ifdef MADV_DONTDUMP
+        madvise(p, capacity, MADV_DONTDUMP);
+#endif
+    }
+#endif
+    return p;
+}
+
+void buffer_pool::free_block(u8* p, size_t capacity, bool locked) const
+{
+#ifdef AES_POSIX_MEMORY
+    if (locked)
+    {
+        munlock(p, capacity);
+#ifdef MADV_DODUMP
+        madvise(p, capacity, MADV_DODUMP);
+#endif
+    }
+    if (mapped(capacity))
+    {
+        munmap(p, capacity);
+        return;
+    }
+#else
+    (void)locked;
+#endif
+    operator delete(p, align_val_t(page_size));
+}
+
+u8* buffer_pool::take(size_t len, bool locked)
+{
+    size_t capacity = capacity_for(len);
+    {
+        lock_guard<mutex> guard(lock);
+        auto& blocks = free_blocks[locked];
+        auto b = blocks.find(capacity);
+        if (b != blocks.end())
+        {
+            u8* p = b->second;
+            blocks.erase(b);
+            cached -= capacity;
+            return p;
+        }
+    }
+    return allocate(capacity, locked);
+}
+
+void buffer_pool::give_back(u8* p, size_t len, bool locked, size_t wipe_len)
+{
+    if (!p)
+    {
+        return;
+    }
+    size_t capacity = capacity_for(len);
+    secure_zero(p, min(wipe_len, capacity));
+    {
+        lock_guard<mutex> guard(lock);
+        if (cached + capacity <= max_cached)
+        {
+            free_blocks[locked].emplace(capacity, p);
+            cached += capacity;
+            return;
+        }
+    }
+    free_block(p, capacity, locked);
+}
+
+pooled_buffer buffer_pool::get(size_t len, bool locked)
+{
+    pooled_buffer b;
+    b.ptr = take(len, locked);
+    b.pool = this;
+    b.len = len;
+    b.locked = locked;
+    return b;
+}
+
+void buffer_pool::trim()
+{
+    lock_guard<mutex> guard(lock);
+    for (int locked = 0; locked < 2; locked++)
+    {
+        for (auto& b : free_blocks[locked])
+        {
+            free_block(b.second, b.first, locked != 0);
+        }
+        free_blocks[locked].clear();
+    }
+    cached = 0;
+}
+
+size_t buffer_pool::cached_bytes() const
+{
+    lock_guard<mutex> guard(lock);
+    return cached;
+}
@@ -0,0 +1,972 @@
+/* AES core (FIPS-197): the field arithmetic and tables, the key schedule, the
+reference and T-table block functions, the choice of backend, the key cache and
+the instrumentation counters.
+*/
+
+#include "aes_internal.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+
+using namespace std;
+
+/*In AES, bytes are not treated as integers but part of a 
+  "Galois field", a finite set of numbers with substitutes for addition
+  and multiplication such that the results remain within the set.
+  Specifically we use Rijndael's field, which contains 0-255 (2**8 - 1),
+  and where addition is replaced by xor. Multiplication uses the standard binary
+  multiplication method, but with xor instead of + and modulo 0x11b.
+  Everything down to the T-tables is constexpr: the tables are computed by the
+  compiler and sit in read-only data, shared by every process using them. */
+constexpr u8 rijndael_multiply(u8 a, u8 b)
+{
+    const int reducing_num = 0x11b;
+    short int result = 0;
+    for (int i = 0; i <= 7; i++) //binary multiply
+    {
+        if ((b & (1 << i)) == (1 << i))
+        {
+            result ^= (a << i);
+        }
+    }
+
+    for (int i = 15; i >= 8; i--) //modulus equivalent
+    {
+        if ((result & (1 << i)) == (1 << i))
+        {
+            result ^= (reducing_num << (i - 8));
+        }
+    }
+    return result;
+}
+
+//In a Galois field with 256 elements a**255 = 1 for a =/= 0,
+// so a**254 = a**-1. Square-and-multiply gets there in 13 multiplications
+// instead of 254.
+constexpr u8 rijndael_inverse(u8 x)
+{
+    u8 result = 1;
+    for (int bit = 7; bit >= 0; bit--)
+    {
+        result = rijndael_multiply(result, result);
+        if ((254 >> bit) & 1)
+        {
+            result = rijndael_multiply(result, x);
+        }
+    }
+    return result;
+}
+
+//Shifts each bit of x to the left y times (and sends the front to the back)
+constexpr u8 lcs_8bit(u8 x, u8 y) //Used to calculate the S-box
+{
+    return ((x << y) % 0x100) + (x >> (8 - y));
+}
+
+//Same but with 4 bytes instead of 8 bits
+array<u8, 4> lcs_4byte(array<u8, 4> x, u8 y)
+{ //Used to generate the key schedule
+    for (int i = 1; i <= y; i++)
+    {
+        x = { x[1], x[2], x[3], x[0] };
+    }
+    return x;
+}
+
+//The S-box is a nonlinear transformation used in all 10 rounds of the encryption,
+//and in generating the keys for each round.
+constexpr u8 sbox_value(u8 input)
+{
+    u8 inv = rijndael_inverse(input);
+    u8 result = inv ^ lcs_8bit(inv, 1) ^ lcs_8bit(inv, 2) ^ lcs_8bit(inv, 3) ^ lcs_8bit(inv, 4) ^ 0x63;
+    return result;
+}
+
+//store the s-box as an array rather than a function
+constexpr array<u8, 256> make_sbox()
+{
+    array<u8, 256> sbox = {};
+    for (int i = 0; i <= 0xff; i++)
+    {
+        sbox[i] = sbox_value(i);
+    }
+    return sbox;
+}
+
+constexpr array<u8, 256> make_inverse_sbox(const array<u8, 256>& sbox)
+{
+    array<u8, 256> inverse = {};
+    for (int i = 0; i <= 0xff; i++)
+    {
+        inverse[sbox[i]] = i;
+    }
+    return inverse;
+}
+
+constexpr array<u8, 256> sbox = make_sbox();
+constexpr array<u8, 256> inverse_sbox = make_inverse_sbox(sbox);
+
+//The T-tables merge SubBytes, ShiftRows and MixColumns: entry x of te0 is the
+//column that MixColumns produces from (sbox[x], 0, 0, 0), and te1..te3 are the same
+//column rotated for bytes coming from rows 1..3. A round then becomes 16 lookups
+//and xors. te4 holds sbox[x] in every byte, for the last round (no MixColumns).
+//Columns are stored as u32 with row 0 in the lowest byte.
+//
+//Each table is built from its row-0 column: rotate is how many bytes to rotate it
+//left by, or 4 for the last-round table (the S-box byte in every row).
+constexpr array<u32, 256> make_ttable(const array<u8, 256>& box, const u8 (&mix)[4], int rotate)
+{
+    array<u32, 256> table = {};
+    for (int i = 0; i <= 0xff; i++)
+    {
+        u32 s = box[i];
+        u32 column = rijndael_multiply(mix[0], s) | (rijndael_multiply(mix[1], s) << 8)
+            | (rijndael_multiply(mix[2], s) << 16) | ((u32)rijndael_multiply(mix[3], s) << 24);
+        table[i] = (rotate == 4 ? s * 0x01010101 : rotate == 0 ? column : (column << (8 * rotate)) | (column >> (32 - 8 * rotate)));
+    }
+    return table;
+}
+
+constexpr u8 mix_column[4] = { 2, 1, 1, 3 };
+constexpr array<u32, 256> te0 = make_ttable(sbox, mix_column, 0);
+constexpr array<u32, 256> te1 = make_ttable(sbox, mix_column, 1);
+constexpr array<u32, 256> te2 = make_ttable(sbox, mix_column, 2);
+constexpr array<u32, 256> te3 = make_ttable(sbox, mix_column, 3);
+constexpr array<u32, 256> te4 = make_ttable(sbox, mix_column, 4);
+
+//Inverse tables for decryption: td0[x] is InvMixColumns of (inverse_sbox[x], 0, 0, 0)
+constexpr u8 inv_mix_column_coefficients[4] = { 14, 9, 13, 11 };
+constexpr array<u32, 256> td0 = make_ttable(inverse_sbox, inv_mix_column_coefficients, 0);
+constexpr array<u32, 256> td1 = make_ttable(inverse_sbox, inv_mix_column_coefficients, 1);
+constexpr array<u32, 256> td2 = make_ttable(inverse_sbox, inv_mix_column_coefficients, 2);
+constexpr array<u32, 256> td3 = make_ttable(inverse_sbox, inv_mix_column_coefficients, 3);
+constexpr array<u32, 256> td4 = make_ttable(inverse_sbox, inv_mix_column_coefficients, 4);
+
+//The round constants are a series of bytes used in computing the keys
+//for each round: rc[1] = 1 and each one after is the one before times 2 (x) in
+//the field. 128-bit keys use the most, rc[1..10].
+constexpr array<u8, 11> make_round_constants()
+{
+    array<u8, 11> rc = {};
+    rc[1] = 1;
+    for (int i = 2; i <= 10; i++)
+    {
+        rc[i] = rijndael_multiply(2, rc[i - 1]);
+    }
+    return rc;
+}
+
+constexpr array<u8, 11> round_constant = make_round_constants();
+static_assert(round_constant[10] == 0x36, "round constants");
+static_assert(sbox[0x00] == 0x63 && sbox[0x53] == 0xed && inverse_sbox[0x63] == 0x00, "S-box");
+
+//InvMixColumns on a single column word
+u32 inv_mix_column(u32 w)
+{
+    u8 c[4] = { u8(w), u8(w >> 8), u8(w >> 16), u8(w >> 24) };
+    u8 mix[4];
+    for (int i = 0; i < 4; i++)
+    {
+        mix[i] = rijndael_multiply(14, c[i]) ^ rijndael_multiply(11, c[(i + 1) % 4])
+            ^ rijndael_multiply(13, c[(i + 2) % 4]) ^ rijndael_multiply(9, c[(i + 3) % 4]);
+    }
+    return load_word(mix);
+}
+
+
+//AES uses 10, 12 or 14 rounds for 16, 24 or 32-byte keys - each round uses a
+//different 16-byte key which is an evolution of the ones before. This function
+//takes the original key (nk words) and returns it followed by the other round keys.
+//
+//It also builds keys.dec for the "equivalent inverse cipher"
+//(FIPS-197 section 5.3.5): the round keys in reverse order, with InvMixColumns
+//applied to all but the first and last. Decryption can then use the same round
+//structure as encryption (InvSubBytes, InvShiftRows, InvMixColumns, AddRoundKey).
+void make_key_schedule_software(const u8* key, size_t key_bytes, aes_round_keys& keys)
+{
+    const int nk = (int)key_bytes / 4;
+    const int rounds = nk + 6;
+    keys.rounds = rounds;
+    array<u8, 4> o1; //1 word ago
+    array<u8, 4> on; //nk words ago
+
+    for (int i = 0; i < 4 * (rounds + 1); i++)
+    {
+        if (i < nk)
+        {
+            memcpy(&keys.enc[i * 4], &key[i * 4], 4);
+        }
+        else
+        {
+            memcpy(&o1, &keys.enc[(i - 1) * 4], 4);
+            memcpy(&on, &keys.enc[(i - nk) * 4], 4);
+            if ((i % nk) == 0)
+            {
+                array<u8, 4> rot = lcs_4byte(o1, 1);
+                array<u8, 4> s = { sbox[rot[0]], sbox[rot[1]], sbox[rot[2]], sbox[rot[3]] };
+                array<u8, 4> rc_array = { round_constant[i / nk], 0x00, 0x00, 0x00 };
+                 for (int j = 0; j < 4; j++)
+                {
+                    keys.enc[4 * i + j] = on[j] ^ s[j] ^ (rc_array[j]);
+                }
+            }
+            else if (nk > 6 && (i % nk) == 4)
+            {   //256-bit keys also substitute the word halfway through each key
+                for (int j = 0; j < 4; j++)
+                {
+                    keys.enc[4 * i + j] = on[j] ^ sbox[o1[j]];
+                }
+            }
+            else
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    keys.enc[4 * i + j] = o1[j] ^ on[j];
+                }
+            }
+        }
+
+    }
+
+    for (int round = 0; round <= rounds; round++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            u32 w = load_word(&keys.enc[16 * (rounds - round) + 4 * j]);
+            if (round != 0 && round != rounds)
+            {
+                w = inv_mix_column(w);
+            }
+            store_word(&keys.dec[16 * round + 4 * j], w);
+        }
+    }
+}
+
+
+//Reference implementation, following the specification step by step.
+//Slow, but kept to cross-check the faster versions against.
+template <int Nr>
+array<u8, 16> encrypt_block_reference(const aes_round_keys& keys, array<u8, 16> block)
+{
+    array<u8, 16> round_key;
+
+    //Round 0
+    memcpy(&round_key, &keys.enc, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        block[i] ^= round_key[i];
+    }
+
+    //Round 1..Nr
+    for (int round = 1; round <= Nr; round++)
+    {
+        //"SubBytes" - perform the S-box transformation
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] = sbox[block[i]];
+        }
+
+        //The next two steps are done treating the block as a 4x4 matrix, filling columns first, then rows
+        //"ShiftRows" - does a left shift on row x (where x goes from 0 to 3) by x bytes.
+        for (int i = 0; i < 4; i++)
+        {
+            array<u8, 4> newrow = lcs_4byte({ block[i], block[i + 4], block[i + 8], block[i + 12] }, i);
+            block[i] = newrow[0];
+            block[i + 4] = newrow[1];
+            block[i + 8] = newrow[2];
+            block[i + 12] = newrow[3];
+        }
+        //"MixColumns" - a linear transformation on each column
+        if (round != Nr)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                array <u8, 4> mix;
+                mix[0] = rijndael_multiply(2, block[4 * i]) ^ rijndael_multiply(3, block[4 * i + 1]) ^ block[4 * i + 2] ^ block[4 * i + 3];
+                mix[1] = block[4 * i] ^ rijndael_multiply(2, block[4 * i + 1]) ^ rijndael_multiply(3, block[4 * i + 2]) ^ block[4 * i + 3];
+                mix[2] = block[4 * i] ^ block[4 * i + 1] ^ rijndael_multiply(2, block[4 * i + 2]) ^ rijndael_multiply(3, block[4 * i + 3]);
+                mix[3] = rijndael_multiply(3, block[4 * i]) ^ block[4 * i + 1] ^ block[4 * i + 2] ^ rijndael_multiply(2, block[4 * i + 3]);
+                memcpy(&block[4 * i], &mix, 4);
+            }
+        }
+
+        //"AddRoundKey" - xor each byte with its corresponding round key byte
+        memcpy(&round_key, &keys.enc[round * 16], 16);
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] ^= round_key[i];
+        }
+    }
+
+    return block;
+}
+
+//Same result as encrypt_block_reference, using the T-tables. Column j of the
+//next state takes row r from column j + r (ShiftRows), so each output column
+//is four table lookups plus the round key.
+template <int Nr>
+array<u8, 16> encrypt_block_ttable(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const u8* rk = &keys.enc[0];
+    u32 s0 = load_word(&block[0]) ^ load_word(rk);
+    u32 s1 = load_word(&block[4]) ^ load_word(rk + 4);
+    u32 s2 = load_word(&block[8]) ^ load_word(rk + 8);
+    u32 s3 = load_word(&block[12]) ^ load_word(rk + 12);
+    u32 t0, t1, t2, t3;
+
+    AES_UNROLL
+    for (int round = 1; round < Nr; round++)
+    {
+        rk += 16;
+        t0 = te0[s0 & 0xff] ^ te1[(s1 >> 8) & 0xff] ^ te2[(s2 >> 16) & 0xff] ^ te3[s3 >> 24] ^ load_word(rk);
+        t1 = te0[s1 & 0xff] ^ te1[(s2 >> 8) & 0xff] ^ te2[(s3 >> 16) & 0xff] ^ te3[s0 >> 24] ^ load_word(rk + 4);
+        t2 = te0[s2 & 0xff] ^ te1[(s3 >> 8) & 0xff] ^ te2[(s0 >> 16) & 0xff] ^ te3[s1 >> 24] ^ load_word(rk + 8);
+        t3 = te0[s3 & 0xff] ^ te1[(s0 >> 8) & 0xff] ^ te2[(s1 >> 16) & 0xff] ^ te3[s2 >> 24] ^ load_word(rk + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    //Last round has no MixColumns, so mask one S-box byte out of each te4 entry
+    rk += 16;
+    t0 = (te4[s0 & 0xff] & 0x000000ff) ^ (te4[(s1 >> 8) & 0xff] & 0x0000ff00)
+        ^ (te4[(s2 >> 16) & 0xff] & 0x00ff0000) ^ (te4[s3 >> 24] & 0xff000000) ^ load_word(rk);
+    t1 = (te4[s1 & 0xff] & 0x000000ff) ^ (te4[(s2 >> 8) & 0xff] & 0x0000ff00)
+        ^ (te4[(s3 >> 16) & 0xff] & 0x00ff0000) ^ (te4[s0 >> 24] & 0xff000000) ^ load_word(rk + 4);
+    t2 = (te4[s2 & 0xff] & 0x000000ff) ^ (te4[(s3 >> 8) & 0xff] & 0x0000ff00)
+        ^ (te4[(s0 >> 16) & 0xff] & 0x00ff0000) ^ (te4[s1 >> 24] & 0xff000000) ^ load_word(rk + 8);
+    t3 = (te4[s3 & 0xff] & 0x000000ff) ^ (te4[(s0 >> 8) & 0xff] & 0x0000ff00)
+        ^ (te4[(s1 >> 16) & 0xff] & 0x00ff0000) ^ (te4[s2 >> 24] & 0xff000000) ^ load_word(rk + 12);
+
+    store_word(&block[0], t0);
+    store_word(&block[4], t1);
+    store_word(&block[8], t2);
+    store_word(&block[12], t3);
+    return block;
+}
+
+//Reference decryption, the cipher steps inverted and run backwards
+template <int Nr>
+array<u8, 16> decrypt_block_reference(const aes_round_keys& keys, array<u8, 16> block)
+{
+    array<u8, 16> round_key;
+    for (int round = 1; round <= Nr; round++)
+    {
+        //AddRoundKey is its own inverse, as xor with a number is its own inverse
+        memcpy(&round_key, &keys.enc[16 * Nr - (16 * (round - 1))], 16);
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] ^= round_key[i];
+        }
+
+        //MixColumns inverse - the original matrix's inverse in the Rijndael field
+        if (round != 1)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                array <u8, 4> mix;
+                mix[0] = rijndael_multiply(14, block[4 * i]) ^ rijndael_multiply(11, block[4 * i + 1])
+                    ^ rijndael_multiply(13, block[4 * i + 2]) ^ rijndael_multiply(9, block[4 * i + 3]);
+                mix[1] = rijndael_multiply(9, block[4 * i]) ^ rijndael_multiply(14, block[4 * i + 1])
+                    ^ rijndael_multiply(11, block[4 * i + 2]) ^ rijndael_multiply(13, block[4 * i + 3]);
+                mix[2] = rijndael_multiply(13, block[4 * i]) ^ rijndael_multiply(9, block[4 * i + 1])
+                    ^ rijndael_multiply(14, block[4 * i + 2]) ^ rijndael_multiply(11, block[4 * i + 3]);
+                mix[3] = rijndael_multiply(11, block[4 * i]) ^ rijndael_multiply(13, block[4 * i + 1])
+                    ^ rijndael_multiply(9, block[4 * i + 2]) ^ rijndael_multiply(14, block[4 * i + 3]);
+                memcpy(&block[4 * i], &mix, 4);
+            }
+        }
+
+        //ShiftRows inverse
+        for (int i = 0; i < 4; i++)
+        {
+            array<u8, 4> newrow = lcs_4byte({ block[i], block[i + 4], block[i + 8], block[i + 12] }, 4 - i);
+            block[i] = newrow[0];
+            block[i + 4] = newrow[1];
+            block[i + 8] = newrow[2];
+            block[i + 12] = newrow[3];
+        }
+
+        //SubBytes inverse
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] = inverse_sbox[block[i]];
+        }
+    }
+
+    memcpy(&round_key, &keys.enc, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        block[i] ^= round_key[i];
+    }
+    return block;
+}
+
+//Equivalent inverse cipher with the inverse T-tables, using keys.dec.
+//InvShiftRows means column j takes row r from column j - r.
+template <int Nr>
+array<u8, 16> decrypt_block_ttable(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const u8* rk = &keys.dec[0];
+    u32 s0 = load_word(&block[0]) ^ load_word(rk);
+    u32 s1 = load_word(&block[4]) ^ load_word(rk + 4);
+    u32 s2 = load_word(&block[8]) ^ load_word(rk + 8);
+    u32 s3 = load_word(&block[12]) ^ load_word(rk + 12);
+    u32 t0, t1, t2, t3;
+
+    AES_UNROLL
+    for (int round = 1; round < Nr; round++)
+    {
+        rk += 16;
+        t0 = td0[s0 & 0xff] ^ td1[(s3 >> 8) & 0xff] ^ td2[(s2 >> 16) & 0xff] ^ td3[s1 >> 24] ^ load_word(rk);
+        t1 = td0[s1 & 0xff] ^ td1[(s0 >> 8) & 0xff] ^ td2[(s3 >> 16) & 0xff] ^ td3[s2 >> 24] ^ load_word(rk + 4);
+        t2 = td0[s2 & 0xff] ^ td1[(s1 >> 8) & 0xff] ^ td2[(s0 >> 16) & 0xff] ^ td3[s3 >> 24] ^ load_word(rk + 8);
+        t3 = td0[s3 & 0xff] ^ td1[(s2 >> 8) & 0xff] ^ td2[(s1 >> 16) & 0xff] ^ td3[s0 >> 24] ^ load_word(rk + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    rk += 16;
+    t0 = (td4[s0 & 0xff] & 0x000000ff) ^ (td4[(s3 >> 8) & 0xff] & 0x0000ff00)
+        ^ (td4[(s2 >> 16) & 0xff] & 0x00ff0000) ^ (td4[s1 >> 24] & 0xff000000) ^ load_word(rk);
+    t1 = (td4[s1 & 0xff] & 0x000000ff) ^ (td4[(s0 >> 8) & 0xff] & 0x0000ff00)
+        ^ (td4[(s3 >> 16) & 0xff] & 0x00ff0000) ^ (td4[s2 >> 24] & 0xff000000) ^ load_word(rk + 4);
+    t2 = (td4[s2 & 0xff] & 0x000000ff) ^ (td4[(s1 >> 8) & 0xff] & 0x0000ff00)
+        ^ (td4[(s0 >> 16) & 0xff] & 0x00ff0000) ^ (td4[s3 >> 24] & 0xff000000) ^ load_word(rk + 8);
+    t3 = (td4[s3 & 0xff] & 0x000000ff) ^ (td4[(s2 >> 8) & 0xff] & 0x0000ff00)
+        ^ (td4[(s1 >> 16) & 0xff] & 0x00ff0000) ^ (td4[s0 >> 24] & 0xff000000) ^ load_word(rk + 12);
+
+    store_word(&block[0], t0);
+    store_word(&block[4], t1);
+    store_word(&block[8], t2);
+    store_word(&block[12], t3);
+    return block;
+}
+
+//Multi-block versions: independent blocks are run through each round together,
+//so the table lookups for one block overlap with those of the others instead of
+//waiting on a single dependency chain. in and out may be the same buffer.
+const int ttable_interleave = 4;
+template <int Nr>
+void encrypt_blocks_ttable(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    for (; nblocks >= ttable_interleave; nblocks -= ttable_interleave)
+    {
+        u32 s[ttable_interleave][4], t[ttable_interleave][4];
+        const u8* rk = &keys.enc[0];
+        for (int b = 0; b < ttable_interleave; b++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                s[b][j] = load_word(in + 16 * b + 4 * j) ^ load_word(rk + 4 * j);
+            }
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            rk += 16;
+            for (int b = 0; b < ttable_interleave; b++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    t[b][j] = te0[s[b][j] & 0xff] ^ te1[(s[b][(j + 1) % 4] >> 8) & 0xff]
+                        ^ te2[(s[b][(j + 2) % 4] >> 16) & 0xff] ^ te3[s[b][(j + 3) % 4] >> 24] ^ load_word(rk + 4 * j);
+                }
+            }
+            memcpy(s, t, sizeof(s));
+        }
+        rk += 16;
+        for (int b = 0; b < ttable_interleave; b++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                t[b][j] = (te4[s[b][j] & 0xff] & 0x000000ff) ^ (te4[(s[b][(j + 1) % 4] >> 8) & 0xff] & 0x0000ff00)
+                    ^ (te4[(s[b][(j + 2) % 4] >> 16) & 0xff] & 0x00ff0000) ^ (te4[s[b][(j + 3) % 4] >> 24] & 0xff000000)
+                    ^ load_word(rk + 4 * j);
+                store_word(out + 16 * b + 4 * j, t[b][j]);
+            }
+        }
+        in += 16 * ttable_interleave;
+        out += 16 * ttable_interleave;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        array<u8, 16> block;
+        memcpy(&block, in, 16);
+        block = encrypt_block_ttable<Nr>(keys, block);
+        memcpy(out, &block, 16);
+    }
+}
+
+template <int Nr>
+void decrypt_blocks_ttable(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    for (; nblocks >= ttable_interleave; nblocks -= ttable_interleave)
+    {
+        u32 s[ttable_interleave][4], t[ttable_interleave][4];
+        const u8* rk = &keys.dec[0];
+        for (int b = 0; b < ttable_interleave; b++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                s[b][j] = load_word(in + 16 * b + 4 * j) ^ load_word(rk + 4 * j);
+            }
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            rk += 16;
+            for (int b = 0; b < ttable_interleave; b++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    t[b][j] = td0[s[b][j] & 0xff] ^ td1[(s[b][(j + 3) % 4] >> 8) & 0xff]
+                        ^ td2[(s[b][(j + 2) % 4] >> 16) & 0xff] ^ td3[s[b][(j + 1) % 4] >> 24] ^ load_word(rk + 4 * j);
+                }
+            }
+            memcpy(s, t, sizeof(s));
+        }
+        rk += 16;
+        for (int b = 0; b < ttable_interleave; b++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                t[b][j] = (td4[s[b][j] & 0xff] & 0x000000ff) ^ (td4[(s[b][(j + 3) % 4] >> 8) & 0xff] & 0x0000ff00)
+                    ^ (td4[(s[b][(j + 2) % 4] >> 16) & 0xff] & 0x00ff0000) ^ (td4[s[b][(j + 1) % 4] >> 24] & 0xff000000)
+                    ^ load_word(rk + 4 * j);
+                store_word(out + 16 * b + 4 * j, t[b][j]);
+            }
+        }
+        in += 16 * ttable_interleave;
+        out += 16 * ttable_interleave;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        array<u8, 16> block;
+        memcpy(&block, in, 16);
+        block = decrypt_block_ttable<Nr>(keys, block);
+        memcpy(out, &block, 16);
+    }
+}
+
+
+//The reference functions one block at a time, for the bulk interface
+template <int Nr>
+void encrypt_blocks_reference(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        array<u8, 16> block;
+        memcpy(&block, in, 16);
+        block = encrypt_block_reference<Nr>(keys, block);
+        memcpy(out, &block, 16);
+    }
+}
+
+template <int Nr>
+void decrypt_blocks_reference(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        array<u8, 16> block;
+        memcpy(&block, in, 16);
+        block = decrypt_block_reference<Nr>(keys, block);
+        memcpy(out, &block, 16);
+    }
+}
+
+template <int Nr>
+constexpr aes_kernels reference_kernels()
+{
+    return { encrypt_block_reference<Nr>, decrypt_block_reference<Nr>, encrypt_blocks_reference<Nr>, decrypt_blocks_reference<Nr>, nullptr };
+}
+
+const aes_backend reference_aes_backend = { "reference", make_key_schedule_software,
+    reference_kernels<10>(), reference_kernels<12>(), reference_kernels<14>() };
+
+const aes_backend& reference_backend()
+{
+    return reference_aes_backend;
+}
+
+template <int Nr>
+constexpr aes_kernels ttable_kernels()
+{
+    return { encrypt_block_ttable<Nr>, decrypt_block_ttable<Nr>, encrypt_blocks_ttable<Nr>, decrypt_blocks_ttable<Nr>, nullptr };
+}
+
+extern const aes_backend ttable_backend = { "T-table", make_key_schedule_software,
+    ttable_kernels<10>(), ttable_kernels<12>(), ttable_kernels<14>() };
+
+//The tables are built at compile time; all that is left is to look at the CPU,
+//on first use, by whichever thread gets there first
+void aes_init()
+{
+    static once_flag once;
+    call_once(once, []
+    {
+#ifdef AES_X86
+        bitsliced_avx2 = cpu_has_avx2();
+#endif
+    });
+}
+
+//Every backend the CPU can run, fastest first. Without hardware AES the bitsliced
+//engine comes before the T-tables, since it is constant-time; the T-tables are
+//faster per block but their cache accesses depend on the key.
+vector<const aes_backend*> available_backends()
+{
+    aes_init();
+    vector<const aes_backend*> backends;
+#ifdef AES_X86
+    if (cpu_has_aesni() && cpu_has_vaes() && cpu_has_avx512())
+    {
+        backends.push_back(&vaes512_backend);
+    }
+    if (cpu_has_aesni() && cpu_has_vaes() && cpu_has_avx2())
+    {
+        backends.push_back(&vaes256_backend);
+    }
+    if (cpu_has_aesni())
+    {
+        backends.push_back(&aesni_backend);
+    }
+#endif
+#ifdef AES_ARM64
+    if (cpu_has_armv8_aes())
+    {
+        backends.push_back(&armv8_backend);
+    }
+#endif
+    backends.push_back(&bitsliced_backend);
+    backends.push_back(&ttable_backend);
+    return backends;
+}
+
+//available_backends() with the other interleave widths of the hardware kernels
+vector<const aes_backend*> tuning_candidates()
+{
+    vector<const aes_backend*> backends = available_backends();
+    for (size_t i = 0; i < backends.size(); i++)
+    {
+#ifdef AES_X86
+        if (backends[i] == &aesni_backend)
+        {
+            backends.insert(backends.begin() + i + 1, { &aesni4_backend, &aesni12_backend });
+            break;
+        }
+#endif
+#ifdef AES_ARM64
+        if (backends[i] == &armv8_backend)
+        {
+            backends.insert(backends.begin() + i + 1, &armv8_4_backend);
+            break;
+        }
+#endif
+    }
+    return backends;
+}
+
+//Set by use_tuning (aes_tune.cpp); nullptr for the first of available_backends()
+atomic<const aes_backend*> tuned_backend{ nullptr };
+
+const aes_backend& best_backend()
+{
+    static const aes_backend* best = available_backends().front();
+    const aes_backend* tuned = tuned_backend.load(memory_order_acquire);
+    return *(tuned ? tuned : best);
+}
+
+aes_context::aes_context(const u8* key, size_t key_bytes, const aes_backend* backend)
+    : impl(backend ? backend : &best_backend())
+{
+    if (!aes_key_size_valid(key_bytes))
+    {
+        throw invalid_argument("AES keys are 16, 24 or 32 bytes");
+    }
+    aes_init();
+    aes_stage_timer timer(stage_key_setup, key_bytes);
+    impl->make_key_schedule(key, key_bytes, keys);
+    fns = &impl->kernels(keys.rounds);
+    aes_stats_backend(*impl);
+}
+
+//The wipe has to survive even when the memory is about to be freed. With GCC and
+//Clang a plain memset is kept by an empty asm that may read the memory, which
+//lets large buffers be wiped at memset speed; otherwise every byte is written
+//through a volatile pointer, which makes each store observable.
+void secure_zero(void* p, size_t len)
+{
+#if defined(__GNUC__)
+    memset(p, 0, len);
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+#else
+    volatile u8* bytes = (volatile u8*)p;
+    for (size_t i = 0; i < len; i++)
+    {
+        bytes[i] = 0;
+    }
+#endif
+}
+
+key_cache::key_cache(size_t capacity) : capacity(max(capacity, (size_t)1))
+{
+    //The seed keeps the hash (of secret keys) from being predictable
+    random_device rd;
+    seed = ((u64)rd() << 32) | rd();
+}
+
+key_cache::~key_cache()
+{
+    clear();
+}
+
+u64 key_cache::hash_key(const u8* key, size_t key_bytes) const
+{
+    u64 h = seed ^ key_bytes;
+    for (size_t i = 0; i < key_bytes; i += 8)
+    {
+        u64 w;
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+key_cache::entry_iterator key_cache::find(u64 hash, const u8* key, size_t key_bytes)
+{
+    auto range = index.equal_range(hash);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+        entry& e = *i->second;
+        u8 diff = 0;
+        for (size_t j = 0; j < key_bytes; j++)
+        {
+            diff |= e.key[j] ^ key[j];
+        }
+        if (e.key_bytes == key_bytes && diff == 0)
+        {
+            return i->second;
+        }
+    }
+    return entries.end();
+}
+
+void key_cache::evict(entry_iterator e)
+{
+    auto range = index.equal_range(e->hash);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+        if (i->second == e)
+        {
+            index.erase(i);
+            break;
+        }
+    }
+    secure_zero(e->key, sizeof(e->key));
+    entries.erase(e); //drops our reference; the last user's destroys the expanded key
+}
+
+shared_ptr<const expanded_key> key_cache::get(const u8* key, size_t key_bytes)
+{
+    if (!aes_key_size_valid(key_bytes))
+    {
+        throw invalid_argument("AES keys are 16, 24 or 32 bytes");
+    }
+    u64 hash = hash_key(key, key_bytes);
+    {
+        lock_guard<mutex> guard(lock);
+        entry_iterator e = find(hash, key, key_bytes);
+        if (e != entries.end())
+        {
+            entries.splice(entries.begin(), entries, e);
+            return e->value;
+        }
+    }
+
+    //Expand outside the lock so other keys aren't held up. Two threads missing on
+    //the same key both expand it, and the second one uses the first one's copy.
+    shared_ptr<const expanded_key> value = allocate_shared<expanded_key>(locked_allocator<expanded_key>(), key, key_bytes);
+    lock_guard<mutex> guard(lock);
+    entry_iterator e = find(hash, key, key_bytes);
+    if (e != entries.end())
+    {
+        entries.splice(entries.begin(), entries, e);
+        return e->value;
+    }
+    entries.push_front(entry{ hash, key_bytes, {}, value });
+    memcpy(entries.front().key, key, key_bytes);
+    index.emplace(hash, entries.begin());
+    while (entries.size() > capacity)
+    {
+        evict(prev(entries.end()));
+    }
+    return value;
+}
+
+void key_cache::clear()
+{
+    lock_guard<mutex> guard(lock);
+    while (!entries.empty())
+    {
+        evict(entries.begin());
+    }
+}
+
+size_t key_cache::size() const
+{
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
+
+#ifdef AES_STATS
+//Every count is a relaxed atomic: they are only added to, and a snapshot doesn't
+//need them all from the same instant
+struct stats_counters
+{
+    atomic<u64> stage_ticks[aes_stage_count], stage_calls[aes_stage_count], stage_bytes[aes_stage_count];
+    atomic<u64> queue_samples[aes_queue_count], queue_depth_total[aes_queue_count], queue_max_depth[aes_queue_count], queue_stalls[aes_queue_count];
+    atomic<const char*> backend{ nullptr };
+    //When counting started, by both clocks, so ticks can be turned into seconds
+    mutex start_lock;
+    u64 start_ticks;
+    chrono::steady_clock::time_point start_time;
+
+    stats_counters()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < aes_stage_count; i++)
+        {
+            stage_ticks[i] = stage_calls[i] = stage_bytes[i] = 0;
+        }
+        for (int i = 0; i < aes_queue_count; i++)
+        {
+            queue_samples[i] = queue_depth_total[i] = queue_max_depth[i] = queue_stalls[i] = 0;
+        }
+        lock_guard<mutex> guard(start_lock);
+        start_ticks = aes_stats_ticks();
+        start_time = chrono::steady_clock::now();
+    }
+};
+
+stats_counters& counters()
+{
+    static stats_counters c;
+    return c;
+}
+
+void aes_stats_add(aes_stage stage, u64 ticks, u64 bytes)
+{
+    stats_counters& c = counters();
+    c.stage_ticks[stage].fetch_add(ticks, memory_order_relaxed);
+    c.stage_calls[stage].fetch_add(1, memory_order_relaxed);
+    c.stage_bytes[stage].fetch_add(bytes, memory_order_relaxed);
+}
+
+void aes_stats_queue(aes_queue queue, unsigned int depth, bool stalled)
+{
+    stats_counters& c = counters();
+    c.queue_samples[queue].fetch_add(1, memory_order_relaxed);
+    c.queue_depth_total[queue].fetch_add(depth, memory_order_relaxed);
+    c.queue_stalls[queue].fetch_add(stalled, memory_order_relaxed);
+    u64 max_depth = c.queue_max_depth[queue].load(memory_order_relaxed);
+    while (depth > max_depth && !c.queue_max_depth[queue].compare_exchange_weak(max_depth, depth, memory_order_relaxed))
+    {
+    }
+}
+
+void aes_stats_backend(const aes_backend& backend)
+{
+    counters().backend.store(backend.name, memory_order_relaxed);
+}
+#endif
+
+aes_stats aes_stats_snapshot()
+{
+    aes_stats s;
+#ifdef AES_STATS
+    stats_counters& c = counters();
+    s.enabled = true;
+    s.backend = c.backend.load(memory_order_relaxed);
+    for (int i = 0; i < aes_stage_count; i++)
+    {
+        s.stages[i].ticks = c.stage_ticks[i].load(memory_order_relaxed);
+        s.stages[i].calls = c.stage_calls[i].load(memory_order_relaxed);
+        s.stages[i].bytes = c.stage_bytes[i].load(memory_order_relaxed);
+    }
+    for (int i = 0; i < aes_queue_count; i++)
+    {
+        s.queues[i].samples = c.queue_samples[i].load(memory_order_relaxed);
+        s.queues[i].depth_total = c.queue_depth_total[i].load(memory_order_relaxed);
+        s.queues[i].max_depth = c.queue_max_depth[i].load(memory_order_relaxed);
+        s.queues[i].stalls = c.queue_stalls[i].load(memory_order_relaxed);
+    }
+    lock_guard<mutex> guard(c.start_lock);
+    u64 ticks = aes_stats_ticks() - c.start_ticks;
+    s.seconds = chrono::duration<double>(chrono::steady_clock::now() - c.start_time).count();
+#ifdef AES_STATS_TSC
+    //The time-stamp counter runs at a fixed rate on anything recent, which this
+    //measures against the steady clock
+    s.ticks_per_second = (s.seconds > 0 ? ticks / s.seconds : 0);
+#else
+    (void)ticks;
+    s.ticks_per_second = 1e9;
+#endif
+#endif
+    return s;
+}
+
+void aes_stats_reset()
+{
+#ifdef AES_STATS
+    counters().reset();
+#endif
+}
+
+void aes_stats_dump(ostream& out)
+{
+    aes_stats s = aes_stats_snapshot();
+    if (!s.enabled)
+    {
+        out << "No statistics: built without -DAES_STATS\n";
+        return;
+    }
+    ios::fmtflags flags = out.flags();
+    out << fixed << setprecision(2);
+    out << "Backend: " << (s.backend ? s.backend : "none") << ", " << s.seconds * 1000 << " ms in all\n";
+    out << left << setw(12) << "stage" << right << setw(10) << "calls" << setw(16) << "bytes"
+        << setw(12) << "ms" << setw(9) << "share" << setw(12) << "MB/s" << "\n";
+    for (int i = 0; i < aes_stage_count; i++)
+    {
+        const aes_stage_stats& st = s.stages[i];
+        double seconds = (s.ticks_per_second > 0 ? st.ticks / s.ticks_per_second : 0);
+        out << left << setw(12) << aes_stage_names[i] << right << setw(10) << st.calls << setw(16) << st.bytes
+            << setw(12) << seconds * 1000 << setw(8) << (s.seconds > 0 ? 100 * seconds / s.seconds : 0) << "%"
+            << setw(12) << (seconds > 0 ? st.bytes / seconds / 1e6 : 0) << "\n";
+    }
+    out << "The cipher handled " << (s.stages[stage_cipher].bytes + 15) / 16 << " blocks\n";
+    out << left << setw(14) << "queue" << right << setw(10) << "samples" << setw(12) << "mean depth"
+        << setw(11) << "max depth" << setw(9) << "stalls" << "\n";
+    for (int i = 0; i < aes_queue_count; i++)
+    {
+        const aes_queue_stats& q = s.queues[i];
+        out << left << setw(14) << aes_queue_names[i] << right << setw(10) << q.samples
+            << setw(12) << (q.samples > 0 ? (double)q.depth_total / q.samples : 0) << setw(11) << q.max_depth
+            << setw(9) << q.stalls << "\n";
+    }
+    out.flags(flags);
+}
@@ -0,0 +1,241 @@
+/* Shared between the library's source files: the CPU feature checks, each
+backend's kernels and the byte-order helpers. Not part of the interface.
+*/
+
+#ifndef AES_INTERNAL_H
+#define AES_INTERNAL_H
+
+#include "aes.h"
+#include "aes_stats.h"
+#include <cstring>
+#include <string>
+
+//Hardware AES on x86 (AES-NI). GCC and Clang need each function using the
+//instructions marked with a target attribute; MSVC allows them anywhere.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AES_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AESNI
+#define TARGET_AVX2
+#define TARGET_VAES256
+#define TARGET_VAES512
+#define TARGET_PCLMUL
+#define TARGET_SSSE3
+#define TARGET_SHA
+#define TARGET_VAES512_GCM
+#else
+#include <cpuid.h>
+#define TARGET_AESNI __attribute__((target("aes,sse4.1")))
+//flatten inlines the whole call tree, so templates used inside are compiled for AVX2 too
+#define TARGET_AVX2 __attribute__((target("avx2"), flatten))
+#define TARGET_VAES256 __attribute__((target("vaes,avx2,aes,sse4.1")))
+#define TARGET_VAES512 __attribute__((target("vaes,avx512f,avx512bw,aes,sse4.1")))
+#define TARGET_PCLMUL __attribute__((target("pclmul,aes,sse4.1")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_SHA __attribute__((target("sha,sse4.1")))
+#define TARGET_VAES512_GCM __attribute__((target("vaes,vpclmulqdq,avx512f,avx512bw,pclmul,aes,sse4.1")))
+#endif
+#endif
+
+//SSE2, which every x86-64 CPU has, and so needs no target attribute. 32-bit x86
+//only has it when the compiler is told to assume it.
+#if defined(AES_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define AES_SSE2
+#endif
+
+//Hardware AES on 64-bit ARM (ARMv8 Crypto Extensions)
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define AES_ARM64
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#if defined(_MSC_VER)
+#define TARGET_ARMV8_CRYPTO
+#define TARGET_ARMV8_SHA2
+#elif defined(__clang__)
+#define TARGET_ARMV8_CRYPTO __attribute__((target("aes")))
+#define TARGET_ARMV8_SHA2 __attribute__((target("sha2")))
+#else
+#define TARGET_ARMV8_CRYPTO __attribute__((target("+crypto")))
+#define TARGET_ARMV8_SHA2 __attribute__((target("+crypto")))
+#endif
+#endif
+
+//Fully unrolls the loop after it. Used on the round loops, whose bounds are
+//template parameters, so each key size gets straight-line code, and on the loops
+//over the blocks in flight, so those stay in registers.
+#if defined(__GNUC__)
+#define AES_UNROLL _Pragma("GCC unroll 16")
+#else
+#define AES_UNROLL
+#endif
+
+//Read/write 4 bytes of a block as a column word (row 0 in the lowest byte)
+inline u32 load_word(const u8* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+inline void store_word(u8* p, u32 w)
+{
+    p[0] = w;
+    p[1] = w >> 8;
+    p[2] = w >> 16;
+    p[3] = w >> 24;
+}
+
+inline u32 byte_swap32(u32 x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+inline u64 byte_swap64(u64 x)
+{
+    return ((u64)byte_swap32((u32)x) << 32) | byte_swap32((u32)(x >> 32));
+}
+
+//Reads/writes a block as a 128-bit big-endian number (hi, lo). One 8-byte access
+//and a byte swap (on little-endian machines), which the compiler turns into a
+//single instruction or two; the byte-at-a-time form isn't always merged.
+inline u64 load_be64(const u8* p)
+{
+    u64 x;
+    memcpy(&x, p, 8);
+#if !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    x = byte_swap64(x);
+#endif
+    return x;
+}
+
+inline void store_be64(u8* p, u64 x)
+{
+#if !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    x = byte_swap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+//Big-endian 4-byte words, for SHA-256 and the file header
+inline u32 load_be32(const u8* p)
+{
+    return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+inline void store_be32(u8* p, u32 x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+//Little-endian 8-byte accesses, for the XTS tweaks
+inline u64 load_le64(const u8* p)
+{
+    u64 x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = byte_swap64(x);
+#endif
+    return x;
+}
+
+inline void store_le64(u8* p, u64 x)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = byte_swap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+//out = in ^ keystream, 16 or 8 bytes at a time (a byte loop isn't vectorised at
+//-O2). out may be in, but must not overlap keystream.
+inline void xor_bytes(const u8* in, const u8* keystream, u8* out, size_t len)
+{
+    size_t i = 0;
+#ifdef AES_SSE2
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(keystream + i))));
+    }
+#endif
+    for (; i + 8 <= len; i += 8)
+    {
+        u64 a, b;
+        memcpy(&a, in + i, 8);
+        memcpy(&b, keystream + i, 8);
+        a ^= b;
+        memcpy(out + i, &a, 8);
+    }
+    for (; i < len; i++)
+    {
+        out[i] = in[i] ^ keystream[i];
+    }
+}
+
+//aes_core.cpp: checks the CPU once; every entry point calls it first
+void aes_init();
+void make_key_schedule_software(const u8* key, size_t key_bytes, aes_round_keys& keys);
+
+//The backends, each defined next to its kernels
+extern const aes_backend ttable_backend;
+extern const aes_backend bitsliced_backend;
+extern bool bitsliced_avx2; //set by aes_init
+//What best_backend() returns instead of the default, if not nullptr
+extern std::atomic<const aes_backend*> tuned_backend;
+
+//aes_kdf.cpp: the SHA-256 compression function over nblocks 64-byte blocks
+typedef void sha256_blocks_function(u32 state[8], const u8* data, size_t nblocks);
+extern const u32 sha256_k[64];
+sha256_blocks_function sha256_blocks_generic;
+//The fastest one the CPU has
+sha256_blocks_function* select_sha256_blocks();
+
+//aes_modes.cpp
+typedef void gcm_blocks_function(gcm_state& st, const u8* in, u8* out, size_t nblocks, bool encrypt);
+void gf128_reduce(u64 x[4], u64& hi, u64& lo);
+gcm_blocks_function gcm_blocks_generic;
+
+#ifdef AES_X86
+//aes_x86.cpp
+extern const aes_backend aesni_backend;
+extern const aes_backend aesni4_backend;  //4 blocks in flight rather than 8
+extern const aes_backend aesni12_backend; //and 12
+extern const aes_backend vaes256_backend;
+extern const aes_backend vaes512_backend;
+bool cpu_has_aesni();
+bool cpu_has_ssse3();
+bool cpu_has_pclmul();
+bool cpu_has_avx2();
+bool cpu_has_vaes();
+bool cpu_has_avx512();
+bool cpu_has_vpclmulqdq();
+bool cpu_has_sha();
+std::string cpu_brand_string();
+TARGET_SHA void sha256_blocks_shani(u32 state[8], const u8* data, size_t nblocks);
+TARGET_PCLMUL void ghash_blocks_pclmul(const gcm_key& key, u8* x, const u8* data, size_t nblocks);
+//The stitched GCM loop for a context on backend with keys of this many rounds: the
+//VAES-512 + VPCLMULQDQ one for the VAES-512 backend when the CPU has VPCLMULQDQ,
+//otherwise AES-NI + PCLMULQDQ. Both read the AES-NI round keys, so they are only
+//for contexts where uses_aesni is true.
+gcm_blocks_function* select_gcm_blocks_aesni(const aes_backend& backend, int rounds);
+bool uses_aesni(const aes_backend& backend);
+#endif
+
+#ifdef AES_ARM64
+//aes_arm.cpp
+extern const aes_backend armv8_backend;
+extern const aes_backend armv8_4_backend; //4 blocks in flight rather than 8
+bool cpu_has_armv8_aes();
+bool cpu_has_armv8_pmull();
+bool cpu_has_armv8_sha2();
+TARGET_ARMV8_SHA2 void sha256_blocks_armv8(u32 state[8], const u8* data, size_t nblocks);
+TARGET_ARMV8_CRYPTO void ghash_blocks_pmull(const gcm_key& key, u8* x, const u8* data, size_t nblocks);
+#endif
+
+#endif
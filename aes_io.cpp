@@ -0,0 +1,735 @@
+/* The hex and base64 codecs, the file header, and the per-mode stream loops.
+*/
+
+#include "aes_io.h"
+#include "aes_internal.h"
+#include <random>
+
+using namespace std;
+
+//The codec tables are filled in once at startup, by make_codec_tables
+
+const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+char hex_digits_for[256][2];
+u8 hex_value[256];    //0xff for anything that isn't a hex digit
+u8 base64_value[256]; //0xff for anything outside the alphabet
+bool codec_ssse3 = false;
+void make_codec_tables()
+{
+    const char digits[] = "0123456789abcdef";
+    memset(hex_value, 0xff, sizeof(hex_value));
+    memset(base64_value, 0xff, sizeof(base64_value));
+    for (int i = 0; i <= 0xff; i++)
+    {
+        hex_digits_for[i][0] = digits[i >> 4];
+        hex_digits_for[i][1] = digits[i & 0xf];
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        hex_value[(u8)digits[i]] = i;
+        hex_value[(u8)toupper(digits[i])] = i;
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        base64_value[(u8)base64_alphabet[i]] = i;
+    }
+#ifdef AES_X86
+    codec_ssse3 = cpu_has_ssse3();
+#endif
+}
+
+#ifdef AES_X86
+//16 bytes at a time: split into nibbles, turn each into its digit with one PSHUFB
+//lookup, and interleave the high and low digits. Returns how many bytes it did.
+TARGET_SSSE3 size_t hex_encode_ssse3(const u8* in, size_t len, char* out)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    size_t done = 0;
+    for (; done + 16 <= len; done += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + done));
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), low_nibble));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(x, low_nibble));
+        _mm_storeu_si128((__m128i*)(out + 2 * done), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 2 * done + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return done;
+}
+
+//Whether each byte of x is at most max (unsigned)
+TARGET_SSSE3 __m128i bytes_at_most(__m128i x, char max)
+{
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(max)), x);
+}
+
+//16 hex characters into 8 bytes, one per 16-bit lane: each character is range-checked
+//as a digit or a letter of either case and turned into its value, and MADDUBS joins
+//each pair. Lanes of invalid get set for anything that isn't a hex digit.
+TARGET_SSSE3 __m128i hex_pairs_ssse3(__m128i c, __m128i& invalid)
+{
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = bytes_at_most(digit, 9);
+    __m128i is_letter = bytes_at_most(letter, 5);
+    invalid = _mm_or_si128(invalid, _mm_andnot_si128(_mm_or_si128(is_digit, is_letter), _mm_set1_epi8(-1)));
+    __m128i v = _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+    return _mm_maddubs_epi16(v, _mm_set1_epi16(0x0110)); //16 * high digit + low
+}
+
+//32 characters at a time. Returns how many bytes it decoded, and sets bad if
+//anything wasn't a hex digit.
+TARGET_SSSE3 size_t hex_decode_ssse3(const char* in, size_t len, u8* out, u8& bad)
+{
+    __m128i invalid = _mm_setzero_si128();
+    size_t done = 0;
+    for (; done + 16 <= len; done += 16)
+    {
+        __m128i lo = hex_pairs_ssse3(_mm_loadu_si128((const __m128i*)(in + 2 * done)), invalid);
+        __m128i hi = hex_pairs_ssse3(_mm_loadu_si128((const __m128i*)(in + 2 * done + 16)), invalid);
+        _mm_storeu_si128((__m128i*)(out + done), _mm_packus_epi16(lo, hi));
+    }
+    bad |= (_mm_movemask_epi8(invalid) != 0 ? 0xff : 0);
+    return done;
+}
+
+//16 characters at a time into 12 bytes: each range of the alphabet is checked and
+//moved to its values, then MADDUBS and MADDWD join the 6-bit values of each group
+//and PSHUFB puts its 3 bytes in order. The stores are 16 bytes wide, so it stops
+//while 16 characters are left (the scalar loop also takes the padded last group).
+//Returns how many characters it decoded, and sets bad if any was outside the alphabet.
+TARGET_SSSE3 size_t base64_decode_ssse3(const char* in, size_t nchars, u8* out, u8& bad)
+{
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m128i invalid = _mm_setzero_si128();
+    size_t done = 0;
+    for (; done + 32 <= nchars; done += 16, out += 12)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(in + done));
+        __m128i upper = bytes_at_most(_mm_sub_epi8(c, _mm_set1_epi8('A')), 25);
+        __m128i lower = bytes_at_most(_mm_sub_epi8(c, _mm_set1_epi8('a')), 25);
+        __m128i digit = bytes_at_most(_mm_sub_epi8(c, _mm_set1_epi8('0')), 9);
+        __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+        __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+        __m128i shift = _mm_or_si128(_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+            _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')), _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+        __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+        invalid = _mm_or_si128(invalid, _mm_andnot_si128(valid, _mm_set1_epi8(-1)));
+        __m128i v = _mm_add_epi8(c, shift);
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)); //a << 6 | b, c << 6 | d
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));    //the group's 24 bits
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(v, order));
+    }
+    bad |= (_mm_movemask_epi8(invalid) != 0 ? 0xff : 0);
+    return done;
+}
+#endif
+
+void hex_encode(const u8* in, size_t len, char* out)
+{
+    size_t done = 0;
+#ifdef AES_X86
+    if (codec_ssse3)
+    {
+        done = hex_encode_ssse3(in, len, out);
+    }
+#endif
+    for (; done < len; done++)
+    {
+        memcpy(out + 2 * done, hex_digits_for[in[done]], 2);
+    }
+}
+
+//Decodes 2 * len hex characters; false if any of them isn't a hex digit
+bool hex_decode(const char* in, size_t len, u8* out)
+{
+    u8 bad = 0;
+    size_t i = 0;
+#ifdef AES_X86
+    if (codec_ssse3)
+    {
+        i = hex_decode_ssse3(in, len, out, bad);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        u8 hi = hex_value[(u8)in[2 * i]];
+        u8 lo = hex_value[(u8)in[2 * i + 1]];
+        bad |= hi | lo;
+        out[i] = (hi << 4) | lo;
+    }
+    return (bad & 0xf0) == 0;
+}
+
+//Encodes len bytes, padding the final group with '=' if len isn't a multiple of 3.
+//Returns the number of characters written.
+size_t base64_encode(const u8* in, size_t len, char* out)
+{
+    char* start = out;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3, out += 4)
+    {
+        u32 v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out[0] = base64_alphabet[v >> 18];
+        out[1] = base64_alphabet[(v >> 12) & 63];
+        out[2] = base64_alphabet[(v >> 6) & 63];
+        out[3] = base64_alphabet[v & 63];
+    }
+    if (i < len)
+    {
+        u32 v = in[i] << 16;
+        if (i + 1 < len)
+        {
+            v |= in[i + 1] << 8;
+        }
+        out[0] = base64_alphabet[v >> 18];
+        out[1] = base64_alphabet[(v >> 12) & 63];
+        out[2] = (i + 1 < len ? base64_alphabet[(v >> 6) & 63] : '=');
+        out[3] = '=';
+        out += 4;
+    }
+    return out - start;
+}
+
+//Decodes groups of 4 characters (nchars must be a multiple of 4). '=' padding is
+//only accepted in the last group, which sets padded. Returns false on bad input.
+bool base64_decode(const char* in, size_t nchars, u8* out, size_t& out_len, bool& padded)
+{
+    u8 bad = 0;
+    out_len = 0;
+    padded = false;
+    size_t i = 0;
+#ifdef AES_X86
+    if (codec_ssse3)
+    {
+        i = base64_decode_ssse3(in, nchars, out, bad);
+        out_len = 3 * i / 4;
+    }
+#endif
+    for (; i < nchars; i += 4)
+    {
+        int pad = 0;
+        if (i + 4 == nchars)
+        {
+            pad = (in[i + 3] == '=') + (in[i + 3] == '=' && in[i + 2] == '=');
+        }
+        u8 a = base64_value[(u8)in[i]], b = base64_value[(u8)in[i + 1]];
+        u8 c = (pad == 2 ? 0 : base64_value[(u8)in[i + 2]]);
+        u8 d = (pad >= 1 ? 0 : base64_value[(u8)in[i + 3]]);
+        bad |= a | b | c | d;
+        u32 v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[out_len] = v >> 16;
+        out[out_len + 1] = v >> 8;
+        out[out_len + 2] = v;
+        out_len += 3 - pad;
+        padded = (pad != 0);
+    }
+    return (bad & 0xc0) == 0;
+}
+
+
+//Makes a header with a fresh random IV for mode
+file_header new_file_header(int mode, size_t key_bytes, int chunk_shift)
+{
+    file_header h = {};
+    h.mode = mode;
+    h.key_bytes = (u8)key_bytes;
+    bool gcm = (mode == mode_gcm || mode == mode_seekable);
+    h.iv_len = (mode == mode_ecb ? 0 : gcm ? 12 : 16);
+    h.tag_len = (gcm ? 16 : 0);
+    h.chunk_shift = (mode == mode_seekable ? (u8)chunk_shift : 0);
+    random_device rng;
+    for (int i = 0; i < h.iv_len; i++)
+    {
+        h.iv[i] = (u8)rng();
+    }
+    if (mode == mode_ctr)
+    {   //random nonce, then a 64-bit block counter starting at zero
+        memset(h.iv + 8, 0, 8);
+    }
+
+    memcpy(h.bytes, "GAES", 4);
+    h.bytes[4] = file_version;
+    h.bytes[5] = h.mode;
+    h.bytes[6] = h.key_bytes;
+    h.bytes[7] = h.iv_len;
+    h.bytes[8] = h.tag_len;
+    h.bytes[9] = h.chunk_shift;
+    memcpy(h.bytes + header_fixed_size, h.iv, h.iv_len);
+    return h;
+}
+
+void set_header_kdf(file_header& h, const u8* salt, u32 iterations)
+{
+    h.kdf = kdf_pbkdf2_sha256;
+    memcpy(h.salt, salt, kdf_salt_size);
+    h.iterations = iterations;
+    h.bytes[4] = file_version_kdf;
+    h.bytes[10] = h.kdf;
+    u8* params = h.bytes + header_fixed_size + h.iv_len;
+    memcpy(params, h.salt, kdf_salt_size);
+    store_be32(params + kdf_salt_size, iterations);
+}
+
+//The checks for both kinds of input. read(dst, len) is true if it got all len bytes.
+template <typename Read>
+const char* parse_file_header(file_header& h, Read read)
+{
+    h = {};
+    if (!read(h.bytes, header_fixed_size) || memcmp(h.bytes, "GAES", 4) != 0)
+    {
+        return "not an encrypted file";
+    }
+    if (h.bytes[4] != file_version && h.bytes[4] != file_version_kdf)
+    {
+        return "unsupported file format version";
+    }
+    h.mode = h.bytes[5];
+    h.key_bytes = h.bytes[6];
+    h.iv_len = h.bytes[7];
+    h.tag_len = h.bytes[8];
+    h.chunk_shift = h.bytes[9];
+    if (h.mode > mode_seekable || h.iv_len > 16 || h.tag_len > 16)
+    {
+        return "corrupted header";
+    }
+    if (h.mode == mode_seekable && (h.iv_len != 12 || h.tag_len != 16 ||
+        h.chunk_shift < seekable_min_chunk_shift || h.chunk_shift > seekable_max_chunk_shift))
+    {
+        return "corrupted header";
+    }
+    if (!aes_key_size_valid(h.key_bytes))
+    {
+        return "unsupported key size";
+    }
+    if (!read(h.iv, h.iv_len))
+    {
+        return "corrupted header";
+    }
+    memcpy(h.bytes + header_fixed_size, h.iv, h.iv_len);
+    if (h.bytes[4] == file_version_kdf)
+    {
+        h.kdf = h.bytes[10];
+        u8* params = h.bytes + header_fixed_size + h.iv_len;
+        if (h.kdf != kdf_pbkdf2_sha256 || !read(params, kdf_params_size))
+        {
+            return "corrupted header";
+        }
+        memcpy(h.salt, params, kdf_salt_size);
+        h.iterations = load_be32(params + kdf_salt_size);
+        if (h.iterations == 0 || h.iterations > kdf_max_iterations)
+        {   //a file shouldn't be able to make its reader spin for minutes
+            return "corrupted header";
+        }
+    }
+    return nullptr;
+}
+
+//Reads and checks a header; returns an error message, or nullptr if it's fine
+const char* read_file_header(input_stream& in, file_header& h)
+{
+    return parse_file_header(h, [&](u8* dst, size_t len) { return in.read(dst, len) == len; });
+}
+
+const char* read_file_header(random_access_file& in, file_header& h)
+{
+    u64 offset = 0;
+    return parse_file_header(h, [&](u8* dst, size_t len)
+    {
+        offset += len;
+        return in.read_at(offset - len, dst, len);
+    });
+}
+
+const char* read_file_header(const u8* data, size_t len, file_header& h)
+{
+    size_t offset = 0;
+    return parse_file_header(h, [&](u8* dst, size_t n)
+    {
+        if (len - offset < n)
+        {
+            return false;
+        }
+        memcpy(dst, data + offset, n);
+        offset += n;
+        return true;
+    });
+}
+
+//How much the parallel loops read at a time: at least 16 MiB, so there are few
+//reads, and several chunks for every thread, so stealing can even out the load
+size_t parallel_read_size(const thread_pool& pool, size_t chunk_size)
+{
+    size_t chunks = max(4 * pool.size(), (16 * ctr_chunk_size + chunk_size - 1) / chunk_size);
+    return chunks * chunk_size;
+}
+
+//ECB and CBC: PKCS#7-padded blocks. ECB encrypts every block on its own; CBC
+//chains them (serial to encrypt, parallel to decrypt). Decryption holds back the
+//last block of each read until it knows whether it is the final one, since that
+//is where the padding is. Returns false on bad padding.
+bool process_block_mode(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt,
+    thread_pool& pool, size_t chunk_size)
+{
+    const size_t bytes_per_read = parallel_read_size(pool, chunk_size);
+    bool chained = (header.mode == mode_cbc);
+    array<u8, 16> iv;
+    memcpy(&iv, header.iv, 16);
+    pooled_buffer data = buffer_pool::shared().get(bytes_per_read + 16); //only the part used is wiped afterwards
+
+    if (encrypt)
+    {
+        while (true)
+        {
+            size_t len = in.read(data.data(), bytes_per_read);
+            bool last = (len < bytes_per_read);
+            if (last)
+            {   //pad out to a whole number of blocks (a full block if already aligned)
+                size_t pad = 16 - len % 16;
+                memset(&data[len], (int)pad, pad);
+                len += pad;
+            }
+            data.mark_used(len);
+            {
+                aes_stage_timer timer(stage_cipher, len);
+                if (chained)
+                {
+                    cbc_encrypt(ctx, data.data(), data.data(), len / 16, iv);
+                }
+                else
+                {
+                    ctx.encrypt_blocks(data.data(), data.data(), len / 16);
+                }
+            }
+            out.write(data.data(), len);
+            if (last)
+            {
+                return true;
+            }
+        }
+    }
+
+    pooled_buffer plain = buffer_pool::shared().get(bytes_per_read);
+    if (chained)
+    {
+        first_touch(pool, data.data(), bytes_per_read, chunk_size);
+        first_touch(pool, plain.data(), bytes_per_read, chunk_size);
+    }
+    u8 pending[16];
+    bool have_pending = false;
+    while (true)
+    {
+        size_t nblocks = in.read(data.data(), bytes_per_read) / 16;
+        if (nblocks == 0)
+        {
+            break;
+        }
+        data.mark_used(16 * nblocks);
+        plain.mark_used(16 * nblocks);
+        {
+            aes_stage_timer timer(stage_cipher, 16 * nblocks);
+            if (chained)
+            {
+                cbc_decrypt_parallel(pool, ctx, data.data(), plain.data(), nblocks, iv, chunk_size);
+                memcpy(&iv, &data[16 * (nblocks - 1)], 16);
+            }
+            else
+            {
+                ctx.decrypt_blocks(data.data(), plain.data(), nblocks);
+            }
+        }
+
+        if (have_pending)
+        {
+            out.write(pending, 16);
+        }
+        out.write(plain.data(), 16 * (nblocks - 1));
+        memcpy(pending, &plain[16 * (nblocks - 1)], 16);
+        have_pending = true;
+    }
+
+    int keep = (have_pending ? pkcs7_unpadded_length(pending) : -1);
+    if (keep < 0)
+    {
+        return false;
+    }
+    out.write(pending, keep);
+    return true;
+}
+
+//GCM: the ciphertext is followed by the 16-byte tag. Decryption holds back the
+//last 16 bytes of each read until it knows which bytes are the tag. Returns false
+//if the tag doesn't match, in which case the output must not be used.
+bool process_gcm(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt)
+{
+    const size_t bytes_per_read = 16 * ctr_chunk_size;
+    gcm_key key = make_gcm_key(ctx);
+    gcm_state st;
+    gcm_start(st, key, header.iv, header.iv_len, header.bytes, header.size());
+    pooled_buffer data = buffer_pool::shared().get(bytes_per_read + 16);
+    u8 tag[16];
+
+    if (encrypt)
+    {
+        while (true)
+        {
+            size_t len = in.read(data.data(), bytes_per_read);
+            data.mark_used(len);
+            {
+                aes_stage_timer timer(stage_cipher, len);
+                gcm_update(st, data.data(), data.data(), len, true);
+            }
+            out.write(data.data(), len);
+            if (len < bytes_per_read)
+            {
+                break;
+            }
+        }
+        gcm_finish(st, tag);
+        out.write(tag, 16);
+        return true;
+    }
+
+    size_t held = 0; //bytes at the start of data carried over from the last read
+    while (true)
+    {
+        size_t len = in.read(&data[held], bytes_per_read);
+        size_t total = held + len;
+        data.mark_used(total);
+        if (total < 16)
+        {
+            return false;
+        }
+        {
+            aes_stage_timer timer(stage_cipher, total - 16);
+            gcm_update(st, data.data(), data.data(), total - 16, false);
+        }
+        out.write(data.data(), total - 16);
+        memmove(data.data(), &data[total - 16], 16);
+        held = 16;
+        if (len < bytes_per_read)
+        {
+            break;
+        }
+    }
+    gcm_finish(st, tag);
+    return tags_equal(tag, data.data());
+}
+
+//CTR: the data is the same length as the input, read in large pieces which are
+//split across the thread pool
+void process_ctr(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header,
+    thread_pool& pool, size_t chunk_size)
+{
+    const size_t bytes_per_read = parallel_read_size(pool, chunk_size);
+    array<u8, 16> iv;
+    memcpy(&iv, header.iv, 16);
+    pooled_buffer data = buffer_pool::shared().get(bytes_per_read);
+    first_touch(pool, data.data(), bytes_per_read, chunk_size);
+    u64 block_offset = 0;
+    while (true)
+    {
+        size_t len = in.read(data.data(), bytes_per_read);
+        data.mark_used(len);
+        {
+            aes_stage_timer timer(stage_cipher, len);
+            ctr_crypt_parallel(pool, ctx, data.data(), data.data(), len, iv, block_offset, chunk_size);
+        }
+        out.write(data.data(), len);
+        block_offset += len / 16; //every read but the last is a whole number of blocks
+        if (len < bytes_per_read)
+        {
+            break;
+        }
+    }
+}
+
+//The seekable mode's IV for chunk index: the file's IV with index xored into
+//its last 8 bytes. The footer uses the one index no chunk can have.
+const u64 seekable_footer_index = ~(u64)0;
+void seekable_iv(const file_header& header, u64 index, u8* iv)
+{
+    memcpy(iv, header.iv, 12);
+    store_be64(iv + 4, load_be64(header.iv + 4) ^ index);
+}
+
+void seekable_footer_tag(const gcm_key& key, const file_header& header, const u8* length_bytes, u8* tag)
+{
+    u8 aad[sizeof(header.bytes) + 8], iv[12];
+    memcpy(aad, header.bytes, header.size());
+    memcpy(aad + header.size(), length_bytes, 8);
+    seekable_iv(header, seekable_footer_index, iv);
+    gcm_encrypt(key, iv, 12, aad, header.size() + 8, aad, aad, 0, tag);
+}
+
+bool seekable_chunks(const gcm_key& key, const file_header& header, u64 first, size_t n, size_t last_len,
+    u8* plain, u8* records, bool encrypt, thread_pool& pool)
+{
+    const size_t chunk = header.chunk_size(), record_size = chunk + 16;
+    aes_stage_timer timer(stage_cipher, (n - 1) * chunk + last_len);
+    atomic<bool> ok{ true };
+    pool.run(n, [&](size_t c)
+    {
+        size_t len = (c + 1 == n ? last_len : chunk);
+        u8 iv[12];
+        seekable_iv(header, first + c, iv);
+        u8* record = records + c * record_size;
+        if (encrypt)
+        {
+            gcm_encrypt(key, iv, 12, header.bytes, header.size(), plain + c * chunk, record, len, record + len);
+        }
+        else if (!gcm_decrypt(key, iv, 12, header.bytes, header.size(), record, plain + c * chunk, len, record + len))
+        {
+            ok = false;
+        }
+    });
+    return ok;
+}
+
+bool process_seekable(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt,
+    thread_pool& pool)
+{
+    gcm_key key = make_gcm_key(ctx);
+    const size_t chunk = header.chunk_size(), record_size = chunk + 16;
+    const size_t chunks_per_read = parallel_read_size(pool, chunk) / chunk;
+    pooled_buffer plain = buffer_pool::shared().get(chunks_per_read * chunk);
+    pooled_buffer records = buffer_pool::shared().get(chunks_per_read * record_size + seekable_footer_size);
+    u64 index = 0, total = 0;
+
+    if (encrypt)
+    {
+        while (true)
+        {
+            size_t len = in.read(plain.data(), chunks_per_read * chunk);
+            size_t n = (len + chunk - 1) / chunk;
+            plain.mark_used(len);
+            records.mark_used(len + 16 * n);
+            if (n > 0)
+            {
+                seekable_chunks(key, header, index, n, len - (n - 1) * chunk, plain.data(), records.data(), true, pool);
+            }
+            out.write(records.data(), len + 16 * n);
+            index += n;
+            total += len;
+            if (len < chunks_per_read * chunk)
+            {
+                break;
+            }
+        }
+        u8 footer[seekable_footer_size];
+        store_be64(footer, total);
+        seekable_footer_tag(key, header, footer, footer + 8);
+        out.write(footer, sizeof(footer));
+        return true;
+    }
+
+    //records starts with the last footer-size bytes of the previous read, which
+    //are the footer if nothing follows them
+    if (in.read(records.data(), seekable_footer_size) != seekable_footer_size)
+    {
+        return false;
+    }
+    while (true)
+    {
+        size_t len = in.read(&records[seekable_footer_size], chunks_per_read * record_size);
+        size_t n = (len + record_size - 1) / record_size;
+        records.mark_used(seekable_footer_size + len);
+        plain.mark_used(len);
+        size_t last_record = len - (n > 0 ? n - 1 : 0) * record_size;
+        if (n > 0 && (last_record <= 16 ||
+            !seekable_chunks(key, header, index, n, last_record - 16, plain.data(), records.data(), false, pool)))
+        {
+            return false;
+        }
+        out.write(plain.data(), len - 16 * n);
+        index += n;
+        total += len - 16 * n;
+        memmove(records.data(), &records[len], seekable_footer_size);
+        if (len < chunks_per_read * record_size)
+        {
+            break;
+        }
+    }
+    u8 tag[16];
+    seekable_footer_tag(key, header, records.data(), tag);
+    return load_be64(records.data()) == total && tags_equal(tag, &records[8]);
+}
+
+bool decrypt_seekable_range(const aes_context& ctx, random_access_file& in, const file_header& header, u64 offset, u64 length,
+    output_stream& out, thread_pool& pool)
+{
+    gcm_key key = make_gcm_key(ctx);
+    const u64 chunk = header.chunk_size(), record_size = chunk + 16;
+    u64 size = (u64)in.size();
+    u8 footer[seekable_footer_size], tag[16];
+    if (size < header.size() + seekable_footer_size || !in.read_at(size - seekable_footer_size, footer, sizeof(footer)))
+    {
+        return false;
+    }
+    seekable_footer_tag(key, header, footer, tag);
+    u64 total = load_be64(footer);
+    if (!tags_equal(tag, footer + 8) || total > size)
+    {
+        return false;
+    }
+    //Everything between the header and the footer must be that many chunks
+    u64 nchunks = (total + chunk - 1) / chunk;
+    if (size - header.size() - seekable_footer_size != total + 16 * nchunks)
+    {
+        return false;
+    }
+    if (length == 0 || offset >= total)
+    {
+        return true;
+    }
+
+    u64 end = offset + min(length, total - offset);
+    const size_t chunks_per_read = parallel_read_size(pool, chunk) / chunk;
+    pooled_buffer plain = buffer_pool::shared().get(chunks_per_read * chunk);
+    pooled_buffer records = buffer_pool::shared().get(chunks_per_read * record_size);
+    for (u64 first = offset / chunk; first * chunk < end; first += chunks_per_read)
+    {
+        size_t n = (size_t)min<u64>(chunks_per_read, (end - 1) / chunk + 1 - first);
+        size_t last_len = (size_t)min(chunk, total - (first + n - 1) * chunk);
+        records.mark_used((n - 1) * record_size + last_len + 16);
+        plain.mark_used((n - 1) * chunk + last_len);
+        if (!in.read_at(header.size() + first * record_size, records.data(), (n - 1) * record_size + last_len + 16) ||
+            !seekable_chunks(key, header, first, n, last_len, plain.data(), records.data(), false, pool))
+        {
+            return false;
+        }
+        u64 from = max(offset, first * chunk), to = min(end, (first + n) * chunk);
+        out.write(&plain[from - first * chunk], to - from);
+    }
+    return true;
+}
+
+//Roughly how big the output file will be, for reserving its space. Decryption
+//can only guess an upper bound, as the padding isn't known until the end.
+u64 expected_output_size(const file_header& header, u64 input_size, bool encrypt, armor_type armor)
+{
+    if (!encrypt)
+    {
+        return input_size;
+    }
+    u64 size = header.size() + input_size + header.tag_len;
+    if (header.mode == mode_ecb || header.mode == mode_cbc)
+    {
+        size += 16 - input_size % 16;
+    }
+    else if (header.mode == mode_seekable)
+    {
+        size = header.size() + input_size + 16 * ((input_size + header.chunk_size() - 1) / header.chunk_size()) + seekable_footer_size;
+    }
+    if (armor == armor_hex)
+    {
+        size = 2 * size + 1;
+    }
+    else if (armor == armor_base64)
+    {
+        size = (size + 2) / 3 * 4 + 1;
+    }
+    return size;
+}
+
@@ -0,0 +1,1187 @@
+/* Encrypted files: fast file input and output, the hex and base64 armors, the
+file header, and encrypting or decrypting a whole stream in each mode.
+*/
+
+#ifndef AES_IO_H
+#define AES_IO_H
+
+#include "aes.h"
+#include "aes_stats.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+//Direct file I/O: mmap, large reads and writes, fallocate
+#if defined(__unix__) || defined(__APPLE__)
+#define AES_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+//Asynchronous file I/O through io_uring (Linux 5.6 and later); build with
+//-DAES_NO_IO_URING to leave it out
+#if defined(__linux__) && !defined(AES_NO_IO_URING)
+#define AES_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#ifndef AES_POSIX_IO
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h> //binary standard input and output
+#include <fcntl.h>
+#endif
+#endif
+
+//File I/O. On Linux, regular files go through io_uring with a ring of buffers, so
+//several reads run ahead of the cipher and several writes drain behind it, all at
+//once. Failing that (an old kernel, or io_uring blocked), a regular input file is
+//memory-mapped on POSIX systems, and anything else (a pipe, say) is read into
+//large aligned buffers, the next one being filled on another thread while the
+//current one is used. Output is gathered into large writes, and when the final
+//size is known its space is reserved up front with fallocate.
+const size_t io_buffer_size = 4 << 20;
+const unsigned io_ring_depth = 8; //buffers per file, in flight or being used
+
+//From the shared buffer pool, so one file after another reuses the same
+//buffers. Whatever fills one marks how far, as only that much is wiped when the
+//file is closed.
+struct io_buffer
+{
+    pooled_buffer memory = buffer_pool::shared().get(io_buffer_size);
+    u8* data = memory.data();
+
+    void mark_used(size_t end)
+    {
+        memory.mark_used(end);
+    }
+};
+
+#ifdef AES_POSIX_IO
+//A pipe holds 64 KiB by default, which makes a stream take thousands of
+//wakeups per second. Ask for more room; it's fine if we don't get it.
+inline void enlarge_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#else
+    (void)fd;
+#endif
+}
+#else
+inline FILE* binary_stdio(FILE* f)
+{
+#ifdef _WIN32
+    _setmode(_fileno(f), _O_BINARY);
+#endif
+    return f;
+}
+#endif
+
+#ifdef AES_IO_URING
+//A minimal io_uring, driven with the raw system calls so liburing isn't needed.
+//Only one thread uses each ring, and it never has more requests in flight than
+//the ring has entries.
+class io_ring
+{
+public:
+    ~io_ring()
+    {
+        close();
+    }
+
+    bool open(unsigned entries)
+    {
+        io_uring_params p = {};
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+        {
+            return false;
+        }
+        if (!(p.features & IORING_FEAT_RW_CUR_POS))
+        {   //added in the same kernel (5.6) as IORING_OP_READ and IORING_OP_WRITE
+            close();
+            return false;
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sq_ring = (u8*)mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring :
+            (u8*)mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        sq_tail = (u32*)(sq_ring + p.sq_off.tail);
+        sq_mask = *(u32*)(sq_ring + p.sq_off.ring_mask);
+        sq_array = (u32*)(sq_ring + p.sq_off.array);
+        cq_head = (u32*)(cq_ring + p.cq_off.head);
+        cq_tail = (u32*)(cq_ring + p.cq_off.tail);
+        cq_mask = *(u32*)(cq_ring + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq_ring + p.cq_off.cqes);
+        return true;
+    }
+
+    //Starts a read or write (IORING_OP_READ/WRITE) of len bytes at offset in
+    //file; tag comes back with its completion. False if the kernel refused it.
+    bool submit(u8 opcode, int file, void* buf, u32 len, u64 offset, u64 tag)
+    {
+        u32 tail = *sq_tail;
+        u32 index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = file;
+        sqe->addr = (u64)buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Waits for the next completion and returns its tag; result is the byte
+    //count, or minus the error number
+    u64 wait(int& result)
+    {
+        while (true)
+        {
+            u32 head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                io_uring_cqe* cqe = &cqes[head & cq_mask];
+                u64 tag = cqe->user_data;
+                result = cqe->res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return tag;
+            }
+            syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+    }
+
+    void close()
+    {
+        if (sqes && sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        {
+            munmap(cq_ring, cq_size);
+        }
+        if (sq_ring && sq_ring != MAP_FAILED)
+        {
+            munmap(sq_ring, sq_size);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+        sq_ring = cq_ring = nullptr;
+        sqes = nullptr;
+    }
+
+private:
+    int fd = -1;
+    u8* sq_ring = nullptr;
+    u8* cq_ring = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    u32* sq_tail;
+    u32* sq_array;
+    u32 sq_mask;
+    u32* cq_head;
+    u32* cq_tail;
+    u32 cq_mask;
+    io_uring_cqe* cqes;
+};
+
+//The kernel does io_uring's buffered reads and writes on worker threads, which
+//only pays off with a spare core to run them
+inline bool io_ring_worthwhile()
+{
+    return std::thread::hardware_concurrency() > 1;
+}
+
+//One buffer of a file's ring, and the read or write it is part of
+struct ring_slot
+{
+    std::unique_ptr<io_buffer> buffer{new io_buffer};
+    u64 offset = 0;
+    u32 len = 0;    //bytes requested
+    u32 done = 0;   //bytes transferred so far
+    bool busy = false;
+};
+
+//Waits for one request on the ring to finish. A short transfer is continued
+//where it stopped (reads stop early only at the end of the file). Sets failed on
+//an I/O error.
+inline void reap_ring_slot(io_ring& ring, std::vector<ring_slot>& slots, u8 opcode, int file, bool& failed)
+{
+    int result;
+    ring_slot& s = slots[ring.wait(result)];
+    if (result < 0)
+    {
+        failed = true;
+        s.busy = false;
+        return;
+    }
+    s.done += result;
+    if (result > 0 && s.done < s.len)
+    {
+        if (ring.submit(opcode, file, s.buffer->data + s.done, s.len - s.done, s.offset + s.done, &s - &slots[0]))
+        {
+            return;
+        }
+        failed = true;
+    }
+    if (result == 0 && opcode == IORING_OP_WRITE && s.done < s.len)
+    {
+        failed = true;
+    }
+    s.busy = false;
+}
+#endif
+
+class file_source
+{
+public:
+    ~file_source()
+    {
+        close();
+    }
+
+    //"-" is standard input
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef AES_POSIX_IO
+        fd = (path == "-" ? dup(0) : ::open(path.c_str(), O_RDONLY));
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        {
+            enlarge_pipe(fd);
+        }
+        else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) == 0)
+        {
+            known_size = st.st_size;
+#ifdef AES_IO_URING
+            if (io_ring_worthwhile() && ring.open(io_ring_depth))
+            {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                slots.resize(io_ring_depth);
+                for (unsigned i = 0; i < io_ring_depth; i++)
+                {
+                    start_ring_read(i);
+                }
+                return true;
+            }
+#endif
+            void* p = (st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+            if (p != MAP_FAILED)
+            {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                map = (const u8*)p;
+            }
+        }
+#else
+        file = (path == "-" ? binary_stdio(stdin) : fopen(path.c_str(), "rb"));
+        if (!file)
+        {
+            return false;
+        }
+#endif
+        if (!map)
+        {
+            front.reset(new io_buffer);
+            back.reset(new io_buffer);
+            start_read_ahead();
+        }
+        return true;
+    }
+
+    //Copies out the next len bytes, or fewer at the end of the file
+    size_t read(u8* dst, size_t len)
+    {
+        aes_stage_timer timer(stage_read);
+        if (map)
+        {
+            size_t n = std::min(len, (size_t)known_size - map_pos);
+            memcpy(dst, map + map_pos, n);
+            map_pos += n;
+            timer.set_bytes(n);
+            return n;
+        }
+
+        size_t done = 0;
+        while (done < len)
+        {
+            if (front_pos == front_len && !next_buffer())
+            {
+                break;
+            }
+            size_t n = std::min(len - done, front_len - front_pos);
+            memcpy(dst + done, front_data + front_pos, n);
+            front_pos += n;
+            done += n;
+        }
+        timer.set_bytes(done);
+        return done;
+    }
+
+    //Size in bytes, or -1 if it can't be known in advance (a pipe, say)
+    long long size() const
+    {
+        return known_size;
+    }
+
+    bool failed = false;
+
+private:
+    //Moves on to the next filled buffer; false at the end of the file
+    bool next_buffer()
+    {
+        if (at_end)
+        {
+            return false;
+        }
+#ifdef AES_IO_URING
+        if (!slots.empty())
+        {   //the slot just used up can start on the next unread piece of the file
+            if (buffers_used > 0)
+            {
+                start_ring_read((buffers_used - 1) % io_ring_depth);
+            }
+            ring_slot& s = slots[buffers_used % io_ring_depth];
+#ifdef AES_STATS
+            aes_stats_queue(queue_read, (unsigned int)std::count_if(slots.begin(), slots.end(), [](const ring_slot& r) { return r.busy; }), s.busy);
+#endif
+            while (s.busy)
+            {
+                reap_ring_slot(ring, slots, IORING_OP_READ, fd, failed);
+            }
+            buffers_used++;
+            s.buffer->mark_used(s.done);
+            front_data = s.buffer->data;
+            front_len = s.done;
+            front_pos = 0;
+            at_end = (s.done == 0 || failed);
+            return !at_end;
+        }
+#endif
+#ifdef AES_STATS
+        aes_stats_queue(queue_read, 1, ahead.wait_for(std::chrono::seconds(0)) != std::future_status::ready);
+#endif
+        front_len = ahead.get();
+        front_pos = 0;
+        std::swap(front, back);
+        front->mark_used(front_len);
+        front_data = front->data;
+        if (front_len == 0)
+        {
+            at_end = true;
+            return false;
+        }
+        start_read_ahead();
+        return true;
+    }
+
+#ifdef AES_IO_URING
+    void start_ring_read(unsigned i)
+    {
+        ring_slot& s = slots[i];
+        s.offset = next_offset;
+        s.len = (u32)std::min<u64>(io_buffer_size, known_size - std::min<u64>(next_offset, known_size));
+        s.done = 0;
+        next_offset += s.len;
+        s.busy = (s.len > 0);
+        if (s.busy && !ring.submit(IORING_OP_READ, fd, s.buffer->data, s.len, s.offset, i))
+        {
+            failed = true;
+            s.busy = false;
+        }
+    }
+#endif
+
+    void start_read_ahead()
+    {
+        u8* dst = back->data;
+        ahead = std::async(std::launch::async, [this, dst] { return read_fully(dst, io_buffer_size); });
+    }
+
+    //Runs on the read-ahead thread: fills dst unless the file ends first
+    size_t read_fully(u8* dst, size_t len)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+#ifdef AES_POSIX_IO
+            ssize_t n = ::read(fd, dst + done, len - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#else
+            size_t n = fread(dst + done, 1, len - done, file);
+            if (n == 0 && ferror(file))
+            {
+                n = -1;
+            }
+#endif
+            if (n <= 0)
+            {
+                failed = failed || (n < 0);
+                break;
+            }
+            done += n;
+        }
+        return done;
+    }
+
+    void close()
+    {
+        if (ahead.valid())
+        {
+            ahead.wait();
+        }
+#ifdef AES_IO_URING
+        bool ignored = false;
+        while (std::any_of(slots.begin(), slots.end(), [](const ring_slot& s) { return s.busy; }))
+        {
+            reap_ring_slot(ring, slots, IORING_OP_READ, fd, ignored);
+        }
+        slots.clear();
+        ring.close();
+        next_offset = buffers_used = 0;
+#endif
+#ifdef AES_POSIX_IO
+        if (map)
+        {
+            munmap((void*)map, known_size);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+#else
+        if (file && file != stdin)
+        {
+            fclose(file);
+        }
+        file = nullptr;
+#endif
+        map = nullptr;
+        map_pos = front_pos = front_len = 0;
+        known_size = -1;
+        at_end = false;
+    }
+
+#ifdef AES_POSIX_IO
+    int fd = -1;
+#else
+    FILE* file = nullptr;
+#endif
+    long long known_size = -1;
+    const u8* map = nullptr;
+    size_t map_pos = 0;
+    const u8* front_data = nullptr; //the buffer being copied out of
+    size_t front_pos = 0, front_len = 0;
+    bool at_end = false;
+    std::unique_ptr<io_buffer> front, back;
+    std::future<size_t> ahead; //the read filling back
+#ifdef AES_IO_URING
+    io_ring ring;
+    std::vector<ring_slot> slots; //empty unless the ring is in use
+    u64 next_offset = 0;
+    u64 buffers_used = 0;
+#endif
+};
+
+//A regular file read at any offset, for decrypting part of a seekable file
+//without reading the rest. No read-ahead: each read is one positioned read.
+class random_access_file
+{
+public:
+    ~random_access_file()
+    {
+        close();
+    }
+
+    //Only regular files, whose size is known
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef AES_POSIX_IO
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            close();
+            return false;
+        }
+        known_size = st.st_size;
+#else
+        file = fopen(path.c_str(), "rb");
+        if (!file || seek(0, SEEK_END) != 0)
+        {
+            close();
+            return false;
+        }
+#ifdef _WIN32
+        known_size = _ftelli64(file);
+#else
+        known_size = ftell(file);
+#endif
+#endif
+        return known_size >= 0;
+    }
+
+    long long size() const
+    {
+        return known_size;
+    }
+
+    //Fills dst with the len bytes at offset; false if they aren't all there
+    bool read_at(u64 offset, u8* dst, size_t len)
+    {
+        aes_stage_timer timer(stage_read, len);
+        if (offset > (u64)known_size || len > (u64)known_size - offset)
+        {
+            return false;
+        }
+        size_t done = 0;
+        while (done < len)
+        {
+#ifdef AES_POSIX_IO
+            ssize_t n = pread(fd, dst + done, len - done, (off_t)(offset + done));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#else
+            long long n = (seek((long long)(offset + done), SEEK_SET) == 0 ? (long long)fread(dst + done, 1, len - done, file) : -1);
+#endif
+            if (n <= 0)
+            {
+                failed = true;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool failed = false;
+
+private:
+#ifndef AES_POSIX_IO
+    int seek(long long offset, int whence)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, offset, whence);
+#else
+        return fseek(file, (long)offset, whence);
+#endif
+    }
+#endif
+
+    void close()
+    {
+#ifdef AES_POSIX_IO
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = -1;
+#else
+        if (file)
+        {
+            fclose(file);
+        }
+        file = nullptr;
+#endif
+        known_size = -1;
+    }
+
+#ifdef AES_POSIX_IO
+    int fd = -1;
+#else
+    FILE* file = nullptr;
+#endif
+    long long known_size = -1;
+};
+
+class file_sink
+{
+public:
+    ~file_sink()
+    {
+        close();
+    }
+
+    //"-" is standard output
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef AES_POSIX_IO
+        fd = (path == "-" ? dup(1) : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        {
+            enlarge_pipe(fd);
+        }
+#ifdef AES_IO_URING
+        if (path != "-" && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && io_ring_worthwhile() && ring.open(io_ring_depth))
+        {
+            slots.resize(io_ring_depth);
+        }
+#endif
+        return true;
+#else
+        file = (path == "-" ? binary_stdio(stdout) : fopen(path.c_str(), "wb"));
+        return file != nullptr;
+#endif
+    }
+
+    //Reserves disk space for an output of about size bytes, so a large file is
+    //laid out in one piece. close() gives back anything that wasn't used.
+    void reserve(u64 size)
+    {
+#ifdef __linux__
+        if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+        {
+            reserved = true;
+        }
+#else
+        (void)size;
+#endif
+    }
+
+    void write(const u8* data, size_t len)
+    {
+        aes_stage_timer timer(stage_write, len);
+#ifdef AES_IO_URING
+        if (!slots.empty())
+        {   //fill the current slot, and send it off whenever it is full
+            while (len > 0)
+            {
+                size_t n = std::min(len, io_buffer_size - pending);
+                memcpy(slots[current].buffer->data + pending, data, n);
+                pending += n;
+                slots[current].buffer->mark_used(pending);
+                data += n;
+                len -= n;
+                if (pending == io_buffer_size)
+                {
+                    flush();
+                }
+            }
+            return;
+        }
+#endif
+        if (pending + len > io_buffer_size)
+        {
+            flush();
+        }
+        if (len >= io_buffer_size)
+        {   //big enough to go straight out
+            write_fully(data, len);
+            return;
+        }
+        memcpy(buffer->data + pending, data, len);
+        pending += len;
+        buffer->mark_used(pending);
+    }
+
+    //Writes out anything buffered and closes the file; false if any write failed
+    bool close()
+    {
+        bool ok = !failed;
+#ifdef AES_POSIX_IO
+        if (fd >= 0)
+        {
+            flush();
+#ifdef AES_IO_URING
+            while (std::any_of(slots.begin(), slots.end(), [](const ring_slot& s) { return s.busy; }))
+            {
+                reap_ring_slot(ring, slots, IORING_OP_WRITE, fd, failed);
+            }
+            slots.clear();
+            ring.close();
+            current = 0;
+#endif
+            if (reserved && ftruncate(fd, written) != 0)
+            {
+                failed = true;
+            }
+            ok = !failed && ::close(fd) == 0;
+        }
+        fd = -1;
+#else
+        if (file)
+        {
+            flush();
+            ok = !failed && (file == stdout ? fflush(file) : fclose(file)) == 0;
+        }
+        file = nullptr;
+#endif
+        failed = reserved = false;
+        written = 0;
+        return ok;
+    }
+
+private:
+    void flush()
+    {
+#ifdef AES_IO_URING
+        if (!slots.empty())
+        {   //start writing the current slot, then wait for the next one to be free
+            if (pending == 0)
+            {
+                return;
+            }
+            ring_slot& s = slots[current];
+            s.offset = written;
+            s.len = (u32)pending;
+            s.done = 0;
+            s.busy = ring.submit(IORING_OP_WRITE, fd, s.buffer->data, s.len, s.offset, current);
+            failed = failed || !s.busy;
+            written += pending;
+            pending = 0;
+            current = (current + 1) % io_ring_depth;
+#ifdef AES_STATS
+            aes_stats_queue(queue_write, (unsigned int)std::count_if(slots.begin(), slots.end(), [](const ring_slot& r) { return r.busy; }), slots[current].busy);
+#endif
+            while (slots[current].busy)
+            {
+                reap_ring_slot(ring, slots, IORING_OP_WRITE, fd, failed);
+            }
+            return;
+        }
+#endif
+        write_fully(buffer->data, pending);
+        pending = 0;
+    }
+
+    void write_fully(const u8* data, size_t len)
+    {
+        size_t done = 0;
+        while (done < len && !failed)
+        {
+#ifdef AES_POSIX_IO
+            ssize_t n = ::write(fd, data + done, len - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            failed = (n <= 0);
+#else
+            size_t n = fwrite(data + done, 1, len - done, file);
+            failed = (n == 0);
+#endif
+            if (!failed)
+            {
+                done += n;
+            }
+        }
+        written += done;
+    }
+
+#ifdef AES_POSIX_IO
+    int fd = -1;
+#else
+    FILE* file = nullptr;
+#endif
+    std::unique_ptr<io_buffer> buffer{new io_buffer};
+    size_t pending = 0;
+    u64 written = 0;
+    bool reserved = false;
+    bool failed = false;
+#ifdef AES_IO_URING
+    io_ring ring;
+    std::vector<ring_slot> slots; //empty unless the ring is in use
+    unsigned current = 0;    //the slot being filled
+#endif
+};
+
+
+//Encrypted files are binary by default, or the same bytes armored as hex or
+//base64 text
+enum armor_type { armor_binary, armor_hex, armor_base64 };
+
+//Fills in the codec tables; call once before using anything below
+void make_codec_tables();
+
+//Encodes len bytes as 2 * len lowercase hex digits
+void hex_encode(const u8* in, size_t len, char* out);
+
+//Decodes 2 * len hex characters; false if any of them isn't a hex digit
+bool hex_decode(const char* in, size_t len, u8* out);
+
+//Encodes len bytes, padding the final group with '=' if len isn't a multiple of 3.
+//Returns the number of characters written.
+size_t base64_encode(const u8* in, size_t len, char* out);
+
+//Decodes groups of 4 characters (nchars must be a multiple of 4). '=' padding is
+//only accepted in the last group, which sets padded. Returns false on bad input.
+bool base64_decode(const char* in, size_t nchars, u8* out, size_t& out_len, bool& padded);
+
+//Where encrypted or decrypted bytes go: straight to the file, or through the hex
+//or base64 encoder. Base64 works in 3-byte groups, so up to 2 bytes can be left
+//waiting for the next write; finish() flushes them.
+class output_stream
+{
+public:
+    output_stream(file_sink& file, armor_type armor) : file(file), armor(armor) {}
+
+    void write(const u8* data, size_t len)
+    {
+        if (armor == armor_binary)
+        {
+            file.write(data, len);
+        }
+        else if (armor == armor_hex)
+        {
+            text.resize(2 * len);
+            {
+                aes_stage_timer timer(stage_encode, len);
+                hex_encode(data, len, text.data());
+            }
+            file.write((const u8*)text.data(), text.size());
+        }
+        else
+        {
+            while (carry_len > 0 && carry_len < 3 && len > 0)
+            {
+                carry[carry_len++] = *data++;
+                len--;
+            }
+            if (carry_len > 0 && carry_len < 3)
+            {
+                return;
+            }
+            if (carry_len == 3)
+            {
+                char group[4];
+                file.write((const u8*)group, base64_encode(carry, 3, group));
+                carry_len = 0;
+            }
+            size_t whole = len / 3 * 3;
+            text.resize(whole / 3 * 4);
+            {
+                aes_stage_timer timer(stage_encode, whole);
+                base64_encode(data, whole, text.data());
+            }
+            file.write((const u8*)text.data(), text.size());
+            carry_len = len - whole;
+            memcpy(carry, data + whole, carry_len);
+        }
+    }
+
+    void finish()
+    {
+        if (armor == armor_base64 && carry_len > 0)
+        {
+            char group[4];
+            file.write((const u8*)group, base64_encode(carry, carry_len, group));
+            carry_len = 0;
+        }
+        if (armor != armor_binary)
+        {
+            file.write((const u8*)"\n", 1);
+        }
+    }
+
+private:
+    file_sink& file;
+    armor_type armor;
+    std::vector<char> text;
+    u8 carry[3];
+    size_t carry_len = 0;
+};
+
+//Reads an encrypted file in whichever form it was written. The form is told
+//apart by how the file starts: the binary magic "GAES" is "47414553" in hex and
+//begins "R0FFU" in base64. Whitespace in the armored forms is ignored.
+class input_stream
+{
+public:
+    input_stream(file_source& file) : file(file)
+    {
+        char start[8];
+        size_t n = file.read((u8*)start, sizeof(start));
+        if (n >= 8 && memcmp(start, "47414553", 8) == 0)
+        {
+            armor = armor_hex;
+        }
+        else if (n >= 5 && memcmp(start, "R0FFU", 5) == 0)
+        {
+            armor = armor_base64;
+        }
+        else
+        {
+            armor = armor_binary;
+        }
+
+        if (armor == armor_binary)
+        {
+            pending.assign(start, start + n);
+        }
+        else
+        {
+            text.assign(start, start + n);
+        }
+    }
+
+    //Fills data with len bytes, or fewer at the end of the file. Sets failed if
+    //the armored text is malformed.
+    size_t read(u8* data, size_t len)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            if (pending_pos < pending.size())
+            {
+                size_t n = std::min(len - done, pending.size() - pending_pos);
+                memcpy(data + done, &pending[pending_pos], n);
+                pending_pos += n;
+                done += n;
+            }
+            else if (armor == armor_binary)
+            {
+                done += file.read(data + done, len - done);
+                break;
+            }
+            else if (!decode_more())
+            {
+                break;
+            }
+        }
+        return done;
+    }
+
+    armor_type armor;
+    bool failed = false;
+
+private:
+    //Decodes the next piece of text into pending; false at the end of input
+    bool decode_more()
+    {
+        const size_t chars_per_read = 1 << 22;
+        pending.clear();
+        pending_pos = 0;
+        while (pending.empty())
+        {
+            size_t old = text.size();
+            text.resize(old + chars_per_read);
+            size_t got = file.read((u8*)&text[old], chars_per_read);
+            text.resize(old + got);
+            aes_stage_timer timer(stage_decode, got); //the whitespace too, but not the read
+            text.erase(std::remove_if(text.begin(), text.end(), [](char c) { return isspace((u8)c); }), text.end());
+
+            size_t unit = (armor == armor_hex ? 2 : 4);
+            size_t usable = text.size() / unit * unit;
+            if (got == 0 && usable != text.size())
+            {
+                failed = true; //ends partway through a hex pair or base64 group
+            }
+            if (got == 0 && usable == 0)
+            {
+                return false;
+            }
+            if (usable > 0 && base64_ended)
+            {
+                failed = true; //data after the base64 padding
+                return false;
+            }
+
+            bool ok;
+            if (armor == armor_hex)
+            {
+                pending.resize(usable / 2);
+                ok = hex_decode(text.data(), usable / 2, pending.data());
+            }
+            else
+            {
+                size_t n;
+                pending.resize(usable / 4 * 3);
+                ok = base64_decode(text.data(), usable, pending.data(), n, base64_ended);
+                pending.resize(n);
+            }
+            text.erase(text.begin(), text.begin() + usable);
+            if (!ok)
+            {
+                failed = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    file_source& file;
+    std::vector<char> text;   //armored characters not decoded yet
+    std::vector<u8> pending;  //decoded bytes not handed out yet
+    size_t pending_pos = 0;
+    bool base64_ended = false;
+};
+
+
+//Encrypted file layout, for every mode:
+//  "GAES", format version, cipher mode, key length in bytes, IV length,
+//  tag length, 3 reserved bytes, the IV, the ciphertext, then the tag.
+//For GCM the header bytes are authenticated as additional data.
+//
+//The seekable mode is GCM in independent chunks, so any byte range can be
+//decrypted (and authenticated) on its own. The first reserved byte is log2 of
+//the chunk size, and the other two are zero. After the 12-byte IV comes each
+//chunk's ciphertext followed by its tag. Every chunk is full-size but the last,
+//which is shorter (there are none at all for empty input). Then comes the index
+//footer: the plaintext length as 8 big-endian bytes, and a tag over it. As the
+//chunks are all the same size, that length is all a reader needs to find any
+//of them. Chunk i is encrypted under the IV with i xored into its last 8 bytes
+//(as a big-endian number). The footer's tag uses the IV xored with all ones
+//there instead, and authenticates the header bytes followed by the length.
+//Every chunk has the header bytes as additional data. A chunk can't be moved,
+//and the file can't be truncated or extended, without a tag failing.
+//
+//Format version 2 is for keys derived from a passphrase, and is version 1 with
+//the derivation's parameters added: the second reserved byte says how the key
+//was derived (1 for PBKDF2-HMAC-SHA256), and after the IV come the 16-byte salt
+//and the iteration count as 4 big-endian bytes. They are part of the header
+//bytes, so GCM authenticates them too. Files encrypted with a key are still
+//version 1.
+const u8 file_version = 1;
+const u8 file_version_kdf = 2;
+enum kdf_id { kdf_none = 0, kdf_pbkdf2_sha256 = 1 };
+const size_t kdf_salt_size = 16;
+const size_t kdf_params_size = kdf_salt_size + 4;
+const u32 kdf_max_iterations = 100000000;
+enum cipher_mode_id { mode_ecb = 0, mode_cbc = 1, mode_ctr = 2, mode_gcm = 3, mode_seekable = 4 };
+const char* const cipher_mode_names[] = { "ECB", "CBC", "CTR", "GCM", "SEEKABLE" };
+const size_t header_fixed_size = 12;
+const int seekable_default_chunk_shift = 16; //64 KiB
+const int seekable_min_chunk_shift = 12, seekable_max_chunk_shift = 24;
+const size_t seekable_footer_size = 8 + 16;
+
+struct file_header
+{
+    u8 mode;
+    u8 key_bytes;
+    u8 iv_len;
+    u8 tag_len;
+    u8 chunk_shift; //seekable mode only
+    u8 kdf;         //a kdf_id
+    u8 iv[16];
+    u8 salt[kdf_salt_size]; //for the key derivation, if there is one
+    u32 iterations;
+    u8 bytes[header_fixed_size + 16 + kdf_params_size]; //serialized form
+
+    size_t size() const
+    {
+        return header_fixed_size + iv_len + (kdf != kdf_none ? kdf_params_size : 0);
+    }
+
+    size_t chunk_size() const
+    {
+        return (size_t)1 << chunk_shift;
+    }
+};
+
+//Makes a header with a fresh random IV for mode. chunk_shift is only used by the
+//seekable mode, and must be from seekable_min_chunk_shift to seekable_max_chunk_shift.
+file_header new_file_header(int mode, size_t key_bytes, int chunk_shift = seekable_default_chunk_shift);
+
+//Makes h a version 2 header, for a key derived from a passphrase with
+//PBKDF2-HMAC-SHA256 under salt (kdf_salt_size bytes) and iterations
+void set_header_kdf(file_header& h, const u8* salt, u32 iterations);
+
+//Reads and checks a header; returns an error message, or nullptr if it's fine
+const char* read_file_header(input_stream& in, file_header& h);
+const char* read_file_header(random_access_file& in, file_header& h);
+//From memory: the header is the start of the len bytes at data
+const char* read_file_header(const u8* data, size_t len, file_header& h);
+
+//How long the header starting with these header_fixed_size bytes is, for readers
+//that are handed the file a piece at a time. An impossible IV length is left for
+//read_file_header to reject.
+inline size_t file_header_size(const u8* fixed)
+{
+    return header_fixed_size + std::min<size_t>(fixed[7], 16) + (fixed[4] == file_version_kdf ? kdf_params_size : 0);
+}
+
+//ECB and CBC: PKCS#7-padded blocks. ECB encrypts every block on its own; CBC
+//chains them (serial to encrypt, parallel to decrypt). Decryption holds back the
+//last block of each read until it knows whether it is the final one, since that
+//is where the padding is. Returns false on bad padding. CBC decryption is split
+//into chunk_size pieces across the pool.
+bool process_block_mode(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt,
+    thread_pool& pool, size_t chunk_size = ctr_chunk_size);
+
+//GCM: the ciphertext is followed by the 16-byte tag. Decryption holds back the
+//last 16 bytes of each read until it knows which bytes are the tag. Returns false
+//if the tag doesn't match, in which case the output must not be used.
+bool process_gcm(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt);
+
+//CTR: the data is the same length as the input, read in large pieces which are
+//split into chunk_size pieces across the pool
+void process_ctr(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header,
+    thread_pool& pool, size_t chunk_size = ctr_chunk_size);
+
+//The seekable mode, as a stream: whole batches of chunks at a time, each chunk a
+//task on the pool. Decryption holds back the last bytes of each read until it
+//knows which are the footer. Returns false if any tag doesn't match.
+bool process_seekable(const aes_context& ctx, input_stream& in, output_stream& out, const file_header& header, bool encrypt,
+    thread_pool& pool);
+
+//The pieces of the seekable mode, for callers that are handed the data rather
+//than reading it (the server). seekable_chunks encrypts or decrypts n consecutive
+//chunks, starting with chunk first, one task each: plain holds their plaintext
+//back to back, and records their ciphertext and tags. All are full-size but the
+//last, which has last_len bytes. Returns false if any tag doesn't match.
+bool seekable_chunks(const gcm_key& key, const file_header& header, u64 first, size_t n, size_t last_len,
+    u8* plain, u8* records, bool encrypt, thread_pool& pool);
+//The footer's tag, over the header bytes and then the footer's 8 length bytes
+void seekable_footer_tag(const gcm_key& key, const file_header& header, const u8* length_bytes, u8* tag);
+
+//Decrypts plaintext bytes [offset, offset + length) of a seekable file, reading
+//only the header, the footer and the chunks the range touches. A range running
+//past the end stops there. Returns false if the file is damaged, or a tag doesn't match.
+bool decrypt_seekable_range(const aes_context& ctx, random_access_file& in, const file_header& header, u64 offset, u64 length,
+    output_stream& out, thread_pool& pool);
+
+//Roughly how big the output file will be, for reserving its space. Decryption
+//can only guess an upper bound, as the padding isn't known until the end.
+u64 expected_output_size(const file_header& header, u64 input_size, bool encrypt, armor_type armor);
+
+#endif
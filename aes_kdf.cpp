@@ -0,0 +1,373 @@
+/* Key derivation from passphrases: SHA-256 (FIPS 180-4) with the SHA extensions
+where the CPU has them, HMAC-SHA256 (RFC 2104), PBKDF2-HMAC-SHA256 (RFC 8018) and
+the cache of derived keys.
+*/
+
+#include "aes_internal.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+using namespace std;
+
+const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+const u32 sha256_initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline u32 rotate_right(u32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void sha256_blocks_generic(u32 state[8], const u8* data, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, data += 64)
+    {
+        u32 w[64];
+        for (int t = 0; t < 16; t++)
+        {
+            w[t] = load_be32(data + 4 * t);
+        }
+        for (int t = 16; t < 64; t++)
+        {
+            u32 s0 = rotate_right(w[t - 15], 7) ^ rotate_right(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            u32 s1 = rotate_right(w[t - 2], 17) ^ rotate_right(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        u32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t++)
+        {
+            u32 t1 = h + (rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+            u32 t2 = (rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        secure_zero(w, sizeof(w));
+    }
+}
+
+sha256_blocks_function* select_sha256_blocks()
+{
+#ifdef AES_X86
+    if (cpu_has_sha())
+    {
+        return sha256_blocks_shani;
+    }
+#endif
+#ifdef AES_ARM64
+    if (cpu_has_armv8_sha2())
+    {
+        return sha256_blocks_armv8;
+    }
+#endif
+    return sha256_blocks_generic;
+}
+
+//A hash being computed: whole blocks go straight to the compression function,
+//and the rest waits in buffer
+struct sha256_state
+{
+    sha256_blocks_function* blocks;
+    u32 h[8];
+    u8 buffer[64];
+    size_t buffered;
+    u64 total;
+
+    sha256_state()
+    {
+        static sha256_blocks_function* const best = select_sha256_blocks();
+        blocks = best;
+        memcpy(h, sha256_initial, sizeof(h));
+        buffered = 0;
+        total = 0;
+    }
+
+    ~sha256_state()
+    {
+        secure_zero(this, sizeof(*this));
+    }
+
+    void update(const u8* data, size_t len)
+    {
+        total += len;
+        if (buffered > 0)
+        {
+            size_t n = min(len, 64 - buffered);
+            memcpy(buffer + buffered, data, n);
+            buffered += n;
+            data += n;
+            len -= n;
+            if (buffered < 64)
+            {
+                return;
+            }
+            blocks(h, buffer, 1);
+            buffered = 0;
+        }
+        blocks(h, data, len / 64);
+        memcpy(buffer, data + len / 64 * 64, len % 64);
+        buffered = len % 64;
+    }
+
+    void finish(u8* digest)
+    {
+        u64 bits = total * 8;
+        u8 pad[72] = { 0x80 };
+        size_t pad_len = (buffered < 56 ? 56 : 120) - buffered;
+        store_be64(pad + pad_len, bits);
+        update(pad, pad_len + 8);
+        for (int i = 0; i < 8; i++)
+        {
+            store_be32(digest + 4 * i, h[i]);
+        }
+    }
+};
+
+void sha256(const u8* data, size_t len, u8 digest[32])
+{
+    sha256_state st;
+    st.update(data, len);
+    st.finish(digest);
+}
+
+//The two hash states HMAC starts from: after absorbing the key xored with the
+//inner pad (0x36 bytes) and with the outer pad (0x5c bytes)
+void hmac_sha256_start(const u8* key, size_t key_len, sha256_state& inner, sha256_state& outer)
+{
+    u8 block[64] = {};
+    if (key_len > 64)
+    {
+        sha256(key, key_len, block);
+    }
+    else
+    {
+        memcpy(block, key, key_len);
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        block[i] ^= 0x36;
+    }
+    inner.update(block, 64);
+    for (int i = 0; i < 64; i++)
+    {
+        block[i] ^= 0x36 ^ 0x5c;
+    }
+    outer.update(block, 64);
+    secure_zero(block, sizeof(block));
+}
+
+void hmac_sha256(const u8* key, size_t key_len, const u8* data, size_t len, u8 mac[32])
+{
+    sha256_state inner, outer;
+    hmac_sha256_start(key, key_len, inner, outer);
+    inner.update(data, len);
+    inner.finish(mac);
+    outer.update(mac, 32);
+    outer.finish(mac);
+}
+
+//After the first, every iteration is HMAC of a 32-byte value: one block for the
+//inner hash and one for the outer, each the 32 bytes followed by the same padding
+//(the length is always 64 + 32 bytes). So each iteration is exactly two calls of
+//the compression function, from the two saved pad states, with no buffering.
+void pbkdf2_hmac_sha256(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len, u32 iterations,
+    u8* out, size_t out_len)
+{
+    aes_stage_timer timer(stage_key_setup);
+    if (iterations == 0)
+    {
+        throw invalid_argument("PBKDF2 needs at least one iteration");
+    }
+    sha256_state inner, outer;
+    hmac_sha256_start(passphrase, passphrase_len, inner, outer);
+    u8 block[64] = {};
+    block[32] = 0x80;
+    store_be64(block + 56, (64 + 32) * 8);
+
+    for (u32 index = 1; out_len > 0; index++)
+    {
+        //U1 = HMAC(passphrase, salt || index)
+        u8 u[32], t[32], be_index[4];
+        store_be32(be_index, index);
+        sha256_state first = inner, last = outer;
+        first.update(salt, salt_len);
+        first.update(be_index, 4);
+        first.finish(u);
+        last.update(u, 32);
+        last.finish(u);
+        memcpy(t, u, 32);
+
+        for (u32 i = 1; i < iterations; i++)
+        {
+            u32 h[8];
+            memcpy(block, u, 32);
+            memcpy(h, inner.h, sizeof(h));
+            inner.blocks(h, block, 1);
+            for (int w = 0; w < 8; w++)
+            {
+                store_be32(block + 4 * w, h[w]);
+            }
+            memcpy(h, outer.h, sizeof(h));
+            outer.blocks(h, block, 1);
+            for (int w = 0; w < 8; w++)
+            {
+                store_be32(u + 4 * w, h[w]);
+                store_be32(block + 4 * w, 0);
+            }
+            xor_bytes(t, u, t, 32);
+            secure_zero(h, sizeof(h));
+        }
+        size_t n = min(out_len, (size_t)32);
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+        secure_zero(u, sizeof(u));
+        secure_zero(t, sizeof(t));
+    }
+    secure_zero(block, sizeof(block));
+}
+
+passphrase_cache::passphrase_cache(size_t capacity) : capacity(max(capacity, (size_t)1)) {}
+
+passphrase_cache::~passphrase_cache()
+{
+    clear();
+}
+
+//Compares everything, the passphrase in constant time
+bool passphrase_cache::matches(const entry& e, const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+    u32 iterations, size_t key_bytes)
+{
+    if (e.passphrase.size() != passphrase_len || e.salt.size() != salt_len || e.iterations != iterations || e.key_bytes != key_bytes)
+    {
+        return false;
+    }
+    u8 diff = 0;
+    for (size_t i = 0; i < passphrase_len; i++)
+    {
+        diff |= e.passphrase[i] ^ passphrase[i];
+    }
+    return diff == 0 && equal(e.salt.begin(), e.salt.end(), salt);
+}
+
+shared_ptr<const expanded_key> passphrase_cache::get(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+    u32 iterations, size_t key_bytes)
+{
+    if (!aes_key_size_valid(key_bytes))
+    {
+        throw invalid_argument("AES keys are 16, 24 or 32 bytes");
+    }
+    auto same = [&](const entry& e) { return matches(e, passphrase, passphrase_len, salt, salt_len, iterations, key_bytes); };
+    promise<shared_ptr<const expanded_key>> result;
+    shared_future<shared_ptr<const expanded_key>> value;
+    bool derive = false;
+    {
+        lock_guard<mutex> guard(lock);
+        auto e = find_if(entries.begin(), entries.end(), same);
+        if (e != entries.end())
+        {
+            entries.splice(entries.begin(), entries, e);
+            value = e->value;
+        }
+        else
+        {   //the first to ask derives the key; anyone else asking meanwhile waits for it
+            value = result.get_future().share();
+            entries.emplace_front();
+            entry& added = entries.front();
+            added.passphrase.assign(passphrase, passphrase + passphrase_len);
+            added.salt.assign(salt, salt + salt_len);
+            added.iterations = iterations;
+            added.key_bytes = key_bytes;
+            added.value = value;
+            while (entries.size() > capacity)
+            {
+                entries.pop_back();
+            }
+            derive = true;
+        }
+    }
+
+    if (derive)
+    {   //outside the lock, so other passphrases aren't held up
+        u8 key[32];
+        try
+        {
+            pbkdf2_hmac_sha256(passphrase, passphrase_len, salt, salt_len, iterations, key, key_bytes);
+            result.set_value(allocate_shared<expanded_key>(locked_allocator<expanded_key>(), key, key_bytes));
+        }
+        catch (...)
+        {   //don't keep the failure: the next get() tries again
+            result.set_exception(current_exception());
+            lock_guard<mutex> guard(lock);
+            auto e = find_if(entries.begin(), entries.end(), same);
+            if (e != entries.end())
+            {
+                entries.erase(e);
+            }
+        }
+        secure_zero(key, sizeof(key));
+    }
+    return value.get();
+}
+
+shared_ptr<const expanded_key> passphrase_cache::find(const u8* passphrase, size_t passphrase_len, const u8* salt, size_t salt_len,
+    u32 iterations, size_t key_bytes) const
+{
+    lock_guard<mutex> guard(lock);
+    for (const entry& e : entries)
+    {
+        if (matches(e, passphrase, passphrase_len, salt, salt_len, iterations, key_bytes))
+        {   //still being derived, or failed
+            if (e.value.wait_for(chrono::seconds(0)) != future_status::ready)
+            {
+                return nullptr;
+            }
+            try
+            {
+                return e.value.get();
+            }
+            catch (...)
+            {
+                return nullptr;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void passphrase_cache::clear()
+{
+    lock_guard<mutex> guard(lock);
+    entries.clear();
+}
+
+size_t passphrase_cache::size() const
+{
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
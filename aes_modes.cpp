@@ -0,0 +1,884 @@
+/* Modes of operation: CTR, CBC with PKCS#7 padding, and GCM.
+*/
+
+#include "aes_internal.h"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+//Adds n to a 16-byte counter block, read as one big-endian 128-bit number
+void counter_add(u8* counter, u64 n)
+{
+    for (int i = 15; i >= 0 && n != 0; i--)
+    {
+        u64 sum = counter[i] + (n & 0xff);
+        counter[i] = (u8)sum;
+        n = (n >> 8) + (sum >> 8);
+    }
+}
+
+//Writes n consecutive counter blocks, starting from the 128-bit number (hi, lo),
+//and advances it. Whole 8-byte stores, so the kernels' 16-byte loads of the
+//blocks can be forwarded from the store buffer instead of waiting for it to drain.
+void counter_blocks(u64& hi, u64& lo, u8* out, size_t n)
+{
+    u64 h = hi, l = lo; //locals, so the stores to out can't be taken to change them
+    for (size_t b = 0; b < n; b++, out += 16)
+    {
+        store_be64(out, h);
+        store_be64(out + 8, l);
+        h += (++l == 0);
+    }
+    hi = h;
+    lo = l;
+}
+
+//Counter (CTR) mode: block i of the data is xored with the encryption of iv + i,
+//so encryption and decryption are the same operation, any length works without
+//padding, and every block can be processed independently. block_offset is the
+//index of the block at in[0], so a chunk from the middle of a stream can be
+//processed on its own. The whole blocks go through the backend's CTR kernel if it
+//has one; otherwise, and for a partial last block, counter blocks are written out
+//and encrypted with encrypt_blocks. Keystream xored with the ciphertext is the
+//plaintext, so those buffers are wiped afterwards, as far as they were used.
+const size_t ctr_batch_blocks = 64;
+void ctr_crypt(const aes_context& ctx, const u8* in, u8* out, size_t len, const array<u8, 16>& iv, u64 block_offset)
+{
+    u8 counters[16 * ctr_batch_blocks];
+    u8 keystream[16 * ctr_batch_blocks];
+    array<u8, 16> counter = iv;
+    counter_add(&counter[0], block_offset);
+    u64 hi = load_be64(&counter[0]), lo = load_be64(&counter[8]);
+
+    size_t whole = len / 16;
+    if (whole > 0 && ctx.ctr_blocks(in, out, whole, hi, lo))
+    {
+        in += 16 * whole;
+        out += 16 * whole;
+        len -= 16 * whole;
+    }
+
+    size_t used = 16 * min(ctr_batch_blocks, (len + 15) / 16);
+    while (len > 0)
+    {
+        size_t nblocks = min(ctr_batch_blocks, (len + 15) / 16);
+        counter_blocks(hi, lo, counters, nblocks);
+        ctx.encrypt_blocks(counters, keystream, nblocks);
+
+        size_t n = min(len, 16 * nblocks);
+        xor_bytes(in, keystream, out, n);
+        in += n;
+        out += n;
+        len -= n;
+    }
+    secure_zero(counters, used);
+    secure_zero(keystream, used);
+}
+
+//Splits the data into chunk_size pieces and runs them on the thread pool, each
+//starting from its own counter offset.
+void ctr_crypt_parallel(thread_pool& pool, const aes_context& ctx, const u8* in, u8* out, size_t len, const array<u8, 16>& iv,
+    u64 block_offset, size_t chunk_size)
+{
+    size_t nchunks = (len + chunk_size - 1) / chunk_size;
+    pool.run(nchunks, [&](size_t chunk)
+    {
+        size_t start = chunk * chunk_size;
+        size_t n = min(chunk_size, len - start);
+        ctr_crypt(ctx, in + start, out + start, n, iv, block_offset + start / 16);
+    });
+}
+
+//The order to process a batch in: the jobs for each context together, and
+//otherwise as given. Empty if they already are (always so with a single key), to
+//save sorting small batches.
+template <typename Job, typename Context>
+vector<size_t> group_by_context(const Job* jobs, size_t njobs, Context context)
+{
+    auto before = [&](size_t a, size_t b)
+    {
+        return less<const aes_context*>()(context(jobs[a]), context(jobs[b]));
+    };
+    vector<size_t> order;
+    size_t i = 1;
+    while (i < njobs && !before(i, i - 1))
+    {
+        i++;
+    }
+    if (i < njobs)
+    {
+        order.resize(njobs);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), before);
+    }
+    return order;
+}
+
+//The counter blocks of consecutive messages (for one context) are packed into a
+//single buffer, and each piece of it xored into its own message once the buffer
+//is full or the context changes. A long message just takes several buffers.
+void ctr_crypt_batch(const ctr_job* jobs, size_t njobs)
+{
+    struct piece
+    {
+        const u8* in;
+        u8* out;
+        size_t len;
+    };
+    u8 counters[16 * ctr_batch_blocks];
+    u8 keystream[16 * ctr_batch_blocks];
+    piece pieces[ctr_batch_blocks]; //every piece is at least one block
+    size_t nblocks = 0, npieces = 0, used = 0;
+    const aes_context* ctx = nullptr;
+
+    auto flush = [&]
+    {
+        ctx->encrypt_blocks(counters, keystream, nblocks);
+        used = max(used, 16 * nblocks);
+        const u8* ks = keystream;
+        for (size_t p = 0; p < npieces; p++)
+        {
+            xor_bytes(pieces[p].in, ks, pieces[p].out, pieces[p].len);
+            ks += 16 * ((pieces[p].len + 15) / 16);
+        }
+        nblocks = npieces = 0;
+    };
+
+    vector<size_t> order = group_by_context(jobs, njobs, [](const ctr_job& job) { return job.ctx; });
+    for (size_t k = 0; k < njobs; k++)
+    {
+        const ctr_job& job = jobs[order.empty() ? k : order[k]];
+        if (job.ctx != ctx && nblocks > 0)
+        {
+            flush();
+        }
+        ctx = job.ctx;
+        u64 hi = load_be64(&job.iv[0]), lo = load_be64(&job.iv[8]);
+        for (size_t done = 0; done < job.len;)
+        {
+            size_t n = min(ctr_batch_blocks - nblocks, (job.len - done + 15) / 16);
+            counter_blocks(hi, lo, &counters[16 * nblocks], n);
+            size_t bytes = min(16 * n, job.len - done);
+            pieces[npieces++] = { job.in + done, job.out + done, bytes };
+            nblocks += n;
+            done += bytes;
+            if (nblocks == ctr_batch_blocks)
+            {
+                flush();
+            }
+        }
+    }
+    if (nblocks > 0)
+    {
+        flush();
+    }
+    secure_zero(counters, used);
+    secure_zero(keystream, used);
+}
+
+//Cipher block chaining: each plaintext block is xored with the previous ciphertext
+//block (the IV for the first) before encryption, so identical blocks encrypt
+//differently. Encryption is inherently serial. iv is updated to the last
+//ciphertext block so the next call continues the chain.
+void cbc_encrypt(const aes_context& ctx, const u8* in, u8* out, size_t nblocks, array<u8, 16>& iv)
+{
+    array<u8, 16> block = iv;
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            block[i] ^= in[i];
+        }
+        block = ctx.encrypt_block(block);
+        memcpy(out, &block, 16);
+    }
+    iv = block;
+}
+
+//Decryption only needs ciphertext, so all blocks can be decrypted at once
+//through ctx.decrypt_blocks and then xored with the ciphertext block before them.
+//prev is the ciphertext block before in[0] (or the IV). out must not overlap in.
+const size_t cbc_batch_blocks = 64;
+void cbc_decrypt(const aes_context& ctx, const u8* in, u8* out, size_t nblocks, const u8* prev)
+{
+    u8 plain[16 * cbc_batch_blocks];
+    size_t used = 16 * min(cbc_batch_blocks, nblocks);
+    while (nblocks > 0)
+    {
+        size_t n = min(cbc_batch_blocks, nblocks);
+        ctx.decrypt_blocks(in, plain, n);
+        for (int i = 0; i < 16; i++)
+        {
+            out[i] = plain[i] ^ prev[i];
+        }
+        for (size_t i = 16; i < 16 * n; i++)
+        {
+            out[i] = plain[i] ^ in[i - 16];
+        }
+        prev = in + 16 * (n - 1);
+        in += 16 * n;
+        out += 16 * n;
+        nblocks -= n;
+    }
+    secure_zero(plain, used);
+}
+
+//Each chunk takes its chaining value from the ciphertext just before it
+void cbc_decrypt_parallel(thread_pool& pool, const aes_context& ctx, const u8* in, u8* out, size_t nblocks, const array<u8, 16>& iv,
+    size_t chunk_size)
+{
+    size_t cbc_chunk_blocks = chunk_size / 16;
+    size_t nchunks = (nblocks + cbc_chunk_blocks - 1) / cbc_chunk_blocks;
+    pool.run(nchunks, [&](size_t chunk)
+    {
+        size_t start = chunk * cbc_chunk_blocks;
+        size_t n = min(cbc_chunk_blocks, nblocks - start);
+        cbc_decrypt(ctx, in + 16 * start, out + 16 * start, n, (start == 0 ? &iv[0] : in + 16 * (start - 1)));
+    });
+}
+
+//PKCS#7 padding: 1 to 16 bytes, each holding the number of padding bytes.
+//Returns how many bytes of the padded final block to keep, or -1 if the padding
+//is invalid (wrong key or corrupted file).
+int pkcs7_unpadded_length(const u8* last_block)
+{
+    int pad = last_block[15];
+    if (pad < 1 || pad > 16)
+    {
+        return -1;
+    }
+    for (int i = 16 - pad; i < 16; i++)
+    {
+        if (last_block[i] != pad)
+        {
+            return -1;
+        }
+    }
+    return 16 - pad;
+}
+
+
+//GCM (Galois/Counter Mode, NIST SP 800-38D) is CTR mode plus an authentication tag.
+//The tag is GHASH: each ciphertext block is xored into an accumulator which is
+//then multiplied by H = E(0) in GF(2^128), with the field defined by
+//x^128 + x^7 + x^2 + x + 1 and the bits of each byte taken most significant first.
+
+//The field multiplication exactly as the specification gives it, one bit at a time.
+//Only used to set up the key (powers of H), never on data.
+void gf128_multiply(const u8* x, const u8* y, u8* result)
+{
+    u64 z_hi = 0, z_lo = 0;
+    u64 v_hi = load_be64(y), v_lo = load_be64(y + 8);
+    for (int i = 0; i < 128; i++)
+    {
+        if ((x[i / 8] >> (7 - i % 8)) & 1)
+        {
+            z_hi ^= v_hi;
+            z_lo ^= v_lo;
+        }
+        bool carry = v_lo & 1;
+        v_lo = (v_lo >> 1) | (v_hi << 63);
+        v_hi >>= 1;
+        if (carry)
+        {
+            v_hi ^= 0xe100000000000000ULL;
+        }
+    }
+    store_be64(result, z_hi);
+    store_be64(result + 8, z_lo);
+}
+
+//Carry-less multiplication gives the 256-bit product of two blocks read as
+//big-endian numbers x[3]:x[2]:x[1]:x[0]. Because GCM numbers its bits the other
+//way round, that product is the true one bit-reversed and shifted by one, so it
+//is shifted left and then reduced with the reversed polynomial (shifts by 63,
+//62, 57 then 1, 2, 7), following Intel's carry-less multiplication white paper.
+void gf128_reduce(u64 x[4], u64& hi, u64& lo)
+{
+    x[3] = (x[3] << 1) | (x[2] >> 63);
+    x[2] = (x[2] << 1) | (x[1] >> 63);
+    x[1] = (x[1] << 1) | (x[0] >> 63);
+    x[0] <<= 1;
+
+    u64 d = x[1] ^ (x[0] << 63) ^ (x[0] << 62) ^ (x[0] << 57);
+    u64 h1 = d ^ (d >> 1) ^ (d >> 2) ^ (d >> 7);
+    u64 h0 = x[0] ^ (x[0] >> 1) ^ (d << 63) ^ (x[0] >> 2) ^ (d << 62) ^ (x[0] >> 7) ^ (d << 57);
+    hi = x[3] ^ h1;
+    lo = x[2] ^ h0;
+}
+
+//Multiplies the accumulator by H four bits at a time, from the last byte to the
+//first. ghash_table holds every 4-bit multiple of H, and each shift right by four
+//bits folds the bits that fall off the end back in via ghash_remainder.
+const u64 ghash_remainder[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0 };
+
+void ghash_multiply_table(const gcm_key& key, u8* x)
+{
+    u64 z_hi = 0, z_lo = 0;
+    for (int i = 15; i >= 0; i--)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            int nibble = (half == 0 ? x[i] & 0xf : x[i] >> 4);
+            if (i != 15 || half != 0)
+            {
+                int rem = z_lo & 0xf;
+                z_lo = (z_hi << 60) | (z_lo >> 4);
+                z_hi = (z_hi >> 4) ^ (ghash_remainder[rem] << 48);
+            }
+            z_hi ^= key.table_hi[nibble];
+            z_lo ^= key.table_lo[nibble];
+        }
+    }
+    store_be64(x, z_hi);
+    store_be64(x + 8, z_lo);
+}
+
+void ghash_blocks_table(const gcm_key& key, u8* x, const u8* data, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, data += 16)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            x[i] ^= data[i];
+        }
+        ghash_multiply_table(key, x);
+    }
+}
+
+
+//x = (x ^ block) * H for each block
+void ghash_blocks(const gcm_key& key, u8* x, const u8* data, size_t nblocks)
+{
+    key.ghash(key, x, data, nblocks);
+}
+
+void gcm_counter_block(const gcm_state& st, u32 counter, u8* block)
+{
+    memcpy(block, st.j0, 12);
+    block[12] = counter >> 24;
+    block[13] = counter >> 16;
+    block[14] = counter >> 8;
+    block[15] = counter;
+}
+
+//Hashes data, zero-padding the last partial block
+void ghash_padded(const gcm_key& key, u8* x, const u8* data, size_t len)
+{
+    if (len >= 16)
+    {
+        ghash_blocks(key, x, data, len / 16);
+    }
+    if (len % 16 != 0)
+    {
+        u8 last[16] = {};
+        memcpy(last, data + len - len % 16, len % 16);
+        ghash_blocks(key, x, last, 1);
+    }
+}
+
+//A 12-byte IV is used directly as the counter prefix; any other length is hashed
+void gcm_start(gcm_state& st, const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len)
+{
+    memset(&st, 0, sizeof(st));
+    st.key = &key;
+    if (iv_len == 12)
+    {
+        memcpy(st.j0, iv, 12);
+        st.j0[15] = 1;
+    }
+    else
+    {
+        ghash_padded(key, st.j0, iv, iv_len);
+        u8 lengths[16] = {};
+        store_be64(lengths + 8, (u64)iv_len * 8);
+        ghash_blocks(key, st.j0, lengths, 1);
+    }
+    st.counter = byte_swap32(load_word(st.j0 + 12)) + 1;
+    ghash_padded(key, st.x, aad, aad_len);
+    st.aad_len = aad_len;
+}
+
+//Portable path: keystream for 8 blocks through the context's encrypt_blocks, then GHASH them
+void gcm_blocks_generic(gcm_state& st, const u8* in, u8* out, size_t nblocks, bool encrypt)
+{
+    u8 keystream[16 * ghash_aggregate];
+    size_t used = 16 * min((size_t)ghash_aggregate, nblocks);
+    while (nblocks > 0)
+    {
+        size_t n = min((size_t)ghash_aggregate, nblocks);
+        for (size_t b = 0; b < n; b++)
+        {
+            gcm_counter_block(st, st.counter++, &keystream[16 * b]);
+        }
+        st.key->aes->encrypt_blocks(keystream, keystream, n);
+        if (!encrypt)
+        {
+            ghash_blocks(*st.key, st.x, in, n);
+        }
+        xor_bytes(in, keystream, out, 16 * n);
+        if (encrypt)
+        {
+            ghash_blocks(*st.key, st.x, out, n);
+        }
+        in += 16 * n;
+        out += 16 * n;
+        nblocks -= n;
+    }
+    secure_zero(keystream, used);
+}
+
+
+//Sets up GHASH for one AES key, and picks the GHASH and bulk functions: carry-less
+//multiply when the CPU has it, the 4-bit tables otherwise. The stitched loops need
+//AES-NI as well, so only contexts on the AES-NI family backends use them.
+gcm_key make_gcm_key(const aes_context& aes)
+{
+    aes_stage_timer timer(stage_key_setup);
+    gcm_key key;
+    key.aes = &aes;
+    array<u8, 16> h = {};
+    h = aes.encrypt_block(h);
+    memcpy(key.h, &h, 16);
+
+    //Table entry n is H times the 4-bit value n, with bit 3 of n the first bit
+    u64 v_hi = load_be64(key.h), v_lo = load_be64(key.h + 8);
+    key.table_hi[0] = key.table_lo[0] = 0;
+    key.table_hi[8] = v_hi;
+    key.table_lo[8] = v_lo;
+    for (int i = 4; i > 0; i >>= 1)
+    {
+        u64 carry = v_lo & 1;
+        v_lo = (v_hi << 63) | (v_lo >> 1);
+        v_hi = (v_hi >> 1) ^ (carry * 0xe100000000000000ULL);
+        key.table_hi[i] = v_hi;
+        key.table_lo[i] = v_lo;
+    }
+    for (int i = 2; i <= 8; i *= 2)
+    {
+        for (int j = 1; j < i; j++)
+        {
+            key.table_hi[i + j] = key.table_hi[i] ^ key.table_hi[j];
+            key.table_lo[i + j] = key.table_lo[i] ^ key.table_lo[j];
+        }
+    }
+
+    u8 power[16];
+    memcpy(power, key.h, 16);
+    for (int i = 0; i < ghash_powers; i++)
+    {
+        if (i > 0)
+        {
+            gf128_multiply(power, key.h, power);
+        }
+        key.h_powers[i][0] = load_be64(power);
+        key.h_powers[i][1] = load_be64(power + 8);
+    }
+
+    key.ghash = ghash_blocks_table;
+    key.blocks = gcm_blocks_generic;
+#ifdef AES_X86
+    if (cpu_has_pclmul())
+    {
+        key.ghash = ghash_blocks_pclmul;
+        if (uses_aesni(aes.backend()))
+        {
+            key.blocks = select_gcm_blocks_aesni(aes.backend(), aes.round_keys().rounds);
+        }
+    }
+#endif
+#ifdef AES_ARM64
+    if (cpu_has_armv8_pmull())
+    {
+        key.ghash = ghash_blocks_pmull;
+    }
+#endif
+    return key;
+}
+
+
+//Encrypts (or decrypts) len bytes. in and out may be the same buffer.
+void gcm_update(gcm_state& st, const u8* in, u8* out, size_t len, bool encrypt)
+{
+    size_t whole = len / 16;
+    st.key->blocks(st, in, out, whole, encrypt);
+    size_t rest = len % 16;
+    if (rest != 0)
+    {
+        u8 block[16] = {};
+        u8 keystream[16];
+        memcpy(block, in + 16 * whole, rest);
+        gcm_counter_block(st, st.counter++, keystream);
+        st.key->aes->encrypt_blocks(keystream, keystream, 1);
+        if (!encrypt)
+        {
+            ghash_blocks(*st.key, st.x, block, 1);
+        }
+        for (size_t i = 0; i < rest; i++)
+        {
+            block[i] ^= keystream[i];
+        }
+        if (encrypt)
+        {
+            memset(block + rest, 0, 16 - rest);
+            ghash_blocks(*st.key, st.x, block, 1);
+        }
+        memcpy(out + 16 * whole, block, rest);
+        secure_zero(block, sizeof(block));
+        secure_zero(keystream, sizeof(keystream));
+    }
+    st.data_len += len;
+}
+
+//The tag is E(J0) (the mask) xored with GHASH over the bit lengths of the AAD and data
+void gcm_tag(gcm_state& st, const u8* mask, u8* tag)
+{
+    u8 lengths[16];
+    store_be64(lengths, st.aad_len * 8);
+    store_be64(lengths + 8, st.data_len * 8);
+    ghash_blocks(*st.key, st.x, lengths, 1);
+    for (int i = 0; i < 16; i++)
+    {
+        tag[i] = st.x[i] ^ mask[i];
+    }
+}
+
+void gcm_finish(gcm_state& st, u8* tag)
+{
+    u8 mask[16];
+    st.key->aes->encrypt_blocks(st.j0, mask, 1);
+    gcm_tag(st, mask, tag);
+    secure_zero(mask, sizeof(mask));
+}
+
+//Compares tags without stopping at the first difference, so the time taken
+//doesn't reveal how much of a forged tag was right
+bool tags_equal(const u8* a, const u8* b)
+{
+    u8 diff = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+//One-shot versions. gcm_decrypt returns false (and the output must be discarded)
+//if the tag doesn't match.
+void gcm_encrypt(const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len, const u8* in, u8* out, size_t len, u8* tag)
+{
+    gcm_state st;
+    gcm_start(st, key, iv, iv_len, aad, aad_len);
+    gcm_update(st, in, out, len, true);
+    gcm_finish(st, tag);
+}
+
+bool gcm_decrypt(const gcm_key& key, const u8* iv, size_t iv_len, const u8* aad, size_t aad_len, const u8* in, u8* out, size_t len, const u8* tag)
+{
+    gcm_state st;
+    u8 expected[16];
+    gcm_start(st, key, iv, iv_len, aad, aad_len);
+    gcm_update(st, in, out, len, false);
+    gcm_finish(st, expected);
+    return tags_equal(expected, tag);
+}
+
+
+//Each batched message takes 1 + ceil(len / 16) blocks of the buffer: J0 for the
+//tag mask, then its counter blocks. The keystream for the whole buffer comes from
+//one encrypt_blocks call; GHASH is then done message by message.
+const size_t gcm_batch_blocks = 64;
+bool gcm_batch(gcm_job* jobs, size_t njobs, bool encrypt)
+{
+    u8 keystream[16 * gcm_batch_blocks];
+    size_t pending[gcm_batch_blocks];
+    size_t nblocks = 0, npending = 0, used = 0;
+    const aes_context* aes = nullptr;
+    bool all_ok = true;
+
+    auto flush = [&]
+    {
+        aes->encrypt_blocks(keystream, keystream, nblocks);
+        used = max(used, 16 * nblocks);
+        const u8* ks = keystream;
+        for (size_t p = 0; p < npending; p++)
+        {
+            gcm_job& job = jobs[pending[p]];
+            gcm_state st;
+            gcm_start(st, *job.key, job.iv, job.iv_len, job.aad, job.aad_len);
+            if (!encrypt)
+            {
+                ghash_padded(*job.key, st.x, job.in, job.len);
+            }
+            xor_bytes(job.in, ks + 16, job.out, job.len);
+            if (encrypt)
+            {
+                ghash_padded(*job.key, st.x, job.out, job.len);
+            }
+            st.data_len = job.len;
+            if (encrypt)
+            {
+                gcm_tag(st, ks, job.tag);
+            }
+            else
+            {
+                u8 expected[16];
+                gcm_tag(st, ks, expected);
+                job.ok = tags_equal(expected, job.tag);
+                all_ok = all_ok && job.ok;
+            }
+            ks += 16 * (1 + (job.len + 15) / 16);
+        }
+        nblocks = npending = 0;
+    };
+
+    vector<size_t> order = group_by_context(jobs, njobs, [](const gcm_job& job) { return job.key->aes; });
+    for (size_t k = 0; k < njobs; k++)
+    {
+        size_t j = order.empty() ? k : order[k];
+        gcm_job& job = jobs[j];
+        size_t need = 1 + (job.len + 15) / 16;
+        if (job.iv_len != 12 || need > gcm_batch_blocks)
+        {
+            if (encrypt)
+            {
+                gcm_encrypt(*job.key, job.iv, job.iv_len, job.aad, job.aad_len, job.in, job.out, job.len, job.tag);
+            }
+            else
+            {
+                job.ok = gcm_decrypt(*job.key, job.iv, job.iv_len, job.aad, job.aad_len, job.in, job.out, job.len, job.tag);
+                all_ok = all_ok && job.ok;
+            }
+            continue;
+        }
+        if ((job.key->aes != aes || nblocks + need > gcm_batch_blocks) && nblocks > 0)
+        {
+            flush();
+        }
+        aes = job.key->aes;
+        u64 hi = load_be64(job.iv), lo = ((u64)byte_swap32(load_word(job.iv + 8)) << 32) | 1;
+        counter_blocks(hi, lo, &keystream[16 * nblocks], need);
+        pending[npending++] = j;
+        nblocks += need;
+    }
+    if (nblocks > 0)
+    {
+        flush();
+    }
+    secure_zero(keystream, used);
+    return all_ok;
+}
+
+void gcm_encrypt_batch(gcm_job* jobs, size_t njobs)
+{
+    gcm_batch(jobs, njobs, true);
+}
+
+bool gcm_decrypt_batch(gcm_job* jobs, size_t njobs)
+{
+    return gcm_batch(jobs, njobs, false);
+}
+
+
+//XTS. The tweak for block j of a sector is T * x^j in GF(2^128), where T is the
+//sector number (16 bytes, little-endian) encrypted under the tweak key. Here the
+//bytes of a block are one little-endian 128-bit number (lo, hi), so multiplying
+//by x is a shift left, with x^128 = x^7 + x^2 + x + 1 folded back in as 0x87.
+
+//Checks the key before either half is expanded
+size_t xts_half_key(const u8* key, size_t key_bytes)
+{
+    if (key_bytes != 32 && key_bytes != 64)
+    {
+        throw invalid_argument("XTS keys are 32 or 64 bytes");
+    }
+    u8 diff = 0;
+    for (size_t i = 0; i < key_bytes / 2; i++)
+    {
+        diff |= key[i] ^ key[key_bytes / 2 + i];
+    }
+    if (diff == 0)
+    {
+        throw invalid_argument("The two halves of an XTS key must differ");
+    }
+    return key_bytes / 2;
+}
+
+xts_key::xts_key(const u8* key, size_t key_bytes, const aes_backend* backend)
+    : data(key, xts_half_key(key, key_bytes), backend), tweak(key + key_bytes / 2, key_bytes / 2, backend)
+{
+}
+
+//The tweaks of 8 consecutive blocks, each advanced by x^8 for the next 8. That
+//makes 8 independent chains rather than one long one. With SSE2 each tweak is a
+//vector register, so a step is a few vector shifts and one 16-byte store;
+//elsewhere the same steps are done on 64-bit halves.
+struct xts_tweaks
+{
+#ifdef AES_SSE2
+    __m128i t[8];
+#else
+    u64 lo[8], hi[8];
+#endif
+
+    explicit xts_tweaks(const u8* first)
+    {
+        u64 l = load_le64(first), h = load_le64(first + 8);
+        for (int i = 0; i < 8; i++)
+        {
+#ifdef AES_SSE2
+            t[i] = _mm_set_epi64x((long long)h, (long long)l);
+#else
+            lo[i] = l;
+            hi[i] = h;
+#endif
+            //times x
+            u64 carry = h >> 63;
+            h = (h << 1) | (l >> 63);
+            l = (l << 1) ^ (0x87 & (0 - carry));
+        }
+    }
+
+    //Writes the next n tweaks (n a multiple of 8) to out. Times x^8 is a shift by a
+    //byte, with the byte shifted out of the top reduced by a carry-less multiply
+    //by 0x87 (x^7 + x^2 + x + 1) into the bottom.
+    void next(u8* out, size_t n)
+    {
+        for (size_t b = 0; b < n; b += 8, out += 128)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+#ifdef AES_SSE2
+                _mm_storeu_si128((__m128i*)(out + 16 * i), t[i]);
+                __m128i top = _mm_srli_epi64(t[i], 56);
+                __m128i c = _mm_srli_si128(top, 8);
+                c = _mm_xor_si128(_mm_xor_si128(c, _mm_slli_epi64(c, 1)), _mm_xor_si128(_mm_slli_epi64(c, 2), _mm_slli_epi64(c, 7)));
+                t[i] = _mm_xor_si128(_mm_or_si128(_mm_slli_epi64(t[i], 8), _mm_slli_si128(top, 8)), c);
+#else
+                store_le64(out + 16 * i, lo[i]);
+                store_le64(out + 16 * i + 8, hi[i]);
+                u64 c = hi[i] >> 56;
+                hi[i] = (hi[i] << 8) | (lo[i] >> 56);
+                lo[i] = (lo[i] << 8) ^ c ^ (c << 1) ^ (c << 2) ^ (c << 7);
+#endif
+            }
+        }
+    }
+};
+
+//One block on its own, for ciphertext stealing
+void xts_block(const aes_context& ctx, bool encrypt, const u8* tweak, const u8* in, u8* out)
+{
+    array<u8, 16> block;
+    xor_bytes(in, tweak, block.data(), 16);
+    block = (encrypt ? ctx.encrypt_block(block) : ctx.decrypt_block(block));
+    xor_bytes(block.data(), tweak, out, 16);
+}
+
+//Whole blocks go through the bulk kernels 64 at a time: xor in the tweaks,
+//encrypt or decrypt, xor them in again. With a partial last block, the last
+//whole one is left for ciphertext stealing, which takes the two tweaks after the
+//rest (the final batch makes them too, so it has room for up to 8 more).
+const size_t xts_batch_blocks = 64;
+void xts_crypt(const xts_key& key, u64 sector, const u8* in, u8* out, size_t len, bool encrypt)
+{
+    if (len < 16)
+    {
+        throw invalid_argument("XTS needs at least 16 bytes");
+    }
+    size_t tail = len % 16;
+    size_t whole = len / 16 - (tail != 0);
+    array<u8, 16> t = {};
+    store_le64(t.data(), sector);
+    t = key.tweak.encrypt_block(t);
+    xts_tweaks tweaks(t.data());
+    u8 tweak_bytes[16 * (xts_batch_blocks + 8)];
+    u8 buffer[16 * xts_batch_blocks];
+
+    for (size_t done = 0;;)
+    {
+        size_t n = min(xts_batch_blocks, whole - done);
+        bool last = (done + n == whole);
+        size_t ntweaks = n + (last && tail != 0 ? 2 : 0);
+        tweaks.next(tweak_bytes, (ntweaks + 7) / 8 * 8);
+        if (n > 0)
+        {
+            xor_bytes(in + 16 * done, tweak_bytes, buffer, 16 * n);
+            if (encrypt)
+            {
+                key.data.encrypt_blocks(buffer, buffer, n);
+            }
+            else
+            {
+                key.data.decrypt_blocks(buffer, buffer, n);
+            }
+            xor_bytes(buffer, tweak_bytes, out + 16 * done, 16 * n);
+        }
+        done += n;
+        if (!last)
+        {
+            continue;
+        }
+        if (tail != 0)
+        {   //the last whole block is done with the tweak after it when decrypting
+            const u8* first_tweak = &tweak_bytes[16 * (encrypt ? n : n + 1)];
+            const u8* second_tweak = &tweak_bytes[16 * (encrypt ? n + 1 : n)];
+            const u8* in_last = in + 16 * whole;
+            u8* out_last = out + 16 * whole;
+            u8 stolen[16], merged[16];
+            xts_block(key.data, encrypt, first_tweak, in_last, stolen);
+            memcpy(merged, in_last + 16, tail); //read before out_last + 16 is written, which may be the same bytes
+            memcpy(merged + tail, stolen + tail, 16 - tail);
+            memcpy(out_last + 16, stolen, tail);
+            xts_block(key.data, encrypt, second_tweak, merged, out_last);
+        }
+        break;
+    }
+}
+
+void xts_encrypt(const xts_key& key, u64 sector, const u8* in, u8* out, size_t len)
+{
+    xts_crypt(key, sector, in, out, len, true);
+}
+
+void xts_decrypt(const xts_key& key, u64 sector, const u8* in, u8* out, size_t len)
+{
+    xts_crypt(key, sector, in, out, len, false);
+}
+
+void xts_crypt_sectors(thread_pool& pool, const xts_key& key, u64 first_sector, size_t sector_size, const u8* in, u8* out,
+    size_t nsectors, bool encrypt)
+{
+    if (sector_size < 16)
+    {   //checked here, as an exception can't leave a pool task
+        throw invalid_argument("XTS needs at least 16 bytes");
+    }
+    size_t per_task = max<size_t>(1, ctr_chunk_size / sector_size);
+    size_t ntasks = (nsectors + per_task - 1) / per_task;
+    pool.run(ntasks, [&](size_t task)
+    {
+        size_t end = min(nsectors, (task + 1) * per_task);
+        for (size_t s = task * per_task; s < end; s++)
+        {
+            xts_crypt(key, first_sector + s, in + s * sector_size, out + s * sector_size, sector_size, encrypt);
+        }
+    });
+}
+
+void xts_encrypt_sectors(thread_pool& pool, const xts_key& key, u64 first_sector, size_t sector_size, const u8* in, u8* out,
+    size_t nsectors)
+{
+    xts_crypt_sectors(pool, key, first_sector, sector_size, in, out, nsectors, true);
+}
+
+void xts_decrypt_sectors(thread_pool& pool, const xts_key& key, u64 first_sector, size_t sector_size, const u8* in, u8* out,
+    size_t nsectors)
+{
+    xts_crypt_sectors(pool, key, first_sector, sector_size, in, out, nsectors, false);
+}
@@ -0,0 +1,319 @@
+/* The thread pool behind the parallel modes: per-thread shares of each batch with
+work stealing, NUMA-aware placement of the workers, and first-touch page placement.
+*/
+
+#include "aes.h"
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <string>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#define AES_NUMA_LINUX
+#endif
+
+using namespace std;
+
+#ifdef AES_NUMA_LINUX
+//A sysfs CPU or node list such as "0-3,8-11"
+vector<int> parse_cpu_list(const string& text)
+{
+    vector<int> ids;
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t end = text.find(',', pos);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+        string part = text.substr(pos, end - pos);
+        size_t dash = part.find('-');
+        try
+        {
+            int first = stoi(part), last = (dash == string::npos ? first : stoi(part.substr(dash + 1)));
+            for (int id = first; id <= last; id++)
+            {
+                ids.push_back(id);
+            }
+        }
+        catch (const exception&)
+        {   //a trailing newline, or something unexpected: ignore that part
+        }
+        pos = end + 1;
+    }
+    return ids;
+}
+
+string read_sysfs(const string& path)
+{
+    ifstream file(path);
+    string text;
+    getline(file, text);
+    return text;
+}
+#endif
+
+//The CPUs this process may run on, grouped by NUMA node. Empty where that can't be
+//found out, in which case nothing is pinned and every thread is taken to share one node.
+vector<vector<int>> numa_nodes()
+{
+    vector<vector<int>> nodes;
+#ifdef AES_NUMA_LINUX
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return nodes;
+    }
+    auto usable = [&](int cpu) { return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed); };
+    for (int node : parse_cpu_list(read_sysfs("/sys/devices/system/node/online")))
+    {
+        vector<int> cpus = parse_cpu_list(read_sysfs("/sys/devices/system/node/node" + to_string(node) + "/cpulist"));
+        cpus.erase(remove_if(cpus.begin(), cpus.end(), [&](int cpu) { return !usable(cpu); }), cpus.end());
+        if (!cpus.empty())
+        {
+            nodes.push_back(cpus);
+        }
+    }
+    if (nodes.empty())
+    {   //no sysfs (a container, say): one node with every allowed CPU
+        vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (usable(cpu))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty())
+        {
+            nodes.push_back(cpus);
+        }
+    }
+#endif
+    return nodes;
+}
+
+void pin_current_thread(int cpu)
+{
+#ifdef AES_NUMA_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set); //only a hint; fine if it fails
+#else
+    (void)cpu;
+#endif
+}
+
+//Threads are given CPUs a node at a time in turn (the first CPU of each node, then
+//the second, and so on), so any number of them is spread evenly. Within a node
+//the lowest-numbered CPUs come first, which on Linux are separate cores before
+//their hyperthread siblings.
+thread_pool::thread_pool(unsigned int nthreads, bool pin_threads)
+    : nthreads(max(nthreads, 1u)), shares(new share[max(nthreads, 1u)]), victims(max(nthreads, 1u))
+{
+    vector<vector<int>> nodes;
+    if (this->nthreads > 1)
+    {   //a pool of one is only the calling thread, which stays where it is
+        nodes = numa_nodes();
+    }
+    vector<pair<int, int>> placement; //(cpu, node)
+    for (size_t i = 0; !nodes.empty(); i++)
+    {
+        size_t before = placement.size();
+        for (size_t node = 0; node < nodes.size(); node++)
+        {
+            if (i < nodes[node].size())
+            {
+                placement.push_back({ nodes[node][i], (int)node });
+            }
+        }
+        if (placement.size() == before)
+        {
+            break;
+        }
+    }
+    bool pin = pin_threads && !placement.empty() && this->nthreads <= placement.size();
+    for (size_t t = 0; t < this->nthreads; t++)
+    {
+        if (!placement.empty())
+        {
+            shares[t].node = placement[t % placement.size()].second;
+        }
+        if (pin && t != 0)
+        {
+            shares[t].cpu = placement[t].first;
+        }
+    }
+    //Thieves start just after themselves, so they don't all go for the same victim
+    for (size_t t = 0; t < this->nthreads; t++)
+    {
+        for (size_t step = 1; step < this->nthreads; step++)
+        {
+            victims[t].push_back((t + step) % this->nthreads);
+        }
+        stable_partition(victims[t].begin(), victims[t].end(), [&](size_t v) { return shares[v].node == shares[t].node; });
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    start_signal.notify_all();
+    for (thread& t : workers)
+    {
+        t.join();
+    }
+}
+
+void thread_pool::run(size_t ntasks, const function<void(size_t)>& task)
+{
+    if (ntasks <= 1 || nthreads == 1)
+    {
+        for (size_t i = 0; i < ntasks; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+    if (ntasks > UINT_MAX)
+    {   //more than a share can describe; a batch at a time
+        for (size_t base = 0; base < ntasks; base += UINT_MAX)
+        {
+            run(min<size_t>(UINT_MAX, ntasks - base), [&](size_t i) { task(base + i); });
+        }
+        return;
+    }
+    if (workers.empty())
+    {
+        for (unsigned int i = 1; i < nthreads; i++)
+        {
+            workers.emplace_back([this, i, seen = generation] { worker_loop(i, seen); });
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        current_task = &task;
+        for (size_t t = 0; t < nthreads; t++)
+        {
+            u64 begin = t * ntasks / nthreads, end = (t + 1) * ntasks / nthreads;
+            shares[t].range.store((begin << 32) | end, memory_order_relaxed);
+        }
+        workers_done = 0;
+        generation++;
+    }
+    start_signal.notify_all();
+    run_tasks(0, task);
+
+    //Every worker checks in for every batch, so none can still be holding
+    //a pointer to this task after we return
+    unique_lock<mutex> guard(lock);
+    done_signal.wait(guard, [this] { return workers_done == workers.size(); });
+}
+
+//The next index from the front of this thread's own share
+bool thread_pool::take_own(size_t self, size_t& index)
+{
+    atomic<u64>& range = shares[self].range;
+    u64 r = range.load(memory_order_relaxed);
+    while ((r >> 32) < (u32)r)
+    {
+        if (range.compare_exchange_weak(r, r + ((u64)1 << 32), memory_order_relaxed))
+        {
+            index = (size_t)(r >> 32);
+            return true;
+        }
+    }
+    return false;
+}
+
+//Moves the back half of someone else's share (all of it, if only one is left)
+//into this thread's, which is empty. False once there's nothing left anywhere.
+bool thread_pool::steal(size_t self)
+{
+    for (size_t victim : victims[self])
+    {
+        atomic<u64>& range = shares[victim].range;
+        u64 r = range.load(memory_order_relaxed);
+        while (true)
+        {
+            u64 next = r >> 32, end = (u32)r;
+            if (next >= end)
+            {
+                break;
+            }
+            u64 middle = next + (end - next) / 2;
+            if (range.compare_exchange_weak(r, (next << 32) | middle, memory_order_relaxed))
+            {
+                shares[self].range.store((middle << 32) | end, memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//Tasks that are stolen are always run by the thief, so when no share has
+//anything left every task has been started
+void thread_pool::run_tasks(size_t self, const function<void(size_t)>& task)
+{
+    size_t index;
+    do
+    {
+        while (take_own(self, index))
+        {
+            task(index);
+        }
+    } while (steal(self));
+}
+
+void thread_pool::worker_loop(size_t self, u64 seen)
+{
+    if (shares[self].cpu >= 0)
+    {
+        pin_current_thread(shares[self].cpu);
+    }
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        start_signal.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping)
+        {
+            return;
+        }
+        seen = generation;
+        const function<void(size_t)>& task = *current_task;
+        guard.unlock();
+        run_tasks(self, task);
+        guard.lock();
+        if (++workers_done == workers.size())
+        {
+            done_signal.notify_one();
+        }
+    }
+}
+
+void first_touch(thread_pool& pool, u8* data, size_t len, size_t chunk_size)
+{
+    if (pool.size() == 1)
+    {   //the allocating thread is the one that will use it
+        return;
+    }
+    const size_t page = 4096; //the smallest page size; larger pages just get several writes
+    size_t nchunks = (len + chunk_size - 1) / chunk_size;
+    pool.run(nchunks, [&](size_t chunk)
+    {
+        size_t end = min(len, (chunk + 1) * chunk_size);
+        for (size_t i = chunk * chunk_size; i < end; i += page)
+        {
+            data[i] = 0;
+        }
+    });
+}
@@ -0,0 +1,843 @@
+/* Self-tests for every backend and mode: published known-answer vectors (among
+them the NIST CAVP ECB and CBC ones), Monte Carlo chains in the style of the NIST
+AES validation suite, and a randomised
+comparison of each backend with the reference implementation. Also the hashing
+behind passphrases: SHA-256, HMAC and PBKDF2.
+*/
+
+#include "aes.h"
+#include "aes_internal.h"
+#include <cstring>
+#include <ostream>
+#include <random>
+#include <string>
+
+using namespace std;
+
+//The vectors are written as hex; spaces are only there to make them readable
+vector<u8> from_hex(const char* text)
+{
+    vector<u8> bytes;
+    int nibbles = 0;
+    u8 byte = 0;
+    for (const char* p = text; *p; p++)
+    {
+        char c = *p;
+        if (c == ' ')
+        {
+            continue;
+        }
+        byte = (u8)(byte << 4 | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10));
+        if (++nibbles % 2 == 0)
+        {
+            bytes.push_back(byte);
+        }
+    }
+    return bytes;
+}
+
+//Collects the failures, one line each; a group that passes gets one line
+struct test_log
+{
+    ostream& out;
+    int failures = 0;
+    int group_failures = 0;
+
+    void check(bool ok, const string& what)
+    {
+        if (!ok)
+        {
+            out << "FAIL " << what << endl;
+            failures++;
+            group_failures++;
+        }
+    }
+
+    void end_group(const string& name, size_t count)
+    {
+        if (group_failures == 0)
+        {
+            out << "ok   " << name << " (" << count << ")" << endl;
+        }
+        group_failures = 0;
+    }
+};
+
+//FIPS-197 appendix C (and the appendix B example): one block under each key size
+struct cipher_vector
+{
+    const char* key;
+    const char* plain;
+    const char* cipher;
+};
+
+const cipher_vector fips197_vectors[] = {
+    { "2b7e151628aed2a6abf7158809cf4f3c", "3243f6a8885a308d313198a2e0370734", "3925841d02dc09fbdc118597196a0b32" },
+    { "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a" },
+    { "000102030405060708090a0b0c0d0e0f1011121314151617", "00112233445566778899aabbccddeeff", "dda97ca4864cdfe06eaf70a0ec0d7191" },
+    { "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "00112233445566778899aabbccddeeff", "8ea2b7ca516745bfeafc49904b496089" },
+};
+
+//NIST SP 800-38A appendix F: four blocks of the same plaintext in ECB, CBC and CTR
+const char sp800_38a_plain[] = "6bc1bee22e409f96e93d7e117393172a ae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52ef f69f2445df4f9b17ad2b417be66c3710";
+const char sp800_38a_cbc_iv[] = "000102030405060708090a0b0c0d0e0f";
+const char sp800_38a_ctr_iv[] = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+struct mode_vector
+{
+    const char* key;
+    const char* ecb;
+    const char* cbc;
+    const char* ctr;
+};
+
+const mode_vector sp800_38a_vectors[] = {
+    { "2b7e151628aed2a6abf7158809cf4f3c",
+        "3ad77bb40d7a3660a89ecaf32466ef97 f5d3d58503b9699de785895a96fdbaaf 43b1cd7f598ece23881b00e3ed030688 7b0c785e27e8ad3f8223207104725dd4",
+        "7649abac8119b246cee98e9b12e9197d 5086cb9b507219ee95db113a917678b2 73bed6b8e3c1743b7116e69e22229516 3ff1caa1681fac09120eca307586e1a7",
+        "874d6191b620e3261bef6864990db6ce 9806f66b7970fdff8617187bb9fffdff 5ae4df3edbd5d35e5b4f09020db03eab 1e031dda2fbe03d1792170a0f3009cee" },
+    { "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+        "bd334f1d6e45f25ff712a214571fa5cc 974104846d0ad3ad7734ecb3ecee4eef ef7afd2270e2e60adce0ba2face6444e 9a4b41ba738d6c72fb16691603c18e0e",
+        "4f021db243bc633d7178183a9fa071e8 b4d9ada9ad7dedf4e5e738763f69145a 571b242012fb7ae07fa9baac3df102e0 08b0e27988598881d920a9e64f5615cd",
+        "1abc932417521ca24f2b0459fe7e6e0b 090339ec0aa6faefd5ccc2c6f4ce8e94 1e36b26bd1ebc670d1bd1d665620abf7 4f78a7f6d29809585a97daec58c6b050" },
+    { "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+        "f3eed1bdb5d2a03c064b5a7e3db181f8 591ccb10d410ed26dc5ba74a31362870 b6ed21b99ca6f4f9f153e7b1beafed1d 23304b7a39f9f3ff067d8d8f9e24ecc7",
+        "f58c4c04d6e5f1ba779eabfb5f7bfbd6 9cfc4e967edb808d679f777bc6702c7d 39f23369a9d9bacfa530e26304231461 b2eb05e2c39be9fcda6c19078c6a9d1b",
+        "601ec313775789a5b7a7f504bbf3d228 f443e3ca4d62b59aca84e990cacaf5c5 2b0930daa23de94ce87017ba2d84988d dfc9c58db67aada613c2dd08457941a6" },
+};
+
+//The test cases from the GCM specification (McGrew and Viega), covering empty
+//messages, partial blocks, AAD, and IVs other than 96 bits
+struct gcm_vector
+{
+    const char* key;
+    const char* iv;
+    const char* aad;
+    const char* plain;
+    const char* cipher;
+    const char* tag;
+};
+
+#define GCM_KEY "feffe9928665731c6d6a8f9467308308"
+#define GCM_IV "cafebabefacedbaddecaf888"
+#define GCM_AAD "feedfacedeadbeeffeedfacedeadbeefabaddad2"
+#define GCM_PLAIN "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39"
+const gcm_vector gcm_vectors[] = {
+    //AES-128: test cases 1-6
+    { "00000000000000000000000000000000", "000000000000000000000000", "", "", "", "58e2fccefa7e3061367f1d57a4e7455a" },
+    { "00000000000000000000000000000000", "000000000000000000000000", "", "00000000000000000000000000000000",
+        "0388dace60b6a392f328c2b971b2fe78", "ab6e47d42cec13bdf53a67b21257bddf" },
+    { GCM_KEY, GCM_IV, "", GCM_PLAIN "1aafd255",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+        "4d5c2af327cd64a62cf35abd2ba6fab4" },
+    { GCM_KEY, GCM_IV, GCM_AAD, GCM_PLAIN,
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+        "5bc94fbc3221a5db94fae95ae7121a47" },
+    { GCM_KEY, "cafebabefacedbad", GCM_AAD, GCM_PLAIN,
+        "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c742373806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+        "3612d2e79e3b0785561be14aaca2fccb" },
+    { GCM_KEY, "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+        GCM_AAD, GCM_PLAIN,
+        "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca701e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+        "619cc5aefffe0bfa462af43c1699d050" },
+    //AES-192: test cases 7-9
+    { "000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "", "", "cd33b28ac773f74ba00ed1f312572435" },
+    { "000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "00000000000000000000000000000000",
+        "98e7247c07f0fe411c267e4384b0f600", "2ff58d80033927ab8ef4d4587514f0fb" },
+    { GCM_KEY "feffe9928665731c", GCM_IV, "", GCM_PLAIN "1aafd255",
+        "3980ca0b3c00e841eb06fac4872a2757859e1ceaa6efd984628593b40ca1e19c7d773d00c144c525ac619d18c84a3f4718e2448b2fe324d9ccda2710acade256",
+        "9924a7c8587336bfb118024db8674a14" },
+    //AES-256: test cases 13-16
+    { "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "", "",
+        "530f8afbc74536b9a963b4f1c4cb738b" },
+    { "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "",
+        "00000000000000000000000000000000", "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+    { GCM_KEY GCM_KEY, GCM_IV, "", GCM_PLAIN "1aafd255",
+        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+        "b094dac5d93471bdec1a502270e3cc6c" },
+    { GCM_KEY GCM_KEY, GCM_IV, GCM_AAD, GCM_PLAIN,
+        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+        "76fc6ece0f4e1768cddf8853bb2d551b" },
+};
+#undef GCM_KEY
+#undef GCM_IV
+#undef GCM_AAD
+#undef GCM_PLAIN
+
+//XTS: vector 2 of IEEE 1619 annex B, then a 64-byte AES-256 case and ciphertext
+//stealing for 17, 20 and 31 bytes, made with OpenSSL
+struct xts_vector
+{
+    const char* key;
+    u64 sector;
+    const char* plain;
+    const char* cipher;
+};
+
+#define XTS_STEAL_KEY "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0 bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0"
+#define XTS_SEQUENCE "000102030405060708090a0b0c0d0e0f 101112131415161718191a1b1c1d1e1f"
+const xts_vector xts_vectors[] = {
+    { "11111111111111111111111111111111 22222222222222222222222222222222", 0x3333333333,
+        "4444444444444444444444444444444444444444444444444444444444444444",
+        "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0" },
+    { "2718281828459045235360287471352662497757247093699959574966967627"
+        "3141592653589793238462643383279502884197169399375105820974944592", 0xff,
+        XTS_SEQUENCE "202122232425262728292a2b2c2d2e2f 303132333435363738393a3b3c3d3e3f",
+        "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b"
+        "5d31e276f8fe4a8d66b317f9ac683f44680a86ac35adfc3345befecb4bb188fd" },
+    { XTS_STEAL_KEY, 0x9a78563412, "000102030405060708090a0b0c0d0e0f 10", "641610679dcbf92e505c41333fb06c2a95" },
+    { XTS_STEAL_KEY, 0x9a78563412, "000102030405060708090a0b0c0d0e0f 10111213", "a8ba0048d75084603eb8423a09b7bf7595c871f6" },
+    { XTS_STEAL_KEY, 0x9a78563412, "000102030405060708090a0b0c0d0e0f 101112131415161718191a1b1c1d1e",
+        "c03f4c6088fcf14c308aa39f7938980995c871f6522469cc737109594ab0fe" },
+};
+#undef XTS_STEAL_KEY
+#undef XTS_SEQUENCE
+
+//ECB Monte Carlo chains as in the AES validation suite (AESAVS 6.4.1): 100 outer
+//steps of 1000 chained encryptions (or decryptions), the key xored with the last
+//outputs after each. expected is the output of the 100th step; every one has
+//also been checked against OpenSSL.
+struct monte_carlo_vector
+{
+    bool encrypt;
+    const char* key;
+    const char* text;
+    const char* expected;
+};
+
+const monte_carlo_vector monte_carlo_vectors[] = {
+    { true, "139a35422f1d61de3c91787fe0507afd", "b9145a768b7dc489a096b546f43b231f", "fb2649694783b551eacd9d5db6126d47" },
+    { false, "0c60e7bf20ada9baa9e1ddf0d1540726", "b08a29b11a500ea3aca42c36675b9785", "d1d2bfdc58ffcad2341b095bce55221e" },
+    { true, "b9a63e09e1dfc42e93a90d9bad739e5967aef672eedd5da9", "85a1f7a58167b389cddc8a9ff175ee26", "5d1196da8f184975e240949a25104554" },
+    { false, "4b97585701c03fbebdfa8555024f589f1482c58a00fdd9fd", "d0bd0e02ded155e4516be83f42d347a4", "b63ef1b79507a62eba3dafcec54a6328" },
+    { true, "f9e8389f5b80712e3886cc1fa2d28a3b8c9cd88a2d4a54c6aa86ce0fef944be0", "b379777f9050e2a818f2940cbbd9aba4", "c5d2cb3d5b7ff0e23e308967ee074825" },
+    { false, "2b09ba39b834062b9e93f48373b8dd018dedf1e5ba1b8af831ebbacbc92a2643", "89649bd0115f30bd878567610223a59d", "e3d3868f578caf34e36445bf14cefc68" },
+};
+
+//CBC Monte Carlo chains (AESAVS 6.4.2): the same, with the chaining block
+//carried through each step and on to the next as its IV. The AES-128 encryption
+//chain starts from COUNT = 0 of the CAVP CBCMCT128 file, and its first step gives
+//that file's ciphertext (first); the others reuse the ECB chains' keys and texts.
+//expected is again the 100th step's output, computed with OpenSSL.
+struct cbc_monte_carlo_vector
+{
+    bool encrypt;
+    const char* key;
+    const char* iv;
+    const char* text;
+    const char* first; //nullptr if not published
+    const char* expected;
+};
+
+const cbc_monte_carlo_vector cbc_monte_carlo_vectors[] = {
+    { true, "9dc2c84a37850c11699818605f47958c", "256953b2feab2a04ae0180d8335bbed6", "2e586692e647f5028ec6fa47a55a2aab",
+        "1b1ebd1fc45ec43037fd4844241a437f", "01a04923c8d9f806748d7e60124d7c0d" },
+    { false, "0c60e7bf20ada9baa9e1ddf0d1540726", "256953b2feab2a04ae0180d8335bbed6", "b08a29b11a500ea3aca42c36675b9785",
+        nullptr, "cfb9c1ffb55a01e1611d3051aac1618c" },
+    { true, "b9a63e09e1dfc42e93a90d9bad739e5967aef672eedd5da9", "426fbc087b50b395c0fc81ef9fd6d1aa", "85a1f7a58167b389cddc8a9ff175ee26",
+        nullptr, "ed9e0d82785b5a24f7986d5dbfe1696c" },
+    { false, "4b97585701c03fbebdfa8555024f589f1482c58a00fdd9fd", "426fbc087b50b395c0fc81ef9fd6d1aa", "d0bd0e02ded155e4516be83f42d347a4",
+        nullptr, "a1bc00c72489780d414b955daff9a35a" },
+    { true, "f9e8389f5b80712e3886cc1fa2d28a3b8c9cd88a2d4a54c6aa86ce0fef944be0", "ff8127621be616803e3f002cb1b6c96a",
+        "b379777f9050e2a818f2940cbbd9aba4", nullptr, "7b233f0cce52c1a918c4434e07cd9d62" },
+    { false, "2b09ba39b834062b9e93f48373b8dd018dedf1e5ba1b8af831ebbacbc92a2643", "ff8127621be616803e3f002cb1b6c96a",
+        "89649bd0115f30bd878567610223a59d", nullptr, "5a7072c821d2e52feea6189d3205e2ad" },
+};
+
+//The NIST CAVP known-answer tests (AESAVS 6.2), which the ECB and CBC files share
+//(the CBC ones use a zero IV): GFSbox, plaintexts under the zero key; KeySbox,
+//keys with the zero plaintext. input is the plaintext or the key respectively.
+struct cavp_kat_vector
+{
+    int key_bits;
+    const char* input;
+    const char* cipher;
+};
+
+const cavp_kat_vector gfsbox_vectors[] = {
+    { 128, "f34481ec3cc627bacd5dc3fb08f273e6", "0336763e966d92595a567cc9ce537f5e" },
+    { 128, "9798c4640bad75c7c3227db910174e72", "a9a1631bf4996954ebc093957b234589" },
+    { 128, "96ab5c2ff612d9dfaae8c31f30c42168", "ff4f8391a6a40ca5b25d23bedd44a597" },
+    { 128, "6a118a874519e64e9963798a503f1d35", "dc43be40be0e53712f7e2bf5ca707209" },
+    { 128, "cb9fceec81286ca3e989bd979b0cb284", "92beedab1895a94faa69b632e5cc47ce" },
+    { 128, "b26aeb1874e47ca8358ff22378f09144", "459264f4798f6a78bacb89c15ed3d601" },
+    { 128, "58c8e00b2631686d54eab84b91f0aca1", "08a4e2efec8a8e3312ca7460b9040bbf" },
+    { 192, "1b077a6af4b7f98229de786d7516b639", "275cfc0413d8ccb70513c3859b1d0f72" },
+    { 192, "9c2d8842e5f48f57648205d39a239af1", "c9b8135ff1b5adc413dfd053b21bd96d" },
+    { 192, "bff52510095f518ecca60af4205444bb", "4a3650c3371ce2eb35e389a171427440" },
+    { 192, "51719783d3185a535bd75adc65071ce1", "4f354592ff7c8847d2d0870ca9481b7c" },
+    { 192, "26aa49dcfe7629a8901a69a9914e6dfd", "d5e08bf9a182e857cf40b3a36ee248cc" },
+    { 192, "941a4773058224e1ef66d10e0a6ee782", "067cd9d3749207791841562507fa9626" },
+    { 256, "014730f80ac625fe84f026c60bfd547d", "5c9d844ed46f9885085e5d6a4f94c7d7" },
+    { 256, "0b24af36193ce4665f2825d7b4749c98", "a9ff75bd7cf6613d3731c77c3b6d0c04" },
+    { 256, "761c1fe41a18acf20d241650611d90f1", "623a52fcea5d443e48d9181ab32c7421" },
+    { 256, "8a560769d605868ad80d819bdba03771", "38f2c7ae10612415d27ca190d27da8b4" },
+    { 256, "91fbef2d15a97816060bee1feaa49afe", "1bc704f1bce135ceb810341b216d7abe" },
+};
+
+const cavp_kat_vector keysbox_vectors[] = {
+    { 128, "10a58869d74be5a374cf867cfb473859", "6d251e6944b051e04eaa6fb4dbf78465" },
+    { 128, "caea65cdbb75e9169ecd22ebe6e54675", "6e29201190152df4ee058139def610bb" },
+    { 128, "a2e2fa9baf7d20822ca9f0542f764a41", "c3b44b95d9d2f25670eee9a0de099fa3" },
+    { 128, "b6364ac4e1de1e285eaf144a2415f7a0", "5d9b05578fc944b3cf1ccf0e746cd581" },
+    { 128, "64cf9c7abc50b888af65f49d521944b2", "f7efc89d5dba578104016ce5ad659c05" },
+    { 128, "47d6742eefcc0465dc96355e851b64d9", "0306194f666d183624aa230a8b264ae7" },
+    { 128, "3eb39790678c56bee34bbcdeccf6cdb5", "858075d536d79ccee571f7d7204b1f67" },
+    { 128, "64110a924f0743d500ccadae72c13427", "35870c6a57e9e92314bcb8087cde72ce" },
+    { 128, "18d8126516f8a12ab1a36d9f04d68e51", "6c68e9be5ec41e22c825b7c7affb4363" },
+    { 128, "f530357968578480b398a3c251cd1093", "f5df39990fc688f1b07224cc03e86cea" },
+    { 128, "da84367f325d42d601b4326964802e8e", "bba071bcb470f8f6586e5d3add18bc66" },
+    { 128, "e37b1c6aa2846f6fdb413f238b089f23", "43c9f7e62f5d288bb27aa40ef8fe1ea8" },
+    { 128, "6c002b682483e0cabcc731c253be5674", "3580d19cff44f1014a7c966a69059de5" },
+    { 128, "143ae8ed6555aba96110ab58893a8ae1", "806da864dd29d48deafbe764f8202aef" },
+    { 128, "b69418a85332240dc82492353956ae0c", "a303d940ded8f0baff6f75414cac5243" },
+    { 128, "71b5c08a1993e1362e4d0ce9b22b78d5", "c2dabd117f8a3ecabfbb11d12194d9d0" },
+    { 128, "e234cdca2606b81f29408d5f6da21206", "fff60a4740086b3b9c56195b98d91a7b" },
+    { 128, "13237c49074a3da078dc1d828bb78c6f", "8146a08e2357f0caa30ca8c94d1a0544" },
+    { 128, "3071a2a48fe6cbd04f1a129098e308f8", "4b98e06d356deb07ebb824e5713f7be3" },
+    { 128, "90f42ec0f68385f2ffc5dfc03a654dce", "7a20a53d460fc9ce0423a7a0764c6cf2" },
+    { 128, "febd9a24d8b65c1c787d50a4ed3619a9", "f4a70d8af877f9b02b4c40df57d45b17" },
+    { 192, "e9f065d7c13573587f7875357dfbb16c53489f6a4bd0f7cd", "0956259c9cd5cfd0181cca53380cde06" },
+    { 192, "15d20f6ebc7e649fd95b76b107e6daba967c8a9484797f29", "8e4e18424e591a3d5b6f0876f16f8594" },
+    { 192, "a8a282ee31c03fae4f8e9b8930d5473c2ed695a347e88b7c", "93f3270cfc877ef17e106ce938979cb0" },
+    { 192, "cd62376d5ebb414917f0c78f05266433dc9192a1ec943300", "7f6c25ff41858561bb62f36492e93c29" },
+    { 192, "502a6ab36984af268bf423c7f509205207fc1552af4a91e5", "8e06556dcbb00b809a025047cff2a940" },
+    { 192, "25a39dbfd8034f71a81f9ceb55026e4037f8f6aa30ab44ce", "3608c344868e94555d23a120f8a5502d" },
+    { 192, "e08c15411774ec4a908b64eadc6ac4199c7cd453f3aaef53", "77da2021935b840b7f5dcc39132da9e5" },
+    { 192, "3b375a1ff7e8d44409696e6326ec9dec86138e2ae010b980", "3b7c24f825e3bf9873c9f14d39a0e6f4" },
+    { 192, "950bb9f22cc35be6fe79f52c320af93dec5bc9c0c2f9cd53", "64ebf95686b353508c90ecd8b6134316" },
+    { 192, "7001c487cc3e572cfc92f4d0e697d982e8856fdcc957da40", "ff558c5d27210b7929b73fc708eb4cf1" },
+    { 192, "f029ce61d4e5a405b41ead0a883cc6a737da2cf50a6c92ae", "a2c3b2a818075490a7b4c14380f02702" },
+    { 192, "61257134a518a0d57d9d244d45f6498cbc32f2bafc522d79", "cfe4d74002696ccf7d87b14a2f9cafc9" },
+    { 192, "b0ab0a6a818baef2d11fa33eac947284fb7d748cfb75e570", "d2eafd86f63b109b91f5dbb3a3fb7e13" },
+    { 192, "ee053aa011c8b428cdcc3636313c54d6a03cac01c71579d6", "9b9fdd1c5975655f539998b306a324af" },
+    { 192, "d2926527e0aa9f37b45e2ec2ade5853ef807576104c7ace3", "dd619e1cf204446112e0af2b9afa8f8c" },
+    { 192, "982215f4e173dfa0fcffe5d3da41c4812c7bcc8ed3540f93", "d4f0aae13c8fe9339fbf9e69ed0ad74d" },
+    { 192, "98c6b8e01e379fbd14e61af6af891596583565f2a27d59e9", "19c80ec4a6deb7e5ed1033dda933498f" },
+    { 192, "b3ad5cea1dddc214ca969ac35f37dae1a9a9d1528f89bb35", "3cf5e1d21a17956d1dffad6a7c41c659" },
+    { 192, "45899367c3132849763073c435a9288a766c8b9ec2308516", "69fd12e8505f8ded2fdcb197a121b362" },
+    { 192, "ec250e04c3903f602647b85a401a1ae7ca2f02f67fa4253e", "8aa584e2cc4d17417a97cb9a28ba29c8" },
+    { 192, "d077a03bd8a38973928ccafe4a9d2f455130bd0af5ae46a9", "abc786fb1edb504580c4d882ef29a0c7" },
+    { 192, "d184c36cf0dddfec39e654195006022237871a47c33d3198", "2e19fb60a3e1de0166f483c97824a978" },
+    { 192, "4c6994ffa9dcdc805b60c2c0095334c42d95a8fc0ca5b080", "7656709538dd5fec41e0ce6a0f8e207d" },
+    { 192, "c88f5b00a4ef9a6840e2acaf33f00a3bdc4e25895303fa72", "a67cf333b314d411d3c0ae6e1cfcd8f5" },
+    { 256, "c47b0294dbbbee0fec4757f22ffeee3587ca4730c3d33b691df38bab076bc558", "46f2fb342d6f0ab477476fc501242c5f" },
+    { 256, "28d46cffa158533194214a91e712fc2b45b518076675affd910edeca5f41ac64", "4bf3b0a69aeb6657794f2901b1440ad4" },
+    { 256, "c1cc358b449909a19436cfbb3f852ef8bcb5ed12ac7058325f56e6099aab1a1c", "352065272169abf9856843927d0674fd" },
+    { 256, "984ca75f4ee8d706f46c2d98c0bf4a45f5b00d791c2dfeb191b5ed8e420fd627", "4307456a9e67813b452e15fa8fffe398" },
+    { 256, "b43d08a447ac8609baadae4ff12918b9f68fc1653f1269222f123981ded7a92f", "4663446607354989477a5c6f0f007ef4" },
+    { 256, "1d85a181b54cde51f0e098095b2962fdc93b51fe9b88602b3f54130bf76a5bd9", "531c2c38344578b84d50b3c917bbb6e1" },
+    { 256, "dc0eba1f2232a7879ded34ed8428eeb8769b056bbaf8ad77cb65c3541430b4cf", "fc6aec906323480005c58e7e1ab004ad" },
+    { 256, "f8be9ba615c5a952cabbca24f68f8593039624d524c816acda2c9183bd917cb9", "a3944b95ca0b52043584ef02151926a8" },
+    { 256, "797f8b3d176dac5b7e34a2d539c4ef367a16f8635f6264737591c5c07bf57a3e", "a74289fe73a4c123ca189ea1e1b49ad5" },
+    { 256, "6838d40caf927749c13f0329d331f448e202c73ef52c5f73a37ca635d4c47707", "b91d4ea4488644b56cf0812fa7fcf5fc" },
+    { 256, "ccd1bc3c659cd3c59bc437484e3c5c724441da8d6e90ce556cd57d0752663bbc", "304f81ab61a80c2e743b94d5002a126b" },
+    { 256, "13428b5e4c005e0636dd338405d173ab135dec2a25c22c5df0722d69dcc43887", "649a71545378c783e368c9ade7114f6c" },
+    { 256, "07eb03a08d291d1b07408bf3512ab40c91097ac77461aad4bb859647f74f00ee", "47cb030da2ab051dfc6c4bf6910d12bb" },
+    { 256, "90143ae20cd78c5d8ebdd6cb9dc1762427a96c78c639bccc41a61424564eafe1", "798c7c005dee432b2c8ea5dfa381ecc3" },
+    { 256, "b7a5794d52737475d53d5a377200849be0260a67a2b22ced8bbef12882270d07", "637c31dc2591a07636f646b72daabbe7" },
+    { 256, "fca02f3d5011cfc5c1e23165d413a049d4526a991827424d896fe3435e0bf68e", "179a49c712154bbffbe6e7a84a18e220" },
+};
+
+
+//VarTxt (the zero key, plaintexts of 1 to 128 leading one bits) and VarKey (the
+//zero plaintext, keys of 1 to 128, 192 or 256 leading one bits) are generated
+//here rather than listed: digest is the SHA-256 of every ciphertext of the set in
+//order. The digests were computed with OpenSSL; the published first and last
+//values agree with them.
+struct cavp_variable_vector
+{
+    bool variable_key;
+    int key_bits;
+    const char* digest;
+};
+
+const cavp_variable_vector cavp_variable_vectors[] = {
+    { false, 128, "a328816ac7c1c36c53972d1b61401e4e3fa1851d250d90d6f75ab727b60fc70f" },
+    { false, 192, "435347b8029e4f40e8efdb8d0545efbdc33a8b1c07f44afdad38e734183e0fb4" },
+    { false, 256, "3e19308b4e0c659bb04e9dfe123a299ed9a1403f3f30bdbc8904c6b1b551a897" },
+    { true, 128, "c1aa7a75490f6282e8c7b81b6f138b9506238114f9c4429907e15c7f286e0332" },
+    { true, 192, "ead6f12f52738d4540b12a99bd08ce17c5aec6bb702a932acea1e8e2f84a1f29" },
+    { true, 256, "1a2ac0fa74a7a05cd22754ab5f8cee7edc5b1da7d6dada3257cebc8e535aaa9a" },
+};
+
+//COUNT = 0 of each CAVP multi-block message (MMT) file, ECB and then CBC. Those
+//are one block; the longer messages of the later counts aren't included, and
+//SP 800-38A's four-block vectors cover chaining across blocks instead.
+struct cavp_mmt_vector
+{
+    const char* key;
+    const char* iv; //nullptr for ECB
+    const char* plain;
+    const char* cipher;
+};
+
+const cavp_mmt_vector cavp_mmt_vectors[] = {
+    { "edfdb257cb37cdf182c5455b0c0efebb", nullptr, "1695fe475421cace3557daca01f445ff", "7888beae6e7a426332a7eaa2f808e637" },
+    { "61396c530cc1749a5bab6fbcf906fe672d0c4ab201af4554", nullptr, "60bcdb9416bac08d7fd0d780353740a5",
+        "24f40c4eecd9c49825000fcb4972647a" },
+    { "cc22da787f375711c76302bef0979d8eddf842829c2b99ef3dd04e23e54cc24b", nullptr, "ccc62c6b0a09a671d64456818db29a4d",
+        "df8634ca02b13a125b786e1dce90658b" },
+    { "1f8e4973953f3fb0bd6b16662e9a3c17", "2fe2b333ceda8f98f4a99b40d2cd34a8", "45cf12964fc824ab76616ae2f4bf0822",
+        "0f61c4d44c5147c03c195ad7e2cc12b2" },
+    { "ba75f4d1d9d7cf7f551445d56cc1a8ab2a078e15e049dc2c", "531ce78176401666aa30db94ec4a30eb", "c51fc276774dad94bcdc1d2891ec8668",
+        "70dd95a14ee975e239df36ff4aee1d5d" },
+    { "6ed76d2d97c69fd1339589523931f2a6cff554b15f738f21ec72dd97a7330907", "851e8764776e6796aab722dbb644ace8",
+        "6282b8c05c5c1530b97d4816ca434762", "6acc04142e100a65f51b97adf5172c41" },
+};
+
+//FIPS 180-4 examples (and the million a's of the NIST SHA test vectors); RFC 4231
+//test cases 1, 2 and 6 (a key longer than a block); RFC 7914 section 11, which
+//gives PBKDF2-HMAC-SHA256 results
+struct sha256_vector
+{
+    string message;
+    const char* digest;
+};
+
+const sha256_vector sha256_vectors[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+struct hmac_vector
+{
+    string key;
+    string message;
+    const char* mac;
+};
+
+const hmac_vector hmac_vectors[] = {
+    { string(20, '\x0b'), "Hi There", "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+    { "Jefe", "what do ya want for nothing?", "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+    { string(131, '\xaa'), "Test Using Larger Than Block-Size Key - Hash Key First",
+        "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" },
+};
+
+struct pbkdf2_vector
+{
+    const char* passphrase;
+    const char* salt;
+    u32 iterations;
+    const char* key;
+};
+
+const pbkdf2_vector pbkdf2_vectors[] = {
+    { "passwd", "salt", 1, "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+        "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783" },
+    { "Password", "NaCl", 80000, "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+        "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d" },
+};
+
+array<u8, 16> to_block(const vector<u8>& bytes)
+{
+    array<u8, 16> block;
+    memcpy(&block, bytes.data(), 16);
+    return block;
+}
+
+void test_cipher(test_log& log, const aes_backend& backend)
+{
+    for (const cipher_vector& v : fips197_vectors)
+    {
+        vector<u8> key = from_hex(v.key), plain = from_hex(v.plain), cipher = from_hex(v.cipher);
+        aes_context ctx(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " FIPS-197 AES-" + to_string(8 * key.size());
+        log.check(ctx.encrypt_block(to_block(plain)) == to_block(cipher), what + " encrypt");
+        log.check(ctx.decrypt_block(to_block(cipher)) == to_block(plain), what + " decrypt");
+    }
+    log.end_group(string(backend.name) + " FIPS-197", size(fips197_vectors));
+}
+
+void test_modes(test_log& log, const aes_backend& backend)
+{
+    vector<u8> plain = from_hex(sp800_38a_plain);
+    vector<u8> out(plain.size());
+    for (const mode_vector& v : sp800_38a_vectors)
+    {
+        vector<u8> key = from_hex(v.key);
+        aes_context ctx(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " SP 800-38A AES-" + to_string(8 * key.size());
+
+        vector<u8> ecb = from_hex(v.ecb);
+        ctx.encrypt_blocks(plain.data(), out.data(), 4);
+        log.check(out == ecb, what + " ECB encrypt");
+        ctx.decrypt_blocks(ecb.data(), out.data(), 4);
+        log.check(out == plain, what + " ECB decrypt");
+
+        vector<u8> cbc = from_hex(v.cbc);
+        array<u8, 16> iv = to_block(from_hex(sp800_38a_cbc_iv));
+        array<u8, 16> chain = iv;
+        cbc_encrypt(ctx, plain.data(), out.data(), 4, chain);
+        log.check(out == cbc, what + " CBC encrypt");
+        cbc_decrypt(ctx, cbc.data(), out.data(), 4, &iv[0]);
+        log.check(out == plain, what + " CBC decrypt");
+
+        vector<u8> ctr = from_hex(v.ctr);
+        ctr_crypt(ctx, plain.data(), out.data(), plain.size(), to_block(from_hex(sp800_38a_ctr_iv)), 0);
+        log.check(out == ctr, what + " CTR");
+    }
+    log.end_group(string(backend.name) + " SP 800-38A ECB/CBC/CTR", 5 * size(sp800_38a_vectors));
+
+    for (const gcm_vector& v : gcm_vectors)
+    {
+        vector<u8> key = from_hex(v.key), iv = from_hex(v.iv), aad = from_hex(v.aad);
+        vector<u8> gcm_plain = from_hex(v.plain), cipher = from_hex(v.cipher), tag = from_hex(v.tag);
+        expanded_key k(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " GCM AES-" + to_string(8 * key.size()) + " (" +
+            to_string(gcm_plain.size()) + " bytes, " + to_string(8 * iv.size()) + "-bit IV)";
+
+        vector<u8> result(gcm_plain.size());
+        u8 computed[16];
+        gcm_encrypt(k.gcm, iv.data(), iv.size(), aad.data(), aad.size(), gcm_plain.data(), result.data(), gcm_plain.size(), computed);
+        log.check(result == cipher && memcmp(computed, tag.data(), 16) == 0, what + " encrypt");
+        bool ok = gcm_decrypt(k.gcm, iv.data(), iv.size(), aad.data(), aad.size(), cipher.data(), result.data(), cipher.size(), tag.data());
+        log.check(ok && result == gcm_plain, what + " decrypt");
+        tag[15] ^= 1;
+        ok = gcm_decrypt(k.gcm, iv.data(), iv.size(), aad.data(), aad.size(), cipher.data(), result.data(), cipher.size(), tag.data());
+        log.check(!ok, what + " accepts a wrong tag");
+    }
+    log.end_group(string(backend.name) + " GCM", 3 * size(gcm_vectors));
+
+    for (const xts_vector& v : xts_vectors)
+    {
+        vector<u8> key = from_hex(v.key), xts_plain = from_hex(v.plain), cipher = from_hex(v.cipher);
+        xts_key k(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " XTS-AES-" + to_string(4 * key.size()) + " (" + to_string(xts_plain.size()) + " bytes)";
+        vector<u8> result(xts_plain.size());
+        xts_encrypt(k, v.sector, xts_plain.data(), result.data(), result.size());
+        log.check(result == cipher, what + " encrypt");
+        xts_decrypt(k, v.sector, cipher.data(), result.data(), result.size());
+        log.check(result == xts_plain, what + " decrypt");
+    }
+    log.end_group(string(backend.name) + " XTS", 2 * size(xts_vectors));
+}
+
+//One CAVP known answer, in ECB and in CBC with the zero IV, both ways
+void check_cavp_answer(test_log& log, const aes_context& ctx, const u8 plain[16], const u8 cipher[16], const string& what)
+{
+    u8 out[16];
+    ctx.encrypt_blocks(plain, out, 1);
+    bool ecb = memcmp(out, cipher, 16) == 0;
+    ctx.decrypt_blocks(cipher, out, 1);
+    log.check(ecb && memcmp(out, plain, 16) == 0, what + " ECB");
+
+    array<u8, 16> iv = {};
+    cbc_encrypt(ctx, plain, out, 1, iv);
+    bool cbc = memcmp(out, cipher, 16) == 0;
+    const u8 zero[16] = {};
+    cbc_decrypt(ctx, cipher, out, 1, zero);
+    log.check(cbc && memcmp(out, plain, 16) == 0, what + " CBC");
+}
+
+void test_cavp(test_log& log, const aes_backend& backend)
+{
+    const u8 zero[32] = {};
+    for (const cavp_kat_vector& v : gfsbox_vectors)
+    {
+        vector<u8> plain = from_hex(v.input), cipher = from_hex(v.cipher);
+        aes_context ctx(zero, v.key_bits / 8, &backend);
+        check_cavp_answer(log, ctx, plain.data(), cipher.data(), string(backend.name) + " GFSbox AES-" + to_string(v.key_bits) + " " + v.input);
+    }
+    for (const cavp_kat_vector& v : keysbox_vectors)
+    {
+        vector<u8> key = from_hex(v.input), cipher = from_hex(v.cipher);
+        aes_context ctx(key.data(), key.size(), &backend);
+        check_cavp_answer(log, ctx, zero, cipher.data(), string(backend.name) + " KeySbox AES-" + to_string(v.key_bits) + " " + v.input);
+    }
+    size_t count = 2 * (size(gfsbox_vectors) + size(keysbox_vectors));
+
+    for (const cavp_variable_vector& v : cavp_variable_vectors)
+    {
+        //Entry i has i leading one bits in the key or the plaintext, i from 1 up
+        size_t entries = v.variable_key ? v.key_bits : 128;
+        vector<u8> ciphers(16 * entries);
+        u8 varied[32] = {};
+        for (size_t i = 0; i < entries; i++)
+        {
+            varied[i / 8] |= 0x80 >> (i % 8);
+            aes_context ctx(v.variable_key ? varied : zero, v.key_bits / 8, &backend);
+            ctx.encrypt_blocks(v.variable_key ? zero : varied, &ciphers[16 * i], 1);
+        }
+        u8 digest[32];
+        sha256(ciphers.data(), ciphers.size(), digest);
+        log.check(memcmp(digest, from_hex(v.digest).data(), 32) == 0,
+            string(backend.name) + (v.variable_key ? " VarKey" : " VarTxt") + " AES-" + to_string(v.key_bits));
+    }
+    count += size(cavp_variable_vectors);
+
+    for (const cavp_mmt_vector& v : cavp_mmt_vectors)
+    {
+        vector<u8> key = from_hex(v.key), plain = from_hex(v.plain), cipher = from_hex(v.cipher);
+        vector<u8> out(plain.size());
+        aes_context ctx(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " MMT AES-" + to_string(8 * key.size()) + (v.iv ? " CBC" : " ECB");
+        if (v.iv)
+        {
+            array<u8, 16> iv = to_block(from_hex(v.iv));
+            array<u8, 16> chain = iv;
+            cbc_encrypt(ctx, plain.data(), out.data(), plain.size() / 16, chain);
+            log.check(out == cipher, what + " encrypt");
+            cbc_decrypt(ctx, cipher.data(), out.data(), cipher.size() / 16, &iv[0]);
+            log.check(out == plain, what + " decrypt");
+        }
+        else
+        {
+            ctx.encrypt_blocks(plain.data(), out.data(), plain.size() / 16);
+            log.check(out == cipher, what + " encrypt");
+            ctx.decrypt_blocks(cipher.data(), out.data(), cipher.size() / 16);
+            log.check(out == plain, what + " decrypt");
+        }
+    }
+    count += 2 * size(cavp_mmt_vectors);
+    log.end_group(string(backend.name) + " CAVP KAT/MMT", count);
+}
+
+//Between the outer steps of a Monte Carlo chain the key is xored with the last
+//128, 192 or 256 bits of output: previous, then last
+void next_monte_carlo_key(vector<u8>& key, const array<u8, 16>& previous, const array<u8, 16>& last)
+{
+    u8 output[32];
+    memcpy(output, &previous, 16);
+    memcpy(output + 16, &last, 16);
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        key[i] ^= output[32 - key.size() + i];
+    }
+}
+
+void test_monte_carlo(test_log& log, const aes_backend& backend)
+{
+    for (const monte_carlo_vector& v : monte_carlo_vectors)
+    {
+        vector<u8> key = from_hex(v.key);
+        array<u8, 16> text = to_block(from_hex(v.text)), previous = {};
+        for (int outer = 0; outer < 100; outer++)
+        {
+            aes_context ctx(key.data(), key.size(), &backend);
+            for (int inner = 0; inner < 1000; inner++)
+            {
+                previous = text;
+                text = v.encrypt ? ctx.encrypt_block(text) : ctx.decrypt_block(text);
+            }
+            next_monte_carlo_key(key, previous, text);
+        }
+        log.check(text == to_block(from_hex(v.expected)), string(backend.name) + " Monte Carlo AES-" +
+            to_string(8 * key.size()) + (v.encrypt ? " encrypt" : " decrypt"));
+    }
+    log.end_group(string(backend.name) + " Monte Carlo", size(monte_carlo_vectors));
+
+    for (const cbc_monte_carlo_vector& v : cbc_monte_carlo_vectors)
+    {
+        vector<u8> key = from_hex(v.key);
+        array<u8, 16> iv = to_block(from_hex(v.iv)), text = to_block(from_hex(v.text));
+        array<u8, 16> output = {}, previous = {};
+        string what = string(backend.name) + " CBC Monte Carlo AES-" + to_string(8 * key.size()) + (v.encrypt ? " encrypt" : " decrypt");
+        for (int outer = 0; outer < 100; outer++)
+        {
+            aes_context ctx(key.data(), key.size(), &backend);
+            array<u8, 16> chain = iv;
+            for (int inner = 0; inner < 1000; inner++)
+            {
+                //Each input is the output from two steps back; the second is the IV
+                array<u8, 16> next = inner == 0 ? iv : output;
+                previous = output;
+                if (v.encrypt)
+                {
+                    cbc_encrypt(ctx, &text[0], &output[0], 1, chain);
+                }
+                else
+                {
+                    cbc_decrypt(ctx, &text[0], &output[0], 1, &chain[0]);
+                    chain = text;
+                }
+                text = next;
+            }
+            if (outer == 0 && v.first)
+            {
+                log.check(output == to_block(from_hex(v.first)), what + " (first step)");
+            }
+            next_monte_carlo_key(key, previous, output);
+            iv = output;
+            text = previous;
+        }
+        log.check(output == to_block(from_hex(v.expected)), what);
+    }
+    log.end_group(string(backend.name) + " CBC Monte Carlo", size(cbc_monte_carlo_vectors));
+}
+
+//Random keys, lengths and alignments, each backend checked against the reference
+void test_differential(test_log& log, const aes_backend& backend, unsigned int rounds, u64 seed)
+{
+    mt19937_64 random(seed);
+    auto fill = [&](vector<u8>& bytes)
+    {
+        for (u8& b : bytes)
+        {
+            b = (u8)random();
+        }
+    };
+    const size_t key_sizes[] = { 16, 24, 32 };
+    for (unsigned int round = 0; round < rounds; round++)
+    {
+        vector<u8> key(key_sizes[random() % 3]);
+        fill(key);
+        expanded_key ref(key.data(), key.size(), &reference_backend());
+        expanded_key fast(key.data(), key.size(), &backend);
+        string what = string(backend.name) + " differential (seed " + to_string(seed) + ", round " + to_string(round) + ")";
+
+        //Up to 70 blocks reaches every kernel's tail handling; the offset gives
+        //unaligned buffers
+        size_t nblocks = 1 + random() % 70, offset = random() % 16;
+        vector<u8> data(16 * nblocks + 16), expected(16 * nblocks), got(16 * nblocks + 16);
+        fill(data);
+        const u8* in = data.data() + offset;
+        u8* out = got.data() + offset;
+        array<u8, 16> block;
+        memcpy(&block, in, 16);
+        log.check(fast.aes.encrypt_block(block) == ref.aes.encrypt_block(block), what + " encrypt_block");
+        log.check(fast.aes.decrypt_block(block) == ref.aes.decrypt_block(block), what + " decrypt_block");
+
+        ref.aes.encrypt_blocks(in, expected.data(), nblocks);
+        fast.aes.encrypt_blocks(in, out, nblocks);
+        log.check(memcmp(out, expected.data(), 16 * nblocks) == 0, what + " encrypt_blocks");
+        ref.aes.decrypt_blocks(in, expected.data(), nblocks);
+        fast.aes.decrypt_blocks(in, out, nblocks);
+        log.check(memcmp(out, expected.data(), 16 * nblocks) == 0, what + " decrypt_blocks");
+
+        //A counter close to wrapping, so the carry between the halves is covered,
+        //in the CTR kernels' groups of blocks as well as between them
+        array<u8, 16> iv;
+        for (u8& b : iv)
+        {
+            b = (u8)random();
+        }
+        if (random() % 2)
+        {
+            memset(&iv[8], 0xff, 8);
+            iv[15] -= (u8)(random() % 40);
+        }
+        size_t len = random() % (16 * nblocks + 1);
+        ctr_crypt(ref.aes, in, expected.data(), len, iv, 0);
+        ctr_crypt(fast.aes, in, out, len, iv, 0);
+        log.check(memcmp(out, expected.data(), len) == 0, what + " CTR");
+
+        cbc_decrypt(ref.aes, in, expected.data(), nblocks, &iv[0]);
+        cbc_decrypt(fast.aes, in, out, nblocks, &iv[0]);
+        log.check(memcmp(out, expected.data(), 16 * nblocks) == 0, what + " CBC decrypt");
+
+        size_t iv_len = (random() % 4 == 0) ? 1 + random() % 16 : 12, aad_len = random() % 40;
+        u8 tag_ref[16], tag_fast[16];
+        gcm_encrypt(ref.gcm, &iv[0], iv_len, data.data(), aad_len, in, expected.data(), len, tag_ref);
+        gcm_encrypt(fast.gcm, &iv[0], iv_len, data.data(), aad_len, in, out, len, tag_fast);
+        log.check(memcmp(out, expected.data(), len) == 0 && memcmp(tag_ref, tag_fast, 16) == 0, what + " GCM");
+        vector<u8> back(len + 1);
+        bool ok = gcm_decrypt(fast.gcm, &iv[0], iv_len, data.data(), aad_len, out, back.data(), len, tag_fast);
+        log.check(ok && memcmp(back.data(), in, len) == 0, what + " GCM round trip");
+
+        //XTS needs at least a block; any other length steals from the last one
+        vector<u8> xts_key_bytes(32 * (1 + random() % 2));
+        fill(xts_key_bytes);
+        xts_key xts_ref(xts_key_bytes.data(), xts_key_bytes.size(), &reference_backend());
+        xts_key xts_fast(xts_key_bytes.data(), xts_key_bytes.size(), &backend);
+        size_t xts_len = 16 + random() % (16 * nblocks - 15);
+        u64 sector = random();
+        xts_encrypt(xts_ref, sector, in, expected.data(), xts_len);
+        xts_encrypt(xts_fast, sector, in, out, xts_len);
+        log.check(memcmp(out, expected.data(), xts_len) == 0, what + " XTS encrypt");
+        xts_decrypt(xts_ref, sector, in, expected.data(), xts_len);
+        xts_decrypt(xts_fast, sector, in, out, xts_len);
+        log.check(memcmp(out, expected.data(), xts_len) == 0, what + " XTS decrypt");
+
+        //The batch functions against one message at a time
+        ctr_job jobs[3];
+        gcm_job gjobs[3];
+        vector<u8> batch_out(3 * len + 1), gcm_out(3 * len + 1);
+        u8 tags[3][16];
+        for (int j = 0; j < 3; j++)
+        {
+            iv[0] ^= (u8)j;
+            jobs[j] = { &fast.aes, iv, in, &batch_out[j * len], len };
+            gjobs[j] = { &fast.gcm, &iv[0], 12, nullptr, 0, in, &gcm_out[j * len], len, tags[j], false };
+        }
+        ctr_crypt_batch(jobs, 3);
+        gcm_encrypt_batch(gjobs, 3);
+        for (int j = 0; j < 3; j++)
+        {
+            ctr_crypt(ref.aes, in, expected.data(), len, jobs[j].iv, 0);
+            log.check(memcmp(&batch_out[j * len], expected.data(), len) == 0, what + " CTR batch");
+            gcm_encrypt(ref.gcm, gjobs[j].iv, 12, nullptr, 0, in, expected.data(), len, tag_ref);
+            log.check(memcmp(&gcm_out[j * len], expected.data(), len) == 0 && memcmp(tags[j], tag_ref, 16) == 0, what + " GCM batch");
+        }
+    }
+    log.end_group(string(backend.name) + " against the reference", rounds);
+}
+
+void test_kdf(test_log& log, u64 seed)
+{
+    u8 digest[32];
+    for (const sha256_vector& v : sha256_vectors)
+    {
+        sha256((const u8*)v.message.data(), v.message.size(), digest);
+        log.check(vector<u8>(digest, digest + 32) == from_hex(v.digest), "SHA-256 of " + to_string(v.message.size()) + " bytes");
+    }
+    for (const hmac_vector& v : hmac_vectors)
+    {
+        hmac_sha256((const u8*)v.key.data(), v.key.size(), (const u8*)v.message.data(), v.message.size(), digest);
+        log.check(vector<u8>(digest, digest + 32) == from_hex(v.mac), "HMAC-SHA256 with a " + to_string(v.key.size()) + "-byte key");
+    }
+    for (const pbkdf2_vector& v : pbkdf2_vectors)
+    {
+        vector<u8> expected = from_hex(v.key), key(expected.size());
+        pbkdf2_hmac_sha256((const u8*)v.passphrase, strlen(v.passphrase), (const u8*)v.salt, strlen(v.salt), v.iterations,
+            key.data(), key.size());
+        log.check(key == expected, "PBKDF2-HMAC-SHA256 with " + to_string(v.iterations) + " iterations");
+    }
+
+    //The vectors only test the compression function the CPU picked, so check it
+    //against the portable one as well
+    mt19937_64 rng(seed);
+    vector<u8> data(64 * 64);
+    for (u8& b : data)
+    {
+        b = (u8)rng();
+    }
+    u32 fast[8], portable[8];
+    for (size_t nblocks = 1; nblocks <= 64; nblocks++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            fast[i] = portable[i] = (u32)rng();
+        }
+        select_sha256_blocks()(fast, data.data(), nblocks);
+        sha256_blocks_generic(portable, data.data(), nblocks);
+        log.check(memcmp(fast, portable, sizeof(fast)) == 0, "SHA-256 compression of " + to_string(nblocks) + " blocks");
+    }
+    log.end_group("SHA-256, HMAC, PBKDF2", size(sha256_vectors) + size(hmac_vectors) + size(pbkdf2_vectors) + 64);
+}
+
+bool aes_self_test(ostream& out, unsigned int rounds, u64 seed)
+{
+    test_log log{ out };
+    vector<const aes_backend*> backends = tuning_candidates();
+    backends.push_back(&reference_backend());
+    for (const aes_backend* backend : backends)
+    {
+        test_cipher(log, *backend);
+        test_modes(log, *backend);
+        test_cavp(log, *backend);
+        //The reference takes tens of microseconds a block, so the 1,200,000 blocks of
+        //the Monte Carlo chains are left to the others, which it is checked against
+        if (backend != &reference_backend())
+        {
+            test_monte_carlo(log, *backend);
+            test_differential(log, *backend, rounds, seed);
+        }
+    }
+    test_kdf(log, seed);
+    out << (log.failures == 0 ? "All tests passed" : to_string(log.failures) + " tests FAILED") << endl;
+    return log.failures == 0;
+}
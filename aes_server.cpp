@@ -0,0 +1,1061 @@
+/* The encryption service: the listening sockets, the event loops, and each
+connection's frames, requests and output. aes_server.h has the protocol.
+*/
+
+#include "aes_server.h"
+#include "aes_internal.h"
+#ifdef AES_SERVER
+#include <thread>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+using namespace std;
+
+//Older headers lack the zero-copy names; older kernels just refuse them
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+const size_t server_batch_bytes = 1 << 20;     //of plaintext, handled at once
+const size_t server_inbox_size = 64 << 10;     //for frame lengths and small frames
+const size_t direct_receive_min = 16 << 10;    //frames with this much left are received into the cipher's buffer
+const size_t zerocopy_send_min = 16 << 10;     //smaller sends are cheaper copied than pinned
+const size_t max_pending_output = 8 << 20;     //stop reading a client that doesn't read its output
+const unsigned int connection_events_max = 64; //per epoll_wait
+const size_t max_queued_keys = 64;             //beyond this, requests needing a new key are turned away
+
+//A piece of a connection's output: whole frames, sent in order. Kept until the
+//kernel is done with it, which with MSG_ZEROCOPY is after it has been sent.
+struct output_segment
+{
+    pooled_buffer buffer;
+    size_t len = 0;  //bytes filled
+    size_t sent = 0;
+    bool zerocopy = false;  //some of it went with MSG_ZEROCOPY...
+    u32 zerocopy_last = 0;  //...the last time in this send
+};
+
+//Output the kernel may still be sending from when its connection goes without
+//having heard that it is done (the server stopping): never given back to the
+//pool, so it can't become anyone else's buffer while the kernel reads it
+void keep_forever(pooled_buffer&& buffer)
+{
+    static mutex lock;
+    static vector<pooled_buffer>* kept = new vector<pooled_buffer>; //never destroyed
+    lock_guard<mutex> hold(lock);
+    kept->push_back(move(buffer));
+}
+
+//A key being derived on the key thread. The loop that asked is woken through
+//wake_fd once done is set; by then the connection may have gone, in which case
+//the result is dropped.
+struct aes_server::key_request
+{
+    file_header header;
+    int wake_fd = -1;
+    atomic<bool> done{ false };
+    shared_ptr<const expanded_key> key;
+    string error;
+};
+
+struct aes_server::connection
+{
+    aes_server* server = nullptr;
+    int fd = -1;
+    int wake_fd = -1;       //the loop's, for key requests
+    size_t slot = 0;        //in the loop's list of connections
+    u32 events = 0;         //what epoll is watching for
+    bool closing = false;   //the client has stopped sending: finish sending, then close
+    bool zerocopy = false;  //the socket takes MSG_ZEROCOPY
+    u32 zerocopy_sent = 0;  //zero-copy sends so far; the kernel numbers them from 0
+    u32 zerocopy_done = 0;  //how many it has finished with (it reports them in order, for TCP)
+    bool lingering = false; //closed, but kept until the kernel is done with the output
+
+    //Where the input is in the protocol
+    enum { want_op, want_length, want_data } state = want_op;
+    u8 length_bytes[4];
+    size_t length_got = 0;
+    size_t frame_left = 0;
+    pooled_buffer inbox = buffer_pool::shared().get(server_inbox_size);
+
+    //The request
+    bool encrypt = false;
+    server_status status = server_ok; //anything else and the rest of the input is ignored
+    file_header header;
+    bool have_header = false;
+    size_t header_got = 0;  //decryption reads the header into header.bytes first
+    shared_ptr<const expanded_key> key;
+    shared_ptr<key_request> key_wait; //while set, the connection isn't read...
+    pooled_buffer held;               //...and what came after the header waits here
+    size_t held_len = 0;
+    u64 index = 0, total = 0;
+    pooled_buffer work;     //plaintext to encrypt, or records to decrypt (then the last footer-size bytes held back)
+    size_t work_len = 0, work_capacity = 0;
+    size_t segment_size = 0;
+
+    //The output
+    deque<output_segment> output;
+    bool frame_open = false;
+    size_t frame_start = 0; //in output.back(): where the open frame's length goes
+    size_t pending = 0;     //bytes not yet sent
+
+    ~connection()
+    {
+        for (output_segment& s : output)
+        {
+            if (kernel_holds(s))
+            {
+                keep_forever(move(s.buffer));
+            }
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    //Room for len more bytes of output, in a frame; commit() then adds them
+    u8* reserve(size_t len)
+    {
+        if (output.empty() || output.back().buffer.size() - output.back().len < len + (frame_open ? 0 : 4))
+        {
+            finish_frame();
+            output_segment s;
+            s.buffer = buffer_pool::shared().get(max(segment_size, len + 4 + 5));
+            output.push_back(move(s));
+        }
+        output_segment& s = output.back();
+        if (!frame_open)
+        {
+            frame_open = true;
+            frame_start = s.len;
+            s.len += 4;
+            pending += 4;
+        }
+        s.buffer.mark_used(s.len + len); //so even output never sent (a chunk that failed) is wiped
+        return &s.buffer[s.len];
+    }
+
+    void commit(size_t len)
+    {
+        output.back().len += len;
+        pending += len;
+    }
+
+    //Fills in the open frame's length, or takes it back if nothing went in it
+    void finish_frame()
+    {
+        if (!frame_open)
+        {
+            return;
+        }
+        frame_open = false;
+        output_segment& s = output.back();
+        size_t frame_len = s.len - frame_start - 4;
+        if (frame_len == 0)
+        {
+            s.len -= 4;
+            pending -= 4;
+            return;
+        }
+        store_be32(&s.buffer[frame_start], (u32)frame_len);
+    }
+
+    //The end of a response: the 0 frame and the status
+    void finish_response()
+    {
+        finish_frame();
+        u8 end[5] = { 0, 0, 0, 0, (u8)status };
+        if (output.empty() || output.back().buffer.size() - output.back().len < sizeof(end))
+        {
+            output_segment s;
+            s.buffer = buffer_pool::shared().get(max(segment_size, sizeof(end)));
+            output.push_back(move(s));
+        }
+        output_segment& s = output.back();
+        memcpy(&s.buffer[s.len], end, sizeof(end));
+        s.len += sizeof(end);
+        s.buffer.mark_used(s.len);
+        pending += sizeof(end);
+    }
+
+    //Sizes the buffers for the header's chunk size, reusing the last request's if they fit
+    void start_chunks()
+    {
+        const size_t chunk = header.chunk_size(), record_size = chunk + 16;
+        const size_t batch = max<size_t>(1, server_batch_bytes / chunk);
+        size_t capacity = (encrypt ? batch * chunk : batch * record_size + seekable_footer_size);
+        if (capacity != work_capacity)
+        {
+            work = buffer_pool::shared().get(capacity);
+            work_capacity = capacity;
+        }
+        segment_size = 4 + sizeof(header.bytes) + batch * record_size + seekable_footer_size + 5;
+    }
+
+    void start_request(bool e, const server_options& options)
+    {
+        encrypt = e;
+        status = server_ok;
+        index = total = 0;
+        work_len = header_got = 0;
+        have_header = false;
+        key.reset();
+        if (!encrypt)
+        {
+            return;
+        }
+        header = new_file_header(mode_seekable, options.key_bytes, options.chunk_shift);
+        key = options.encryption_key(header);
+        if (!key)
+        {
+            status = server_wrong_key;
+            return;
+        }
+        have_header = true;
+        start_chunks();
+        memcpy(reserve(header.size()), header.bytes, header.size());
+        commit(header.size());
+    }
+
+    //Decryption starts with the header, which says which key and how big the chunks are
+    void take_header(const u8*& data, size_t& len, const server_options& options)
+    {
+        //The fixed part says how long the rest is
+        auto header_need = [&] { return header_got < header_fixed_size ? header_fixed_size : file_header_size(header.bytes); };
+        size_t need = header_need();
+        while (len > 0 && header_got < need)
+        {
+            size_t n = min(len, need - header_got);
+            memcpy(header.bytes + header_got, data, n);
+            header_got += n;
+            data += n;
+            len -= n;
+            need = header_need();
+        }
+        if (header_got < need)
+        {
+            return;
+        }
+
+        u8 bytes[sizeof(header.bytes)];
+        memcpy(bytes, header.bytes, header_got);
+        string error;
+        if (read_file_header(bytes, header_got, header) != nullptr || header.mode != mode_seekable)
+        {
+            status = server_failed;
+            return;
+        }
+        if (!options.decryption_key_ready || !options.decryption_key_ready(header))
+        {
+            key_wait = server->request_key(header, wake_fd);
+            status = (key_wait ? status : server_busy);
+            return;
+        }
+        key = options.decryption_key(header, error);
+        use_key();
+    }
+
+    void use_key()
+    {
+        if (!key)
+        {
+            status = server_wrong_key;
+            return;
+        }
+        have_header = true;
+        start_chunks();
+    }
+
+    //Carries on from take_header with the key thread's answer; false if the input
+    //held meanwhile isn't the protocol
+    bool key_arrived(const server_options& options, thread_pool& pool)
+    {
+        key = key_wait->key;
+        key_wait.reset();
+        use_key();
+        pooled_buffer rest = move(held);
+        size_t len = held_len;
+        held_len = 0;
+        return take_input(rest.data(), len, options, pool);
+    }
+
+    //Encrypts or decrypts the whole chunks in work; with final, everything left
+    void process(bool final, thread_pool& pool)
+    {
+        if (status != server_ok || !have_header)
+        {
+            return;
+        }
+        const size_t chunk = header.chunk_size(), record_size = chunk + 16;
+        const gcm_key& gcm = key->gcm;
+        if (encrypt)
+        {
+            size_t n = (final ? (work_len + chunk - 1) / chunk : work_len / chunk);
+            size_t len = (final ? work_len : n * chunk);
+            if (n > 0)
+            {
+                u8* records = reserve(len + 16 * n);
+                seekable_chunks(gcm, header, index, n, len - (n - 1) * chunk, work.data(), records, true, pool);
+                commit(len + 16 * n);
+                index += n;
+                total += len;
+                memmove(work.data(), &work[len], work_len - len);
+                work_len -= len;
+            }
+            if (final)
+            {
+                u8* footer = reserve(seekable_footer_size);
+                store_be64(footer, total);
+                seekable_footer_tag(gcm, header, footer, footer + 8);
+                commit(seekable_footer_size);
+            }
+            return;
+        }
+
+        //The last footer-size bytes are held back until it is known whether they are the footer
+        if (work_len < seekable_footer_size)
+        {
+            status = (final ? server_failed : status);
+            return;
+        }
+        size_t body = work_len - seekable_footer_size;
+        size_t n = (final ? (body + record_size - 1) / record_size : body / record_size);
+        size_t len = (final ? body : n * record_size);
+        if (n > 0)
+        {
+            size_t last_record = len - (n - 1) * record_size;
+            u8* plain = reserve(len - 16 * n);
+            if (last_record <= 16 || !seekable_chunks(gcm, header, index, n, last_record - 16, plain, work.data(), false, pool))
+            {
+                status = server_failed;
+                return;
+            }
+            commit(len - 16 * n);
+            index += n;
+            total += len - 16 * n;
+            memmove(work.data(), &work[len], work_len - len);
+            work_len -= len;
+        }
+        if (final)
+        {
+            u8 tag[16];
+            seekable_footer_tag(gcm, header, work.data(), tag);
+            if (load_be64(work.data()) != total || !tags_equal(tag, &work[8]))
+            {
+                status = server_failed;
+            }
+        }
+    }
+
+    //A piece of a frame's data; returns how much was taken, which is less than len
+    //only when it stops to wait for a key
+    size_t take_data(const u8* data, size_t len, const server_options& options, thread_pool& pool)
+    {
+        const size_t start_len = len;
+        while (len > 0 && status == server_ok && !key_wait)
+        {
+            if (!have_header)
+            {
+                take_header(data, len, options);
+                continue;
+            }
+            size_t n = min(len, work_capacity - work_len);
+            memcpy(&work[work_len], data, n);
+            work_len += n;
+            work.mark_used(work_len);
+            data += n;
+            len -= n;
+            if (work_len == work_capacity)
+            {
+                process(false, pool);
+            }
+        }
+        return (key_wait ? start_len - len : start_len);
+    }
+
+    void end_request(thread_pool& pool)
+    {
+        if (status == server_ok && !have_header)
+        {   //decryption of something shorter than a header
+            status = server_failed;
+        }
+        process(true, pool);
+        finish_response();
+        key.reset();
+    }
+
+    //Follows the protocol through bytes the client sent; false if they aren't it
+    bool take_input(const u8* data, size_t len, const server_options& options, thread_pool& pool)
+    {
+        while (len > 0)
+        {
+            if (state == want_op)
+            {
+                if (*data != 'E' && *data != 'D')
+                {
+                    return false;
+                }
+                start_request(*data == 'E', options);
+                state = want_length;
+                length_got = 0;
+                data++;
+                len--;
+            }
+            else if (state == want_length)
+            {
+                size_t n = min(len, sizeof(length_bytes) - length_got);
+                memcpy(length_bytes + length_got, data, n);
+                length_got += n;
+                data += n;
+                len -= n;
+                if (length_got < sizeof(length_bytes))
+                {
+                    continue;
+                }
+                frame_left = load_be32(length_bytes);
+                length_got = 0;
+                if (frame_left > server_max_frame)
+                {
+                    return false;
+                }
+                if (frame_left == 0)
+                {
+                    end_request(pool);
+                    state = want_op;
+                }
+                else
+                {
+                    state = want_data;
+                }
+            }
+            else
+            {
+                size_t n = take_data(data, min(len, frame_left), options, pool);
+                frame_left -= n;
+                data += n;
+                len -= n;
+                state = (frame_left == 0 ? want_length : want_data);
+                if (key_wait && len > 0)
+                {
+                    held = buffer_pool::shared().get(len);
+                    memcpy(held.data(), data, len);
+                    held.mark_used(len);
+                    held_len = len;
+                    return true;
+                }
+            }
+        }
+        return true;
+    }
+
+    //Where a large frame can be received straight into work, or nullptr
+    u8* direct_receive(size_t& len)
+    {
+        if (state != want_data || status != server_ok || !have_header || frame_left < direct_receive_min ||
+            work_capacity - work_len < direct_receive_min)
+        {
+            return nullptr;
+        }
+        len = min(frame_left, work_capacity - work_len);
+        work.mark_used(work_len + len);
+        return &work[work_len];
+    }
+
+    //The kernel's reports of which zero-copy sends it has finished with
+    void read_completions()
+    {
+        while (true)
+        {
+            u8 control[128];
+            msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+            {
+                break;
+            }
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                    (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                {
+                    continue;
+                }
+                const sock_extended_err* err = (const sock_extended_err*)CMSG_DATA(cm);
+                if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                {
+                    continue;
+                }
+                zerocopy_done = err->ee_data + 1; //sends ee_info to ee_data
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                {   //the kernel copied them anyway (loopback, say), so pinning the pages only costs
+                    zerocopy = false;
+                }
+            }
+        }
+        release_output();
+    }
+
+    //Whether the kernel may still be reading a segment: it went with MSG_ZEROCOPY,
+    //and the kernel hasn't yet reported the last send it was in
+    bool kernel_holds(const output_segment& s) const
+    {
+        return s.zerocopy && (int)(zerocopy_done - s.zerocopy_last) <= 0;
+    }
+
+    //Gives back the segments that are sent and that the kernel is done with
+    void release_output()
+    {
+        while (!output.empty() && !(frame_open && output.size() == 1))
+        {
+            output_segment& s = output.front();
+            if (s.sent < s.len || kernel_holds(s))
+            {
+                break;
+            }
+            output.pop_front();
+        }
+    }
+
+    //On closing: false if nothing of the output is still the kernel's, and the
+    //connection can go. Otherwise the socket is shut down instead of closed, so the
+    //kernel can still report on it; everything but the segments it holds is given
+    //back, and epoll only watches for the reports (edge-triggered, as a socket shut
+    //down both ways is always hung up).
+    bool linger(int epoll_fd)
+    {
+        frame_open = false;
+        pending = 0;
+        for (output_segment& s : output)
+        {
+            s.len = s.sent; //what wasn't sent never will be
+        }
+        release_output();
+        if (output.empty())
+        {
+            return false;
+        }
+        lingering = true;
+        shutdown(fd, SHUT_RDWR);
+        inbox = pooled_buffer();
+        work = pooled_buffer();
+        held = pooled_buffer();
+        work_len = work_capacity = held_len = 0;
+        key.reset();
+        key_wait.reset();
+        epoll_event ev = {};
+        ev.events = events = EPOLLET;
+        ev.data.ptr = this;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        return true;
+    }
+
+    //Sends as much of the output as the socket takes; false if the connection is broken
+    bool send_output()
+    {
+        finish_frame();
+        while (pending > 0)
+        {
+            iovec iov[16];
+            msghdr msg = {};
+            size_t bytes = 0, first = 0;
+            while (first < output.size() && output[first].sent == output[first].len)
+            {
+                first++;
+            }
+            for (size_t i = first; i < output.size() && msg.msg_iovlen < 16; i++)
+            {
+                iov[msg.msg_iovlen].iov_base = &output[i].buffer[output[i].sent];
+                iov[msg.msg_iovlen].iov_len = output[i].len - output[i].sent;
+                bytes += iov[msg.msg_iovlen++].iov_len;
+            }
+            msg.msg_iov = iov;
+            bool zero_copy = (zerocopy && bytes >= zerocopy_send_min);
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | (zero_copy ? MSG_ZEROCOPY : 0));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && errno == ENOBUFS && zero_copy)
+            {   //out of the memory pinned pages are accounted to; copy until some is free
+                zerocopy = false;
+                continue;
+            }
+            if (n < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            pending -= n;
+            for (size_t i = first; n > 0; i++)
+            {
+                size_t part = min((size_t)n, output[i].len - output[i].sent);
+                output[i].sent += part;
+                n -= part;
+                if (zero_copy)
+                {
+                    output[i].zerocopy = true;
+                    output[i].zerocopy_last = zerocopy_sent;
+                }
+            }
+            zerocopy_sent += (zero_copy ? 1 : 0);
+        }
+        release_output();
+        return true;
+    }
+};
+
+aes_server::aes_server(const server_options& options) : options(options)
+{
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+aes_server::~aes_server()
+{
+    for (int fd : listen_fds)
+    {
+        ::close(fd);
+    }
+    for (const string& path : unix_paths)
+    {
+        unlink(path.c_str());
+    }
+    if (stop_fd >= 0)
+    {
+        ::close(stop_fd);
+    }
+}
+
+bool aes_server::listen(const string& address, string& error)
+{
+    int fd = -1;
+    bool unix_socket = (address.compare(0, 5, "unix:") == 0 || address.find('/') != string::npos);
+    if (unix_socket)
+    {
+        string path = (address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        {
+            error = "the socket path must be 1 to " + to_string(sizeof(addr.sun_path) - 1) + " characters";
+            return false;
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        {   //left by a server that didn't get to clean up
+            unlink(path.c_str());
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+        {
+            error = strerror(errno);
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            return false;
+        }
+        listen_fds.push_back(fd);
+        unix_paths.push_back(path);
+        return true;
+    }
+
+    size_t colon = address.rfind(':');
+    string host = (colon == string::npos ? "" : address.substr(0, colon));
+    string port = (colon == string::npos ? address : address.substr(colon + 1));
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    {   //[::1]:port
+        host = host.substr(1, host.size() - 2);
+    }
+    addrinfo hints = {}, *found = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int result = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+    if (result != 0)
+    {
+        error = gai_strerror(result);
+        return false;
+    }
+    error = "no address to listen on";
+    for (addrinfo* a = found; a && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        int on = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            bind(fd, a->ai_addr, a->ai_addrlen) != 0 || ::listen(fd, SOMAXCONN) != 0))
+        {
+            error = strerror(errno);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd < 0)
+    {
+        return false;
+    }
+    listen_fds.push_back(fd);
+    return true;
+}
+
+bool aes_server::run(string& error)
+{
+    if (stop_fd < 0 || listen_fds.empty())
+    {
+        error = (stop_fd < 0 ? strerror(errno) : "nothing to listen on");
+        return false;
+    }
+    //Each loop watches every listening socket; EPOLLEXCLUSIVE (Linux 4.5) wakes
+    //just one of them for each new connection. Each also has an eventfd of its
+    //own (nullptr in epoll's data) that the key thread wakes it with.
+    vector<int> epoll_fds, wake_fds;
+    auto close_all = [&]
+    {
+        for (int fd : epoll_fds)
+        {
+            ::close(fd);
+        }
+        for (int fd : wake_fds)
+        {
+            ::close(fd);
+        }
+    };
+    for (unsigned int i = 0; i < max(1u, options.threads); i++)
+    {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stop_fd;
+        bool ok = (epoll_fd >= 0 && wake_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) == 0);
+        ev.data.ptr = nullptr;
+        ok = ok && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == 0;
+        for (int& fd : listen_fds)
+        {
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &fd;
+            if (ok && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            {
+                ev.events = EPOLLIN;
+                ok = (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+            }
+        }
+        if (epoll_fd >= 0)
+        {
+            epoll_fds.push_back(epoll_fd);
+        }
+        if (wake_fd >= 0)
+        {
+            wake_fds.push_back(wake_fd);
+        }
+        if (!ok)
+        {
+            error = strerror(errno);
+            close_all();
+            return false;
+        }
+    }
+
+    {
+        lock_guard<mutex> hold(key_lock);
+        key_stopping = false;
+    }
+    thread key_thread([this] { key_loop(); });
+    vector<thread> loops;
+    for (size_t i = 1; i < epoll_fds.size(); i++)
+    {
+        loops.emplace_back([this, &epoll_fds, &wake_fds, i] { event_loop(epoll_fds[i], wake_fds[i]); });
+    }
+    event_loop(epoll_fds[0], wake_fds[0]);
+    for (thread& t : loops)
+    {
+        t.join();
+    }
+    //The wake fds stay open until the key thread can no longer write to them
+    {
+        lock_guard<mutex> hold(key_lock);
+        key_stopping = true;
+        key_queue.clear();
+    }
+    key_signal.notify_all();
+    key_thread.join();
+    close_all();
+    return true;
+}
+
+//Queues a key for the key thread; nullptr if too many are waiting already
+shared_ptr<aes_server::key_request> aes_server::request_key(const file_header& header, int wake_fd)
+{
+    auto r = make_shared<key_request>();
+    r->header = header;
+    r->wake_fd = wake_fd;
+    {
+        lock_guard<mutex> hold(key_lock);
+        if (key_queue.size() >= max_queued_keys)
+        {
+            return nullptr;
+        }
+        key_queue.push_back(r);
+    }
+    key_signal.notify_one();
+    return r;
+}
+
+//Derives the queued keys one at a time, so however many are asked for, PBKDF2
+//only ever takes one core from the event loops
+void aes_server::key_loop()
+{
+    while (true)
+    {
+        shared_ptr<key_request> r;
+        {
+            unique_lock<mutex> hold(key_lock);
+            key_signal.wait(hold, [&] { return key_stopping || !key_queue.empty(); });
+            if (key_stopping)
+            {
+                return;
+            }
+            r = move(key_queue.front());
+            key_queue.pop_front();
+        }
+        if (r.use_count() == 1)
+        {   //the connection has closed while it waited
+            continue;
+        }
+        try
+        {
+            r->key = options.decryption_key(r->header, r->error);
+        }
+        catch (const exception& e)
+        {
+            r->error = e.what();
+        }
+        r->done.store(true, memory_order_release);
+        u64 one = 1;
+        ssize_t ignored = write(r->wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void aes_server::stop()
+{
+    u64 one = 1;
+    ssize_t ignored = write(stop_fd, &one, sizeof(one)); //fails only if it is already set
+    (void)ignored;
+}
+
+void aes_server::accept_connections(int epoll_fd, int listen_fd, int wake_fd, vector<unique_ptr<connection>>& connections)
+{
+    while (true)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {   //usually EAGAIN: another loop took it, or there are no more
+            return;
+        }
+        unique_ptr<connection> c(new connection);
+        c->server = this;
+        c->fd = fd;
+        c->wake_fd = wake_fd;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); //fails harmlessly on Unix sockets
+        c->zerocopy = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+        c->events = EPOLLIN;
+        epoll_event ev = {};
+        ev.events = c->events;
+        ev.data.ptr = c.get();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            continue;
+        }
+        c->slot = connections.size();
+        connections.push_back(move(c));
+    }
+}
+
+void aes_server::event_loop(int epoll_fd, int wake_fd)
+{
+    thread_pool pool(1); //the cipher runs on the loop's own thread
+    vector<unique_ptr<connection>> connections;
+    //Closed connections whose output the kernel may still be sending from with
+    //MSG_ZEROCOPY. Their buffers go back to the pool only once it says it is done;
+    //given to another connection sooner, the kernel could send that one's data.
+    vector<unique_ptr<connection>> lingering;
+    auto remove = [](vector<unique_ptr<connection>>& list, connection* c)
+    {
+        size_t slot = c->slot;
+        swap(list[slot], list.back());
+        list[slot]->slot = slot;
+        unique_ptr<connection> removed = move(list.back());
+        list.pop_back();
+        return removed;
+    };
+    auto close_connection = [&](connection* c)
+    {
+        unique_ptr<connection> closed = remove(connections, c);
+        if (closed->linger(epoll_fd))
+        {
+            closed->slot = lingering.size();
+            lingering.push_back(move(closed));
+        }
+    };
+    //After a connection's input: sends what it can, then closes the connection or
+    //changes what epoll watches it for
+    auto settle = [&](connection* c, bool ok, bool hangup)
+    {
+        //Send whatever is complete, rather than waiting for a full batch
+        if (ok && c->state != connection::want_op)
+        {
+            c->process(false, pool);
+        }
+        ok = ok && c->send_output();
+        if (!ok || (c->closing && (c->output.empty() || hangup)))
+        {
+            close_connection(c);
+            return;
+        }
+        bool reading = !c->closing && !c->key_wait && c->pending < max_pending_output;
+        u32 wanted = (reading ? (u32)EPOLLIN : 0u) | (c->pending > 0 ? (u32)EPOLLOUT : 0u);
+        if (wanted != c->events)
+        {
+            epoll_event ev = {};
+            ev.events = c->events = wanted;
+            ev.data.ptr = c;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    };
+
+    epoll_event events[connection_events_max];
+    while (true)
+    {
+        int n = epoll_wait(epoll_fd, events, connection_events_max, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            break;
+        }
+        bool woken = false;
+        for (int e = 0; e < n; e++)
+        {
+            void* p = events[e].data.ptr;
+            if (p == &stop_fd)
+            {
+                return;
+            }
+            if (p == nullptr)
+            {   //handled after the others, as it may close connections they refer to
+                woken = true;
+                continue;
+            }
+            if (p >= (void*)listen_fds.data() && p < (void*)(listen_fds.data() + listen_fds.size()))
+            {
+                accept_connections(epoll_fd, *(int*)p, wake_fd, connections);
+                continue;
+            }
+
+            connection* c = (connection*)p;
+            if (c->lingering)
+            {
+                c->read_completions();
+                if (c->output.empty())
+                {
+                    remove(lingering, c);
+                }
+                continue;
+            }
+            bool ok = true;
+            if (events[e].events & EPOLLERR)
+            {   //zero-copy completions, or a real error that the next call will find
+                c->read_completions();
+            }
+            if (c->key_wait && (events[e].events & (EPOLLHUP | EPOLLERR)))
+            {   //not being read, so nothing else would notice
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                ok = !(events[e].events & EPOLLHUP) && err == 0;
+            }
+            while (ok && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->closing && !c->key_wait &&
+                c->pending < max_pending_output)
+            {
+                size_t len = server_inbox_size;
+                u8* direct = c->direct_receive(len);
+                ssize_t got = recv(c->fd, direct ? direct : c->inbox.data(), len, 0);
+                if (got < 0)
+                {
+                    ok = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+                    if (errno != EINTR)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                if (got == 0)
+                {   //a client may stop sending and wait for the last response, but not mid-request
+                    c->closing = true;
+                    ok = (c->state == connection::want_op);
+                    break;
+                }
+                if (direct)
+                {
+                    c->work_len += got;
+                    c->frame_left -= got;
+                    if (c->frame_left == 0)
+                    {
+                        c->state = connection::want_length;
+                    }
+                    if (c->work_len == c->work_capacity)
+                    {
+                        c->process(false, pool);
+                    }
+                }
+                else
+                {
+                    c->inbox.mark_used(got);
+                    ok = c->take_input(c->inbox.data(), got, options, pool);
+                }
+            }
+            settle(c, ok, events[e].events & EPOLLHUP);
+        }
+
+        //Keys from the key thread. A connection only has one outstanding, so each
+        //that is done gets going again.
+        if (woken)
+        {
+            u64 count;
+            ssize_t ignored = read(wake_fd, &count, sizeof(count));
+            (void)ignored;
+            vector<connection*> ready;
+            for (const unique_ptr<connection>& c : connections)
+            {
+                if (c->key_wait && c->key_wait->done.load(memory_order_acquire))
+                {
+                    ready.push_back(c.get());
+                }
+            }
+            for (connection* c : ready)
+            {
+                bool ok = c->key_arrived(options, pool);
+                settle(c, ok, false);
+            }
+        }
+    }
+}
+#endif
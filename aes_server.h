@@ -0,0 +1,122 @@
+/* A long-lived encryption service, for callers that would otherwise start the
+program for every file: the tables are made and the keys expanded once, and each
+request only costs the cipher. It listens on a Unix or TCP socket and runs one
+epoll event loop per thread, each owning the connections it accepts.
+
+The protocol. A connection carries any number of requests, one after another:
+
+    client: one byte, 'E' to encrypt or 'D' to decrypt
+            the input as frames: a 4-byte big-endian length, then that many
+            bytes; a frame of length 0 ends the input
+    server: the output as frames in the same way, ending with a 0 frame
+            one status byte (server_status)
+
+Encryption turns the input into a SEEKABLE file (aes_io.h), exactly what the
+command line writes with -m SEEKABLE, and decryption takes one back. The output
+streams as the input arrives: each chunk is sent once it is complete (and, when
+decrypting, once its tag has been checked), so nothing unauthenticated is ever
+sent. A request that fails stops producing output, but its input is still read
+to the end, so the connection can be used for the next one; the status says what
+went wrong. Anything that isn't the protocol closes the connection.
+
+A key that has to be derived (a passphrase under a salt not seen before) is
+derived on a thread of its own, never on an event loop: a client can choose the
+salt, and so make the server run PBKDF2 as often as it likes. The connection
+waiting for it stops being read meanwhile; the loop goes on with the others.
+
+Large sends go with MSG_ZEROCOPY where the socket allows it (TCP on Linux 4.14
+and later), so the kernel transmits straight from the buffer the cipher wrote
+into; each buffer is only reused once the kernel says it is done with it, even
+when the connection closes first (the socket is then shut down, kept until the
+kernel reports, and closed after). Where
+the kernel reports that it copied anyway (loopback), the connection goes back to
+plain sends. Large frames are received straight into the buffer the cipher reads
+from, so apart from the kernel's own copies the only pass over the data is the
+cipher's.
+*/
+
+#ifndef AES_SERVER_H
+#define AES_SERVER_H
+
+#include "aes_io.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+//epoll, eventfd and MSG_ZEROCOPY are Linux's
+#if defined(__linux__)
+#define AES_SERVER
+#endif
+
+enum server_status
+{
+    server_ok = 0,
+    server_failed = 1,   //a tag didn't match, or the input isn't a SEEKABLE file
+    server_wrong_key = 2, //the input needs a different key (another size, or a passphrase)
+    server_busy = 3       //too many keys waiting to be derived; try again later
+};
+
+const size_t server_max_frame = 16 << 20;
+
+struct server_options
+{
+    unsigned int threads = std::thread::hardware_concurrency(); //event loops
+    int chunk_shift = seekable_default_chunk_shift;             //of the files it encrypts
+    //The key for a new file, given its header; may add the key derivation's
+    //parameters to the header. Called from every loop at once.
+    std::function<std::shared_ptr<const expanded_key>(file_header& header)> encryption_key;
+    //The key a file needs, or nullptr (and why in error) if it can't be had.
+    //Called from every loop at once, and from the key thread.
+    std::function<std::shared_ptr<const expanded_key>(const file_header& header, std::string& error)> decryption_key;
+    //Whether decryption_key answers for this header at once: a fixed key, one
+    //already derived, or a refusal. Only then is it called on an event loop; for
+    //anything else (and for everything, if this is left empty) it is called on
+    //the key thread.
+    std::function<bool(const file_header& header)> decryption_key_ready;
+    size_t key_bytes = 32; //of the files it encrypts
+};
+
+#ifdef AES_SERVER
+class aes_server
+{
+public:
+    explicit aes_server(const server_options& options);
+    ~aes_server();
+    aes_server(const aes_server&) = delete;
+    aes_server& operator=(const aes_server&) = delete;
+
+    //"unix:PATH", or anything with a '/' in it, is a Unix socket (a stale one
+    //left at PATH is replaced); otherwise HOST:PORT, or just PORT for every
+    //interface. False, with the reason in error, if it can't be listened on.
+    bool listen(const std::string& address, std::string& error);
+
+    //Serves until stop(); false, with the reason in error, if the loops can't start
+    bool run(std::string& error);
+
+    //Safe to call from a signal handler or another thread. Open connections are
+    //dropped, whatever they were doing.
+    void stop();
+
+private:
+    struct connection;
+    struct key_request;
+    void event_loop(int epoll_fd, int wake_fd);
+    void accept_connections(int epoll_fd, int listen_fd, int wake_fd, std::vector<std::unique_ptr<connection>>& connections);
+    std::shared_ptr<key_request> request_key(const file_header& header, int wake_fd);
+    void key_loop();
+
+    server_options options;
+    std::vector<int> listen_fds;
+    std::vector<std::string> unix_paths; //to remove afterwards
+    int stop_fd = -1;                    //an eventfd every loop watches
+
+    //Keys for the key thread to derive, oldest first
+    std::mutex key_lock;
+    std::condition_variable key_signal;
+    std::deque<std::shared_ptr<key_request>> key_queue;
+    bool key_stopping = false;
+};
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+/* Optional instrumentation of the library and the file pipeline: the time spent in
+each stage (in time-stamp counter ticks), the bytes each stage handled, how deep
+the read-ahead and write-behind queues ran, and the backend the keys were expanded
+for. It costs a couple of counter reads and atomic adds per call, so it is only
+compiled in with -DAES_STATS. Without it every hook below is an empty inline
+function, and aes_stats_snapshot() reports enabled = false.
+*/
+
+#ifndef AES_STATS_H
+#define AES_STATS_H
+
+#include "aes.h"
+#ifdef AES_STATS
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AES_STATS_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#include <chrono>
+#endif
+#endif
+
+//Key setup is aes_context and make_gcm_key; read and write are the file I/O as the
+//pipeline sees it (waiting for it included); decode and encode are the hex and
+//base64 armor; cipher is the mode itself, across all of the pool's threads.
+enum aes_stage { stage_key_setup, stage_read, stage_decode, stage_cipher, stage_encode, stage_write, aes_stage_count };
+const char* const aes_stage_names[] = { "key setup", "read", "decode", "cipher", "encode", "write" };
+
+enum aes_queue { queue_read, queue_write, aes_queue_count };
+const char* const aes_queue_names[] = { "read-ahead", "write-behind" };
+
+struct aes_stage_stats
+{
+    u64 ticks = 0;
+    u64 calls = 0;
+    u64 bytes = 0;
+};
+
+//Each time the pipeline moves to the next buffer it notes how many requests were
+//in flight, and whether it had to wait for the one it wanted
+struct aes_queue_stats
+{
+    u64 samples = 0;
+    u64 depth_total = 0;
+    u64 max_depth = 0;
+    u64 stalls = 0;
+};
+
+struct aes_stats
+{
+    bool enabled = false;
+    const char* backend = nullptr; //of the last key expanded; nullptr if none was
+    double ticks_per_second = 0;
+    double seconds = 0;            //since the start, or the last aes_stats_reset()
+    aes_stage_stats stages[aes_stage_count];
+    aes_queue_stats queues[aes_queue_count];
+};
+
+//The counts so far. Safe to call while other threads are counting; each number
+//is read on its own, so they may be a moment apart.
+aes_stats aes_stats_snapshot();
+void aes_stats_reset();
+//The snapshot as a table
+void aes_stats_dump(std::ostream& out);
+
+#ifdef AES_STATS
+inline u64 aes_stats_ticks()
+{
+#ifdef AES_STATS_TSC
+    return __rdtsc();
+#else
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void aes_stats_add(aes_stage stage, u64 ticks, u64 bytes);
+void aes_stats_queue(aes_queue queue, unsigned int depth, bool stalled);
+void aes_stats_backend(const aes_backend& backend);
+
+//Charges the time until it goes out of scope to stage
+class aes_stage_timer
+{
+public:
+    explicit aes_stage_timer(aes_stage stage, u64 bytes = 0) : stage(stage), bytes(bytes), start(aes_stats_ticks()) {}
+    aes_stage_timer(const aes_stage_timer&) = delete;
+    aes_stage_timer& operator=(const aes_stage_timer&) = delete;
+    ~aes_stage_timer()
+    {
+        aes_stats_add(stage, aes_stats_ticks() - start, bytes);
+    }
+
+    //For when the byte count is only known at the end
+    void set_bytes(u64 n)
+    {
+        bytes = n;
+    }
+
+private:
+    aes_stage stage;
+    u64 bytes;
+    u64 start;
+};
+#else
+inline void aes_stats_queue(aes_queue, unsigned int, bool) {}
+inline void aes_stats_backend(const aes_backend&) {}
+
+class aes_stage_timer
+{
+public:
+    explicit aes_stage_timer(aes_stage, u64 = 0) {}
+    void set_bytes(u64) {}
+};
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+/* The autotuner and its file (aes_tune.h)
+*/
+
+#include "aes_tune.h"
+#include "aes_internal.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+using namespace std;
+
+//The backends are timed on a buffer that fits in the L2 cache, so it is the
+//kernels being compared rather than the memory; the chunk sizes on one big
+//enough to give every thread several chunks, as a file would
+const size_t tune_backend_bytes = 256 << 10;
+const size_t tune_chunk_bytes = 32 << 20;
+const size_t tune_chunk_sizes[] = { 256 << 10, 512 << 10, 1 << 20, 2 << 20, 4 << 20 };
+
+mutex tuning_lock;
+aes_tuning tuning_in_use;
+
+string cpu_model()
+{
+#ifdef AES_X86
+    string brand = cpu_brand_string();
+    if (!brand.empty())
+    {
+        return brand;
+    }
+#endif
+    //x86 Linux has "model name"; ARM has no name, only the implementer and part numbers
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line, implementer, part;
+    while (getline(cpuinfo, line))
+    {
+        size_t colon = line.find(':');
+        if (colon == string::npos)
+        {
+            continue;
+        }
+        string field = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+        string value = line.substr(min(line.find_first_not_of(" \t", colon + 1), line.size()));
+        if (field == "model name" && !value.empty())
+        {
+            return value;
+        }
+        if (field == "CPU implementer" && implementer.empty())
+        {
+            implementer = value;
+        }
+        if (field == "CPU part" && part.empty())
+        {
+            part = value;
+        }
+    }
+    if (!implementer.empty() && !part.empty())
+    {
+        return "implementer " + implementer + " part " + part;
+    }
+    return "unknown";
+}
+
+//The shortest of runs timings of call, in seconds. The shortest is the one least
+//disturbed by everything else the machine was doing.
+double fastest_run(int runs, const function<void()>& call)
+{
+    double best = 1e30;
+    for (int r = 0; r < runs; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        call();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+double mb_per_s(size_t bytes, double seconds)
+{
+    return bytes / seconds / 1e6;
+}
+
+aes_tuning autotune(thread_pool& pool, bool allow_ttable, ostream* report)
+{
+    aes_tuning best;
+    vector<u8> data(max(tune_backend_bytes, tune_chunk_bytes));
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (u8)(i * 131);
+    }
+    u8 key[32];
+    for (int i = 0; i < 32; i++)
+    {
+        key[i] = (u8)(i * 7 + 1);
+    }
+    if (report)
+    {
+        *report << "CPU: " << cpu_model() << "\n";
+    }
+
+    //Encryption and decryption together, with AES-256: the modes that can run
+    //in parallel use one or the other, and the key size scales every backend alike
+    double best_rate = 0;
+    for (const aes_backend* backend : tuning_candidates())
+    {
+        if (backend == &ttable_backend && !allow_ttable)
+        {
+            continue;
+        }
+        aes_context ctx(key, 32, backend);
+        size_t nblocks = tune_backend_bytes / 16;
+        ctx.encrypt_blocks(data.data(), data.data(), nblocks); //warm up
+        double seconds = fastest_run(20, [&] { ctx.encrypt_blocks(data.data(), data.data(), nblocks); })
+            + fastest_run(20, [&] { ctx.decrypt_blocks(data.data(), data.data(), nblocks); });
+        double rate = mb_per_s(2 * tune_backend_bytes, seconds);
+        if (report)
+        {
+            *report << "  " << left << setw(12) << backend->name << right << setw(8) << (long long)rate << " MB/s\n";
+        }
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            best.backend = backend;
+        }
+    }
+
+    //CTR stands in for the other modes that split the data into chunks. Sizes
+    //that leave some threads with nothing to do aren't tried.
+    aes_context ctx(key, 32, best.backend);
+    array<u8, 16> iv = {};
+    ctr_crypt_parallel(pool, ctx, data.data(), data.data(), tune_chunk_bytes, iv, 0); //starts the workers
+    best_rate = 0;
+    for (size_t chunk_size : tune_chunk_sizes)
+    {
+        if (chunk_size != tune_chunk_sizes[0] && tune_chunk_bytes / chunk_size < pool.size())
+        {
+            break;
+        }
+        double seconds = fastest_run(5, [&] { ctr_crypt_parallel(pool, ctx, data.data(), data.data(), tune_chunk_bytes, iv, 0, chunk_size); });
+        double rate = mb_per_s(tune_chunk_bytes, seconds);
+        if (report)
+        {
+            *report << "  " << setw(4) << (chunk_size >> 10) << " KiB chunks on " << pool.size() << " threads " << setw(8) << (long long)rate
+                    << " MB/s\n";
+        }
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            best.chunk_size = chunk_size;
+        }
+    }
+    if (report)
+    {
+        *report << "Chose " << best.backend->name << " with " << (best.chunk_size >> 10) << " KiB chunks\n";
+    }
+    return best;
+}
+
+void use_tuning(const aes_tuning& tuning)
+{
+    lock_guard<mutex> hold(tuning_lock);
+    tuning_in_use = tuning;
+    tuned_backend.store(tuning.backend, memory_order_release);
+}
+
+aes_tuning current_tuning()
+{
+    lock_guard<mutex> hold(tuning_lock);
+    return tuning_in_use;
+}
+
+//A line of the tuning file, split at the tabs; false if it doesn't have four fields
+bool parse_tuning_line(const string& line, string& model, unsigned long& threads, string& backend, unsigned long long& chunk_size)
+{
+    vector<string> fields;
+    istringstream in(line);
+    for (string field; getline(in, field, '\t');)
+    {
+        fields.push_back(field);
+    }
+    if (fields.size() != 4)
+    {
+        return false;
+    }
+    char* end;
+    threads = strtoul(fields[1].c_str(), &end, 10);
+    if (*end != 0 || fields[1].empty())
+    {
+        return false;
+    }
+    chunk_size = strtoull(fields[3].c_str(), &end, 10);
+    if (*end != 0 || fields[3].empty())
+    {
+        return false;
+    }
+    model = fields[0];
+    backend = fields[2];
+    return true;
+}
+
+bool load_tuning(const string& path, unsigned int threads, aes_tuning& tuning)
+{
+    ifstream in(path);
+    string model = cpu_model();
+    for (string line; getline(in, line);)
+    {
+        string line_model, backend_name;
+        unsigned long line_threads;
+        unsigned long long chunk_size;
+        if (!parse_tuning_line(line, line_model, line_threads, backend_name, chunk_size) || line_model != model)
+        {
+            continue;
+        }
+        vector<const aes_backend*> candidates = tuning_candidates();
+        auto backend = find_if(candidates.begin(), candidates.end(), [&](const aes_backend* b) { return backend_name == b->name; });
+        if (backend == candidates.end())
+        {
+            return false;
+        }
+        tuning.backend = *backend;
+        //Anything a whole number of blocks works; the bounds only keep a damaged
+        //file from making one task of the whole input, or millions of tiny ones
+        if (line_threads == threads && chunk_size % 16 == 0 && chunk_size >= (4 << 10) && chunk_size <= (1ull << 30))
+        {
+            tuning.chunk_size = (size_t)chunk_size;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool save_tuning(const string& path, unsigned int threads, const aes_tuning& tuning)
+{
+    string model = cpu_model();
+    vector<string> lines;
+    {
+        ifstream in(path);
+        for (string line; getline(in, line);)
+        {
+            string line_model, backend_name;
+            unsigned long line_threads;
+            unsigned long long chunk_size;
+            if (!parse_tuning_line(line, line_model, line_threads, backend_name, chunk_size) || line_model != model)
+            {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(model + "\t" + to_string(threads) + "\t" + (tuning.backend ? tuning.backend->name : best_backend().name) + "\t"
+        + to_string(tuning.chunk_size));
+
+    //Written beside it and renamed over it, so a reader never sees half a file
+    error_code ec;
+    filesystem::path parent = filesystem::path(path).parent_path();
+    if (!parent.empty())
+    {
+        filesystem::create_directories(parent, ec);
+    }
+    string temporary = path + ".new";
+    {
+        ofstream out(temporary, ios::trunc);
+        for (const string& line : lines)
+        {
+            out << line << "\n";
+        }
+        if (!out.flush())
+        {
+            out.close();
+            remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+/* The autotuner: measures, on this machine, which backend (including its
+interleave width) and which chunk size for the thread pool are fastest, and keeps
+the result in a small file so later runs start with it. The file has a line per
+CPU model,
+
+    model<TAB>threads<TAB>backend name<TAB>chunk size in bytes
+
+so one file can be shared between machines. Only the backend comes from a line
+whose thread count differs from the pool's; the chunk size depends on it.
+
+Candidates are constant-time unless the T-tables are asked for: their speed
+without hardware AES comes from key-dependent table lookups, which leak the key
+through the cache, so a measurement alone must never choose them.
+*/
+
+#ifndef AES_TUNE_H
+#define AES_TUNE_H
+
+#include "aes.h"
+#include <iosfwd>
+#include <string>
+
+struct aes_tuning
+{
+    const aes_backend* backend = nullptr; //nullptr for the default best_backend()
+    size_t chunk_size = ctr_chunk_size;   //for ctr_crypt_parallel and the like
+};
+
+//This CPU's model, as the tuning file names it: the CPUID brand string on x86,
+//otherwise what /proc/cpuinfo says, otherwise "unknown"
+std::string cpu_model();
+
+//Times every candidate from tuning_candidates() on bulk encryption and
+//decryption, then the chunk sizes from 256 KiB to 4 MiB on pool with the winner.
+//Takes a second or two. Writes what it measured to report, if not nullptr.
+aes_tuning autotune(thread_pool& pool, bool allow_ttable = false, std::ostream* report = nullptr);
+
+//Makes best_backend() return tuning.backend (from then on; contexts already made
+//keep theirs) and current_tuning() return tuning
+void use_tuning(const aes_tuning& tuning);
+aes_tuning current_tuning();
+
+//This CPU's line of the file at path, for a pool of threads threads. False if the
+//file has none, or names a backend this CPU can't run (it may have been
+//measured with a build that has backends this one lacks).
+bool load_tuning(const std::string& path, unsigned int threads, aes_tuning& tuning);
+//Replaces this CPU's line, keeping the others; creates the file and its
+//directory if need be. False if it can't be written.
+bool save_tuning(const std::string& path, unsigned int threads, const aes_tuning& tuning);
+
+#endif
@@ -0,0 +1,1031 @@
+/* x86 kernels: CPU feature detection, AES-NI and VAES block and CTR functions,
+PCLMULQDQ GHASH, the stitched AES-NI + PCLMULQDQ and VAES-512 + VPCLMULQDQ GCM
+loops and SHA-NI SHA-256.
+*/
+
+#include "aes_internal.h"
+
+using namespace std;
+
+#ifdef AES_X86
+//CPUID leaf/subleaf into regs = { eax, ebx, ecx, edx }
+void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, leaf, subleaf);
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    if (leaf <= __get_cpuid_max(0, nullptr))
+    {
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    }
+#endif
+}
+
+//Which register state the OS saves on context switch (XCR0); the AVX registers
+//can only be used if it saves them.
+u64 os_saved_state()
+{
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    if (!(regs[2] & (1 << 27))) //OSXSAVE
+    {
+        return 0;
+    }
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((u64)hi << 32) | lo;
+#endif
+}
+
+bool cpu_has_aesni()
+{
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    return (regs[2] & (1 << 25)) != 0;
+}
+
+bool cpu_has_ssse3()
+{
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    return (regs[2] & (1 << 9)) != 0;
+}
+
+bool cpu_has_pclmul()
+{
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    return (regs[2] & (1 << 1)) != 0;
+}
+
+bool cpu_has_avx2()
+{
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[1] & (1 << 5)) && (os_saved_state() & 0x6) == 0x6;
+}
+
+bool cpu_has_vaes()
+{
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[2] & (1 << 9)) != 0;
+}
+
+//AVX-512 F and BW (the byte shuffles are BW; every CPU with VAES has both). It also
+//needs the OS to save the opmask and upper zmm registers (XCR0 bits 5-7).
+bool cpu_has_avx512()
+{
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[1] & (1 << 16)) && (regs[1] & (1u << 30)) && (os_saved_state() & 0xe6) == 0xe6;
+}
+
+bool cpu_has_vpclmulqdq()
+{
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[2] & (1 << 10)) != 0;
+}
+
+bool cpu_has_sha()
+{
+    unsigned int regs[4];
+    cpuid(7, 0, regs);
+    return (regs[1] & (1 << 29)) && cpu_has_ssse3();
+}
+
+//The brand string from CPUID leaves 0x80000002 to 0x80000004, trimmed; empty if
+//the CPU doesn't have them
+string cpu_brand_string()
+{
+    unsigned int regs[4];
+#ifdef _MSC_VER
+    __cpuid((int*)regs, 0x80000000);
+#else
+    __cpuid(0x80000000, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    if (regs[0] < 0x80000004)
+    {
+        return "";
+    }
+    char brand[49] = {};
+    for (unsigned int i = 0; i < 3; i++)
+    {
+#ifdef _MSC_VER
+        __cpuid((int*)regs, 0x80000002 + i);
+#else
+        __cpuid(0x80000002 + i, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        memcpy(brand + 16 * i, regs, 16);
+    }
+    string model = brand;
+    model.erase(0, model.find_first_not_of(' '));
+    model.erase(model.find_last_not_of(' ') + 1);
+    return model;
+}
+#endif
+
+
+#ifdef AES_X86
+//One step of the key expansion: AESKEYGENASSIST gives SubWord(RotWord(w3)) ^ rcon
+//in its top word, which is then xored into the running prefix xor of the previous key.
+template <int rcon>
+TARGET_AESNI __m128i aesni_expand_step(__m128i key)
+{
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, rcon), 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+//keys.dec for the equivalent inverse cipher, as in the software version: the
+//round keys in reverse order, with AESIMC (InvMixColumns) on all but the ends
+TARGET_AESNI void make_decrypt_keys_aesni(aes_round_keys& keys)
+{
+    for (int round = 0; round <= keys.rounds; round++)
+    {
+        __m128i dk = _mm_loadu_si128((const __m128i*)&keys.enc[16 * (keys.rounds - round)]);
+        if (round != 0 && round != keys.rounds)
+        {
+            dk = _mm_aesimc_si128(dk);
+        }
+        _mm_storeu_si128((__m128i*)&keys.dec[16 * round], dk);
+    }
+}
+
+//SubWord of one key word, done by AESKEYGENASSIST (lane 2 of its result is
+//SubWord of lane 3) so that no table is indexed by the key
+TARGET_AESNI u32 aesni_sub_word(u32 w)
+{
+    return (u32)_mm_extract_epi32(_mm_aeskeygenassist_si128(_mm_set_epi32((int)w, 0, 0, 0), 0), 2);
+}
+
+//192 and 256-bit keys don't fall on round key boundaries, so they are expanded
+//a word at a time as in FIPS-197 section 5.2
+TARGET_AESNI void make_key_schedule_aesni_words(const u8* key, size_t key_bytes, aes_round_keys& keys)
+{
+    const int nk = (int)key_bytes / 4;
+    keys.rounds = nk + 6;
+    u32 w[4 * (aes_max_rounds + 1)];
+    u8 rcon = 1;
+    for (int i = 0; i < 4 * (keys.rounds + 1); i++)
+    {
+        if (i < nk)
+        {
+            w[i] = load_word(key + 4 * i);
+        }
+        else
+        {
+            u32 t = w[i - 1];
+            if (i % nk == 0)
+            {
+                t = aesni_sub_word((t >> 8) | (t << 24)) ^ rcon;
+                rcon = (u8)((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0));
+            }
+            else if (nk > 6 && i % nk == 4)
+            {
+                t = aesni_sub_word(t);
+            }
+            w[i] = w[i - nk] ^ t;
+        }
+        store_word(&keys.enc[4 * i], w[i]);
+    }
+    make_decrypt_keys_aesni(keys);
+}
+
+//Fills keys.enc and keys.dec, same layout as the software version
+TARGET_AESNI void make_key_schedule_aesni(const u8* key, size_t key_bytes, aes_round_keys& keys)
+{
+    if (key_bytes != 16)
+    {
+        make_key_schedule_aesni_words(key, key_bytes, keys);
+        return;
+    }
+    __m128i rk[11];
+    rk[0] = _mm_loadu_si128((const __m128i*)key);
+    rk[1] = aesni_expand_step<0x01>(rk[0]);
+    rk[2] = aesni_expand_step<0x02>(rk[1]);
+    rk[3] = aesni_expand_step<0x04>(rk[2]);
+    rk[4] = aesni_expand_step<0x08>(rk[3]);
+    rk[5] = aesni_expand_step<0x10>(rk[4]);
+    rk[6] = aesni_expand_step<0x20>(rk[5]);
+    rk[7] = aesni_expand_step<0x40>(rk[6]);
+    rk[8] = aesni_expand_step<0x80>(rk[7]);
+    rk[9] = aesni_expand_step<0x1b>(rk[8]);
+    rk[10] = aesni_expand_step<0x36>(rk[9]);
+
+    keys.rounds = 10;
+    for (int round = 0; round <= 10; round++)
+    {
+        _mm_storeu_si128((__m128i*)&keys.enc[16 * round], rk[round]);
+    }
+    make_decrypt_keys_aesni(keys);
+}
+
+template <int Nr>
+TARGET_AESNI array<u8, 16> encrypt_block_aesni(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const __m128i* rk = (const __m128i*)&keys.enc[0];
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&block[0]), _mm_loadu_si128(rk));
+    AES_UNROLL
+    for (int round = 1; round < Nr; round++)
+    {
+        b = _mm_aesenc_si128(b, _mm_loadu_si128(rk + round));
+    }
+    b = _mm_aesenclast_si128(b, _mm_loadu_si128(rk + Nr));
+    _mm_storeu_si128((__m128i*)&block[0], b);
+    return block;
+}
+
+//keys.dec is already in the form AESDEC expects (AESIMC applied to the middle keys)
+template <int Nr>
+TARGET_AESNI array<u8, 16> decrypt_block_aesni(const aes_round_keys& keys, array<u8, 16> block)
+{
+    const __m128i* rk = (const __m128i*)&keys.dec[0];
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&block[0]), _mm_loadu_si128(rk));
+    AES_UNROLL
+    for (int round = 1; round < Nr; round++)
+    {
+        b = _mm_aesdec_si128(b, _mm_loadu_si128(rk + round));
+    }
+    b = _mm_aesdeclast_si128(b, _mm_loadu_si128(rk + Nr));
+    _mm_storeu_si128((__m128i*)&block[0], b);
+    return block;
+}
+
+//8 blocks in flight: AESENC has a latency of several cycles but can start a new
+//instruction every cycle, so independent blocks fill the pipeline. The autotuner
+//also tries 4 and 12 (W), as the best width depends on the core.
+const int aesni_interleave = 8;
+template <int Nr, int W = aesni_interleave>
+TARGET_AESNI void encrypt_blocks_aesni(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m128i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm_loadu_si128((const __m128i*)&keys.enc[16 * round]);
+    }
+
+    for (; nblocks >= W; nblocks -= W)
+    {
+        __m128i b[W];
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * i)), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < W; i++)
+            {
+                b[i] = _mm_aesenc_si128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_aesenclast_si128(b[i], rk[Nr]));
+        }
+        in += 16 * W;
+        out += 16 * W;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            b = _mm_aesenc_si128(b, rk[round]);
+        }
+        _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b, rk[Nr]));
+    }
+}
+
+template <int Nr, int W = aesni_interleave>
+TARGET_AESNI void decrypt_blocks_aesni(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m128i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm_loadu_si128((const __m128i*)&keys.dec[16 * round]);
+    }
+
+    for (; nblocks >= W; nblocks -= W)
+    {
+        __m128i b[W];
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * i)), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < W; i++)
+            {
+                b[i] = _mm_aesdec_si128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_aesdeclast_si128(b[i], rk[Nr]));
+        }
+        in += 16 * W;
+        out += 16 * W;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            b = _mm_aesdec_si128(b, rk[round]);
+        }
+        _mm_storeu_si128((__m128i*)out, _mm_aesdeclast_si128(b, rk[Nr]));
+    }
+}
+
+//VAES runs one AES round on every 128-bit lane of a ymm (2 blocks) or zmm
+//(4 blocks) register. 16 blocks are kept in flight per iteration; anything
+//shorter goes through the AES-NI kernel.
+const int vaes_blocks = 16;
+template <int Nr>
+TARGET_VAES512 void encrypt_blocks_vaes512(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m512i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)&keys.enc[16 * round]));
+    }
+
+    for (; nblocks >= vaes_blocks; nblocks -= vaes_blocks)
+    {
+        __m512i b[4];
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_xor_si512(_mm512_loadu_si512(in + 64 * i), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 4; i++)
+            {
+                b[i] = _mm512_aesenc_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            _mm512_storeu_si512(out + 64 * i, _mm512_aesenclast_epi128(b[i], rk[Nr]));
+        }
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    encrypt_blocks_aesni<Nr>(keys, in, out, nblocks);
+}
+
+template <int Nr>
+TARGET_VAES512 void decrypt_blocks_vaes512(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m512i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)&keys.dec[16 * round]));
+    }
+
+    for (; nblocks >= vaes_blocks; nblocks -= vaes_blocks)
+    {
+        __m512i b[4];
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_xor_si512(_mm512_loadu_si512(in + 64 * i), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 4; i++)
+            {
+                b[i] = _mm512_aesdec_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            _mm512_storeu_si512(out + 64 * i, _mm512_aesdeclast_epi128(b[i], rk[Nr]));
+        }
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    decrypt_blocks_aesni<Nr>(keys, in, out, nblocks);
+}
+
+template <int Nr>
+TARGET_VAES256 void encrypt_blocks_vaes256(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m256i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&keys.enc[16 * round]));
+    }
+
+    for (; nblocks >= vaes_blocks; nblocks -= vaes_blocks)
+    {
+        __m256i b[8];
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(in + 32 * i)), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+                b[i] = _mm256_aesenc_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            _mm256_storeu_si256((__m256i*)(out + 32 * i), _mm256_aesenclast_epi128(b[i], rk[Nr]));
+        }
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    encrypt_blocks_aesni<Nr>(keys, in, out, nblocks);
+}
+
+template <int Nr>
+TARGET_VAES256 void decrypt_blocks_vaes256(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks)
+{
+    __m256i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&keys.dec[16 * round]));
+    }
+
+    for (; nblocks >= vaes_blocks; nblocks -= vaes_blocks)
+    {
+        __m256i b[8];
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(in + 32 * i)), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+                b[i] = _mm256_aesdec_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            _mm256_storeu_si256((__m256i*)(out + 32 * i), _mm256_aesdeclast_epi128(b[i], rk[Nr]));
+        }
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    decrypt_blocks_aesni<Nr>(keys, in, out, nblocks);
+}
+
+//CTR with the counters kept as little-endian numbers in the registers: (hi, lo)
+//in the two halves of a lane, lo first, so adding i to the low half gives counter
+//i, and one byte shuffle turns it into the block to encrypt. A group of blocks is
+//only done that way if none of its counters carries into hi; one that does (once
+//in 2^64 blocks) goes a block at a time, as does whatever is left over.
+template <int Nr, int W = aesni_interleave>
+TARGET_AESNI void ctr_blocks_aesni(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks, u64& hi, u64& lo)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm_loadu_si128((const __m128i*)&keys.enc[16 * round]);
+    }
+    u64 h = hi, l = lo;
+
+    for (; nblocks >= W && l <= ~0ULL - (W - 1); nblocks -= W)
+    {
+        __m128i counter = _mm_set_epi64x((long long)h, (long long)l);
+        __m128i b[W];
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(counter, _mm_set_epi64x(0, i)), reverse), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < W; i++)
+            {
+                b[i] = _mm_aesenc_si128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < W; i++)
+        {
+            b[i] = _mm_aesenclast_si128(b[i], rk[Nr]);
+            _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)(in + 16 * i))));
+        }
+        l += W;
+        h += (l == 0);
+        in += 16 * W;
+        out += 16 * W;
+    }
+
+    for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    {
+        __m128i b = _mm_xor_si128(_mm_shuffle_epi8(_mm_set_epi64x((long long)h, (long long)l), reverse), rk[0]);
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            b = _mm_aesenc_si128(b, rk[round]);
+        }
+        b = _mm_aesenclast_si128(b, rk[Nr]);
+        _mm_storeu_si128((__m128i*)out, _mm_xor_si128(b, _mm_loadu_si128((const __m128i*)in)));
+        h += (++l == 0);
+    }
+    hi = h;
+    lo = l;
+}
+
+//The same with 16 counters in 4 zmm (or 8 ymm) registers, lane j of register i
+//holding counter 4i + j (2i + j); the rest goes through the AES-NI kernel
+template <int Nr>
+TARGET_VAES512 void ctr_blocks_vaes512(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks, u64& hi, u64& lo)
+{
+    const __m512i reverse = _mm512_maskz_broadcast_i32x4(0xffff, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m512i lanes = _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0);
+    __m512i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)&keys.enc[16 * round]));
+    }
+    u64 h = hi, l = lo;
+
+    for (; nblocks >= vaes_blocks && l <= ~0ULL - (vaes_blocks - 1); nblocks -= vaes_blocks)
+    {
+        __m512i counter = _mm512_add_epi64(_mm512_maskz_broadcast_i32x4(0xffff, _mm_set_epi64x((long long)h, (long long)l)), lanes);
+        __m512i b[4];
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_add_epi64(counter, _mm512_set_epi64(0, 4 * i, 0, 4 * i, 0, 4 * i, 0, 4 * i));
+            b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(b[i], reverse), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 4; i++)
+            {
+                b[i] = _mm512_aesenc_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_aesenclast_epi128(b[i], rk[Nr]);
+            _mm512_storeu_si512(out + 64 * i, _mm512_xor_si512(b[i], _mm512_loadu_si512(in + 64 * i)));
+        }
+        l += vaes_blocks;
+        h += (l == 0);
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    ctr_blocks_aesni<Nr>(keys, in, out, nblocks, h, l);
+    hi = h;
+    lo = l;
+}
+
+template <int Nr>
+TARGET_VAES256 void ctr_blocks_vaes256(const aes_round_keys& keys, const u8* in, u8* out, size_t nblocks, u64& hi, u64& lo)
+{
+    const __m256i reverse = _mm256_broadcastsi128_si256(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m256i lanes = _mm256_set_epi64x(0, 1, 0, 0);
+    __m256i rk[Nr + 1];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&keys.enc[16 * round]));
+    }
+    u64 h = hi, l = lo;
+
+    for (; nblocks >= vaes_blocks && l <= ~0ULL - (vaes_blocks - 1); nblocks -= vaes_blocks)
+    {
+        __m256i counter = _mm256_add_epi64(_mm256_broadcastsi128_si256(_mm_set_epi64x((long long)h, (long long)l)), lanes);
+        __m256i b[8];
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm256_add_epi64(counter, _mm256_set_epi64x(0, 2 * i, 0, 2 * i));
+            b[i] = _mm256_xor_si256(_mm256_shuffle_epi8(b[i], reverse), rk[0]);
+        }
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+                b[i] = _mm256_aesenc_epi128(b[i], rk[round]);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm256_aesenclast_epi128(b[i], rk[Nr]);
+            _mm256_storeu_si256((__m256i*)(out + 32 * i), _mm256_xor_si256(b[i], _mm256_loadu_si256((const __m256i*)(in + 32 * i))));
+        }
+        l += vaes_blocks;
+        h += (l == 0);
+        in += 16 * vaes_blocks;
+        out += 16 * vaes_blocks;
+    }
+    ctr_blocks_aesni<Nr>(keys, in, out, nblocks, h, l);
+    hi = h;
+    lo = l;
+}
+
+template <int Nr>
+constexpr aes_kernels aesni_kernels()
+{
+    return { encrypt_block_aesni<Nr>, decrypt_block_aesni<Nr>, encrypt_blocks_aesni<Nr>, decrypt_blocks_aesni<Nr>, ctr_blocks_aesni<Nr> };
+}
+
+template <int Nr>
+constexpr aes_kernels vaes256_kernels()
+{
+    return { encrypt_block_aesni<Nr>, decrypt_block_aesni<Nr>, encrypt_blocks_vaes256<Nr>, decrypt_blocks_vaes256<Nr>,
+        ctr_blocks_vaes256<Nr> };
+}
+
+template <int Nr>
+constexpr aes_kernels vaes512_kernels()
+{
+    return { encrypt_block_aesni<Nr>, decrypt_block_aesni<Nr>, encrypt_blocks_vaes512<Nr>, decrypt_blocks_vaes512<Nr>,
+        ctr_blocks_vaes512<Nr> };
+}
+
+template <int Nr, int W>
+constexpr aes_kernels aesni_width_kernels()
+{
+    return { encrypt_block_aesni<Nr>, decrypt_block_aesni<Nr>, encrypt_blocks_aesni<Nr, W>, decrypt_blocks_aesni<Nr, W>,
+        ctr_blocks_aesni<Nr, W> };
+}
+
+extern const aes_backend aesni_backend = { "AES-NI", make_key_schedule_aesni,
+    aesni_kernels<10>(), aesni_kernels<12>(), aesni_kernels<14>() };
+extern const aes_backend aesni4_backend = { "AES-NI x4", make_key_schedule_aesni,
+    aesni_width_kernels<10, 4>(), aesni_width_kernels<12, 4>(), aesni_width_kernels<14, 4>() };
+extern const aes_backend aesni12_backend = { "AES-NI x12", make_key_schedule_aesni,
+    aesni_width_kernels<10, 12>(), aesni_width_kernels<12, 12>(), aesni_width_kernels<14, 12>() };
+extern const aes_backend vaes256_backend = { "VAES-256", make_key_schedule_aesni,
+    vaes256_kernels<10>(), vaes256_kernels<12>(), vaes256_kernels<14>() };
+extern const aes_backend vaes512_backend = { "VAES-512", make_key_schedule_aesni,
+    vaes512_kernels<10>(), vaes512_kernels<12>(), vaes512_kernels<14>() };
+
+bool uses_aesni(const aes_backend& backend)
+{
+    return backend.make_key_schedule == make_key_schedule_aesni;
+}
+#endif
+
+
+#ifdef AES_X86
+//Loads a block byte-reversed, so the register holds it as a big-endian number
+inline TARGET_PCLMUL __m128i ghash_load(const u8* p)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), reverse);
+}
+
+inline TARGET_PCLMUL void ghash_store(u8* p, __m128i x)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    _mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(x, reverse));
+}
+
+inline TARGET_PCLMUL __m128i ghash_power(const gcm_key& key, int i)
+{
+    return _mm_set_epi64x(key.h_powers[i][0], key.h_powers[i][1]);
+}
+
+//Adds the unreduced product a * b into lo, mid and hi (reduction is linear, so
+//several products can share one)
+inline TARGET_PCLMUL void clmul_accumulate(__m128i a, __m128i b, __m128i& lo, __m128i& mid, __m128i& hi)
+{
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+    mid = _mm_xor_si128(mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01)));
+}
+
+//128-bit shift right by n (1..63) of the register read as one number
+inline TARGET_PCLMUL __m128i shift_right_128(__m128i x, int n)
+{
+    return _mm_or_si128(_mm_srli_epi64(x, n), _mm_slli_epi64(_mm_srli_si128(x, 8), 64 - n));
+}
+
+//Same steps as gf128_reduce, on whole registers
+inline TARGET_PCLMUL __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi)
+{
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    __m128i lo_carry = _mm_srli_epi64(lo, 63);
+    __m128i hi_carry = _mm_srli_epi64(hi, 63);
+    lo = _mm_or_si128(_mm_slli_epi64(lo, 1), _mm_slli_si128(lo_carry, 8));
+    hi = _mm_or_si128(_mm_slli_epi64(hi, 1), _mm_or_si128(_mm_slli_si128(hi_carry, 8), _mm_srli_si128(lo_carry, 8)));
+
+    __m128i abc = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi64(lo, 63), _mm_slli_epi64(lo, 62)), _mm_slli_epi64(lo, 57));
+    __m128i d = _mm_xor_si128(lo, _mm_slli_si128(abc, 8));
+    __m128i h = _mm_xor_si128(_mm_xor_si128(d, shift_right_128(d, 1)), _mm_xor_si128(shift_right_128(d, 2), shift_right_128(d, 7)));
+    return _mm_xor_si128(hi, h);
+}
+
+//8 blocks at a time: (x ^ c0) * H^8 ^ c1 * H^7 ^ ... ^ c7 * H, one reduction per 8
+TARGET_PCLMUL void ghash_blocks_pclmul(const gcm_key& key, u8* x, const u8* data, size_t nblocks)
+{
+    __m128i acc = ghash_load(x);
+    __m128i h[ghash_aggregate];
+    for (int i = 0; i < ghash_aggregate; i++)
+    {
+        h[i] = ghash_power(key, i);
+    }
+
+    for (; nblocks >= ghash_aggregate; nblocks -= ghash_aggregate, data += 16 * ghash_aggregate)
+    {
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for (int i = 0; i < ghash_aggregate; i++)
+        {
+            __m128i c = ghash_load(data + 16 * i);
+            if (i == 0)
+            {
+                c = _mm_xor_si128(c, acc);
+            }
+            clmul_accumulate(c, h[ghash_aggregate - 1 - i], lo, mid, hi);
+        }
+        acc = ghash_reduce(lo, mid, hi);
+    }
+
+    for (; nblocks > 0; nblocks--, data += 16)
+    {
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        clmul_accumulate(_mm_xor_si128(ghash_load(data), acc), h[0], lo, mid, hi);
+        acc = ghash_reduce(lo, mid, hi);
+    }
+    ghash_store(x, acc);
+}
+#endif
+
+
+#ifdef AES_X86
+//Stitched AES-NI + PCLMULQDQ loop: the AES rounds for 8 counter blocks are
+//interleaved with the carry-less multiplies for 8 ciphertext blocks, so the AES
+//and multiply units work at the same time. Decryption hashes the blocks it is
+//decrypting; encryption hashes the previous 8 blocks it produced.
+template <int Nr>
+TARGET_PCLMUL void gcm_blocks_aesni(gcm_state& st, const u8* in, u8* out, size_t nblocks, bool encrypt)
+{
+    __m128i rk[Nr + 1], h[ghash_aggregate];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm_loadu_si128((const __m128i*)&st.key->aes->round_keys().enc[16 * round]);
+    }
+    for (int i = 0; i < ghash_aggregate; i++)
+    {
+        h[i] = ghash_power(*st.key, i);
+    }
+    __m128i acc = ghash_load(st.x);
+    __m128i prefix = _mm_loadu_si128((const __m128i*)st.j0);
+    const u8* unhashed = nullptr; //encryption output waiting to be hashed
+
+    for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128)
+    {
+        const u8* hash_input = (encrypt ? unhashed : in);
+        __m128i b[8], c[8];
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm_xor_si128(_mm_insert_epi32(prefix, (int)byte_swap32(st.counter++), 3), rk[0]);
+        }
+        if (hash_input)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+                c[i] = ghash_load(hash_input + 16 * i);
+            }
+            c[0] = _mm_xor_si128(c[0], acc);
+        }
+
+        __m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 8; i++)
+            {
+                b[i] = _mm_aesenc_si128(b[i], rk[round]);
+            }
+            if (hash_input && round <= 8)
+            {
+                clmul_accumulate(c[round - 1], h[8 - round], lo, mid, hi);
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 8; i++)
+        {
+            b[i] = _mm_aesenclast_si128(b[i], rk[Nr]);
+            _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)(in + 16 * i))));
+        }
+        if (hash_input)
+        {
+            acc = ghash_reduce(lo, mid, hi);
+        }
+        unhashed = out;
+    }
+    ghash_store(st.x, acc);
+    if (encrypt && unhashed)
+    {
+        ghash_blocks_pclmul(*st.key, st.x, unhashed, 8);
+    }
+    gcm_blocks_generic(st, in, out, nblocks, encrypt);
+}
+
+//The four 128-bit lanes xored together
+inline TARGET_VAES512_GCM __m128i xor_lanes(__m512i x)
+{
+    __m256i y = _mm256_xor_si256(_mm512_maskz_extracti64x4_epi64(0xff, x, 0), _mm512_maskz_extracti64x4_epi64(0xff, x, 1));
+    return _mm_xor_si128(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+}
+
+//The same with VAES and VPCLMULQDQ on zmm registers, 16 blocks a pass: the rounds
+//for 4 registers of counter blocks are interleaved with the multiplies for 4 of
+//ciphertext, blocks 0 to 15 by H^16 down to H, summed before one reduction. The
+//counter's low word is kept byte-reversed in each lane, so a 32-bit add steps it
+//and wraps as GCM's does. Fewer than 16 blocks go to the AES-NI loop.
+template <int Nr>
+TARGET_VAES512_GCM void gcm_blocks_vaes512(gcm_state& st, const u8* in, u8* out, size_t nblocks, bool encrypt)
+{
+    const __m512i reverse = _mm512_maskz_broadcast_i32x4(0xffff, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m512i counter_order = _mm512_maskz_broadcast_i32x4(0xffff, _mm_set_epi8(12, 13, 14, 15, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+    const __m512i step = _mm512_set_epi32(4, 0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0, 4, 0, 0, 0);
+    __m512i rk[Nr + 1], h[4];
+    AES_UNROLL
+    for (int round = 0; round <= Nr; round++)
+    {
+        rk[round] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)&st.key->aes->round_keys().enc[16 * round]));
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        const u64(*p)[2] = &st.key->h_powers[ghash_powers - 4 - 4 * i]; //lane j is H^(16 - 4i - j)
+        h[i] = _mm512_set_epi64(p[0][0], p[0][1], p[1][0], p[1][1], p[2][0], p[2][1], p[3][0], p[3][1]);
+    }
+    __m128i acc = ghash_load(st.x);
+    __m512i counter = _mm512_add_epi32(_mm512_maskz_broadcast_i32x4(0xffff, _mm_insert_epi32(_mm_loadu_si128((const __m128i*)st.j0),
+        (int)st.counter, 3)), _mm512_set_epi32(3, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0));
+    const u8* unhashed = nullptr; //encryption output waiting to be hashed
+
+    for (; nblocks >= 16; nblocks -= 16, in += 256, out += 256)
+    {
+        const u8* hash_input = (encrypt ? unhashed : in);
+        __m512i b[4], c[4];
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(counter, counter_order), rk[0]);
+            counter = _mm512_add_epi32(counter, step);
+        }
+        if (hash_input)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 4; i++)
+            {
+                c[i] = _mm512_shuffle_epi8(_mm512_loadu_si512(hash_input + 64 * i), reverse);
+            }
+            c[0] = _mm512_xor_si512(c[0], _mm512_inserti32x4(_mm512_setzero_si512(), acc, 0));
+        }
+
+        __m512i lo = _mm512_setzero_si512(), mid = _mm512_setzero_si512(), hi = _mm512_setzero_si512();
+        AES_UNROLL
+        for (int round = 1; round < Nr; round++)
+        {
+            AES_UNROLL
+            for (int i = 0; i < 4; i++)
+            {
+                b[i] = _mm512_aesenc_epi128(b[i], rk[round]);
+            }
+            if (hash_input && round <= 4)
+            {
+                __m512i x = c[round - 1], y = h[round - 1];
+                lo = _mm512_xor_si512(lo, _mm512_clmulepi64_epi128(x, y, 0x00));
+                hi = _mm512_xor_si512(hi, _mm512_clmulepi64_epi128(x, y, 0x11));
+                mid = _mm512_xor_si512(mid, _mm512_xor_si512(_mm512_clmulepi64_epi128(x, y, 0x10), _mm512_clmulepi64_epi128(x, y, 0x01)));
+            }
+        }
+        AES_UNROLL
+        for (int i = 0; i < 4; i++)
+        {
+            b[i] = _mm512_aesenclast_epi128(b[i], rk[Nr]);
+            _mm512_storeu_si512(out + 64 * i, _mm512_xor_si512(b[i], _mm512_loadu_si512(in + 64 * i)));
+        }
+        if (hash_input)
+        {
+            acc = ghash_reduce(xor_lanes(lo), xor_lanes(mid), xor_lanes(hi));
+        }
+        unhashed = out;
+        st.counter += 16;
+    }
+    ghash_store(st.x, acc);
+    if (encrypt && unhashed)
+    {
+        ghash_blocks_pclmul(*st.key, st.x, unhashed, 16);
+    }
+    gcm_blocks_aesni<Nr>(st, in, out, nblocks, encrypt);
+}
+
+gcm_blocks_function* select_gcm_blocks_aesni(const aes_backend& backend, int rounds)
+{
+    if (&backend == &vaes512_backend && cpu_has_vpclmulqdq())
+    {
+        return rounds == 10 ? gcm_blocks_vaes512<10> : rounds == 12 ? gcm_blocks_vaes512<12> : gcm_blocks_vaes512<14>;
+    }
+    return rounds == 10 ? gcm_blocks_aesni<10> : rounds == 12 ? gcm_blocks_aesni<12> : gcm_blocks_aesni<14>;
+}
+
+//SHA-256 with the SHA extensions. SHA256RNDS2 does two rounds on the state split
+//as (A, B, E, F) and (C, D, G, H), taking its two message words plus constants
+//from the low half of the third operand; SHA256MSG1 and SHA256MSG2 do the two
+//halves of the message schedule, four words at a time.
+TARGET_SHA void sha256_blocks_shani(u32 state[8], const u8* data, size_t nblocks)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i*)&state[4]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; nblocks > 0; nblocks--, data += 64)
+    {
+        __m128i abef_start = abef, cdgh_start = cdgh;
+        __m128i w[4]; //the last 16 message words, four to a register
+        AES_UNROLL
+        for (int g = 0; g < 16; g++)
+        {
+            if (g < 4)
+            {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), byte_swap);
+            }
+            else
+            {   //W[t-16] + s0(W[t-15]), then + W[t-7], then + s1(W[t-2])
+                __m128i x = _mm_sha256msg1_epu32(w[g % 4], w[(g + 1) % 4]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(g + 3) % 4], w[(g + 2) % 4], 4));
+                w[g % 4] = _mm_sha256msg2_epu32(x, w[(g + 3) % 4]);
+            }
+            __m128i wk = _mm_add_epi32(w[g % 4], _mm_loadu_si128((const __m128i*)&sha256_k[4 * g]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, abef_start);
+        cdgh = _mm_add_epi32(cdgh, cdgh_start);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif